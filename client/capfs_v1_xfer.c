@@ -89,6 +89,7 @@
 #include <malloc.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <linux/types.h>
 #include <linux/dirent.h>
@@ -96,6 +97,7 @@
 #include "ll_capfs.h"
 #include "capfs_mount.h"
 #include "capfs_v1_xfer.h"
+#include "capfsd.h"
 #include "capfs_kernel_config.h"
 #include "sockio.h"
 #include "sockset.h"
@@ -113,12 +115,15 @@
 /* and the hash cache prototypes */
 #include "hashes.h"
 #include "cas.h"
+#include "dcache.h"
 #include "sha.h"
 #include "log.h"
 /* and the mapping code from blocks to hashes to iods */
 #include "map_chunk.h"
+#include "place.h"
 /* and the plugin structure's */
 #include "plugin.h"
+#include "list.h"
 
 enum {
 	/* number of times we'll retry if too many files are open */
@@ -159,7 +164,25 @@ struct pf {
 	capfs_handle_t handle;
 	char *name;
 	time_t ltime; /* last time we used this open file */
+	int refs; /* number of upcalls using fp right now */
 	fdesc *fp;
+	/* writes not yet committed to the meta-data server, for plugins that delay commits */
+	struct list_head pending; /* of struct pending_run, sorted and never overlapping or touching */
+	int64_t pending_size; /* end of the furthest of those writes */
+	struct capfs_options pending_opt;
+	struct write_buffer *wb; /* small writes not yet sent to the cas servers, if any */
+	time_t held_since; /* when the oldest of the writes held back was made, 0 if none */
+	int flush_queued; /* capfs_comm_expire() asked for them to be committed */
+	time_t held_checked; /* since when the iods are known to have the chunks of those writes */
+	int held_error; /* held back writes were given up on, to be reported by the next fsync */
+};
+
+/* a run of consecutive chunks whose new hashes have not been committed yet */
+struct pending_run {
+	struct list_head link;
+	int64_t begin_chunk;
+	int64_t nchunks;
+	unsigned char *hashes;
 };
 
 struct pf_cmp {
@@ -167,7 +190,19 @@ struct pf_cmp {
 	char *name;
 };
 
+/*
+ * capfsd services upcalls from several threads, so file_list, and the
+ * ltime and refs fields of its entries, are protected by pf_mutex.  Entries
+ * in use (refs > 0) are never closed behind the user's back by
+ * capfs_comm_idle() or close_some_files().  Since all the upcalls on a
+ * file are serviced by one worker at a time, the pending writes of an
+ * entry are only ever touched by that worker, or by whoever took the
+ * entry out of the list to close it, and so are held_checked and
+ * held_error.  held_since and flush_queued are also protected by
+ * pf_mutex, since capfs_comm_expire() looks at them.
+ */
 static pfl_t file_list = NULL;
+static pthread_mutex_t pf_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static pfl_t pfl_new(void);
 static struct pf *pfl_head(pfl_t pfl);
@@ -182,6 +217,16 @@ static void pf_free(void *p);
 static int pf_rem(pfl_t pfl, capfs_handle_t handle, char *name);
 static struct pf *pf_new(fdesc *fp, capfs_handle_t handle, char *name);
 static int pf_zerotime(void *pfp);
+static struct pf *pf_get(capfs_handle_t handle, char *name);
+static void pf_put(struct pf *p);
+static struct pf *pf_take(void *time, int (*cmp)(void *, void *));
+static int pending_flush(struct pf *pfp);
+static void pending_free(struct pf *pfp);
+static int wb_flush(struct pf *pfp);
+static void pf_hold(struct pf *pfp);
+static int map_chunk(int64_t chunk, unsigned char *hash, fdesc_p fp, struct iod_map *my_map);
+static void pf_keep(struct pf *pfp);
+static int64_t time_diff(struct timeval *end, struct timeval *begin);
 
 /* miscellaneous capfs specific mount time options */
 struct capfs_specific_options {
@@ -191,13 +236,23 @@ struct capfs_specific_options {
 	int32_t cons; /* cons will determine a few other things */
 };
 
+/* a contiguous range of an open file that was written but not yet sent to the cas servers */
+struct write_buffer {
+	char *data; /* CAPFS_WB_CHUNKS * CAPFS_CHUNK_SIZE bytes */
+	int64_t off;
+	int64_t len;
+	/* what the write-back needs to go out on its own */
+	struct capfs_upcall op;
+	struct capfs_specific_options sp_options;
+};
+
 /* PROTOTYPES FOR INTERNAL FUNCTIONS */
 static void init_mgr_req(mreq *rp, struct capfs_upcall *op);
 static void init_res(struct capfs_downcall *resp, struct capfs_upcall *op);
 static void v1_fmeta_to_v2_meta(struct fmeta *fmeta, struct capfs_meta *meta);
 static void v1_fmeta_to_v2_phys(struct fmeta *fmeta, struct capfs_phys *phys);
 static int open_capfs_file(struct capfs_specific_options *, struct sockaddr *mgr, capfs_char_t name[]);
-static void cas_close_capfs_file(struct capfs_specific_options *, struct sockaddr *mgr, struct pf *pfp);
+static int cas_close_capfs_file(struct capfs_specific_options *, struct sockaddr *mgr, struct pf *pfp);
 static int do_generic_op(struct capfs_specific_options *, struct sockaddr *mgr, struct capfs_upcall *op,
 	struct capfs_downcall *resp);
 static int do_create_op(struct capfs_specific_options *, struct sockaddr *mgr, struct capfs_upcall *op,
@@ -329,7 +384,7 @@ do_capfs_op_retry:
 		int (*plugin_close)(const char *) = NULL;
 		struct plugin_info *pinfo = NULL;
 
-		if (op->u.hint.hint != HINT_STATS)
+		if (op->u.hint.hint != HINT_STATS && op->u.hint.hint != HINT_FLUSH)
 		{
 			pinfo = capfsd_match_policy_id(sp_options.cons);
 			if (pinfo && (plugin_close = pinfo->policy_ops->close)) {
@@ -416,26 +471,31 @@ void capfs_comm_idle(void)
 	sp_options.use_tcp = 0;
 
 	/* search out and remove all the old (zero'd) entries */
-	while ((old = (struct pf *) llist_search(file_list,
-	(void *) &time, pf_ltime_cmp)) != NULL)
+	while ((old = pf_take((void *) &time, pf_ltime_cmp)) != NULL)
 	{
-		pf_rem(file_list, old->handle, old->name); /* takes out of list */
-
 		/* close the file */
 		port = name_to_port(old->name);
 		hostcpy(host, old->name);
-		if ((mgr = capfs_mgr_init(host, port)) == NULL) 
+		if ((mgr = capfs_mgr_init(host, port)) == NULL) {
+			pf_keep(old);
 			return;
+		}
 		/* talk to cas servers */
-		cas_close_capfs_file(&sp_options, mgr, old);
+		if (cas_close_capfs_file(&sp_options, mgr, old) < 0) {
+			/* it still holds writes that could not be committed */
+			pf_keep(old);
+		}
+		else {
+			/* free the file structure */
+			pf_free(old);
+		}
 		free(mgr);
-		
-		/* free the file structure */
-		pf_free(old);
 	}
 
 	/* zero everyone else */
+	pthread_mutex_lock(&pf_mutex);
 	llist_doall(file_list, pf_zerotime);
+	pthread_mutex_unlock(&pf_mutex);
 }
 
 /* close_some_files()
@@ -456,24 +516,25 @@ static int close_some_files(void)
 	sp_options.use_tcp = 0;
 
 	/* first we'll look for files that are already marked for removal */
-	while ((old = (struct pf *) llist_search(file_list,
-	(void *) &t, pf_ltime_cmp)) != NULL)
+	while ((old = pf_take((void *) &t, pf_ltime_cmp)) != NULL)
 	{
-		i++;
-
-		pf_rem(file_list, old->handle, old->name); /* takes out of list */
-
 		/* close the file */
 		port = name_to_port(old->name);
 		hostcpy(host, old->name);
-		if ((mgr = capfs_mgr_init(host, port)) == NULL) 
+		if ((mgr = capfs_mgr_init(host, port)) == NULL) {
+			pf_keep(old);
 			return -errno;
+		}
 		/* talk to cas servers */
-		cas_close_capfs_file(&sp_options, mgr, old);
+		if (cas_close_capfs_file(&sp_options, mgr, old) < 0) {
+			pf_keep(old);
+		}
+		else {
+			i++;
+			/* free the file structure */
+			pf_free(old);
+		}
 		free(mgr);
-		
-		/* free the file structure */
-		pf_free(old);
 	}
 
 	/* if we got anything, let's go ahead and return */
@@ -482,25 +543,27 @@ static int close_some_files(void)
 	/* next we'll look for files of decreasing age */
 	for (j = 20; j > 0; j-= 5) {
 		t = time(NULL) - j;
-		while ((old = (struct pf *) llist_search(file_list,
-		(void *) &t, pf_ltime_olderthan)) != NULL)
+		while ((old = pf_take((void *) &t, pf_ltime_olderthan)) != NULL)
 		{
-			i++;
-
-			pf_rem(file_list, old->handle, old->name); /* takes out of list */
 			PDEBUG(D_FILE, "closing %s\n", old->name);
 
 			/* close the file */
 			port = name_to_port(old->name);
 			hostcpy(host, old->name);
-			if ((mgr = capfs_mgr_init(host, port)) == NULL) 
+			if ((mgr = capfs_mgr_init(host, port)) == NULL) {
+				pf_keep(old);
 				return -1;
+			}
 			/* talk to cas servers */
-			cas_close_capfs_file(&sp_options, mgr, old);
+			if (cas_close_capfs_file(&sp_options, mgr, old) < 0) {
+				pf_keep(old);
+			}
+			else {
+				i++;
+				/* free the file structure */
+				pf_free(old);
+			}
 			free(mgr);
-			
-			/* free the file structure */
-			pf_free(old);
 		}
 		if (i > 0) return i;
 	}
@@ -542,18 +605,407 @@ static inline void init_capfs_options(struct capfs_options* opt, struct capfs_sp
 	return;
 }
 
+/*
+ * Session semantics: plugins that delay commits have the new hashes of
+ * every write to an open file remembered here instead of committed right
+ * away. Writes to overlapping or adjacent chunks are merged, and every run
+ * of consecutive chunks is committed with a single wcommit when the file
+ * is closed or synced. Until then, reads and writes through this capfsd see
+ * the remembered hashes in place of the ones on the meta-data server.
+ */
+static int pending_add(struct pf *pfp, struct capfs_options *opt, int64_t begin_chunk, int64_t nchunks,
+		unsigned char *hashes, int64_t end_offset)
+{
+	struct list_head *l, *n;
+	struct pending_run *run;
+	int64_t begin = begin_chunk, end = begin_chunk + nchunks;
+	unsigned char *merged;
+
+	/* find the extent of the new write along with the runs it overlaps or touches */
+	list_for_each(l, &pfp->pending) {
+		run = list_entry(l, struct pending_run, link);
+		if (run->begin_chunk + run->nchunks < begin_chunk || run->begin_chunk > begin_chunk + nchunks) {
+			continue;
+		}
+		begin = MIN(begin, run->begin_chunk);
+		end = MAX(end, run->begin_chunk + run->nchunks);
+	}
+	run = (struct pending_run *) calloc(1, sizeof(struct pending_run));
+	merged = (unsigned char *) calloc(end - begin, CAPFS_MAXHASHLENGTH);
+	if (run == NULL || merged == NULL) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
+		free(run);
+		free(merged);
+		return -ENOMEM;
+	}
+	/* the older runs go in first, so that the new write wins where they overlap */
+	list_for_each_safe(l, n, &pfp->pending) {
+		struct pending_run *old = list_entry(l, struct pending_run, link);
+
+		if (old->begin_chunk + old->nchunks < begin_chunk || old->begin_chunk > begin_chunk + nchunks) {
+			continue;
+		}
+		memcpy(merged + (old->begin_chunk - begin) * CAPFS_MAXHASHLENGTH, old->hashes,
+				old->nchunks * CAPFS_MAXHASHLENGTH);
+		list_del(&old->link);
+		free(old->hashes);
+		free(old);
+	}
+	memcpy(merged + (begin_chunk - begin) * CAPFS_MAXHASHLENGTH, hashes, nchunks * CAPFS_MAXHASHLENGTH);
+	run->begin_chunk = begin;
+	run->nchunks = end - begin;
+	run->hashes = merged;
+	list_for_each(l, &pfp->pending) {
+		if (list_entry(l, struct pending_run, link)->begin_chunk > begin) {
+			break;
+		}
+	}
+	/* i.e. just before the first run that follows it */
+	list_add_tail(&run->link, l);
+	if (end_offset > pfp->pending_size) {
+		pfp->pending_size = end_offset;
+	}
+	pfp->pending_opt = *opt;
+	pf_hold(pfp);
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[delay commit] %s: chunks %Ld-%Ld pending\n", pfp->name,
+			begin, end - 1);
+	return 0;
+}
+
+/* commits one run of pending writes. Returns 0 on success, -errno on failure */
+static int pending_commit(struct pf *pfp, struct pending_run *run)
+{
+	sha1_info old_hashes, new_hashes, current_hashes;
+	struct capfs_options opt = pfp->pending_opt;
+	int64_t version = 0, write_size, i;
+	int ret = 0;
+	struct timeval begin, end;
+
+	gettimeofday(&begin, NULL);
+	/*
+	 * We no longer have the data to redo the writes with, should somebody
+	 * else have committed to these chunks in the meantime. Under session
+	 * semantics the last one to close wins anyway.
+	 */
+	opt.force_commit = 1;
+	memset(&old_hashes, 0, sizeof(old_hashes));
+	new_hashes.sha1_info_len = current_hashes.sha1_info_len = run->nchunks;
+	new_hashes.sha1_info_ptr = (unsigned char **) calloc(run->nchunks, sizeof(unsigned char *));
+	current_hashes.sha1_info_ptr = (unsigned char **) calloc(run->nchunks, sizeof(unsigned char *));
+	if (new_hashes.sha1_info_ptr == NULL || current_hashes.sha1_info_ptr == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	for (i = 0; i < run->nchunks; i++) {
+		new_hashes.sha1_info_ptr[i] = run->hashes + i * CAPFS_MAXHASHLENGTH;
+		if ((current_hashes.sha1_info_ptr[i] = (unsigned char *) calloc(1, CAPFS_MAXHASHLENGTH)) == NULL) {
+			ret = -ENOMEM;
+			goto cleanup;
+		}
+	}
+	write_size = MIN((run->begin_chunk + run->nchunks) * CAPFS_CHUNK_SIZE, pfp->pending_size);
+	if (commit_write(&opt, pfp->name, run->begin_chunk, write_size,
+				&old_hashes, &new_hashes, &current_hashes, &version) < 0) {
+		ret = -errno;
+		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "[delay commit] %s: could not commit chunks %Ld-%Ld: %d\n",
+				pfp->name, run->begin_chunk, run->begin_chunk + run->nchunks - 1, ret);
+	}
+	else {
+		put_hashes(pfp->name, run->begin_chunk, run->nchunks, run->hashes);
+	}
+cleanup:
+	if (current_hashes.sha1_info_ptr) {
+		for (i = 0; i < run->nchunks; i++) {
+			free(current_hashes.sha1_info_ptr[i]);
+		}
+	}
+	free(current_hashes.sha1_info_ptr);
+	free(new_hashes.sha1_info_ptr);
+	gettimeofday(&end, NULL);
+	rpc_commit_time += time_diff(&end, &begin);
+	return ret;
+}
+
+/*
+ * Asks iod (of the file's iods) whether it has the count chunks named by hashes.
+ * Returns 0 if it has them all, -ENOENT if it does not, -errno on failure.
+ */
+static int pending_have(struct pf *pfp, int iod, unsigned char *hashes, int count)
+{
+	unsigned char bitmap[CAPFS_MAXHASHBITMAP];
+	int i;
+
+	memset(bitmap, 0, sizeof(bitmap));
+	if (clnt_have(pfp->pending_opt.tcp, (struct sockaddr *) &pfp->fp->fd.iod[iod].addr,
+				hashes, count, bitmap) < 0) {
+		return -errno;
+	}
+	for (i = 0; i < count; i++) {
+		if (!cas_have_isset(bitmap, i)) {
+			return -ENOENT;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Makes sure that the iods still have the chunks of the pending writes.
+ * Since the iods restart the grace period of a chunk that is asked about,
+ * this also keeps them from reclaiming those for another IOD_RECLAIM_DELAY.
+ * Returns 0 if they do, -ENOENT if some are gone, -errno if we could not tell.
+ */
+static int pending_check(struct pf *pfp)
+{
+	struct iod_map map;
+	struct list_head *l;
+	unsigned char *hashes, *hash;
+	int64_t i;
+	int k, n, error = 0;
+
+	if ((hashes = (unsigned char *) malloc(CAPFS_MAXHASHES * CAPFS_MAXHASHLENGTH)) == NULL) {
+		return -ENOMEM;
+	}
+	list_for_each(l, &pfp->pending) {
+		struct pending_run *run = list_entry(l, struct pending_run, link);
+
+		/* one iod at a time, in batches of what a have request takes */
+		for (k = 0; k < pfp->fp->fd.meta.p_stat.pcount && error == 0; k++) {
+			for (i = 0, n = 0; i < run->nchunks && error == 0; i++) {
+				hash = run->hashes + i * CAPFS_MAXHASHLENGTH;
+				if (map_chunk(run->begin_chunk + i, hash, pfp->fp, &map) < 0) {
+					error = -EINVAL;
+				}
+				else if (map.normalized_iod == k) {
+					memcpy(hashes + n * CAPFS_MAXHASHLENGTH, hash, CAPFS_MAXHASHLENGTH);
+					if (++n == CAPFS_MAXHASHES) {
+						error = pending_have(pfp, k, hashes, n);
+						n = 0;
+					}
+				}
+			}
+			if (error == 0 && n > 0) {
+				error = pending_have(pfp, k, hashes, n);
+			}
+		}
+		if (error < 0) {
+			break;
+		}
+	}
+	free(hashes);
+	return error;
+}
+
+/* commits all the pending writes of a file. Returns 0 on success, -errno on failure */
+static int pending_flush(struct pf *pfp)
+{
+	struct list_head *l, *n;
+	time_t now = time(NULL);
+	int error = 0;
+
+	/*
+	 * Writes held on to this long had their commits fail, and the iods
+	 * reclaim chunks that no recipe refers to after a while. So check that
+	 * they still have the chunks (which keeps them around for a while
+	 * longer) before trying again. We no longer have the data to put them
+	 * back with, so if some are gone, the writes are given up on.
+	 */
+	if (!list_empty(&pfp->pending) && now - pfp->held_checked >= CAPFS_HOLD_CHECK_AGE) {
+		if ((error = pending_check(pfp)) == -ENOENT) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "[delay commit] %s: chunks of uncommitted writes "
+					"were reclaimed, giving up on them\n", pfp->name);
+			pending_free(pfp);
+			pfp->held_error = -EIO;
+			return -EIO;
+		}
+		if (error < 0) {
+			LOG(stderr, WARNING_MSG, SUBSYS_CLIENT, "[delay commit] %s: could not check on chunks of "
+					"uncommitted writes: %d\n", pfp->name, error);
+			return error;
+		}
+		pfp->held_checked = now;
+	}
+	list_for_each_safe(l, n, &pfp->pending) {
+		struct pending_run *run = list_entry(l, struct pending_run, link);
+
+		if ((error = pending_commit(pfp, run)) < 0) {
+			break;
+		}
+		list_del(&run->link);
+		free(run->hashes);
+		free(run);
+	}
+	if (list_empty(&pfp->pending)) {
+		pfp->pending_size = 0;
+	}
+	return error;
+}
+
+/* forgets about the pending writes of a file */
+static void pending_free(struct pf *pfp)
+{
+	struct list_head *l, *n;
+
+	list_for_each_safe(l, n, &pfp->pending) {
+		struct pending_run *run = list_entry(l, struct pending_run, link);
+
+		list_del(&run->link);
+		free(run->hashes);
+		free(run);
+	}
+	pfp->pending_size = 0;
+	return;
+}
+
+/* writes out and commits everything that was held back for an open file */
+static int pf_flush(struct pf *pfp)
+{
+	int error;
+
+	if ((error = wb_flush(pfp)) == 0) {
+		error = pending_flush(pfp);
+	}
+	pthread_mutex_lock(&pf_mutex);
+	/* if that failed, capfs_comm_expire() will have us try again */
+	pfp->flush_queued = 0;
+	if (error == 0) {
+		pfp->held_since = 0;
+	}
+	pthread_mutex_unlock(&pf_mutex);
+	return error;
+}
+
+/* notes that a write to the file is being held back */
+static void pf_hold(struct pf *pfp)
+{
+	pthread_mutex_lock(&pf_mutex);
+	if (pfp->held_since == 0) {
+		pfp->held_since = pfp->held_checked = time(NULL);
+	}
+	pthread_mutex_unlock(&pf_mutex);
+	return;
+}
+
+/*
+ * Puts back an entry that was taken out of file_list to be closed, but
+ * still holds writes that could not be committed. They are tried again
+ * when the file is next flushed or closed.
+ */
+static void pf_keep(struct pf *pfp)
+{
+	int error;
+
+	pthread_mutex_lock(&pf_mutex);
+	pfp->ltime = time(NULL);
+	error = pf_add(file_list, pfp);
+	pthread_mutex_unlock(&pf_mutex);
+	if (error < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "lost uncommitted writes to %s\n", pfp->name);
+		pf_free(pfp);
+	}
+	return;
+}
+
+/* same as pf_flush() for the open file with the given handle and name, if any */
+static int pf_flush_file(capfs_handle_t handle, char *name)
+{
+	struct pf *pfp;
+	int error;
+
+	if ((pfp = pf_get(handle, name)) == NULL) {
+		return 0;
+	}
+	error = pf_flush(pfp);
+	pf_put(pfp);
+	return error;
+}
+
+struct pf_path {
+	char *name;
+	int len;
+	int count;
+	struct pf **found; /* NULL to only count them */
+};
+
+/* collects the entries of file_list named name or inside the directory name */
+static int pf_path_match(void *pfp, void *arg)
+{
+	struct pf *p = (struct pf *) pfp;
+	struct pf_path *path = (struct pf_path *) arg;
+
+	if (strncmp(p->name, path->name, path->len) != 0
+			|| (p->name[path->len] != '\0' && p->name[path->len] != '/')) {
+		return 0;
+	}
+	if (path->found) {
+		p->refs++;
+		path->found[path->count] = p;
+	}
+	path->count++;
+	return 0;
+}
+
+/*
+ * Does pf_flush() on every open file named name or inside the directory
+ * name. The held back writes of a file are committed by the name it was
+ * opened with, so they have to go out before it is renamed, removed or
+ * linked to. No other upcall on those files is serviced meanwhile (see
+ * upcall_names() in capfsd.c), so they are not in use by anyone else.
+ */
+static int pf_flush_path(char *name)
+{
+	struct pf_path path;
+	int i, error = 0;
+
+	path.name = name;
+	path.len = strlen(name);
+	path.count = 0;
+	path.found = NULL;
+	pthread_mutex_lock(&pf_mutex);
+	llist_doall_arg(file_list, pf_path_match, &path);
+	if (path.count == 0 || (path.found = (struct pf **) calloc(path.count, sizeof(struct pf *))) == NULL) {
+		pthread_mutex_unlock(&pf_mutex);
+		return path.count == 0 ? 0 : -ENOMEM;
+	}
+	path.count = 0;
+	llist_doall_arg(file_list, pf_path_match, &path);
+	pthread_mutex_unlock(&pf_mutex);
+	for (i = 0; i < path.count; i++) {
+		int ret;
+
+		if ((ret = pf_flush(path.found[i])) < 0 && error == 0) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not commit held back writes to %s: %d\n",
+					path.found[i]->name, ret);
+			error = ret;
+		}
+		pf_put(path.found[i]);
+	}
+	free(path.found);
+	return error;
+}
+
 /* cas_close_capfs_file()
  *
  * Handles sending a close request to a manager.  All local data
  * management must be handled at a higher level.
  */
-static void cas_close_capfs_file(struct capfs_specific_options *sp_options,
+static int cas_close_capfs_file(struct capfs_specific_options *sp_options,
 		struct sockaddr *mgr, struct pf *pfp)
 {
     mreq req;
     mack ack;
 	 struct capfs_options opt;
+	 int error;
 
+	 /*
+	  * Writes that were held back until the close. These normally went out
+	  * already with the FSYNC the kernel sends on close(); if they still
+	  * cannot be committed, the file stays open.
+	  */
+	 if ((error = pf_flush(pfp)) < 0) {
+		 LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "[close] could not commit held back writes to %s: %d\n",
+				 pfp->name, error);
+		 return error;
+	 }
 	/* initialize request to manager */
     memset(&req, 0, sizeof(req));
     req.majik_nr = MGR_MAJIK_NR;
@@ -577,7 +1029,50 @@ static void cas_close_capfs_file(struct capfs_specific_options *sp_options,
 	  */
 	 LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[close] calling clear_hashes on %s\n", pfp->name);
 	 clear_hashes(pfp->name);
-	 return;
+	 return 0;
+}
+
+static int pf_expire(void *pfp, void *arg)
+{
+	struct pf *p = (struct pf *) pfp;
+	void (*queue_flush)(capfs_handle_t, char *) = (void (*)(capfs_handle_t, char *)) arg;
+
+	if (p->held_since != 0 && p->flush_queued == 0
+			&& time(NULL) - p->held_since >= CAPFS_HOLD_MAX_AGE) {
+		p->flush_queued = 1;
+		queue_flush(p->handle, p->name);
+	}
+	return 0;
+}
+
+/* capfs_comm_expire()
+ *
+ * The chunks of writes that are held back are on the iods, but no recipe
+ * refers to them until they are committed, and the iods reclaim chunks that
+ * stay unreferenced for long enough (IOD_RECLAIM_DELAY). So writes may not
+ * be held back for more than CAPFS_HOLD_MAX_AGE seconds, even if the file
+ * stays open. This calls queue_flush() for every file that has writes held
+ * back for that long; the caller is expected to have the file flushed
+ * (with a HINT_FLUSH) in turn with the other upcalls on it. If the commit
+ * fails, the file is flushed again later, and pending_flush() checks on
+ * the chunks first once the writes are old enough. Cheap enough to be
+ * called often.
+ */
+void capfs_comm_expire(void (*queue_flush)(capfs_handle_t handle, char *name))
+{
+	static time_t last = 0;
+	time_t now = time(NULL);
+
+	if (now - last < CAPFS_HOLD_MAX_AGE / 4) {
+		return;
+	}
+	last = now;
+	pthread_mutex_lock(&pf_mutex);
+	if (file_list) {
+		llist_doall_arg(file_list, pf_expire, (void *) queue_flush);
+	}
+	pthread_mutex_unlock(&pf_mutex);
+	return;
 }
 
 /* capfs_comm_shutdown()
@@ -589,13 +1084,19 @@ void capfs_comm_shutdown(void)
 	struct pf *head;
 
 	/* remove all entries, handling each one individually */
+	pthread_mutex_lock(&pf_mutex);
 	while ((head = pfl_head(file_list)) != NULL) {
 		pf_rem(file_list, head->handle, head->name); /* takes out of list */
+		/* last chance to commit delayed writes */
+		if (pf_flush(head) < 0) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "lost uncommitted writes to %s\n", head->name);
+		}
 		pf_free(head); /* frees memory */
 	}
 
 	pfl_cleanup(file_list);
 	file_list = NULL;
+	pthread_mutex_unlock(&pf_mutex);
 	return;
 }
 
@@ -758,6 +1259,16 @@ static int do_generic_op(struct capfs_specific_options *sp_options,
 			rpc_commit_time = 0;
 			memset(server_get_time, 0, sizeof(int64_t) * CAPFS_STATS_MAX);
 			memset(server_put_time, 0, sizeof(int64_t) * CAPFS_STATS_MAX);
+			clnt_bytes_saved_take();
+		}
+	}
+	/* writes held back for the file (or the files in the directory) go to the old name */
+	if (op->type == REMOVE_OP || op->type == RENAME_OP || op->type == LINK_OP) {
+		if ((error = pf_flush_path(op->type == LINK_OP ? op->u.link.target_name : op->v1.fhname)) < 0) {
+			if(to_free == 1) {
+				free(fn);
+			}
+			goto do_generic_op_error;
 		}
 	}
 	/* note: send_mreq_saddr() is a mgrcomm.c call.  It handles opening
@@ -782,9 +1293,23 @@ static int do_generic_op(struct capfs_specific_options *sp_options,
 
 	switch(op->type) {
 		case GETMETA_OP:
+		{
+			struct pf *pfp;
+
 			v1_fmeta_to_v2_meta(&ack.ack.stat.meta, &(resp->u.getmeta.meta));
 			v1_fmeta_to_v2_phys(&ack.ack.stat.meta, &(resp->u.getmeta.phys));
+			/* account for writes that have not been committed yet */
+			if ((pfp = pf_get(op->u.getmeta.handle, op->v1.fhname)) != NULL) {
+				if (pfp->pending_size > resp->u.getmeta.meta.size) {
+					resp->u.getmeta.meta.size = pfp->pending_size;
+				}
+				if (pfp->wb && pfp->wb->len > 0 && pfp->wb->off + pfp->wb->len > resp->u.getmeta.meta.size) {
+					resp->u.getmeta.meta.size = pfp->wb->off + pfp->wb->len;
+				}
+				pf_put(pfp);
+			}
 			break;
+		}
 		case LOOKUP_OP:
 #ifdef HAVE_MGR_LOOKUP
 			v1_fmeta_to_v2_meta(&ack.ack.stat.meta, &(resp->u.lookup.meta));
@@ -885,6 +1410,7 @@ static int do_hint_op(struct capfs_specific_options *sp_options,
 			resp->u.hint.stats.rpc_compute = compute_hashes_time;
 			memcpy(resp->u.hint.stats.server_get_time, server_get_time, sizeof(int64_t) * CAPFS_STATS_MAX);
 			memcpy(resp->u.hint.stats.server_put_time, server_put_time, sizeof(int64_t) * CAPFS_STATS_MAX);
+			resp->u.hint.stats.put_bytes_saved = clnt_bytes_saved_take();
 			n_retries = sha1_time = 0;
 			rpc_get_time = rpc_put_time = rpc_commit_time = get_hashes_time = compute_hashes_time = 0;
 			memset(server_get_time, 0, sizeof(int64_t) * CAPFS_STATS_MAX);
@@ -896,22 +1422,41 @@ static int do_hint_op(struct capfs_specific_options *sp_options,
 			/* hcache callback stats */
 			hcache_get_cb_stats(&resp->u.hint.stats.hcache_inv, &resp->u.hint.stats.hcache_inv_range,
 					&resp->u.hint.stats.hcache_upd);
+			/* upcall queue stats */
+			capfsd_queue_stats(&resp->u.hint.stats.queue_depth, &resp->u.hint.stats.queue_max,
+					&resp->u.hint.stats.queue_total);
+			/* dcache stats */
+			dcache_get_stats(&resp->u.hint.stats.dcache_hits, &resp->u.hint.stats.dcache_misses,
+					&resp->u.hint.stats.dcache_evicts, 1);
+			dcache_disk_get_stats(&resp->u.hint.stats.dcache_disk_hits, &resp->u.hint.stats.dcache_disk_misses,
+					&resp->u.hint.stats.dcache_disk_evicts, 1);
 			break;
 		}
 		case HINT_CLOSE:
 		{
 			/* find the file in our list, close it, remove from list */
+			pthread_mutex_lock(&pf_mutex);
 			pfp = pf_search(file_list, op->u.hint.handle, op->v1.fhname);
+			if (pfp != NULL) {
+				pf_rem(file_list, pfp->handle, pfp->name);
+			}
+			pthread_mutex_unlock(&pf_mutex);
 			if (pfp == NULL) return 0;
-			pf_rem(file_list, pfp->handle, pfp->name);
 			/* call the cas servers alone */
-			cas_close_capfs_file(sp_options, mgr, pfp);
+			if (cas_close_capfs_file(sp_options, mgr, pfp) < 0) {
+				pf_keep(pfp);
+				break;
+			}
 			pf_free(pfp);
 			/* Purge the hcache of any hashes that may belong to this file */
 			LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[hint_close] calling clear_hashes on %s\n", op->v1.fhname);
 			clear_hashes(op->v1.fhname);
 			break;
 		}
+		case HINT_FLUSH:
+			/* writes held back for too long; see capfs_comm_expire() */
+			pf_flush_file(op->u.hint.handle, op->v1.fhname);
+			break;
 		case HINT_OPEN:
 			/* don't do anything; we'll open the file when I/O is started */
 		default:
@@ -923,11 +1468,26 @@ static int do_hint_op(struct capfs_specific_options *sp_options,
 static int do_cas_fsync_op(struct capfs_specific_options *sp_options,
 		struct sockaddr *mgr, struct capfs_upcall *op, struct capfs_downcall *resp)
 {
+	struct pf *pfp;
+	int error = 0;
+
 	/*
 	 * The CAPFS data servers do not yet
-	 * export any primitives for fsync/fdatasync
+	 * export any primitives for fsync/fdatasync,
+	 * but writes whose commit was delayed go out now.
 	 */
-	return 0;
+	init_res(resp, op);
+	if ((pfp = pf_get(op->u.fsync.handle, op->v1.fhname)) != NULL) {
+		error = pf_flush(pfp);
+		/* held back writes that had to be given up on are reported once, here */
+		if (pfp->held_error < 0) {
+			error = pfp->held_error;
+			pfp->held_error = 0;
+		}
+		pf_put(pfp);
+	}
+	resp->error = error;
+	return error;
 }
 
 /* do_create_op(sp_options, mgr, op, resp)
@@ -978,6 +1538,12 @@ static int do_setmeta_op(struct capfs_specific_options *sp_options,
 	struct capfs_downcall gmres;
 
 	init_capfs_options(&opt, sp_options);
+	/* a truncate must not be undone by delayed writes committed after it */
+	if (op->u.setmeta.meta.valid & V_SIZE) {
+		if ((error = pf_flush_file(op->u.setmeta.meta.handle, op->v1.fhname)) < 0) {
+			goto do_setmeta_op_error;
+		}
+	}
 	/* perform a GETMETA first */
 	memset(&gmup, 0, sizeof(gmup));
 	gmup.magic = op->magic;
@@ -1368,7 +1934,13 @@ struct op_info {
 	int64_t  nchunks;
 	unsigned char  *phashes;
 	unsigned char  *pnewhashes;
+	/* version of the range phashes was read at, 0 if unknown */
+	int64_t  version;
 	capfs_size_t file_size;
+	/* number of bytes of the last chunk that its new hash covers */
+	int64_t  last_length;
+	/* open file the operation is on, for its uncommitted writes */
+	struct pf *pfp;
 };
 
 static int lookup_file_size(struct op_info *info, capfs_size_t *size)
@@ -1424,6 +1996,43 @@ static int64_t time_diff(struct timeval *end, struct timeval *begin)
 	return difference;
 }
 
+/*
+ * Hashes of the chunks [info->begin_chunk, info->begin_chunk + info->nchunks)
+ * that were written through this open file, but not committed yet, override
+ * the ones obtained from the meta-data server.
+ */
+static void pending_overlay(struct op_info *info)
+{
+	struct list_head *l;
+	int64_t first = info->begin_chunk, last;
+
+	if (info->pfp == NULL || list_empty(&info->pfp->pending)) {
+		return;
+	}
+	last = first + MIN(info->nchunks, CAPFS_MAXHASHES);
+	list_for_each(l, &info->pfp->pending) {
+		struct pending_run *run = list_entry(l, struct pending_run, link);
+		int64_t b = MAX(run->begin_chunk, first), e = MIN(run->begin_chunk + run->nchunks, last);
+
+		if (b >= e) {
+			continue;
+		}
+		/* anything between the end of the file on the server and our writes is a hole */
+		if (b - first > info->nhashes) {
+			memset(info->phashes + info->nhashes * CAPFS_MAXHASHLENGTH, 0,
+					(b - first - info->nhashes) * CAPFS_MAXHASHLENGTH);
+		}
+		memcpy(info->phashes + (b - first) * CAPFS_MAXHASHLENGTH,
+				run->hashes + (b - run->begin_chunk) * CAPFS_MAXHASHLENGTH, (e - b) * CAPFS_MAXHASHLENGTH);
+		if (e - first > info->nhashes) {
+			info->nhashes = e - first;
+		}
+		/* the version from the server does not vouch for our own writes */
+		info->version = 0;
+	}
+	return;
+}
+
 /*
  * Try to fetch the hashes for this operation (either from the hcache
  * or by sending an RPC to the hash server.
@@ -1503,7 +2112,11 @@ static int do_get_hashes(struct op_info *info)
 		 * requested for the file.
 		 */
 		nhashes = get_hashes(info->sp_options->use_hcache, info->fhname, 
-					info->begin_chunk, req_nchunks, info->nchunks, info->phashes, &meta);
+					info->begin_chunk, req_nchunks, info->nchunks, info->phashes, &meta, &info->version);
+		/* a version vouches only for the range that was read */
+		if (req_nchunks < info->nchunks) {
+			info->version = 0;
+		}
 		/* 
 		 * Even though we received more, it does not make sense to pre-read/pre-fetch
 		 * data from the file unless we have the dcache in place as well...
@@ -1539,8 +2152,9 @@ static int do_get_hashes(struct op_info *info)
 		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "Could not obtain hashes for file: %Ld\n", info->nhashes);
 		return -errno;
 	}
+	pending_overlay(info);
 	/* if we did have a few hashes!, we also allocate an aligned buffer for xfer */
-	else if (info->nhashes > 0) {
+	if (info->nhashes > 0) {
 		/* Do this only for reads. We do the allocation for writes in do_compute_hashes() */
 		if (info->type == IOD_RW_READ) {
 			info->aligned_buffer = (void *) calloc(CAPFS_CHUNK_SIZE, info->nhashes);
@@ -1558,6 +2172,9 @@ static int do_get_hashes(struct op_info *info)
 	{
 		info->file_size = meta.u_stat.st_size;
 	}
+	if (info->pfp && info->pfp->pending_size > info->file_size) {
+		info->file_size = info->pfp->pending_size;
+	}
 	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "get_hashes yielded %Ld hashes with file size %Ld\n",
 			info->nhashes, info->file_size);
 #ifdef VERBOSE_DEBUG
@@ -1576,12 +2193,13 @@ static int do_get_hashes(struct op_info *info)
 }
 
 /* 
- * Given a chunk, and a file descriptor information, map
+ * Given a chunk, its hash and a file descriptor information, map
  * the chunk back to an iod server number
  * Also return the value of the global_iod_number
  * for the stats updates.
+ * The hash is only used by files placed with CAPFS_PLACE_HASH.
  */
-static int map_chunk(int64_t chunk, fdesc_p fp, struct iod_map *my_map)
+static int map_chunk(int64_t chunk, unsigned char *hash, fdesc_p fp, struct iod_map *my_map)
 {
 	struct capfs_filestat *pfstat = &fp->fd.meta.p_stat;
 	int64_t off = 0;
@@ -1608,6 +2226,12 @@ static int map_chunk(int64_t chunk, fdesc_p fp, struct iod_map *my_map)
 	if (pfstat->base < 0) {
 		pfstat->base = 0;
 	}
+	if (pfstat->placement == CAPFS_PLACE_HASH) {
+		/* fd.iod[] holds the pcount iods of the file starting from base */
+		my_map->normalized_iod = place_chunk(hash, fp->fd.iod, 0, pfstat->pcount, pfstat->pcount);
+		my_map->global_iod = pfstat->base + my_map->normalized_iod;
+		return my_map->normalized_iod;
+	}
 	off = chunk * CAPFS_CHUNK_SIZE;
 	if (pfstat->pcount == 1) {
 		my_map->normalized_iod = (pfstat->base % pfstat->pcount);
@@ -1621,6 +2245,80 @@ static int map_chunk(int64_t chunk, fdesc_p fp, struct iod_map *my_map)
 	return (pfstat->base + (off / pfstat->ssize)) % pfstat->pcount;
 }
 
+/*
+ * Copies the chunk named by hash out of the data cache into buf,
+ * zero-filling whatever the chunk does not cover.
+ * Returns 1 on a hit and 0 otherwise.
+ */
+static int lookup_chunk(struct op_info *info, unsigned char *hash, char *buf)
+{
+	int len;
+
+	if (info->sp_options->use_dcache == 0) {
+		return 0;
+	}
+	if ((len = dcache_get(hash, buf, CAPFS_CHUNK_SIZE)) < 0) {
+		return 0;
+	}
+	memset(buf + len, 0, CAPFS_CHUNK_SIZE - len);
+	return 1;
+}
+
+/*
+ * Returns the number of bytes at the start of buf, of at most size, whose
+ * SHA-1 is hash, or 0 if there is no such prefix. The servers store the
+ * last chunk of a file padded out to CAPFS_CHUNK_SIZE, but its hash covers
+ * only as much of it as the file does.
+ */
+static size_t verify_chunk(struct op_info *info, unsigned char *hash, char *buf, size_t size)
+{
+	unsigned char digest[CAPFS_MAXHASHLENGTH], *dp = digest;
+	size_t dlen, tail = info->file_size % CAPFS_CHUNK_SIZE;
+
+	if (sha1(buf, size, &dp, &dlen) == 0 && memcmp(digest, hash, CAPFS_MAXHASHLENGTH) == 0) {
+		return size;
+	}
+	if (tail > 0 && tail < size
+			&& sha1(buf, tail, &dp, &dlen) == 0 && memcmp(digest, hash, CAPFS_MAXHASHLENGTH) == 0) {
+		return tail;
+	}
+	return 0;
+}
+
+/*
+ * Adds the chunks that the cas servers returned for a get to the data cache.
+ * Chunks from servers that failed and chunks that were not found are skipped.
+ * The cache is shared by all the files on the node, so a chunk only gets in
+ * if its contents match its hash.
+ */
+static void admit_chunks(struct op_info *info, struct cas_iod_worker_data *cas, int niods)
+{
+	int i, k;
+
+	if (info->sp_options->use_dcache == 0) {
+		return;
+	}
+	for (i = 0; i < niods; i++) {
+		if (*(cas[i].returnValue) < 0) {
+			continue;
+		}
+		for (k = 0; k < cas[i].data->count; k++) {
+			unsigned char *hash = cas[i].hashes + k * CAPFS_MAXHASHLENGTH;
+			size_t len;
+
+			if (cas[i].data->buf[k].byteCount <= 0) {
+				continue;
+			}
+			if ((len = verify_chunk(info, hash, cas[i].data->buf[k].start, cas[i].data->buf[k].byteCount)) == 0) {
+				LOG(stderr, INFO_MSG, SUBSYS_CLIENT, "chunk from server %d does not match its hash; not caching it\n", i);
+				continue;
+			}
+			dcache_put(hash, cas[i].data->buf[k].start, len);
+		}
+	}
+	return;
+}
+
 /*
  * If need be fetch atmost 2 corner blocks into the appropriate
  * locations in "overall" and then return.
@@ -1630,7 +2328,7 @@ static int map_chunk(int64_t chunk, fdesc_p fp, struct iod_map *my_map)
  */
 static int fetch_corner_chunks(struct op_info *info, char *overall)
 {
-	int j, nissues = 0, niods, ret;
+	int j, nissues = 0, nfetch = 0, niods, ret;
 	struct iod_map map[2];
 	long issue_read[2] = {0, 0};
 	unsigned char *corner_hashes[2] = {NULL, NULL}, *phash = NULL;
@@ -1675,22 +2373,32 @@ static int fetch_corner_chunks(struct op_info *info, char *overall)
 	/* We need to issue reads here for atmost 2 of the chunks here */
 	for (j = 0; j < nissues; j++) 
 	{
-		memcpy(phash + j * CAPFS_MAXHASHLENGTH, corner_hashes[j], CAPFS_MAXHASHLENGTH);
-		map_chunk(issue_read[j], info->fp, &map[j]);
-		jobs[j].start = overall +
-			(issue_read[j] - info->begin_chunk) * CAPFS_CHUNK_SIZE;
-		jobs[j].byteCount = CAPFS_CHUNK_SIZE;
+		char *start = overall + (issue_read[j] - info->begin_chunk) * CAPFS_CHUNK_SIZE;
+
+		if (lookup_chunk(info, corner_hashes[j], start)) {
+			continue;
+		}
+		memcpy(phash + nfetch * CAPFS_MAXHASHLENGTH, corner_hashes[j], CAPFS_MAXHASHLENGTH);
+		map_chunk(issue_read[j], corner_hashes[j], info->fp, &map[nfetch]);
+		jobs[nfetch].start = start;
+		jobs[nfetch].byteCount = CAPFS_CHUNK_SIZE;
+		nfetch++;
+	}
+	if (nfetch == 0) {
+		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Fetch corner chunks found all %d chunks in the dcache\n", nissues);
+		free(phash);
+		return 0;
 	}
-	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Fetch corner chunks hashes for %d\n", nissues);
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Fetch corner chunks hashes for %d\n", nfetch);
 #ifdef DEBUG
-	for (j = 0; j < nissues; j++) {
+	for (j = 0; j < nfetch; j++) {
 		char str[256];
 		hash2str(phash + j * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH, str);
 		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "%d: %s\n", j, str);
 	}
 #endif
 	/* build a job for the cas servers */
-	cas = convert_to_jobs(jobs, nissues, map, info->fp, phash, &niods);
+	cas = convert_to_jobs(jobs, nfetch, map, info->fp, phash, &niods);
 	if (cas == NULL) {
 		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
 		free(phash);
@@ -1712,6 +2420,7 @@ static int fetch_corner_chunks(struct op_info *info, char *overall)
 		}
 		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Fetch corner chunk from iod %d returned %d\n", j, ret);
 	}
+	admit_chunks(info, cas, niods);
 	free(phash);
 	freeJobs(cas, niods);
 	return 0;
@@ -1752,6 +2461,8 @@ static int do_compute_hashes(struct op_info *info)
 			nissues++;
 		}
 	}
+	/* only the last chunk can be hashed short of CAPFS_CHUNK_SIZE, see below */
+	info->last_length = CAPFS_CHUNK_SIZE;
 	/* let us be optimistic here. totally aligned writes! */
 	if (nissues == 0) {
 		gettimeofday(&begin, NULL);
@@ -1810,6 +2521,7 @@ static int do_compute_hashes(struct op_info *info)
 								(total_length - size_thus_far), &ptr, &len)) < 0) {
 					break;
 				}
+				info->last_length = total_length - size_thus_far;
 			}
 			size_thus_far += CAPFS_CHUNK_SIZE;
 		}
@@ -1849,6 +2561,8 @@ static int do_cas_data_staging(struct op_info *info)
 	if (info->type == IOD_RW_READ) 
 	{
 		struct timeval begin, end;
+		unsigned char *hashes = NULL;
+		int nget = 0;
 
 		gettimeofday(&begin, NULL);
 		if (info->nhashes <= 0) {
@@ -1882,49 +2596,73 @@ static int do_cas_data_staging(struct op_info *info)
 			free(jobs);
 			return -ENOMEM;
 		}
-		//sockio_dump_sockaddr(&info->fp->fd.iod[0].addr, stderr);
-		/* Need to issue reads to the cas servers */
-		for (j = 0; j < info->nhashes; j++) {
-			map_chunk(info->begin_chunk + j, info->fp, &map[j]);
-			jobs[j].start = ptr +  j * CAPFS_CHUNK_SIZE;
-			/*
-			 * FIXME: To handle truncates correctly, we probably need to read
-			 * minimum (CAPFS_CHUNK_SIZE, info->file_size - (info->begin_chunk + j ) *  CAPFS_CHUNK_SIZE) bytes
-			 */
-			jobs[j].byteCount = CAPFS_CHUNK_SIZE;
-		}
-		//sockio_dump_sockaddr(&info->fp->fd.iod[0].addr, stderr);
-		/* build a job for the cas servers */
-		cas = convert_to_jobs(jobs, info->nhashes, map, info->fp, info->phashes, &niods);
-		if (cas == NULL) {
+		hashes = (unsigned char *) calloc(info->nhashes, CAPFS_MAXHASHLENGTH);
+		if (hashes == NULL) {
 			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
 			free(map);
 			free(jobs);
 			return -ENOMEM;
 		}
-		/* feed it to the cas engine */
-		clnt_get(info->sp_options->use_tcp, cas, niods);
-		for (j = 0; j < niods; j++) {
-			ret = *(cas[j].returnValue);
+		//sockio_dump_sockaddr(&info->fp->fd.iod[0].addr, stderr);
+		/*
+		 * Need to issue reads to the cas servers, but only for those chunks
+		 * that are not in the data cache. Since the cache is keyed by the hash,
+		 * whatever it holds is the current contents of the chunk.
+		 */
+		for (j = 0; j < info->nhashes; j++) {
+			if (lookup_chunk(info, info->phashes + j * CAPFS_MAXHASHLENGTH, ptr + j * CAPFS_CHUNK_SIZE)) {
+				continue;
+			}
+			map_chunk(info->begin_chunk + j, info->phashes + j * CAPFS_MAXHASHLENGTH, info->fp, &map[nget]);
+			jobs[nget].start = ptr +  j * CAPFS_CHUNK_SIZE;
 			/*
-			 * Due to the way we are handling lseek() and truncate(),
-			 * it is possible that we may get ENOENT errors from
-			 * the CAS servers, but we can just let them slide,
-			 * since it essentially means that the read should see
-			 * all zeroes for such data.
+			 * FIXME: To handle truncates correctly, we probably need to read
+			 * minimum (CAPFS_CHUNK_SIZE, info->file_size - (info->begin_chunk + j ) *  CAPFS_CHUNK_SIZE) bytes
 			 */
-			if (ret < 0 && ret != -ENOENT) {
-				LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT,"Read operation finished with errors %d\n", ret);
+			jobs[nget].byteCount = CAPFS_CHUNK_SIZE;
+			memcpy(hashes + nget * CAPFS_MAXHASHLENGTH, info->phashes + j * CAPFS_MAXHASHLENGTH,
+					CAPFS_MAXHASHLENGTH);
+			nget++;
+		}
+		if (nget > 0) {
+			//sockio_dump_sockaddr(&info->fp->fd.iod[0].addr, stderr);
+			/* build a job for the cas servers */
+			cas = convert_to_jobs(jobs, nget, map, info->fp, hashes, &niods);
+			if (cas == NULL) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
+				free(hashes);
 				free(map);
 				free(jobs);
-				freeJobs(cas, niods);
-				return ret;
+				return -ENOMEM;
 			}
+			/* feed it to the cas engine */
+			clnt_get(info->sp_options->use_tcp, cas, niods);
+			for (j = 0; j < niods; j++) {
+				ret = *(cas[j].returnValue);
+				/*
+				 * Due to the way we are handling lseek() and truncate(),
+				 * it is possible that we may get ENOENT errors from
+				 * the CAS servers, but we can just let them slide,
+				 * since it essentially means that the read should see
+				 * all zeroes for such data.
+				 */
+				if (ret < 0 && ret != -ENOENT) {
+					LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT,"Read operation finished with errors %d\n", ret);
+					free(hashes);
+					free(map);
+					free(jobs);
+					freeJobs(cas, niods);
+					return ret;
+				}
+			}
+			admit_chunks(info, cas, niods);
+			freeJobs(cas, niods);
 		}
-		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Read operation finished with no errors\n");
+		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Read operation finished with no errors (%d of %Ld chunks fetched)\n",
+				nget, info->nhashes);
+		free(hashes);
 		free(map);
 		free(jobs);
-		freeJobs(cas, niods);
 		/*
 		 * Now that ptr holds the right data, we need to copy out the requested 
 		 * portion of data to the user_ptr address..
@@ -1947,6 +2685,8 @@ static int do_cas_data_staging(struct op_info *info)
 	 */
 	else {
 		struct timeval begin, end;
+		unsigned char *hashes = NULL;
+		int nput = 0;
 
 		gettimeofday(&begin, NULL);
 		if (info->nchunks <= 0) {
@@ -1979,16 +2719,48 @@ static int do_cas_data_staging(struct op_info *info)
 			free(jobs);
 			return -ENOMEM;
 		}
-		/* Need to issue writes to the cas servers */
+		hashes = (unsigned char *) calloc(info->nchunks, CAPFS_MAXHASHLENGTH);
+		if (hashes == NULL) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
+			free(map);
+			free(jobs);
+			return -ENOMEM;
+		}
+		/*
+		 * Need to issue writes to the cas servers, but only for those chunks 
+		 * whose contents have changed. A chunk whose new hash matches the 
+		 * hash that the file currently has at that position is already 
+		 * stored on the servers. clnt_put() will further weed out chunks 
+		 * that the servers already have.
+		 */
 		for (j = 0; j < info->nchunks; j++) {
-			map_chunk(info->begin_chunk + j, info->fp, &map[j]);
-			jobs[j].start = ptr +  j * CAPFS_CHUNK_SIZE;
-			jobs[j].byteCount = CAPFS_CHUNK_SIZE;
+			if (j < info->nhashes && info->phashes
+					&& memcmp(info->phashes + j * CAPFS_MAXHASHLENGTH, 
+						info->pnewhashes + j * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH) == 0) {
+				clnt_bytes_saved_add(CAPFS_CHUNK_SIZE);
+				continue;
+			}
+			map_chunk(info->begin_chunk + j, info->pnewhashes + j * CAPFS_MAXHASHLENGTH, info->fp, &map[nput]);
+			jobs[nput].start = ptr +  j * CAPFS_CHUNK_SIZE;
+			jobs[nput].byteCount = CAPFS_CHUNK_SIZE;
+			memcpy(hashes + nput * CAPFS_MAXHASHLENGTH, info->pnewhashes + j * CAPFS_MAXHASHLENGTH, 
+					CAPFS_MAXHASHLENGTH);
+			nput++;
+		}
+		if (nput == 0) {
+			LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Write operation did not change any chunks\n");
+			free(hashes);
+			free(map);
+			free(jobs);
+			gettimeofday(&end, NULL);
+			rpc_put_time += time_diff(&end, &begin);
+			return 0;
 		}
 		/* build a job for the cas servers */
-		cas = convert_to_jobs(jobs, info->nchunks, map, info->fp, info->pnewhashes, &niods);
+		cas = convert_to_jobs(jobs, nput, map, info->fp, hashes, &niods);
 		if (cas == NULL) {
 			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
+			free(hashes);
 			free(map);
 			free(jobs);
 			return -ENOMEM;
@@ -1998,6 +2770,7 @@ static int do_cas_data_staging(struct op_info *info)
 		for (j = 0; j < niods; j++) {
 			ret = *(cas[j].returnValue);
 			if (ret < 0) {
+				free(hashes);
 				free(map);
 				free(jobs);
 				freeJobs(cas, niods);
@@ -2006,6 +2779,15 @@ static int do_cas_data_staging(struct op_info *info)
 			}
 		}
 		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Write operation finished with no errors\n");
+		/* the servers now hold these chunks, so a later read of them can be served locally */
+		if (info->sp_options->use_dcache) {
+			for (j = 0; j < info->nchunks; j++) {
+				/* cache as much as was hashed, so that the contents always match the hash */
+				dcache_put(info->pnewhashes + j * CAPFS_MAXHASHLENGTH, ptr + j * CAPFS_CHUNK_SIZE,
+						j == info->nchunks - 1 ? info->last_length : CAPFS_CHUNK_SIZE);
+			}
+		}
+		free(hashes);
 		free(map);
 		free(jobs);
 		freeJobs(cas, niods);
@@ -2040,8 +2822,9 @@ static int do_cas_commit_write(struct op_info *info)
 	memset(&new_hashes, 0, sizeof(new_hashes));
 	memset(&current_hashes, 0, sizeof(current_hashes));
 
-	old_hashes.sha1_info_len = info->nhashes;
-	if (info->nhashes > 0) {
+	/* if we know the version of the range, it is presented instead of the old hashes */
+	old_hashes.sha1_info_len = (info->version != 0) ? 0 : info->nhashes;
+	if (old_hashes.sha1_info_len > 0) {
 		old_hashes.sha1_info_ptr = 
 			(unsigned char **) calloc(info->nhashes, sizeof(unsigned char *));
 		if (old_hashes.sha1_info_ptr == NULL) {
@@ -2100,9 +2883,10 @@ static int do_cas_commit_write(struct op_info *info)
 			goto cleanup;
 		}
 	}
-	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Committing with %Ld OLD hashes\n", info->nhashes);
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Committing with %Ld OLD hashes (version %Ld)\n",
+			(int64_t) old_hashes.sha1_info_len, info->version);
 #ifdef VERBOSE_DEBUG
-	for (i = 0; i < info->nhashes; i++) {
+	for (i = 0; i < old_hashes.sha1_info_len; i++) {
 		char str[256];
 
 		hash2str(old_hashes.sha1_info_ptr[i], CAPFS_MAXHASHLENGTH, str);
@@ -2126,7 +2910,7 @@ static int do_cas_commit_write(struct op_info *info)
 	 */
 	if (commit_write(&opt, op->v1.fhname, 
 						  info->begin_chunk, info->user_size + info->user_offset,
-						  &old_hashes, &new_hashes, &current_hashes) < 0) 
+						  &old_hashes, &new_hashes, &current_hashes, &info->version) < 0) 
 	{
 		/* only if errno is set to EAGAIN is it a race condition */
 		if (errno == EAGAIN) 
@@ -2188,6 +2972,179 @@ cleanup:
 	return ret;
 }
 
+/*
+ * Writes size bytes from buf at offset of the open file pfp to the cas
+ * servers, and commits (or, if the plugin delays commits, remembers) the
+ * new hashes. Returns 0 on success, -errno on failure.
+ */
+static int do_cas_write(struct capfs_specific_options *sp_options, struct capfs_upcall *op,
+		struct pf *pfp, void *buf, capfs_off_t offset, capfs_size_t size)
+{
+	struct op_info info;
+	struct capfs_options opt;
+	int error, commit_status;
+
+	memset(&info, 0, sizeof(info));
+	info.type = IOD_RW_WRITE;
+	info.fp = pfp->fp;
+	info.fhname = op->v1.fhname;
+	info.user_ptr = buf;
+	info.user_offset = offset;
+	info.user_size = size;
+	info.op = op;
+	info.sp_options = sp_options;
+	info.pfp = pfp;
+
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[WRITE ] user pointer %p of size: %Ld\n",
+			info.user_ptr, info.user_size);
+	/* Initiate fetching of the hashes */
+	if ((error = do_get_hashes(&info)) < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "Could not get hashes: %d\n", error);
+		goto out;
+	}
+	init_capfs_options(&opt, sp_options);
+write_retry:
+	if ((error = do_compute_hashes(&info)) < 0) {
+		goto out;
+	}
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Computed %Ld hashes for put\n", info.nchunks);
+#ifdef VERBOSE_DEBUG
+	{
+		int i;
+		for (i = 0; i < info.nchunks; i++) {
+			char str[256];
+
+			hash2str(info.pnewhashes + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH, str);
+			LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "%d: %s\n", i, str);
+		}
+	}
+#endif
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "about to stage WRITE operation. should return %Ld bytes\n", size);
+	/* cool, so now we can stage the I/O operation to the cas servers */
+	if ((error = do_cas_data_staging(&info)) < 0) {
+		goto out;
+	}
+	/* under session semantics, the commit waits for a close or fsync */
+	if (opt.delay_commit) {
+		error = pending_add(pfp, &opt, info.begin_chunk, info.nchunks,
+				info.pnewhashes, info.user_offset + info.user_size);
+	}
+	/* Writes need to commit */
+	else if ((commit_status = do_cas_commit_write(&info)) < 0) {
+		error = commit_status;
+	}
+	else if (commit_status == 0) {
+		/* we must have raced. So let us retry */
+		goto write_retry;
+	}
+out:
+	info_dtor(&info);
+	return error;
+}
+
+/*
+ * Writes out the contents of the write-back buffer of an open file.
+ * The buffer is left alone if that fails, so that a later flush can retry.
+ */
+static int wb_flush(struct pf *pfp)
+{
+	struct write_buffer *wb = pfp->wb;
+	int error;
+
+	if (wb == NULL || wb->len == 0) {
+		return 0;
+	}
+	LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[write-back] %s: flushing %Ld bytes at %Ld\n", pfp->name,
+			wb->len, wb->off);
+	if ((error = do_cas_write(&wb->sp_options, &wb->op, pfp, wb->data, wb->off, wb->len)) < 0) {
+		return error;
+	}
+	wb->len = 0;
+	return 0;
+}
+
+/*
+ * Every write to the cas servers that does not cover whole chunks has to
+ * read back the chunks at its ends first, so a stream of small records
+ * would cost two reads and a chunk-sized write apiece. When the plugin
+ * delays commits anyway, consecutive writes to an open file are gathered
+ * here instead, in a buffer of up to CAPFS_WB_CHUNKS chunks that ends on a
+ * chunk boundary, and written out when it fills up, when a write does not
+ * continue (or overwrite) what it holds, or when the file is read from,
+ * synced, truncated or closed. Other plugins have every write go out
+ * right away.
+ *
+ * Returns the number of bytes taken (which is short of size if a flush
+ * fails after part of the write was gathered), -errno if none were.
+ */
+static int64_t wb_write(struct capfs_specific_options *sp_options, struct capfs_upcall *op,
+		struct pf *pfp, char *buf, capfs_off_t offset, capfs_size_t size)
+{
+	struct capfs_options opt;
+	struct write_buffer *wb;
+	int64_t done = 0;
+	int error;
+
+	init_capfs_options(&opt, sp_options);
+	if (opt.delay_commit == 0) {
+		if ((error = wb_flush(pfp)) < 0
+				|| (error = do_cas_write(sp_options, op, pfp, buf, offset, size)) < 0) {
+			return error;
+		}
+		return size;
+	}
+	if ((wb = pfp->wb) == NULL) {
+		wb = (struct write_buffer *) calloc(1, sizeof(struct write_buffer));
+		if (wb == NULL || (wb->data = (char *) malloc(CAPFS_WB_CHUNKS * CAPFS_CHUNK_SIZE)) == NULL) {
+			LOG(stderr, INFO_MSG, SUBSYS_CLIENT, "[write-back] could not allocate memory; writing through\n");
+			free(wb);
+			if ((error = do_cas_write(sp_options, op, pfp, buf, offset, size)) < 0) {
+				return error;
+			}
+			return size;
+		}
+		pfp->wb = wb;
+	}
+	/* the buffer goes out with the credentials and options of the latest write to it */
+	wb->op = *op;
+	wb->sp_options = *sp_options;
+	while (size > 0) {
+		int64_t limit, n;
+
+		if (wb->len > 0 && (offset < wb->off || offset > wb->off + wb->len)) {
+			if ((error = wb_flush(pfp)) < 0) {
+				return done > 0 ? done : error;
+			}
+		}
+		if (wb->len == 0) {
+			/* nothing to gather for writes this large */
+			if (size >= CAPFS_WB_CHUNKS * CAPFS_CHUNK_SIZE) {
+				if ((error = do_cas_write(sp_options, op, pfp, buf, offset, size)) < 0) {
+					return done > 0 ? done : error;
+				}
+				return done + size;
+			}
+			wb->off = offset;
+			pf_hold(pfp);
+		}
+		limit = (wb->off / CAPFS_CHUNK_SIZE + CAPFS_WB_CHUNKS) * CAPFS_CHUNK_SIZE;
+		n = MIN(size, limit - offset);
+		memcpy(wb->data + (offset - wb->off), buf, n);
+		wb->len = MAX(wb->len, offset + n - wb->off);
+		offset += n;
+		buf += n;
+		size -= n;
+		done += n;
+		/* what was copied stays buffered for a later flush to retry */
+		if (wb->off + wb->len == limit) {
+			if ((error = wb_flush(pfp)) < 0) {
+				return done;
+			}
+		}
+	}
+	return done;
+}
+
 /* do_rw_op(sp_options, mgr, op, resp)
  *
  * NOTES:
@@ -2215,7 +3172,7 @@ static int do_rw_op(struct capfs_specific_options *sp_options,
 {
 	int error = 0;
 	capfs_size_t size = 0;
-	struct pf *pfp;
+	struct pf *pfp = NULL;
 	fdesc *fp;
 
 	if (op->u.rw.io.type != IO_CONTIG) {
@@ -2224,7 +3181,7 @@ static int do_rw_op(struct capfs_specific_options *sp_options,
 	}
 	
 	/* make sure the file is open and ready for access */
-	if ((pfp = pf_search(file_list, op->u.rw.handle, op->v1.fhname)) == NULL) {
+	if ((pfp = pf_get(op->u.rw.handle, op->v1.fhname)) == NULL) {
 		/* if it isn't open, open it now */
 		if ((error = open_capfs_file(sp_options, mgr, op->v1.fhname)) < 0)
 			goto do_rw_op_error;
@@ -2240,7 +3197,7 @@ static int do_rw_op(struct capfs_specific_options *sp_options,
 		 */
 		/* UPDATE 8-22-2001: Nope.  This is still a problem. -- Rob
 		 */
-		if ((pfp = pf_search(file_list, op->u.rw.handle, op->v1.fhname)) == NULL)
+		if ((pfp = pf_get(op->u.rw.handle, op->v1.fhname)) == NULL)
 		{
 			PERROR( "NULL returned from pf_search after successful open\n");
 			error = -EINVAL; /* as good as anything... */
@@ -2274,17 +3231,29 @@ static int do_rw_op(struct capfs_specific_options *sp_options,
 	{
 		struct op_info info;
 
-		memset(&info, 0, sizeof(info));
-		if (op->type == READ_OP) {
-			info.type = IOD_RW_READ;
-		}
-		else if(op->type == WRITE_OP) {
-			info.type = IOD_RW_WRITE;
+		if (op->type == WRITE_OP) {
+			/* small writes are gathered into whole chunks first, if the plugin allows it */
+			int64_t ret;
+
+			if ((ret = wb_write(sp_options, op, pfp, op->xfer.ptr, fp->fd.off, op->xfer.size)) < 0) {
+				error = ret;
+				goto do_rw_op_error;
+			}
+			size = ret;
+			goto do_rw_op_complete;
 		}
-		else {
+		else if (op->type != READ_OP) {
 			error = -EINVAL;
 			goto do_rw_op_error;
 		}
+		/* buffered writes that this read might see go out first */
+		if (pfp->wb && pfp->wb->len > 0 && fp->fd.off + op->xfer.size > pfp->wb->off) {
+			if ((error = wb_flush(pfp)) < 0) {
+				goto do_rw_op_error;
+			}
+		}
+		memset(&info, 0, sizeof(info));
+		info.type = IOD_RW_READ;
 		info.fp = fp;
 		info.fhname = op->v1.fhname;
 		info.user_ptr = op->xfer.ptr;
@@ -2292,10 +3261,10 @@ static int do_rw_op(struct capfs_specific_options *sp_options,
 		info.user_size = op->xfer.size;
 		info.op = op;
 		info.sp_options = sp_options;
+		info.pfp = pfp;
 
-		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[%s] user pointer %p of size: %Ld\n",
-				info.type == IOD_RW_READ ? "READ ": "WRITE ", info.user_ptr,
-				info.user_size);
+		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "[READ ] user pointer %p of size: %Ld\n",
+				info.user_ptr, info.user_size);
 		/* Initiate fetching of the hashes */
 		if ((error = do_get_hashes(&info)) < 0) {
 			LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "Could not get hashes: %d\n", error);
@@ -2303,61 +3272,23 @@ static int do_rw_op(struct capfs_specific_options *sp_options,
 			goto do_rw_op_error;
 		}
 		/* read operation with no hashes on the meta-data server */
-		if (info.nhashes == 0 && op->type == READ_OP) {
+		if (info.nhashes == 0) {
 			size = 0;
 			info_dtor(&info);
 			goto do_rw_op_complete;
 		}
-		if (op->type == WRITE_OP) {
-write_retry:
-			if ((error = do_compute_hashes(&info)) < 0) {
-				info_dtor(&info);
-				goto do_rw_op_error;
-			}
-			LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "Computed %Ld hashes for put\n", info.nchunks);
-#ifdef VERBOSE_DEBUG
-			{
-				int i;
-				for (i = 0; i < info.nchunks; i++) {
-					char str[256];
-
-					hash2str(info.pnewhashes + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH, str);
-					LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "%d: %s\n", i, str);
-				}
-			}
-#endif
-			size = op->xfer.size;
-			LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "about to stage WRITE operation. should return %Ld bytes\n", size);
-		}
-		else {
-			/* This is what the user would expect as its return value */
-			size = MIN((info.file_size - fp->fd.off), info.user_size);
-			LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "about to stage READ operation. should return %Ld bytes\n", size);
-			if (size == 0) {
-				info_dtor(&info);
-				goto do_rw_op_error;
-			}
+		/* This is what the user would expect as its return value */
+		size = MIN((info.file_size - fp->fd.off), info.user_size);
+		LOG(stderr, DEBUG_MSG, SUBSYS_CLIENT, "about to stage READ operation. should return %Ld bytes\n", size);
+		if (size == 0) {
+			info_dtor(&info);
+			goto do_rw_op_error;
 		}
 		/* cool, so now we can stage the I/O operation to the cas servers */
 		if ((error = do_cas_data_staging(&info)) < 0) {
 			info_dtor(&info);
 			goto do_rw_op_error;
 		}
-		if (op->type == WRITE_OP) {
-			int commit_status;
-
-			/* Writes need to commit */
-			if ((commit_status = do_cas_commit_write(&info)) < 0) {
-				error = commit_status;
-				info_dtor(&info);
-				goto do_rw_op_error;
-			}
-			else if (commit_status == 0) {
-				/* we must have raced. So let us retry */
-				goto write_retry;
-			}
-			error = 0;
-		}
 		/* free up info structure */
 		info_dtor(&info);
 		error = 0;
@@ -2372,6 +3303,9 @@ do_rw_op_complete:
 	resp->xfer.size = size;
 	resp->u.rw.size = size;
 do_rw_op_error:
+	if (pfp != NULL) {
+		pf_put(pfp);
+	}
 	resp->error = error;
 	return error;
 }
@@ -2732,27 +3666,14 @@ static fdesc *do_open_req(struct capfs_specific_options *sp_options,
 	fp->fs = FS_CAPFS;
 	handle = ack.ack.open.meta.u_stat.st_ino;
 
-	/* store fdesc in our file list for use later */
-	if (file_list == NULL)
-		file_list = pfl_new();
-	if (file_list == NULL)
-	{
-		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
-		error = -ENOMEM;
-		goto open_capfs_file_error;
-	}
 	if ((p = pf_new(fp, handle, name)) == NULL) 
 	{
 		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
 		error = -ENOMEM;
 		goto open_capfs_file_error;
 	}
-	if ((error = pf_add(file_list, p)) < 0) 
-	{
-		PERROR( "Error adding file handle to list.\n");
-		goto open_capfs_file_error;
-	}
-
+	/* the iod table is not thread-safe either, so it is updated under pf_mutex */
+	pthread_mutex_lock(&pf_mutex);
 	for (i = 0; i < ct; i++) 
 	{
 		//sockio_dump_sockaddr((struct sockaddr_in *)&fp->fd.iod[i].addr, stderr);
@@ -2760,11 +3681,29 @@ static fdesc *do_open_req(struct capfs_specific_options *sp_options,
 		if((fp->fd.iod[i].sock = instantiate_iod_entry((struct sockaddr *)&fp->fd.iod[i].addr)) < 0) 
 		{
 			error = -errno;
+			pthread_mutex_unlock(&pf_mutex);
 			PERROR( "Could not instantiate iod entry!\n");
 			goto open_capfs_file_error;
 		}
 		inc_ref_count(fp->fd.iod[i].sock);
 	}
+	/* store fdesc in our file list for use later */
+	if (file_list == NULL)
+		file_list = pfl_new();
+	if (file_list == NULL)
+	{
+		pthread_mutex_unlock(&pf_mutex);
+		LOG(stderr, CRITICAL_MSG, SUBSYS_CLIENT, "could not allocate memory\n");
+		error = -ENOMEM;
+		goto open_capfs_file_error;
+	}
+	if ((error = pf_add(file_list, p)) < 0) 
+	{
+		pthread_mutex_unlock(&pf_mutex);
+		PERROR( "Error adding file handle to list.\n");
+		goto open_capfs_file_error;
+	}
+	pthread_mutex_unlock(&pf_mutex);
 	return fp;
 
 open_capfs_file_error:
@@ -2956,6 +3895,7 @@ static struct pf *pf_new(fdesc *fp, capfs_handle_t handle, char *name)
 	p->name = (char *) p + sizeof(*p);
 	p->ltime = time(NULL);
 	p->fp = fp;
+	INIT_LIST_HEAD(&p->pending);
 	strcpy(p->name, name);
 	return p;
 }
@@ -2983,6 +3923,42 @@ static struct pf *pf_search(pfl_t pfl, capfs_handle_t handle, char *name)
 	return ret;
 }
 
+/* pf_get() - Like pf_search() on file_list, but also marks the entry
+ * as in use until it is released with pf_put().
+ */
+static struct pf *pf_get(capfs_handle_t handle, char *name)
+{
+	struct pf *ret;
+
+	pthread_mutex_lock(&pf_mutex);
+	if ((ret = pf_search(file_list, handle, name)) != NULL) ret->refs++;
+	pthread_mutex_unlock(&pf_mutex);
+	return ret;
+}
+
+static void pf_put(struct pf *p)
+{
+	pthread_mutex_lock(&pf_mutex);
+	p->refs--;
+	p->ltime = time(NULL);
+	pthread_mutex_unlock(&pf_mutex);
+	return;
+}
+
+/* pf_take() - Finds an entry of file_list for which cmp() returns 0 and
+ * takes it out of the list.  Does not free the structure.
+ */
+static struct pf *pf_take(void *time, int (*cmp)(void *, void *))
+{
+	struct pf *ret;
+
+	pthread_mutex_lock(&pf_mutex);
+	if ((ret = (struct pf *) llist_search(file_list, time, cmp)) != NULL)
+		pf_rem(file_list, ret->handle, ret->name);
+	pthread_mutex_unlock(&pf_mutex);
+	return ret;
+}
+
 static struct pf *pfl_head(pfl_t pfl)
 {
 	return (struct pf *) llist_head(pfl);
@@ -3010,6 +3986,7 @@ static int pf_handle_cmp(void *cmp, void *pfp)
  */
 static int pf_ltime_olderthan(void *time, void *pfp)
 {
+	if (((struct pf *) pfp)->refs > 0) return 1;
 	if (((struct pf *) pfp)->ltime < *((time_t *) time)) return 0;
 	return 1;
 }
@@ -3019,10 +3996,11 @@ static int pf_ltime_olderthan(void *time, void *pfp)
  * Returns the time value stored in the file structure minus the time
  * value pointed to by timep.  Thus the resulting value is positive if
  * the file has been touched since the time passed in and negative if
- * the file hasn't been touch since that time.
+ * the file hasn't been touch since that time.  Files in use never match.
  */
 static int pf_ltime_cmp(void *time, void *pfp)
 {
+	if (((struct pf *) pfp)->refs > 0) return 1;
 	return (((struct pf *) pfp)->ltime - *((time_t *) time));
 }
 
@@ -3053,6 +4031,11 @@ static int pf_rem(pfl_t pfl, capfs_handle_t handle, char *name)
  */
 static void pf_free(void *p)
 {
+	pending_free((struct pf *) p);
+	if (((struct pf *)p)->wb) {
+		free(((struct pf *)p)->wb->data);
+		free(((struct pf *)p)->wb);
+	}
 	free(((struct pf *)p)->fp);
 	free(p);
 	return;
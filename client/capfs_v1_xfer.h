@@ -66,6 +66,13 @@ void capfs_comm_shutdown(void);
  */
 void capfs_comm_idle(void);
 
+/* capfs_comm_expire()
+ *
+ * Calls queue_flush() for the open files that have had writes held back
+ * for too long, so that the caller can have them committed.
+ */
+void capfs_comm_expire(void (*queue_flush)(capfs_handle_t handle, char *name));
+
 /*
  * Local variables:
  *  c-indent-level: 3
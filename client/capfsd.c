@@ -60,6 +60,7 @@
 #include "dcache.h"
 #include "log.h"
 #include "plugin.h"
+#include "list.h"
 
 #define  _CAPFS_DISPATCH_FN(x) capfs_capfsd_ ## x
 #define  CAPFS_DISPATCH_FN(x)  _CAPFS_DISPATCH_FN(x)
@@ -75,8 +76,7 @@ static int read_capfsdev(int fd, struct capfs_upcall *up, int timeout);
 static int write_capfsdev(int fd, struct capfs_downcall *down, int timeout);
 static void close_capfsdev(int fd);
 static void init_downcall(struct capfs_downcall *down, struct capfs_upcall *up);
-static int read_op(struct capfs_upcall *up, struct capfs_downcall *down);
-static int write_op(struct capfs_upcall *up, struct capfs_downcall *down);
+static void die(char *string);
 static void usage(void);
 static int parse_devices(const char *targetfile, const char *devname, 
 	int *majornum);
@@ -91,11 +91,19 @@ int capfs_mode = 1;
 
 /* GLOBALS */
 #define CAPFSD_NUM_THREADS 5
+#define CAPFSD_NUM_WORKERS 8
+/* the device is not read while this many upcalls are waiting for a worker */
+#define CAPFSD_MAX_QUEUED  1024
 static int is_daemon = 1;
 static int dev_fd;
-char *orig_iobuf = NULL, *big_iobuf = NULL;
 int capfs_debug = CAPFS_DEFAULT_DEBUG_MASK;
 static int num_threads = CAPFSD_NUM_THREADS;
+static int num_workers = CAPFSD_NUM_WORKERS;
+/* bytes of chunk contents cached by the dcache, shared by all the mounts that ask for it */
+static int64_t dcache_size = (int64_t) CAPFS_DCACHE_COUNT * CAPFS_DCACHE_BSIZE;
+/* directory and size of the on-disk tier of the dcache, if any */
+static char *dcache_dir = NULL;
+static int64_t dcache_disk_size = (int64_t) CAPFS_DCACHE_DISK_COUNT * CAPFS_DCACHE_BSIZE;
 /* Local RPC service must be a separate thread */
 static struct svc_info info = {
 use_thread: 1,
@@ -110,6 +118,46 @@ extern void capfsd_plugin_cleanup(void);
 
 static int capfs_opt_io_size = 0, capfs_dent_size = 0, capfs_link_size = 0;
 
+/*
+ * Upcalls are read off the device by the main thread and queued for a pool
+ * of workers, so that one slow commit or meta-data RPC does not hold up every
+ * other process on the node.  Each worker has its own transfer buffers.
+ */
+struct upcall_work {
+	struct list_head link;
+	/* the names the upcall operates on (pointing into up); see upcall_names() */
+	int nnames;
+	char *names[2];
+	unsigned int keys[2];
+	int under; /* bit i is set if the upcall also operates on everything under names[i] */
+	int ns;    /* changes the namespace */
+	struct capfs_upcall up;
+};
+
+struct upcall_worker {
+	pthread_t tid;
+	/* the upcall being serviced, if any */
+	struct upcall_work *work;
+	char *iobuf, *big_iobuf;
+	struct capfs_dirent *dent;
+	char *link_name;
+};
+
+static LIST_HEAD(upcall_queue);
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+static int64_t queue_depth = 0, queue_max = 0, queue_total = 0;
+static struct upcall_worker *workers = NULL;
+
+static void upcall_names(struct upcall_work *work);
+static struct upcall_work *upcall_next(void);
+static void upcall_queue_flush(capfs_handle_t handle, char *name);
+static void *upcall_worker(void *arg);
+static void service_upcall(struct upcall_worker *w, struct capfs_upcall *up);
+static int read_op(struct upcall_worker *w, struct capfs_upcall *up, struct capfs_downcall *down);
+static int write_op(struct upcall_worker *w, struct capfs_upcall *up, struct capfs_downcall *down);
+
 static inline long ROUND_UP(long size)
 {
 	static int page_size = 0, page_mask = 0;
@@ -123,11 +171,8 @@ static inline long ROUND_UP(long size)
 
 int main(int argc, char **argv)
 {
-	int err;
-	struct capfs_upcall up;
-	struct capfs_downcall down;
-	struct capfs_dirent *dent = NULL;
-	char *link_name = NULL;
+	int err, i;
+	struct upcall_work *work = NULL;
 	int opt = 0;
 	int capfsd_log_level = CRITICAL_MSG | WARNING_MSG;
 	char options[256];
@@ -143,7 +188,7 @@ use_sockets:0,
 	set_log_level(capfsd_log_level);
 	/* capfsd must register a callback with the meta-data server at the time of mount */
 	check_for_registration = 1;
-	while((opt = getopt(argc, argv, "dhsn:p:")) != EOF) {
+	while((opt = getopt(argc, argv, "dhsn:w:c:k:K:p:")) != EOF) {
 		switch(opt){
 			case 's':
 				cas_options.use_sockets = 1;
@@ -162,6 +207,33 @@ use_sockets:0,
 			case 'n':
 				num_threads = atoi(optarg);
 				break;
+			case 'w':
+				num_workers = atoi(optarg);
+				if (num_workers <= 0) {
+					usage();
+					exiterror("bad arguments");
+					exit(1);
+				}
+				break;
+			case 'c':
+				dcache_size = (int64_t) atoi(optarg) * 1024 * 1024;
+				if (dcache_size < 0) {
+					usage();
+					exiterror("bad arguments");
+					exit(1);
+				}
+				break;
+			case 'k':
+				dcache_dir = optarg;
+				break;
+			case 'K':
+				dcache_disk_size = (int64_t) atoi(optarg) * 1024 * 1024;
+				if (dcache_disk_size <= 0) {
+					usage();
+					exiterror("bad arguments");
+					exit(1);
+				}
+				break;
 			case 'h':
 				usage();
 				exit(0);
@@ -195,34 +267,34 @@ use_sockets:0,
 	capfs_comm_init();
 
 
-	/* allocate a 64K, page-aligned buffer for small operations */
 	capfs_opt_io_size = ROUND_UP(CAPFS_OPT_IO_SIZE);
-	if ((orig_iobuf = (char *) valloc(capfs_opt_io_size)) == NULL) {
-		exiterror("calloc failed");
-		capfsd_plugin_cleanup();
-		exit(1);
-	}
-	memset(orig_iobuf, 0, capfs_opt_io_size);
 	capfs_dent_size = ROUND_UP((FETCH_DENTRY_COUNT * sizeof(struct capfs_dirent)));
-	/* allocate a suitably large dent buffer for getdents speed up */
-	if ((dent = (struct capfs_dirent *) valloc(capfs_dent_size)) == NULL) {
-		exiterror("calloc failed");
-		capfsd_plugin_cleanup();
-		exit(1);
-	}
-	memset(dent, 0, capfs_dent_size);
 	/* maximum size of a link target cannot be > 4096 */
 	capfs_link_size = ROUND_UP(4096);
-	link_name = (char *) valloc(capfs_link_size);
-	if(!link_name) {
+	if ((workers = (struct upcall_worker *) calloc(num_workers, sizeof(struct upcall_worker))) == NULL) {
 		exiterror("calloc failed");
 		capfsd_plugin_cleanup();
 		exit(1);
 	}
-	memset(link_name, 0, capfs_link_size);
+	for (i = 0; i < num_workers; i++) {
+		/* a 64K, page-aligned buffer for small operations, and suitably
+		 * large dent and link target buffers for getdents and readlink
+		 */
+		workers[i].iobuf = (char *) valloc(capfs_opt_io_size);
+		workers[i].dent = (struct capfs_dirent *) valloc(capfs_dent_size);
+		workers[i].link_name = (char *) valloc(capfs_link_size);
+		if (!workers[i].iobuf || !workers[i].dent || !workers[i].link_name) {
+			exiterror("valloc failed");
+			capfsd_plugin_cleanup();
+			exit(1);
+		}
+		memset(workers[i].iobuf, 0, capfs_opt_io_size);
+		memset(workers[i].dent, 0, capfs_dent_size);
+		memset(workers[i].link_name, 0, capfs_link_size);
+	}
 	
-	fprintf(stderr, "------------ Starting client daemon servicing VFS requests using a thread pool [%d threads] ----------\n",
-			num_threads);
+	fprintf(stderr, "------------ Starting client daemon servicing VFS requests with %d workers and a thread pool [%d threads] ----------\n",
+			num_workers, num_threads);
 	/*
 	 * Start up the local RPC service on both TCP/UDP 
 	 * for callbacks.
@@ -251,183 +323,421 @@ use_sockets:0,
 	snprintf(options, 256, "%d", CAPFS_HCACHE_COUNT);
 	setenv("CMGR_BCOUNT", options, 1);
 	init_hashes();
-#if 0
 	/*
-	 * Initialize the client-side data cache.
-	 * Note that we are not using this layer
-	 * right now. It is getting fairly complicated already.
+	 * Initialize the client-side data cache. It is keyed by the
+	 * hash of the chunks, so it is shared by every file and mount,
+	 * and is only consulted for mounts with the dcache option.
 	 */
-	snprintf(options, 256, "%d", CAPFS_DCACHE_BSIZE);
-	setenv("CMGR_BSIZE", options, 1);
-	snprintf(options, 256, "%d", CAPFS_DCACHE_COUNT);
-	setenv("CMGR_BCOUNT", options, 1);
-#endif
+	if ((err = dcache_init(dcache_size)) < 0) {
+		errno = -err;
+		PERROR("could not initialize the dcache; continuing without it\n");
+	}
+	/* and the disk behind it, which keeps the chunks across restarts */
+	else if (dcache_enabled() && dcache_dir != NULL) {
+		if ((err = dcache_disk_init(dcache_dir, dcache_disk_size, CAPFS_DCACHE_BSIZE)) < 0) {
+			errno = -err;
+			PERROR("could not initialize the on-disk dcache; continuing without it\n");
+		}
+		else {
+			fprintf(stderr, "on-disk dcache in %s holds %d chunks from earlier runs\n", dcache_dir, err);
+		}
+	}
 	/*
 	 * Initialize the client-side data server communication
 	 * stuff.
 	 */
 	clnt_init(&cas_options, num_threads, CAPFS_CHUNK_SIZE);
 	
+	/* start the workers */
+	for (i = 0; i < num_workers; i++) {
+		if ((err = pthread_create(&workers[i].tid, NULL, upcall_worker, &workers[i])) != 0) {
+			errno = err;
+			PERROR("could not start upcall worker %d\n", i);
+			die("pthread_create failed");
+		}
+	}
+	
 	/* loop forever, doing:
 	 * - read from device
-	 * - service request
-	 * - write back response
+	 * - queue the upcall for a worker, which services it
+	 *   and writes back the response
 	 */
 	for (;;) {
-		struct timeval begin, end;
-
-		err = read_capfsdev(dev_fd, &up, 30);
+		if (work == NULL && (work = (struct upcall_work *) malloc(sizeof(*work))) == NULL) {
+			die("malloc failed");
+		}
+		err = read_capfsdev(dev_fd, &work->up, 30);
 		if (err < 0) {
-			/* cleanup the hash cache */
-			cleanup_hashes();
-			/* Cleanup the RPC service */
-			cleanup_service(&info);
-			capfs_comm_shutdown();
-			close_capfsdev(dev_fd);
-			/* cleanup the plugins */
-			capfsd_plugin_cleanup();
-			/* cleanup the client-side stuff */
-			clnt_finalize();
-			exiterror("read failed\n");
-			exit(1);
+			die("read failed\n");
 		}
 		if (err == 0) {
 			/* timed out */
 			capfs_comm_idle();
+			capfs_comm_expire(upcall_queue_flush);
 			continue;
 		}
-		gettimeofday(&begin, NULL);
-		/* the do_capfs_op() call does this already; can probably remove */
-		init_downcall(&down, &up);
+		upcall_names(work);
+		capfs_comm_expire(upcall_queue_flush);
+
+		pthread_mutex_lock(&queue_mutex);
+		/* stop reading the device while the workers are too far behind */
+		while (queue_depth >= CAPFSD_MAX_QUEUED) {
+			pthread_cond_wait(&queue_space, &queue_mutex);
+		}
+		list_add_tail(&work->link, &upcall_queue);
+		queue_total++;
+		if (++queue_depth > queue_max) {
+			queue_max = queue_depth;
+		}
+		pthread_cond_signal(&queue_work);
+		pthread_mutex_unlock(&queue_mutex);
+		work = NULL;
+	}
+	/* Not reached */
+	die("main loop exited");
+	return 1;
+}
+
+/* upcall_key()
+ *
+ * Hashes a name, so that names can be told apart quickly.
+ */
+static unsigned int upcall_key(char *name)
+{
+	unsigned int key = 5381;
+	int i;
+
+	for (i = 0; i < CAPFSNAMELEN && name[i] != '\0'; i++) {
+		key = key * 33 + (unsigned char) name[i];
+	}
+	return key;
+}
+
+static void upcall_add_name(struct upcall_work *work, char *name, int under)
+{
+	/* the names in an upcall need not be terminated */
+	name[CAPFSNAMELEN] = '\0';
+	work->names[work->nnames] = name;
+	work->keys[work->nnames] = upcall_key(name);
+	if (under) {
+		work->under |= 1 << work->nnames;
+	}
+	work->nnames++;
+	return;
+}
 
-		err = 0;
-		switch (up.type) {
-			/* all the easy operations */
-		case GETMETA_OP:
-		case SETMETA_OP:
-		case LOOKUP_OP:
+/* upcall_names()
+ *
+ * Fills in the names that an upcall operates on.  Upcalls that share a name
+ * are serviced one at a time, in the order they were read off the device
+ * (see upcall_next()), so that (for instance) a HINT_CLOSE, for which the
+ * kernel does not wait, is done with before the next open of the same file,
+ * or a rename of it, is serviced.  A rename, remove or link also operates
+ * on everything under its source, since it commits the held back writes of
+ * every open file in there (see pf_flush_path()).
+ */
+static void upcall_names(struct upcall_work *work)
+{
+	struct capfs_upcall *up = &work->up;
+
+	work->nnames = 0;
+	work->under = 0;
+	work->ns = 1;
+	switch (up->type) {
 		case CREATE_OP:
-		case REMOVE_OP:
-		case RENAME_OP:
-		case SYMLINK_OP:
+			upcall_add_name(work, (char *) up->u.create.name, 0);
+			break;
 		case MKDIR_OP:
+			upcall_add_name(work, (char *) up->u.mkdir.name, 0);
+			break;
 		case RMDIR_OP:
-		case STATFS_OP:
-		case HINT_OP:
-		case FSYNC_OP:
-		case LINK_OP:
-		{
-			PDEBUG(D_UPCALL, "read upcall; type = %d, name = %s\n", up.type,
-					 up.v1.fhname);
-			err = do_capfs_op(&up, &down);
-			if (err < 0) {
-				PDEBUG(D_LIB, "do_capfs_op failed for type %d\n", up.type);
-			}
+			upcall_add_name(work, (char *) up->u.rmdir.name, 0);
 			break;
-			/* the more interesting ones */
-		}
-		case GETDENTS_OP:
-			/* need to pass location and size of buffer to do_capfs_op() */
-			up.xfer.ptr = dent;
-			up.xfer.size = capfs_dent_size;
-			err = do_capfs_op(&up, &down);
-			if (err < 0) {
-				PDEBUG(D_LIB, "do_capfs_op failed for getdents\n");
-			}
+		case REMOVE_OP:
+			upcall_add_name(work, (char *) up->v1.fhname, 1);
 			break;
-		case READLINK_OP:
-			/* need to pass location and size of buffer to hold the target name */
-			up.xfer.ptr = link_name;
-			up.xfer.size = capfs_link_size;
-			err = do_capfs_op(&up, &down);
-			if(err < 0) {
-				PDEBUG(D_LIB, "do_capfs_op failed for readlink\n");
-			}
+		case RENAME_OP:
+			upcall_add_name(work, (char *) up->v1.fhname, 1);
+			upcall_add_name(work, (char *) up->u.rename.new_name, 0);
 			break;
-		case READ_OP:
-			err = read_op(&up, &down);
-			if (err < 0) {
-				PDEBUG(D_LIB, "read_op failed\n");
-			}
+		case SYMLINK_OP:
+			upcall_add_name(work, (char *) up->v1.fhname, 0);
 			break;
-		case WRITE_OP:
-			err = write_op(&up, &down);
-			if (err < 0) {
-				PDEBUG(D_LIB, "do_capfs_op failed\n");
-			}
+		case LINK_OP:
+			upcall_add_name(work, (char *) up->u.link.target_name, 1);
+			upcall_add_name(work, (char *) up->v1.fhname, 0);
 			break;
-			/* things that aren't done yet */
 		default:
-			err = -ENOSYS;
+			work->ns = 0;
+			upcall_add_name(work, (char *) up->v1.fhname, 0);
 			break;
+	}
+	return;
+}
+
+/* Returns 1 if name is under the directory dir */
+static int upcall_under(char *name, char *dir)
+{
+	int len = strlen(dir);
+
+	return strncmp(name, dir, len) == 0 && name[len] == '/';
+}
+
+/* Returns 1 if the upcalls a and b operate on a common name */
+static int upcall_conflict(struct upcall_work *a, struct upcall_work *b)
+{
+	int i, j;
+
+	for (i = 0; i < a->nnames; i++) {
+		for (j = 0; j < b->nnames; j++) {
+			if ((a->keys[i] == b->keys[j] && strcmp(a->names[i], b->names[j]) == 0)
+					|| ((a->under & (1 << i)) && upcall_under(b->names[j], a->names[i]))
+					|| ((b->under & (1 << j)) && upcall_under(a->names[i], b->names[j]))) {
+				return 1;
+			}
 		}
-		gettimeofday(&end, NULL);
-		/* calculate the total time spent servicing this call */
-		if (end.tv_usec < begin.tv_usec) {
-			end.tv_usec += 1000000;
-			end.tv_sec--;
-		}
-		end.tv_sec -= begin.tv_sec;
-		end.tv_usec -= begin.tv_usec;
-		down.total_time = (end.tv_sec * 1000000 + end.tv_usec);
-		down.error = err;
+	}
+	return 0;
+}
 
-		switch(up.type)
-		{
-		case HINT_OP:
-			/* this is a one shot hint, we don't want a response in case of HINT_OPEN/HINT_CLOSE */
-			if (up.u.hint.hint == HINT_CLOSE || up.u.hint.hint == HINT_OPEN) {
-				err = 0;
+/* upcall_next()
+ *
+ * Returns the oldest queued upcall that shares no name with an upcall being
+ * serviced or an older queued one, or NULL.  Upcalls on a single file only
+ * need to look at the older namespace upcalls: an older upcall on the same
+ * file would have been picked first, unless it is held back by one that
+ * holds this one back too.
+ * Must be called with queue_mutex held.
+ */
+static struct upcall_work *upcall_next(void)
+{
+	struct list_head *l, *m;
+	int i;
+
+	list_for_each(l, &upcall_queue) {
+		struct upcall_work *work = list_entry(l, struct upcall_work, link);
+
+		for (i = 0; i < num_workers; i++) {
+			if (workers[i].work && upcall_conflict(work, workers[i].work)) {
 				break;
 			}
-			/* fall through */
-		default:
-			/* the default behavior is to write a response to the device */
-			err = write_capfsdev(dev_fd, &down, -1);
-			if (err < 0) {
-				/* cleanup the hash cache */
-				cleanup_hashes();
-				/* Cleanup the RPC service */
-				cleanup_service(&info);
-				capfs_comm_shutdown();
-				close_capfsdev(dev_fd);
-				/* Cleanup the plugins */
-				capfsd_plugin_cleanup();
-				/* cleanup the client-side stuff */
-				clnt_finalize();
-				exiterror("write failed");
-				exit(1);
+		}
+		if (i < num_workers) {
+			continue;
+		}
+		for (m = upcall_queue.next; m != l; m = m->next) {
+			struct upcall_work *older = list_entry(m, struct upcall_work, link);
+
+			if ((work->ns || older->ns) && upcall_conflict(work, older)) {
+				break;
 			}
-			break;
 		}
+		if (m == l) {
+			return work;
+		}
+	}
+	return NULL;
+}
 
-		/* If we used a big I/O buffer, free it after we have successfully
-		 * returned the downcall.
-		 */
-		if (big_iobuf != NULL) {
-			free(big_iobuf);
-			big_iobuf = NULL;
+/* upcall_queue_flush()
+ *
+ * Queues a HINT_FLUSH for an open file that has had writes held back for too
+ * long, so that it is serviced in turn with the other upcalls on the file.
+ * Called from capfs_comm_expire() with its locks held, so this does not wait
+ * for room in the queue.
+ */
+static void upcall_queue_flush(capfs_handle_t handle, char *name)
+{
+	struct upcall_work *work;
+
+	if ((work = (struct upcall_work *) calloc(1, sizeof(*work))) == NULL) {
+		return;
+	}
+	work->up.type = HINT_OP;
+	work->up.u.hint.hint = HINT_FLUSH;
+	work->up.u.hint.handle = handle;
+	strncpy(work->up.v1.fhname, name, sizeof(work->up.v1.fhname) - 1);
+	upcall_names(work);
+
+	pthread_mutex_lock(&queue_mutex);
+	list_add_tail(&work->link, &upcall_queue);
+	queue_total++;
+	if (++queue_depth > queue_max) {
+		queue_max = queue_depth;
+	}
+	pthread_cond_signal(&queue_work);
+	pthread_mutex_unlock(&queue_mutex);
+	return;
+}
+
+/* upcall_worker()
+ *
+ * Services queued upcalls until the daemon exits.
+ */
+static void *upcall_worker(void *arg)
+{
+	struct upcall_worker *w = (struct upcall_worker *) arg;
+	struct upcall_work *work;
+
+	for (;;) {
+		pthread_mutex_lock(&queue_mutex);
+		while ((work = upcall_next()) == NULL) {
+			pthread_cond_wait(&queue_work, &queue_mutex);
 		}
+		list_del(&work->link);
+		queue_depth--;
+		pthread_cond_signal(&queue_space);
+		w->work = work;
+		pthread_mutex_unlock(&queue_mutex);
+
+		service_upcall(w, &work->up);
+
+		pthread_mutex_lock(&queue_mutex);
+		w->work = NULL;
+		/* upcalls held back behind this one may be runnable now */
+		pthread_cond_broadcast(&queue_work);
+		pthread_mutex_unlock(&queue_mutex);
+		free(work);
 	}
-	/* Not reached */
-	/* cleanup the hash cache */
-	cleanup_hashes();
-	/* Cleanup the RPC service */
-	cleanup_service(&info);
-	capfs_comm_shutdown();
-	close_capfsdev(dev_fd);
-	/* cleanup the plugins */
-	capfsd_plugin_cleanup();
-	/* cleanup the client-side stuff */
-	clnt_finalize();
-	exit(1);
+	return NULL;
+}
+
+/* capfsd_queue_stats()
+ *
+ * Returns the number of upcalls waiting for a worker, the most that have
+ * ever waited, and the number of upcalls queued so far.
+ */
+void capfsd_queue_stats(int64_t *depth, int64_t *max, int64_t *total)
+{
+	pthread_mutex_lock(&queue_mutex);
+	*depth = queue_depth;
+	*max = queue_max;
+	*total = queue_total;
+	pthread_mutex_unlock(&queue_mutex);
+	return;
+}
+
+/* service_upcall()
+ *
+ * Services one upcall and writes the response back to the device.
+ */
+static void service_upcall(struct upcall_worker *w, struct capfs_upcall *up)
+{
+	int err;
+	struct capfs_downcall down;
+	struct timeval begin, end;
+
+	gettimeofday(&begin, NULL);
+	/* the do_capfs_op() call does this already; can probably remove */
+	init_downcall(&down, up);
+
+	err = 0;
+	switch (up->type) {
+		/* all the easy operations */
+	case GETMETA_OP:
+	case SETMETA_OP:
+	case LOOKUP_OP:
+	case CREATE_OP:
+	case REMOVE_OP:
+	case RENAME_OP:
+	case SYMLINK_OP:
+	case MKDIR_OP:
+	case RMDIR_OP:
+	case STATFS_OP:
+	case HINT_OP:
+	case FSYNC_OP:
+	case LINK_OP:
+	{
+		PDEBUG(D_UPCALL, "read upcall; type = %d, name = %s\n", up->type,
+				 up->v1.fhname);
+		err = do_capfs_op(up, &down);
+		if (err < 0) {
+			PDEBUG(D_LIB, "do_capfs_op failed for type %d\n", up->type);
+		}
+		break;
+		/* the more interesting ones */
+	}
+	case GETDENTS_OP:
+		/* need to pass location and size of buffer to do_capfs_op() */
+		up->xfer.ptr = w->dent;
+		up->xfer.size = capfs_dent_size;
+		err = do_capfs_op(up, &down);
+		if (err < 0) {
+			PDEBUG(D_LIB, "do_capfs_op failed for getdents\n");
+		}
+		break;
+	case READLINK_OP:
+		/* need to pass location and size of buffer to hold the target name */
+		up->xfer.ptr = w->link_name;
+		up->xfer.size = capfs_link_size;
+		err = do_capfs_op(up, &down);
+		if(err < 0) {
+			PDEBUG(D_LIB, "do_capfs_op failed for readlink\n");
+		}
+		break;
+	case READ_OP:
+		err = read_op(w, up, &down);
+		if (err < 0) {
+			PDEBUG(D_LIB, "read_op failed\n");
+		}
+		break;
+	case WRITE_OP:
+		err = write_op(w, up, &down);
+		if (err < 0) {
+			PDEBUG(D_LIB, "do_capfs_op failed\n");
+		}
+		break;
+		/* things that aren't done yet */
+	default:
+		err = -ENOSYS;
+		break;
+	}
+	gettimeofday(&end, NULL);
+	/* calculate the total time spent servicing this call */
+	if (end.tv_usec < begin.tv_usec) {
+		end.tv_usec += 1000000;
+		end.tv_sec--;
+	}
+	end.tv_sec -= begin.tv_sec;
+	end.tv_usec -= begin.tv_usec;
+	down.total_time = (end.tv_sec * 1000000 + end.tv_usec);
+	down.error = err;
+
+	switch(up->type)
+	{
+	case HINT_OP:
+		/* this is a one shot hint, we don't want a response in case of HINT_OPEN/HINT_CLOSE */
+		if (up->u.hint.hint == HINT_CLOSE || up->u.hint.hint == HINT_OPEN) {
+			break;
+		}
+		/* nobody asked for this one */
+		if (up->u.hint.hint == HINT_FLUSH) {
+			break;
+		}
+		/* fall through */
+	default:
+		/* the default behavior is to write a response to the device */
+		if (write_capfsdev(dev_fd, &down, -1) < 0) {
+			die("write failed");
+		}
+		break;
+	}
+
+	/* If we used a big I/O buffer, free it after we have successfully
+	 * returned the downcall.
+	 */
+	if (w->big_iobuf != NULL) {
+		free(w->big_iobuf);
+		w->big_iobuf = NULL;
+	}
+	return;
 }
 
 /* read_op()
  *
  * Returns 0 on success, -errno on failure.
  */
-static int read_op(struct capfs_upcall *up, struct capfs_downcall *down)
+static int read_op(struct upcall_worker *w, struct capfs_upcall *up, struct capfs_downcall *down)
 {
 	int err;
 
@@ -435,16 +745,16 @@ static int read_op(struct capfs_upcall *up, struct capfs_downcall *down)
 
 	if (up->u.rw.io.u.contig.size <= CAPFS_OPT_IO_SIZE) {
 		/* use our standard little buffer */
-		up->xfer.ptr = orig_iobuf;
+		up->xfer.ptr = w->iobuf;
 		up->xfer.size = up->u.rw.io.u.contig.size;
 	}
 	else {
-		/* need a big buffer; this is freed in main */
-		if ((big_iobuf = (char *) valloc(up->u.rw.io.u.contig.size)) == NULL)
+		/* need a big buffer; this is freed in service_upcall() */
+		if ((w->big_iobuf = (char *) valloc(up->u.rw.io.u.contig.size)) == NULL)
 			return -errno;
-		memset(big_iobuf, 0, up->u.rw.io.u.contig.size);
+		memset(w->big_iobuf, 0, up->u.rw.io.u.contig.size);
 
-		up->xfer.ptr = big_iobuf;
+		up->xfer.ptr = w->big_iobuf;
 		up->xfer.size = up->u.rw.io.u.contig.size;
 	}
 
@@ -460,7 +770,7 @@ static int read_op(struct capfs_upcall *up, struct capfs_downcall *down)
  *
  * Returns 0 on success, -errno on failure.
  */
-static int write_op(struct capfs_upcall *up, struct capfs_downcall *down)
+static int write_op(struct upcall_worker *w, struct capfs_upcall *up, struct capfs_downcall *down)
 {
 
 	int err;
@@ -470,15 +780,15 @@ static int write_op(struct capfs_upcall *up, struct capfs_downcall *down)
 
 	if (up->u.rw.io.u.contig.size <= CAPFS_OPT_IO_SIZE) {
 		/* use our standard little buffer */
-		up->xfer.ptr = orig_iobuf;
+		up->xfer.ptr = w->iobuf;
 		up->xfer.size = up->u.rw.io.u.contig.size;
 	}
 	else {
-		/* need a big buffer; this is freed in main */
-		if ((big_iobuf = (char *) valloc(up->u.rw.io.u.contig.size)) == NULL)
+		/* need a big buffer; this is freed in service_upcall() */
+		if ((w->big_iobuf = (char *) valloc(up->u.rw.io.u.contig.size)) == NULL)
 			return -errno;
-		memset(big_iobuf, 0, up->u.rw.io.u.contig.size);
-		up->xfer.ptr = big_iobuf;
+		memset(w->big_iobuf, 0, up->u.rw.io.u.contig.size);
+		up->xfer.ptr = w->big_iobuf;
 		up->xfer.size = up->u.rw.io.u.contig.size;
 	}
 
@@ -486,10 +796,13 @@ static int write_op(struct capfs_upcall *up, struct capfs_downcall *down)
 	 * The write process requires an extra downcall, sent here, to tell
 	 * the kernel where to put the data (in our user-space) so we can
 	 * write it to the file system.  Here we setup the downcall to indicate
-	 * the location of the capfsd write buffer, then send it away.
+	 * the location of this worker's write buffer, then send it away.  The
+	 * device matches downcalls to upcalls by sequence number, so other
+	 * workers may be doing the same for their own writes.
 	 *
-	 * The second downcall is performed back up in main() after we return from
-	 * this function, and it indicates the result of the CAPFS request.  
+	 * The second downcall is performed back up in service_upcall() after we
+	 * return from this function, and it indicates the result of the CAPFS
+	 * request.
     */
 	init_downcall(&write_down, up);
 	write_down.xfer.ptr = up->xfer.ptr;
@@ -634,6 +947,9 @@ static void do_signal(int signr, siginfo_t *sinfo, void *unused)
 		case SIGTERM:
 			/* cleanup the hash cache */
 			cleanup_hashes();
+			/* cleanup the data cache */
+			dcache_finalize();
+			dcache_disk_finalize();
 			/* Cleanup the RPC service */
 			cleanup_service(&info);
 			/* Clean up the plugins */
@@ -654,6 +970,9 @@ static void do_signal(int signr, siginfo_t *sinfo, void *unused)
 		case SIGSEGV:
 			/* cleanup the hash cache */
 			cleanup_hashes();
+			/* cleanup the data cache */
+			dcache_finalize();
+			dcache_disk_finalize();
 			/* Cleanup the RPC service */
 			cleanup_service(&info);
 			capfs_comm_shutdown();
@@ -667,6 +986,9 @@ static void do_signal(int signr, siginfo_t *sinfo, void *unused)
 		default:
 			/* cleanup the hash cache */
 			cleanup_hashes();
+			/* cleanup the data cache */
+			dcache_finalize();
+			dcache_disk_finalize();
 			/* Cleanup the RPC service */
 			cleanup_service(&info);
 			capfs_comm_shutdown();
@@ -685,6 +1007,30 @@ static void exiterror(char *string)
 	fprintf(stderr, "capfsd exiting: %s\n", string);
 }
 
+/* die()
+ *
+ * Tears everything down and exits; used when the device can no longer be
+ * read or written, by the main thread or any of the workers.
+ */
+static void die(char *string)
+{
+	/* cleanup the hash cache */
+	cleanup_hashes();
+	/* cleanup the data cache */
+	dcache_finalize();
+	dcache_disk_finalize();
+	/* Cleanup the RPC service */
+	cleanup_service(&info);
+	capfs_comm_shutdown();
+	close_capfsdev(dev_fd);
+	/* cleanup the plugins */
+	capfsd_plugin_cleanup();
+	/* cleanup the client-side stuff */
+	clnt_finalize();
+	exiterror(string);
+	exit(1);
+}
+
 static void cleanup(void)
 {
 	/* two calls to capfs_comm_idle() will close everything */
@@ -888,6 +1234,12 @@ static void usage(void){
 	printf("\t-d {dont run as daemon}\n");
 	printf("\t-p <client/vfs interaction debugging level in hex>   (increases amount of capfsd logging)\n");
 	printf("\t-n <number of threads in the thread pool>\n");
+	printf("\t-w <number of threads servicing upcalls>   (default %d)\n", CAPFSD_NUM_WORKERS);
+	printf("\t-c <MB of memory for the data cache used by dcache mounts>   (default %d, 0 disables it)\n",
+			(int) (((int64_t) CAPFS_DCACHE_COUNT * CAPFS_DCACHE_BSIZE) >> 20));
+	printf("\t-k <directory on a local disk to keep the data cache in across restarts>\n");
+	printf("\t-K <MB of disk for the data cache>   (default %d)\n",
+			(int) (((int64_t) CAPFS_DCACHE_DISK_COUNT * CAPFS_DCACHE_BSIZE) >> 20));
 	printf("\t-h                            (show this help screen)\n");
 	printf("\n");
 	return;
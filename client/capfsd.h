@@ -28,6 +28,11 @@
  *           Phil Carns pcarns@parl.clemson.edu
  */
 
+#include <stdint.h>
+
+/* depth of the upcall queue between the device reader and the workers */
+extern void capfsd_queue_stats(int64_t *depth, int64_t *max, int64_t *total);
+
 #endif
 /*
  * Local variables:
@@ -8,7 +8,7 @@
 extern void init_hashes(void);
 extern void cleanup_hashes(void);
 extern int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk, 
-		int64_t nchunks, int64_t prefetch_index, void *buf, fmeta *meta);
+		int64_t nchunks, int64_t prefetch_index, void *buf, fmeta *meta, int64_t *version);
 extern int64_t put_hashes(char *name, int64_t begin_chunk, int64_t nchunks, void *buf);
 extern int clear_hashes(char *name);
 extern void hashes_stats(int64_t *hits, int64_t *misses, int64_t *fetches, int64_t *inv, int64_t *evict);
@@ -1,457 +1,299 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Client-side data cache (dcache).
+ *
+ * capfsd keeps the contents of recently read and written chunks in memory,
+ * keyed by their hash, so that a read of a chunk it has already seen
+ * (through any file, at any offset) need not go to the CAS servers. Since a
+ * hash always names the same contents, entries never have to be invalidated
+ * when files change and the cache needs no coherence traffic; entries only
+ * leave the cache to make room.
+ *
+ * The cache is a standalone table rather than another instance of the cache
+ * manager, since the cache manager is a single global instance that the
+ * hcache already uses. It is split into DCACHE_SHARDS partitions, each with
+ * its own lock, hash chains and share of the capacity, so that the capfsd
+ * workers rarely contend. Within a partition, entries are replaced using the
+ * CLOCK algorithm.
+ *
+ * If an on-disk tier has been set up (see dcache_disk.c), chunks added to
+ * the cache are written through to it, and chunks that miss in memory are
+ * looked up there before the caller goes to the CAS servers.
+ */
 #include <stdio.h>
-#include <stdarg.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <fcntl.h>
-#include <sys/syscall.h>
-#include <unistd.h>
-#include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <signal.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <openssl/crypto.h>
-#include <openssl/evp.h>
-#include <sys/syscall.h>
-#include <linux/unistd.h>
-#include "cmgr.h"
+#include <pthread.h>
 #include "quicklist.h"
-#include "mquickhash.h"
 #include "dcache.h"
 
-enum {D_READ = 0, D_WRITE = 1};
-
-enum {USE_SHA1 = 0, BSIZE = 16384};
+struct dcache_entry {
+	struct qlist_head de_link;  /* hash chain */
+	struct qlist_head de_clock; /* clock ring */
+	unsigned char     de_hash[EVP_SHA1_SIZE];
+	int               de_referenced;
+	size_t            de_length;
+	char             *de_data;
+};
 
-/* bsize is the size of the cached objects, bcount is the number of objects that can be cached, rest are hash-table sizes */
-static int bsize = BSIZE, bcount = 0, btsize = 0, bftsize = 0;
+struct dcache_shard {
+	pthread_mutex_t    ds_lock;
+	struct qlist_head  ds_table[DCACHE_BUCKETS];
+	struct qlist_head  ds_clock;
+	struct qlist_head *ds_hand;
+	int64_t            ds_capacity;
+	int64_t            ds_bytes;
+	int64_t            ds_hits;
+	int64_t            ds_misses;
+	int64_t            ds_evicts;
+};
 
-/* file hash/comparison routines */
+static struct dcache_shard *dcache_shards = NULL;
 
-static int compare_file(void *key, void *entry_key)
+static inline struct dcache_shard *dcache_shard(unsigned char *hash)
 {
-	cm_handle_t f1 = (cm_handle_t) key;
-	cm_handle_t f2 = (cm_handle_t) entry_key;
-
-	if (strcmp(((struct handle *)f1)->hash, ((struct handle *)f2)->hash) == 0) 
-	{
-		return 1;
-	}
-	return 0;
+	/* pick the partition and the chain off different bytes of the hash */
+	return &dcache_shards[hash[EVP_SHA1_SIZE - 1] % DCACHE_SHARDS];
 }
 
-static int file_hash(void *key)
+static inline unsigned int dcache_bucket(unsigned char *hash)
 {
-	cm_handle_t f1 = (cm_handle_t ) key;
-	int hash_value = 0, i;
-	char *hash = ((struct handle *)f1)->hash;
+	unsigned int b;
 
-	for (i = 0; i < strlen(hash); i++) {
-		hash_value += abs(hash1(hash[i]));
-	}
-	return hash_value;
+	memcpy(&b, hash, sizeof(b));
+	return b % DCACHE_BUCKETS;
 }
 
-struct user_ptr 
+/* must be called with the shard lock held */
+static struct dcache_entry *dcache_search(struct dcache_shard *shard, unsigned char *hash)
 {
-	cm_handle_t    p;
-	int 				mode;
-	int				nframes;
-	char 			  **buffers;
-	size_t		  *sizes;
-	int64_t		  *offsets;
-	int			  *completed;
-};
+	struct qlist_head *head, *tmp;
 
-/*
-* NOTE that we dont free the ->completed integer pointer
-* since that is returned to the cache manager
-*/
-static void dealloc_user_ptr(struct user_ptr *ptr)
-{
-	if (ptr)
-	{
-		free(ptr);
-	}
-}
-
-static struct user_ptr* alloc_user_ptr(cm_handle_t p, int mode, int nframes,
-		char **buffers, size_t *sizes, int64_t *offsets)
-{
-		struct user_ptr *ptr = NULL;
-
-		ptr = (struct user_ptr *) calloc(1, sizeof(struct user_ptr));
-		if (ptr)
-		{
-			ptr->p = p;
-			ptr->mode = mode;
-			ptr->nframes = nframes;
-			ptr->buffers = buffers;
-			ptr->sizes = sizes;
-			ptr->offsets = offsets;
-			/* We try to allocate this at the last, so 
-			 * that if we had to call dealloc_user_ptr()
-			 * we still would not have to free this!
-			 */
-			ptr->completed = (int *) 
-				calloc(nframes, sizeof(int));
-			if (!ptr->completed)
-			{
-				goto error_exit;
-			}
+	head = &shard->ds_table[dcache_bucket(hash)];
+	qlist_for_each(tmp, head) {
+		struct dcache_entry *entry = qlist_entry(tmp, struct dcache_entry, de_link);
+		if (memcmp(entry->de_hash, hash, EVP_SHA1_SIZE) == 0) {
+			return entry;
 		}
-		return ptr;
-error_exit:
-		dealloc_user_ptr(ptr);
-		return NULL;
+	}
+	return NULL;
 }
 
-static inline char* convert(unsigned char* hash)
+/* must be called with the shard lock held */
+static void dcache_evict(struct dcache_shard *shard, struct dcache_entry *entry)
 {
-	char *fname = (char *) malloc(256);
-	int i, count = 0;
-
-	for (i = 0; i < 5; i++) {
-		count += sprintf(fname + count, "%u", *(int *)(hash + i));
+	if (shard->ds_hand == &entry->de_clock) {
+		shard->ds_hand = entry->de_clock.next;
 	}
-	return fname;
+	qlist_del(&entry->de_link);
+	qlist_del(&entry->de_clock);
+	shard->ds_bytes -= entry->de_length;
+	free(entry->de_data);
+	free(entry);
+	return;
 }
 
-
 /*
- * FIXME:
- * Partho, this will be eventually the RPC/Socket
- * interface to get a specified set of block(s) from the
- * server. For now, I am making this do a local 
- * fetch
+ * Advances the clock hand until size more bytes fit in the shard.
+ * must be called with the shard lock held
  */
-static void cas_get(struct user_ptr *uptr)
+static void dcache_make_room(struct dcache_shard *shard, size_t size)
 {
-	char *filename, *hash = ((struct handle *)uptr->p)->hash;
-	int fd;
-
-	filename = convert(hash);
-	fd = open(filename, O_RDONLY);
-	if (fd >= 0) {
-		int i;
+	while (shard->ds_bytes + size > shard->ds_capacity && !qlist_empty(&shard->ds_clock)) {
+		struct dcache_entry *entry;
 
-		for (i = 0; i < uptr->nframes; i++) {
-			uptr->completed[i] = 
-				pread(fd, uptr->buffers[i], uptr->sizes[i], uptr->offsets[i]);
+		if (shard->ds_hand == &shard->ds_clock) {
+			shard->ds_hand = shard->ds_hand->next;
+			continue;
 		}
-		close(fd);
-	}
-	else {
-		int i;
-
-		for (i = 0; i < uptr->nframes; i++) {
-			uptr->completed[i] = -errno;
+		entry = qlist_entry(shard->ds_hand, struct dcache_entry, de_clock);
+		if (entry->de_referenced) {
+			/* give it a second chance */
+			entry->de_referenced = 0;
+			shard->ds_hand = shard->ds_hand->next;
+			continue;
 		}
+		dcache_evict(shard, entry);
+		shard->ds_evicts++;
 	}
 	return;
 }
 
+static int dcache_insert(unsigned char *hash, const void *buf, size_t size);
 
-/*
- * FIXME:
- * Partho, this will be eventually the RPC/Socket
- * Interface for the analogous put operation to the
- * data server. For now, I am making this a local disk write
- */
-static void cas_put(struct user_ptr *uptr)
+/* size is the number of bytes of memory to be used for caching chunks, 0 disables the cache */
+int dcache_init(int64_t size)
 {
-	char *hash = ((struct handle *)uptr->p)->hash;
-	int fd;
-	char *filename = NULL;
-
-	filename = convert(hash);
+	int i, j;
 
-	fd = open(filename, O_CREAT | O_RDWR, 0700);
-	if (fd >= 0) {
-		int i;
-
-		for (i = 0; i < uptr->nframes; i++) {
-			uptr->completed[i] = 
-				pwrite(fd, uptr->buffers[i], uptr->sizes[i], uptr->offsets[i]);
-		}
-		close(fd);
+	if (size <= 0) {
+		return 0;
 	}
-	else {
-		int i;
+	dcache_shards = (struct dcache_shard *) calloc(DCACHE_SHARDS, sizeof(struct dcache_shard));
+	if (dcache_shards == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < DCACHE_SHARDS; i++) {
+		struct dcache_shard *shard = &dcache_shards[i];
 
-		for (i = 0; i < uptr->nframes; i++) {
-			uptr->completed[i] = -errno;
+		pthread_mutex_init(&shard->ds_lock, NULL);
+		for (j = 0; j < DCACHE_BUCKETS; j++) {
+			INIT_QLIST_HEAD(&shard->ds_table[j]);
 		}
+		INIT_QLIST_HEAD(&shard->ds_clock);
+		shard->ds_hand = &shard->ds_clock;
+		shard->ds_capacity = size / DCACHE_SHARDS;
 	}
-	return;
+	return 0;
 }
 
-/*
- * Ideally, we would like to have server-side support for asynch. operations.
- * But that is something to play with in the future. Right, now even though
- * I have nice separation of operation initiation and completion, 
- * we are still operating synchronously! grr..
- */
-static struct user_ptr* 
-post_io(cm_handle_t p, int nframes, char **buffers,
-		size_t *sizes, int64_t *offsets, int mode, int *error)
+void dcache_finalize(void)
 {
-		struct user_ptr *uptr = NULL;
+	int i;
+
+	if (dcache_shards == NULL) {
+		return;
+	}
+	for (i = 0; i < DCACHE_SHARDS; i++) {
+		struct dcache_shard *shard = &dcache_shards[i];
 
-		/* try to allocate the user ptr to keep track of the state */
-		uptr = alloc_user_ptr(p, mode, nframes, buffers, sizes, offsets);
-		if (!uptr)
-		{
-			*error = -ENOMEM;
-			return NULL;
+		pthread_mutex_lock(&shard->ds_lock);
+		while (!qlist_empty(&shard->ds_clock)) {
+			dcache_evict(shard, qlist_entry(shard->ds_clock.next, struct dcache_entry, de_clock));
 		}
-		return uptr;
+		pthread_mutex_unlock(&shard->ds_lock);
+		pthread_mutex_destroy(&shard->ds_lock);
+	}
+	free(dcache_shards);
+	dcache_shards = NULL;
+	return;
 }
 
-/*
- * readpage_begin() routine must return an opaque handle
- * on success and negative error code on failure.
- * This routine is invoked only on a cache miss.
- * Use this to just setup information for computing hashes if need be
- */ 
-static long cas_buffered_read_begin(cm_handle_t p, 
-		int number, cm_buffer_t *buffers, size_t *sizes, int64_t *offsets)
+int dcache_enabled(void)
 {
-		int ret;
-		struct user_ptr *uptr = NULL;
-
-		/* Actually the bulk of the work is done only at the time of the complete routine */
-		if ((uptr = post_io(p, number, (char **) buffers,
-						sizes, offsets, D_READ, &ret)) == NULL)
-		{
-			panic("hash_buffered_read: could not post read %d\n", ret);
-			return ret;
-		}
-		return (long) uptr;
+	return (dcache_shards != NULL);
 }
 
 /*
- * Complete the I/O operation that was posted asynchronously
- * earlier. We return a pointer to an array of integers
- * that indicate the error codes in case of failed I/O
- * or amount of I/O completed.
- * Callers responsibility to free it.
+ * Copies the cached contents of the chunk named by hash into buf.
+ * Returns the length of the chunk on a hit, -ENOENT on a miss
+ * (or if the chunk does not fit in size bytes).
  */
-static int* cas_buffered_read_complete(long _uptr)
+int dcache_get(unsigned char *hash, void *buf, size_t size)
 {
-		struct user_ptr *uptr = NULL;
-		int *completed = NULL;
+	struct dcache_shard *shard;
+	struct dcache_entry *entry;
+	int ret = -ENOENT;
 
-		uptr = (struct user_ptr *) _uptr;
-		completed = (uptr->completed);
-		/*
-		 * Read the data based on the hashes from the file
-		 * here. Note, at some point
-		 * this would become an RPC call, 
-		 * right now, I just do it locally for now.
-		 */
-		cas_get(uptr);
-		/* Deallocate the user pointer */
-		dealloc_user_ptr(uptr);
-		return completed;
+	if (dcache_shards == NULL) {
+		return -ENOENT;
+	}
+	shard = dcache_shard(hash);
+	pthread_mutex_lock(&shard->ds_lock);
+	if ((entry = dcache_search(shard, hash)) != NULL && entry->de_length <= size) {
+		memcpy(buf, entry->de_data, entry->de_length);
+		entry->de_referenced = 1;
+		ret = entry->de_length;
+		shard->ds_hits++;
+	}
+	else {
+		shard->ds_misses++;
+	}
+	pthread_mutex_unlock(&shard->ds_lock);
+	if (ret < 0 && (ret = dcache_disk_get(hash, buf, size)) >= 0) {
+		/* bring it back into memory, it is already on disk */
+		dcache_insert(hash, buf, ret);
+	}
+	return ret;
 }
 
 /*
- * writepage_begin() routine must return an opaque handle
- * on success and negative error code on failure.
- * This routine is invoked only on a cache miss.
- * There is no need to WB crypto-hashes!!
- * So these will be simple no-ops.
- */ 
-static long cas_buffered_write_begin(cm_handle_t p, 
-		int number, cm_buffer_t *buffers, size_t *sizes, int64_t *offsets)
+ * Adds a chunk to the in-memory cache.
+ * Returns 1 if it was added, 0 if it was already there, a negative error code otherwise.
+ */
+static int dcache_insert(unsigned char *hash, const void *buf, size_t size)
 {
-		int ret;
-		struct user_ptr *uptr = NULL;
+	struct dcache_shard *shard;
+	struct dcache_entry *entry;
 
-		if ((uptr = post_io(p, number, (char **) buffers,
-						sizes, offsets, D_WRITE, &ret)) == NULL)
-		{
-			panic("cas_buffered_write: could not post write %d\n", ret);
-			return ret;
-		}
-		return (long) uptr;
+	shard = dcache_shard(hash);
+	if (size == 0 || size > shard->ds_capacity) {
+		return -EINVAL;
+	}
+	/* copy the data outside the lock */
+	entry = (struct dcache_entry *) calloc(1, sizeof(struct dcache_entry));
+	if (entry == NULL) {
+		return -ENOMEM;
+	}
+	if ((entry->de_data = (char *) malloc(size)) == NULL) {
+		free(entry);
+		return -ENOMEM;
+	}
+	memcpy(entry->de_hash, hash, EVP_SHA1_SIZE);
+	memcpy(entry->de_data, buf, size);
+	entry->de_length = size;
+
+	pthread_mutex_lock(&shard->ds_lock);
+	if (dcache_search(shard, hash) != NULL) {
+		/* someone else beat us to it; contents are the same anyway */
+		pthread_mutex_unlock(&shard->ds_lock);
+		free(entry->de_data);
+		free(entry);
+		return 0;
+	}
+	dcache_make_room(shard, size);
+	qlist_add_tail(&entry->de_link, &shard->ds_table[dcache_bucket(hash)]);
+	/* new entries go just behind the hand, so they survive a full sweep */
+	qlist_add_tail(&entry->de_clock, shard->ds_hand);
+	shard->ds_bytes += size;
+	pthread_mutex_unlock(&shard->ds_lock);
+	return 1;
 }
 
 /*
- * We don't have to writeback the data from the cache. We always
- * write through the cache.
+ * Adds the size bytes in buf as the contents of the chunk named by hash.
+ * buf must hold the entire chunk. Returns size if the chunk was cached
+ * (or already was), a negative error code otherwise.
  */
-static int* cas_buffered_write_complete(long _uptr)
+int dcache_put(unsigned char *hash, const void *buf, size_t size)
 {
-		struct user_ptr *uptr = NULL;
-		int *completed = NULL;
-
-		uptr = (struct user_ptr *) _uptr;
-		completed = (uptr->completed);
-		/*
-		 * Write the data based on the hashes from the file
-		 * here. Note, at some point
-		 * this would become an RPC call, 
-		 * right now, I just do it locally for now.
-		 */
-		cas_put(uptr);
-		/* Deallocate the user pointer */
-		dealloc_user_ptr(uptr);
-		return completed;
-}
-
-
-void dcache_init(void)
-{
-	cmgr_options_t options;
 	int ret;
-	int handle_size = sizeof(struct handle);
-	char *envp, *str, *output_fname = NULL;
 
-	output_fname = getenv("CMGR_OUTPUT");
-	/* if output_fname is not NULL, then we open a new file stream */
-	if (output_fname != NULL) 
-	{
-		if ((output_fp = fopen(output_fname, "w+")) == NULL) 
-		{
-			/* revert to stdout/stderr if output_fname could not be created! */
-			output_fp = stdout;
-			error_fp = stderr;
-		}
-		else 
-		{
-			/* make standard error also point to the new file */
-			error_fp = output_fp;
-		}
+	if (dcache_shards == NULL) {
+		return -ENOSYS;
 	}
-	else 
-	{
-		output_fp = stdout;
-		error_fp = stderr;
-	}
-	dprintf("Initializing the Hash Cache Manager!\n");
-	
-	/* sizes of the data that are being cached */
-	if ((envp = getenv("CMGR_BSIZE")) != NULL) 
-	{
-		bsize = strtol(envp, &str, 10);
-		if (*str != '\0') {
-			bsize = 0;
-		}
+	if ((ret = dcache_insert(hash, buf, size)) < 0) {
+		return ret;
 	}
-	if ((envp = getenv("CMGR_BCOUNT")) != NULL) 
-	{
-		bcount = strtol(envp, &str, 10);
-		if (*str != '\0')
-			bcount = 0; /* use defaults provided by buffer manager */
+	/* write new chunks through to disk; failures there only cost us a later miss */
+	if (ret > 0) {
+		dcache_disk_put(hash, buf, size);
 	}
-	if ((envp = getenv("CMGR_BTSIZE")) != NULL) 
-	{
-		btsize = strtol(envp, &str, 10);
-		if (*str != '\0')
-			btsize = 0; /* use defaults provided by buffer manager */
-	}
-	if ((envp = getenv("CMGR_BFTSIZE")) != NULL) 
-	{
-		bftsize = strtol(envp, &str, 10);
-		if (*str != '\0')
-			bftsize = 0; /* use defaults provided by buffer manager */
-	}
-	/* tuneable buffer manager parameters */
-	options.co_output_fname = output_fname;
-	options.co_bsize = bsize;
-	options.co_bcount = bcount;
-	options.co_block_table_size = btsize;
-	options.co_file_table_size = bftsize;
-	options.co_handle_size = handle_size;
-	/* not providing a block comparison/hash routine.  */
-	options.compare_block = NULL;
-	options.block_hash = NULL;
-	/* file comparison and hashing routine need to be provided */
-	options.compare_file = compare_file;
-	options.file_hash = file_hash;
-	/*
-	 * readpage_*() and writepage_*() routines need to be 
-	 * supplied to buffer manager 
-	 */
-	options.readpage_begin = cas_buffered_read_begin;
-	options.readpage_complete = cas_buffered_read_complete;
-	options.writepage_begin = cas_buffered_write_begin;
-	options.writepage_complete = cas_buffered_write_complete;
-
-	/* initialize the cache manager stuff */
-	if ((ret = CMGR_init(&options)) < 0) 
-	{
-		panic("Cache Manager could not be initialized: %s\n", strerror(-ret));
-		exit(1);
-	}
-	dprintf("Cache Manager initialized\n");
-	return;
+	return size;
 }
 
-void dcache_finalize(void)
+void dcache_get_stats(int64_t *hits, int64_t *misses, int64_t *evicts, int reset)
 {
-	/* finalize the cache manager stuff */
-	CMGR_finalize();
-	dprintf("Finalized the Hash cache manager\n");
-}
-
-int dcache_get(char *hash, void *buf, size_t size)
-{
-	/* read through the buffer manager */
-	char *ptr = buf;
-	struct handle h;
-	loff_t begin_byte;
-	int total_count;
-	cmgr_synch_options_t options;
-
-	begin_byte = 0;
-
-	memset(&options, 0, sizeof(options));
-	strncpy(h.hash, hash, EVP_SHA1_SIZE);
+	int i;
 
-	/* sets errno internally */
-	if ((total_count = CMGR_get_region(ptr, &h, 
-					begin_byte, size, -1, &options)) < 0)
-	{
-		panic("Could not get region of the file through the cache\n");
-		return -1;
+	*hits = *misses = *evicts = 0;
+	if (dcache_shards == NULL) {
+		return;
 	}
-	return total_count;
-}
-
-int dcache_put(char *hash, const void *buf, size_t size)
-{
-	char *ptr = (char *)buf;
-	int total_count = 0;
-	ssize_t count = 0;
-	struct handle h;
-	loff_t begin_byte;
-	cmgr_synch_options_t options;
-
-	/* Currently we use the options parameter to signal synchronous writeout */
-	memset(&options, 0, sizeof(options));
-	options.cs_evict = 0;
-	options.cs_opt.keep.wb = 1;
-	begin_byte = 0;
-	count = size;
-	strncpy(h.hash, hash, EVP_SHA1_SIZE);
-	
-	/* Sets errno internally */
-	if ((total_count = CMGR_put_region(ptr, &h,
-					begin_byte, count, &options)) < 0)
-	{
-		panic("Could not put region of the file through the cache!\n");
-		return -1;
+	for (i = 0; i < DCACHE_SHARDS; i++) {
+		struct dcache_shard *shard = &dcache_shards[i];
+
+		pthread_mutex_lock(&shard->ds_lock);
+		*hits += shard->ds_hits;
+		*misses += shard->ds_misses;
+		*evicts += shard->ds_evicts;
+		if (reset) {
+			shard->ds_hits = shard->ds_misses = shard->ds_evicts = 0;
+		}
+		pthread_mutex_unlock(&shard->ds_lock);
 	}
-	return total_count;
-}
-
-void dcache_get_stats(cmgr_stats_t *stats, int reset)
-{
-	CMGR_get_stats(stats, reset);
 	return;
 }
 
@@ -464,6 +306,3 @@ void dcache_get_stats(cmgr_stats_t *stats, int reset)
  *
  * vim: ts=3
  */
-
-
-
@@ -2,20 +2,29 @@
 #define _DCACHE_H
 
 #include <sys/types.h>
-#include "cmgr.h"
-#include "cmgr_constants.h"
+#include <stdint.h>
 
 #define EVP_SHA1_SIZE 20
 
-struct handle {
-	char hash[EVP_SHA1_SIZE];
-};
+/* number of independently locked partitions of the cache */
+#define DCACHE_SHARDS  32
+/* number of hash chains in every partition */
+#define DCACHE_BUCKETS 1024
 
-extern void dcache_init(void);
+extern int  dcache_init(int64_t size);
 extern void dcache_finalize(void);
-extern int dcache_get(char *hash, void *buf, size_t size);
-extern int dcache_put(char *hash, const void *buf, size_t size);
-extern void hcache_get_stats(cmgr_stats_t *stats, int reset);
+extern int  dcache_enabled(void);
+extern int  dcache_get(unsigned char *hash, void *buf, size_t size);
+extern int  dcache_put(unsigned char *hash, const void *buf, size_t size);
+extern void dcache_get_stats(int64_t *hits, int64_t *misses, int64_t *evicts, int reset);
+
+/* on-disk tier behind the in-memory cache */
+extern int  dcache_disk_init(const char *dir, int64_t size, size_t bsize);
+extern void dcache_disk_finalize(void);
+extern int  dcache_disk_enabled(void);
+extern int  dcache_disk_get(unsigned char *hash, void *buf, size_t size);
+extern int  dcache_disk_put(unsigned char *hash, const void *buf, size_t size);
+extern void dcache_disk_get_stats(int64_t *hits, int64_t *misses, int64_t *evicts, int reset);
 
 #endif
 /*
@@ -27,6 +36,3 @@ extern void hcache_get_stats(cmgr_stats_t *stats, int reset);
  *
  * vim: ts=3
  */
-
-
-
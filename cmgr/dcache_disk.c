@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * On-disk tier of the client-side data cache.
+ *
+ * Chunks that enter the in-memory dcache are also written to a local disk,
+ * and chunks that miss in memory are looked up here before they are fetched
+ * from the CAS servers. Like the in-memory tier, everything is keyed by the
+ * hash of the chunk, so the contents of the disk can never be stale and are
+ * kept across restarts of capfsd.
+ *
+ * The cache lives in a directory with two files. "chunks" is divided into
+ * fixed-size slots, each holding one chunk preceded by its hash and length
+ * and followed by its hash again. Nothing is synced to disk, so after a
+ * crash a reused slot may hold the new header and trailer around some of
+ * the old data; since the key of a chunk is its SHA-1, every chunk read back
+ * is checked against it, and a slot that does not match is dropped. "index" holds one small
+ * record (hash, length, segment) per slot and is all that has to be read
+ * to warm the cache up again.
+ *
+ * Slots are replaced using segmented LRU: chunks enter a probationary
+ * segment and are only promoted to the protected segment when they are hit
+ * again, so a long sequential scan can only ever displace other chunks that
+ * were used once, not the working set.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "quicklist.h"
+#include "sha.h"
+#include "dcache.h"
+
+#define DISK_MAGIC   0x44434b31 /* "DCK1" */
+#define DISK_VERSION 1
+/* percentage of the slots that the protected segment may occupy */
+#define DISK_PROTECTED_PCT 75
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_PROBATION = 1,
+	SLOT_PROTECTED = 2,
+	SLOT_BUSY = 3, /* being written, neither in the table nor on a list */
+};
+
+/* on-disk layout of the index */
+struct disk_index_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t bsize;
+};
+
+struct disk_index_rec {
+	unsigned char hash[EVP_SHA1_SIZE];
+	uint32_t      length; /* 0 if the slot is empty */
+	uint32_t      state;
+};
+
+/* on-disk layout of the head of a slot; the hash is repeated after the data */
+struct disk_slot_hdr {
+	unsigned char hash[EVP_SHA1_SIZE];
+	uint32_t      length;
+};
+
+struct disk_slot {
+	struct qlist_head ds_link; /* hash chain */
+	struct qlist_head ds_lru;  /* free, probation or protected list */
+	unsigned char     ds_hash[EVP_SHA1_SIZE];
+	uint32_t          ds_length;
+	int               ds_state;
+	int               ds_pinned; /* readers in progress */
+};
+
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static int disk_chunks_fd = -1, disk_index_fd = -1;
+static size_t disk_bsize = 0, disk_stride = 0;
+static int64_t disk_nslots = 0, disk_nbuckets = 0;
+static int64_t disk_nprotected = 0, disk_protected_max = 0;
+static struct disk_slot *disk_slots = NULL;
+static struct qlist_head *disk_table = NULL;
+static struct qlist_head disk_free, disk_probation, disk_protected;
+static int64_t disk_hits = 0, disk_misses = 0, disk_evicts = 0;
+
+static inline unsigned int disk_bucket(unsigned char *hash)
+{
+	unsigned int b;
+
+	memcpy(&b, hash + 4, sizeof(b));
+	return b % disk_nbuckets;
+}
+
+static inline off_t disk_slot_offset(struct disk_slot *slot)
+{
+	return (off_t) (slot - disk_slots) * disk_stride;
+}
+
+static inline off_t disk_rec_offset(struct disk_slot *slot)
+{
+	return sizeof(struct disk_index_hdr) + (off_t) (slot - disk_slots) * sizeof(struct disk_index_rec);
+}
+
+/* must be called with disk_lock held */
+static struct disk_slot *disk_search(unsigned char *hash)
+{
+	struct qlist_head *head, *tmp;
+
+	head = &disk_table[disk_bucket(hash)];
+	qlist_for_each(tmp, head) {
+		struct disk_slot *slot = qlist_entry(tmp, struct disk_slot, ds_link);
+		if (memcmp(slot->ds_hash, hash, EVP_SHA1_SIZE) == 0) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/* adds a slot holding a chunk to the table. must be called with disk_lock held */
+static void disk_insert(struct disk_slot *slot, int state)
+{
+	qlist_add_tail(&slot->ds_link, &disk_table[disk_bucket(slot->ds_hash)]);
+	slot->ds_state = state;
+	if (state == SLOT_PROTECTED) {
+		qlist_add_tail(&slot->ds_lru, &disk_protected);
+		disk_nprotected++;
+	}
+	else {
+		qlist_add_tail(&slot->ds_lru, &disk_probation);
+	}
+	return;
+}
+
+/* takes a slot holding a chunk out of the table. must be called with disk_lock held */
+static void disk_remove(struct disk_slot *slot)
+{
+	qlist_del(&slot->ds_link);
+	qlist_del(&slot->ds_lru);
+	if (slot->ds_state == SLOT_PROTECTED) {
+		disk_nprotected--;
+	}
+	slot->ds_state = SLOT_BUSY;
+	return;
+}
+
+/* records a hit on a slot. must be called with disk_lock held */
+static void disk_touch(struct disk_slot *slot)
+{
+	if (slot->ds_state == SLOT_PROBATION) {
+		slot->ds_state = SLOT_PROTECTED;
+		disk_nprotected++;
+	}
+	qlist_del(&slot->ds_lru);
+	qlist_add_tail(&slot->ds_lru, &disk_protected);
+	/* the least recently used protected chunk gets one more chance on probation */
+	if (disk_nprotected > disk_protected_max) {
+		struct disk_slot *lru = qlist_entry(disk_protected.next, struct disk_slot, ds_lru);
+
+		qlist_del(&lru->ds_lru);
+		lru->ds_state = SLOT_PROBATION;
+		disk_nprotected--;
+		qlist_add_tail(&lru->ds_lru, &disk_probation);
+	}
+	return;
+}
+
+/*
+ * Picks a slot to write a new chunk into, evicting the least recently
+ * used chunk on probation (or failing that, in the protected segment)
+ * if there are no free slots. Slots that are being read are skipped.
+ * must be called with disk_lock held
+ */
+static struct disk_slot *disk_victim(void)
+{
+	struct qlist_head *lists[2] = {&disk_probation, &disk_protected}, *tmp;
+	struct disk_slot *slot;
+	int i;
+
+	if (!qlist_empty(&disk_free)) {
+		slot = qlist_entry(disk_free.next, struct disk_slot, ds_lru);
+		qlist_del(&slot->ds_lru);
+		slot->ds_state = SLOT_BUSY;
+		return slot;
+	}
+	for (i = 0; i < 2; i++) {
+		qlist_for_each(tmp, lists[i]) {
+			slot = qlist_entry(tmp, struct disk_slot, ds_lru);
+			if (slot->ds_pinned == 0) {
+				disk_remove(slot);
+				disk_evicts++;
+				return slot;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* returns a slot that could not be filled to the free list. must be called with disk_lock held */
+static void disk_release(struct disk_slot *slot)
+{
+	slot->ds_length = 0;
+	slot->ds_state = SLOT_FREE;
+	qlist_add_tail(&slot->ds_lru, &disk_free);
+	return;
+}
+
+static int disk_write_rec(struct disk_slot *slot, uint32_t length, uint32_t state)
+{
+	struct disk_index_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	if (length > 0) {
+		memcpy(rec.hash, slot->ds_hash, EVP_SHA1_SIZE);
+	}
+	rec.length = length;
+	rec.state = state;
+	if (pwrite(disk_index_fd, &rec, sizeof(rec), disk_rec_offset(slot)) != sizeof(rec)) {
+		return -EIO;
+	}
+	return 0;
+}
+
+/* (re)creates an empty index, and puts every slot on the free list */
+static int disk_format(void)
+{
+	struct disk_index_hdr hdr;
+	off_t index_size;
+	int64_t i;
+
+	for (i = 0; i < disk_nslots; i++) {
+		disk_release(&disk_slots[i]);
+	}
+
+	index_size = sizeof(hdr) + (off_t) disk_nslots * sizeof(struct disk_index_rec);
+	if (ftruncate(disk_index_fd, 0) < 0 || ftruncate(disk_index_fd, index_size) < 0) {
+		return -errno;
+	}
+	hdr.magic = DISK_MAGIC;
+	hdr.version = DISK_VERSION;
+	hdr.nslots = disk_nslots;
+	hdr.bsize = disk_bsize;
+	if (pwrite(disk_index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		return -EIO;
+	}
+	return 0;
+}
+
+/* fills the table from the index left behind by an earlier run, if it matches our geometry */
+static int disk_load(void)
+{
+	struct disk_index_hdr hdr;
+	struct disk_index_rec *recs;
+	size_t recs_size = disk_nslots * sizeof(struct disk_index_rec);
+	int64_t i, nloaded = 0;
+
+	if (pread(disk_index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+			|| hdr.magic != DISK_MAGIC || hdr.version != DISK_VERSION
+			|| hdr.nslots != disk_nslots || hdr.bsize != disk_bsize) {
+		return disk_format();
+	}
+	if ((recs = (struct disk_index_rec *) malloc(recs_size)) == NULL) {
+		return -ENOMEM;
+	}
+	if (pread(disk_index_fd, recs, recs_size, sizeof(hdr)) != recs_size) {
+		free(recs);
+		return disk_format();
+	}
+	for (i = 0; i < disk_nslots; i++) {
+		struct disk_slot *slot = &disk_slots[i];
+
+		if (recs[i].length == 0 || recs[i].length > disk_bsize || disk_search(recs[i].hash) != NULL) {
+			disk_release(slot);
+			continue;
+		}
+		memcpy(slot->ds_hash, recs[i].hash, EVP_SHA1_SIZE);
+		slot->ds_length = recs[i].length;
+		disk_insert(slot, (recs[i].state == SLOT_PROTECTED && disk_nprotected < disk_protected_max)
+				? SLOT_PROTECTED : SLOT_PROBATION);
+		nloaded++;
+	}
+	free(recs);
+	return nloaded;
+}
+
+/*
+ * dir is the directory to keep the cache in, size the number of bytes
+ * of chunks to keep there and bsize the largest chunk. Returns the number
+ * of chunks found from an earlier run, or a negative error code.
+ */
+int dcache_disk_init(const char *dir, int64_t size, size_t bsize)
+{
+	char path[PATH_MAX];
+	int64_t i;
+	int ret;
+
+	if (dir == NULL || size <= 0 || bsize == 0) {
+		return -EINVAL;
+	}
+	disk_bsize = bsize;
+	/* round the slots up to 512 bytes */
+	disk_stride = (sizeof(struct disk_slot_hdr) + bsize + EVP_SHA1_SIZE + 511) & ~511;
+	if ((disk_nslots = size / bsize) <= 0) {
+		return -EINVAL;
+	}
+	disk_nbuckets = disk_nslots;
+	disk_protected_max = (disk_nslots * DISK_PROTECTED_PCT) / 100;
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		return -errno;
+	}
+	snprintf(path, PATH_MAX, "%s/chunks", dir);
+	if ((disk_chunks_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		return -errno;
+	}
+	snprintf(path, PATH_MAX, "%s/index", dir);
+	if ((disk_index_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		ret = -errno;
+		close(disk_chunks_fd);
+		disk_chunks_fd = -1;
+		return ret;
+	}
+	disk_slots = (struct disk_slot *) calloc(disk_nslots, sizeof(struct disk_slot));
+	disk_table = (struct qlist_head *) calloc(disk_nbuckets, sizeof(struct qlist_head));
+	if (disk_slots == NULL || disk_table == NULL) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	for (i = 0; i < disk_nbuckets; i++) {
+		INIT_QLIST_HEAD(&disk_table[i]);
+	}
+	INIT_QLIST_HEAD(&disk_free);
+	INIT_QLIST_HEAD(&disk_probation);
+	INIT_QLIST_HEAD(&disk_protected);
+	disk_nprotected = 0;
+	disk_hits = disk_misses = disk_evicts = 0;
+	if ((ret = disk_load()) < 0) {
+		goto err;
+	}
+	/* a cache that shrank since the last run leaves a longer file behind */
+	if (ftruncate(disk_chunks_fd, (off_t) disk_nslots * disk_stride) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	return ret;
+err:
+	free(disk_table);
+	free(disk_slots);
+	disk_table = NULL;
+	disk_slots = NULL;
+	close(disk_index_fd);
+	close(disk_chunks_fd);
+	disk_index_fd = disk_chunks_fd = -1;
+	return ret;
+}
+
+/* writes out the segment of every chunk so that the next run starts where this one left off */
+void dcache_disk_finalize(void)
+{
+	struct disk_index_rec *recs;
+	int64_t i;
+
+	if (disk_slots == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&disk_lock);
+	if ((recs = (struct disk_index_rec *) calloc(disk_nslots, sizeof(struct disk_index_rec))) != NULL) {
+		for (i = 0; i < disk_nslots; i++) {
+			struct disk_slot *slot = &disk_slots[i];
+
+			if (slot->ds_state == SLOT_PROBATION || slot->ds_state == SLOT_PROTECTED) {
+				memcpy(recs[i].hash, slot->ds_hash, EVP_SHA1_SIZE);
+				recs[i].length = slot->ds_length;
+				recs[i].state = slot->ds_state;
+			}
+		}
+		pwrite(disk_index_fd, recs, disk_nslots * sizeof(struct disk_index_rec), sizeof(struct disk_index_hdr));
+		free(recs);
+	}
+	fsync(disk_chunks_fd);
+	fsync(disk_index_fd);
+	close(disk_chunks_fd);
+	close(disk_index_fd);
+	disk_chunks_fd = disk_index_fd = -1;
+	free(disk_table);
+	free(disk_slots);
+	disk_table = NULL;
+	disk_slots = NULL;
+	pthread_mutex_unlock(&disk_lock);
+	return;
+}
+
+int dcache_disk_enabled(void)
+{
+	return (disk_slots != NULL);
+}
+
+/*
+ * Reads the chunk named by hash into buf.
+ * Returns the length of the chunk on a hit, -ENOENT on a miss.
+ */
+int dcache_disk_get(unsigned char *hash, void *buf, size_t size)
+{
+	struct disk_slot *slot;
+	struct disk_slot_hdr hdr;
+	unsigned char *sbuf, *trailer;
+	uint32_t length;
+	off_t offset;
+	int ret = -ENOENT;
+
+	if (disk_slots == NULL) {
+		return -ENOENT;
+	}
+	pthread_mutex_lock(&disk_lock);
+	if ((slot = disk_search(hash)) == NULL || slot->ds_length > size) {
+		disk_misses++;
+		pthread_mutex_unlock(&disk_lock);
+		return -ENOENT;
+	}
+	/* keep the slot from being reused while we read it */
+	slot->ds_pinned++;
+	length = slot->ds_length;
+	offset = disk_slot_offset(slot);
+	pthread_mutex_unlock(&disk_lock);
+
+	if ((sbuf = (unsigned char *) malloc(disk_stride)) != NULL) {
+		if (pread(disk_chunks_fd, sbuf, disk_stride, offset) == disk_stride) {
+			memcpy(&hdr, sbuf, sizeof(hdr));
+			trailer = sbuf + sizeof(hdr) + length;
+			if (hdr.length == length && memcmp(hdr.hash, hash, EVP_SHA1_SIZE) == 0
+					&& memcmp(trailer, hash, EVP_SHA1_SIZE) == 0) {
+				unsigned char digest[EVP_MAX_MD_SIZE], *dp = digest;
+				size_t dlen;
+
+				/* the header and trailer do not vouch for the pages in between */
+				if (sha1((char *) sbuf + sizeof(hdr), length, &dp, &dlen) == 0
+						&& memcmp(digest, hash, EVP_SHA1_SIZE) == 0) {
+					memcpy(buf, sbuf + sizeof(hdr), length);
+					ret = length;
+				}
+			}
+		}
+		free(sbuf);
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	slot->ds_pinned--;
+	if (ret >= 0) {
+		disk_touch(slot);
+		disk_hits++;
+	}
+	else if (slot->ds_pinned == 0 && slot->ds_state != SLOT_BUSY) {
+		/* torn or unreadable; forget about it */
+		disk_remove(slot);
+		disk_release(slot);
+		disk_write_rec(slot, 0, SLOT_FREE);
+		disk_misses++;
+	}
+	else {
+		disk_misses++;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return ret;
+}
+
+/*
+ * Writes the size bytes in buf to disk as the contents of the chunk named by hash.
+ * Returns size if the chunk was written (or already there), a negative error code otherwise.
+ */
+int dcache_disk_put(unsigned char *hash, const void *buf, size_t size)
+{
+	struct disk_slot *slot;
+	struct disk_slot_hdr hdr;
+	unsigned char *sbuf;
+	int ret = size;
+
+	if (disk_slots == NULL) {
+		return -ENOSYS;
+	}
+	if (size == 0 || size > disk_bsize) {
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&disk_lock);
+	if (disk_search(hash) != NULL) {
+		pthread_mutex_unlock(&disk_lock);
+		return size;
+	}
+	if ((slot = disk_victim()) == NULL) {
+		pthread_mutex_unlock(&disk_lock);
+		return -EBUSY;
+	}
+	pthread_mutex_unlock(&disk_lock);
+
+	/* the slot is ours alone now; make sure the index never points at a half-written slot */
+	memcpy(slot->ds_hash, hash, EVP_SHA1_SIZE);
+	slot->ds_length = size;
+	if ((sbuf = (unsigned char *) calloc(1, disk_stride)) == NULL) {
+		ret = -ENOMEM;
+	}
+	else {
+		memcpy(hdr.hash, hash, EVP_SHA1_SIZE);
+		hdr.length = size;
+		memcpy(sbuf, &hdr, sizeof(hdr));
+		memcpy(sbuf + sizeof(hdr), buf, size);
+		memcpy(sbuf + sizeof(hdr) + size, hash, EVP_SHA1_SIZE);
+		if ((ret = disk_write_rec(slot, 0, SLOT_FREE)) == 0) {
+			if (pwrite(disk_chunks_fd, sbuf, disk_stride, disk_slot_offset(slot)) != disk_stride) {
+				ret = -EIO;
+			}
+			else {
+				ret = disk_write_rec(slot, size, SLOT_PROBATION);
+			}
+		}
+		free(sbuf);
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	if (ret < 0 || disk_search(hash) != NULL) {
+		/* failed, or someone else wrote the same chunk in the meantime */
+		disk_release(slot);
+		disk_write_rec(slot, 0, SLOT_FREE);
+	}
+	else {
+		disk_insert(slot, SLOT_PROBATION);
+		ret = size;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return ret;
+}
+
+void dcache_disk_get_stats(int64_t *hits, int64_t *misses, int64_t *evicts, int reset)
+{
+	pthread_mutex_lock(&disk_lock);
+	*hits = disk_hits;
+	*misses = disk_misses;
+	*evicts = disk_evicts;
+	if (reset) {
+		disk_hits = disk_misses = disk_evicts = 0;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ * End:
+ *
+ * vim: ts=3
+ */
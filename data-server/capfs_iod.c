@@ -32,7 +32,7 @@
 #include <dirent.h>
 #include <utime.h>
 #include <netdb.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/uio.h>
 #include <sys/statvfs.h>
 #include <sys/socket.h>
@@ -48,6 +48,12 @@
 #include "tp_proto.h"
 #include "log.h"
 #include "iod_prot.h"
+#include "iod_pack.h"
+#include "iod_io.h"
+#include "iod_cache.h"
+#include "iod_codec.h"
+#include "iod_ref.h"
+#include "iod_cdc.h"
 #include "capfs_config.h"
 
 #define  _CAPFS_DISPATCH_FN(x) capfs_iod_ ## x
@@ -55,7 +61,12 @@
 
 /* Are we using a sockets based approach or not? */
 int use_sockets = 0;
-fd_set global_readsock_set, aux_readsock_set;
+/* epoll instance that watches the listening socket and all client sockets */
+static int iod_epfd = -1;
+/* maximum number of events reaped by a single epoll_wait() */
+#define IOD_MAX_EVENTS 256
+/* how long to stay off accept() when out of descriptors or memory (usecs) */
+#define IOD_ACCEPT_BACKOFF 100000
 static int is_daemon = 1;
 static char * iod_conf_name;
 static struct svc_info info = {
@@ -176,6 +187,31 @@ static int create_capfsiod_file(char *dir)
 	return 0;
 }
 
+/*
+ * Removes the temporary files that chunk_store() leaves behind if we crash
+ * while it writes a chunk. Those are named after the chunk (25 characters,
+ * see get_fileName()) followed by ".XXXXXX".
+ */
+static void remove_tmp_files(char *dir)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL) {
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (strlen(de->d_name) == 32 && de->d_name[25] == '.') {
+			snprintf(path, 64, "%s/%s", dir, de->d_name);
+			LOG(stderr, INFO_MSG, SUBSYS_DATA, "removing stale chunk file %s\n", path);
+			unlink(path);
+		}
+	}
+	closedir(dp);
+	return;
+}
+
 static int check_dir(char c1, char c2)
 {
 	char buf[64], dir[64];
@@ -199,6 +235,7 @@ static int check_dir(char c1, char c2)
 	unlink(buf);
 	sprintf(buf, "%c%c", c1, c2);
 	create_capfsiod_file(buf);
+	remove_tmp_files(buf);
 	return 0;
 }
 
@@ -390,16 +427,63 @@ static void capfs_dispatch(struct svc_req *rqstp, SVCXPRT *xprt)
 	return;
 }
 
-pthread_spinlock_t fdset_spinlock;
+/*
+ * Client sockets are registered with EPOLLONESHOT, so that once a socket
+ * has been handed off to a worker thread, it is not reported again until
+ * the worker is done with the request and re-arms it. Hence no other
+ * synchronization is needed between the main loop and the workers.
+ */
+static int iod_sock_arm(int sock, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.fd = sock;
+	return epoll_ctl(iod_epfd, op, sock, &ev);
+}
+
+/* Called by a worker that successfully serviced a request on sock */
+void iod_sock_rearm(int sock)
+{
+	/* clients reconnect for every request if we are not caching handles */
+	if (CAPFS_CAS_CACHE_HANDLES == 0) {
+		close(sock);
+		return;
+	}
+	if (iod_sock_arm(sock, EPOLL_CTL_MOD) < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Could not re-arm socket %d: %s\n", sock, strerror(errno));
+		close(sock);
+	}
+	return;
+}
 
-static inline void fd_lock(void)
+/* Called by a worker that encountered an error on sock */
+void iod_sock_close(int sock)
 {
-	pthread_spin_lock(&fdset_spinlock);
+	/* closing the last reference to the socket also removes it from the epoll set */
+	close(sock);
+	return;
 }
 
-static inline void fd_unlock(void)
+/* Make sure that we can have as many clients as the hard limit allows */
+static void raise_fd_limit(void)
 {
-	pthread_spin_unlock(&fdset_spinlock);
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		PERROR(SUBSYS_DATA, "getrlimit");
+		return;
+	}
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+			PERROR(SUBSYS_DATA, "setrlimit");
+			return;
+		}
+	}
+	LOG(stderr, INFO_MSG, SUBSYS_DATA, "Can service upto %ld open descriptors\n", (long) rl.rlim_cur);
+	return;
 }
 
 static int capfs_init(int argc, char **argv)
@@ -533,6 +617,50 @@ static int capfs_init(int argc, char **argv)
 		return -1;
 	}
 
+	/* load the index of the packed chunk store */
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		if ((i = pack_init(__iod_config.pack_size, __iod_config.pack_checkpoint)) < 0) {
+			errno = -i;
+			PERROR(SUBSYS_DATA,"error initializing packed chunk store");
+			return -1;
+		}
+	}
+
+	/* fire up the threads that service chunk reads/writes */
+	if ((i = iod_io_init(__iod_config.io_threads)) < 0) {
+		errno = -i;
+		PERROR(SUBSYS_DATA,"error initializing I/O engine");
+		return -1;
+	}
+
+	/* set aside memory for caching popular chunks */
+	if ((i = iod_cache_init(__iod_config.chunk_cache)) < 0) {
+		errno = -i;
+		PERROR(SUBSYS_DATA,"error initializing chunk cache");
+		return -1;
+	}
+
+	/* pick the codec that chunks are compressed with */
+	if ((i = iod_codec_init(__iod_config.compression)) < 0) {
+		errno = -i;
+		PERROR(SUBSYS_DATA,"error initializing compression");
+		return -1;
+	}
+
+	/* cut chunks into content-defined pieces if asked to */
+	if ((i = iod_cdc_init(__iod_config.cdc_min_size, __iod_config.cdc_avg_size, __iod_config.cdc_max_size)) < 0) {
+		errno = -i;
+		PERROR(SUBSYS_DATA,"error initializing content-defined chunking");
+		return -1;
+	}
+
+	/* load the chunk reference counts and start reclaiming unreferenced chunks */
+	if ((i = iod_ref_init(__iod_config.reclaim_rate, __iod_config.reclaim_delay)) < 0) {
+		errno = -i;
+		PERROR(SUBSYS_DATA,"error initializing reference counts");
+		return -1;
+	}
+
 	if (is_daemon) {
 		openlog("iod", LOG_PID, LOG_ACC_FACILITY);
 	}
@@ -581,119 +709,107 @@ static int capfs_init(int argc, char **argv)
 	}
 	else /* use a sockets based server */
 	{
-		fd_set readsock_set;
-		int max, new_max;
-
-		FD_ZERO(&aux_readsock_set);
-		FD_ZERO(&global_readsock_set);
-		FD_ZERO(&readsock_set);
-		FD_SET(fd, &aux_readsock_set);
-		FD_SET(fd, &global_readsock_set);
-		FD_SET(fd, &readsock_set);
-		new_max = 1 + fd;
+		struct epoll_event ev, events[IOD_MAX_EVENTS];
+
+		raise_fd_limit();
+		if ((iod_epfd = epoll_create(IOD_MAX_EVENTS)) < 0) {
+			PERROR(SUBSYS_DATA, "epoll_create");
+			close(fd);
+			return -1;
+		}
+		/* the listening socket stays armed all the time */
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(iod_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			PERROR(SUBSYS_DATA, "epoll_ctl");
+			close(fd);
+			return -1;
+		}
 		while (1) /* loop till killed */
 		{
-			int s, myerr, ret;
+			int s, myerr, ret, n;
 			struct sockaddr_in sanew;
 			socklen_t salen = sizeof(sanew);
-			struct hostent *hp;
-
-			/* protect global_readsock_set */
-			fd_lock();
-			memcpy(&readsock_set, &global_readsock_set, sizeof(fd_set));
-			fd_unlock();
-			max = new_max;
-			if ((ret = select(max, &readsock_set, NULL, NULL, NULL)) < 0)
+
+			if ((ret = epoll_wait(iod_epfd, events, IOD_MAX_EVENTS, -1)) < 0)
 			{
-				if (errno != EBADF)
+				if (errno == EINTR)
 				{
-					PERROR(SUBSYS_DATA, "select: CAS server bailing out...!");
-					close(fd);
-					return -1;
+					continue;
 				}
+				PERROR(SUBSYS_DATA, "epoll_wait: CAS server bailing out...!");
+				close(fd);
+				return -1;
 			}
-			else if (ret == 0 && errno == EINTR)
-			{
-				continue;
-			}
-			for (i = 0; i < max; i++)
+			for (n = 0; n < ret; n++)
 			{
-				if (FD_ISSET(i, &readsock_set))
+				i = events[n].data.fd;
+				/* new connection */
+				if (i == fd)
 				{
-					/* new connection */
-					if (i == fd)
-					{
-						if ((s = accept(fd,(struct sockaddr *) &sanew, &salen)) == -1) {
-							myerr = errno;
-							PERROR(SUBSYS_DATA, "new_request: accept");
-							return -myerr;
+					if ((s = accept(fd,(struct sockaddr *) &sanew, &salen)) == -1) {
+						myerr = errno;
+						/* the client went away before we got to it */
+						if (myerr == EINTR || myerr == ECONNABORTED) {
+							LOG(stderr, WARNING_MSG, SUBSYS_DATA, "new_request: accept: %s\n", strerror(myerr));
+							continue;
 						}
-						if (s + 1 > new_max)
-							new_max = s + 1;
-						hp = gethostbyaddr((char *)&sanew.sin_addr.s_addr, 
-												 sizeof(sanew.sin_addr),
-												 sanew.sin_family);
-						LOG(stderr, INFO_MSG, SUBSYS_DATA, "New connection on socket = [%d]. IP = [%s] host = [%s]\n",
-								s, inet_ntoa(sanew.sin_addr), (hp == NULL) ? "Unknown" : hp->h_name);
-
-						/* kill Nagle */
-						if (set_tcpopt(s, TCP_NODELAY, 1) < 0) {
-							myerr = errno;
-							PERROR(SUBSYS_DATA, "set_tcpopt");
-							close(s);
-							return -myerr;
+						/*
+						 * out of descriptors or memory; the pending connection stays
+						 * queued, so give the clients we have a chance to let go
+						 */
+						if (myerr == EMFILE || myerr == ENFILE || myerr == ENOBUFS || myerr == ENOMEM) {
+							LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "new_request: accept: %s, backing off\n", strerror(myerr));
+							usleep(IOD_ACCEPT_BACKOFF);
+							continue;
 						}
-						/* add them only if there is caching of client-side sockets */
-						if (CAPFS_CAS_CACHE_HANDLES == 1)
-						{
-							fd_lock();
-							/* set s in both aux_readsock_set and global_readsock_set in this critical section */
-							FD_SET(s, &aux_readsock_set);
-							FD_SET(s, &global_readsock_set);
-							fd_unlock();
-						}
-						/* hand it over to one of our threads */
-						tp_assign_work_by_id(id, capfs_iod_worker, (void *)s);
+						PERROR(SUBSYS_DATA, "new_request: accept");
+						return -myerr;
+					}
+					/* no name lookup here, it would hold up every other client */
+					LOG(stderr, INFO_MSG, SUBSYS_DATA, "New connection on socket = [%d]. IP = [%s:%d]\n",
+							s, inet_ntoa(sanew.sin_addr), ntohs(sanew.sin_port));
+
+					/* kill Nagle */
+					if (set_tcpopt(s, TCP_NODELAY, 1) < 0) {
+						PERROR(SUBSYS_DATA, "set_tcpopt");
+						close(s);
+						continue;
+					}
+					/* a worker is handed the socket once the request shows up */
+					if (iod_sock_arm(s, EPOLL_CTL_ADD) < 0) {
+						PERROR(SUBSYS_DATA, "epoll_ctl");
+						close(s);
+					}
+				}
+				else /* data on a previously opened connection, no one else is servicing it */
+				{
+					int peek;
+					char header[16];
+
+					if (events[n].events & (EPOLLERR | EPOLLHUP))
+					{
+						iod_sock_close(i);
+						LOG(stderr, INFO_MSG, SUBSYS_DATA, "Closed socket [hangup] %d\n", i);
+						continue;
 					}
-					else /* data on a previously opened connection */
+					/* but still make sure there is data on the socket before handing it off */
+					if ((peek = nbpeek(i, header, sizeof(struct cas_header)))  < 0)
 					{
-						int status;
-
-						fd_lock();
-						status = FD_ISSET(i, &aux_readsock_set);
-						fd_unlock();
-						/* if no-one else is servicing req on this socket hand it off */
-						if (!status)
-						{
-							int peek;
-							char header[16];
-							/* but still make sure there is data on the socket before handing it off */
-							if ((peek = nbpeek(i, header, sizeof(struct cas_header)))  < 0)
-							{
-								fd_lock();
-								FD_CLR(i, &aux_readsock_set);
-								FD_CLR(i, &global_readsock_set);
-								close(i);
-								fd_unlock();
-								LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [peek failed] %d due to %s\n",
-										i, strerror(errno));
-								continue;
-							}
-							else if (peek == 0) /* No data on this. so don't hand it off */
-							{
-								continue;
-							}
-							else
-							{
-								/* simply hand it off to one of our threads if no thread is servicing this currently */
-								fd_lock();
-								FD_SET(i, &aux_readsock_set);
-								fd_unlock();
-								tp_assign_work_by_id(id, capfs_iod_worker, (void *)i);
-							}
-						}
+						iod_sock_close(i);
+						LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [peek failed] %d due to %s\n",
+								i, strerror(errno));
+						continue;
 					}
-				} /* end if-else-FD_ISSET */
+					else if (peek == 0) /* No data on this. so don't hand it off */
+					{
+						iod_sock_arm(i, EPOLL_CTL_MOD);
+						continue;
+					}
+					/* simply hand it off to one of our threads */
+					tp_assign_work_by_id(id, capfs_iod_worker, (void *)i);
+				}
 			} /* end-for */
 		} /* end while(1) */
 		return -1; /* should never get here */
@@ -709,13 +825,18 @@ static void capfs_cleanup(void)
 	}
 	/* Clean up the thread pool */
 	tp_cleanup_by_id(id);
+	iod_ref_finalize();
+	iod_io_finalize();
+	iod_cache_finalize();
+	/* checkpoint the packed store index */
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		pack_finalize();
+	}
 	return;
 }
 
 int main(int argc, char **argv)
 {
-	/* initialize a spinlock */
-	pthread_spin_init(&fdset_spinlock, 0);
 	pmap_unset(CAPFS_IOD, iodv1);
 	/* Start up the thread pool and register a service with the portmapper */
 	if (capfs_init(argc, argv) < 0) {
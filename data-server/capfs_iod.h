@@ -5,6 +5,10 @@
 
 extern char* get_fileName(void* binHash);
 extern void *capfs_iod_worker(void *args);
+extern void iod_sock_rearm(int sock);
+extern void iod_sock_close(int sock);
+extern int chunk_exists(unsigned char *hash);
+extern int chunk_remove(unsigned char *hash);
 
 
 #endif
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * In-memory cache of popular chunks for the CAS server.
+ *
+ * Chunks that every client reads (shared libraries, input decks etc.)
+ * would otherwise be read off the disk on every GET. We keep the contents
+ * of recently read chunks in memory, keyed by their hash. Since a hash
+ * always names the same contents, an entry never has to be invalidated
+ * or updated; entries only ever leave the cache to make room.
+ *
+ * The cache is split into IOD_CACHE_SHARDS partitions, each with its own
+ * lock, hash chains and share of the capacity, so that concurrent GETs
+ * rarely contend. Within a partition, entries are replaced using the
+ * CLOCK algorithm: a hit only sets the entry's referenced bit, and the
+ * hand sweeps over the entries clearing referenced bits until it finds
+ * one that was not touched since the last sweep.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "capfs_config.h"
+#include "list.h"
+#include "log.h"
+#include "iod_cache.h"
+
+struct iod_cache_entry {
+	struct list_head ce_link;  /* hash chain */
+	struct list_head ce_clock; /* clock ring */
+	unsigned char    ce_hash[CAPFS_MAXHASHLENGTH];
+	int              ce_referenced;
+	int              ce_length;
+	char            *ce_data;
+};
+
+struct iod_cache_shard {
+	pthread_mutex_t   cs_lock;
+	struct list_head  cs_table[IOD_CACHE_BUCKETS];
+	struct list_head  cs_clock;
+	struct list_head *cs_hand;
+	int64_t           cs_capacity;
+	int64_t           cs_bytes;
+	int64_t           cs_entries;
+	int64_t           cs_hits;
+	int64_t           cs_misses;
+	int64_t           cs_evictions;
+};
+
+static struct iod_cache_shard *cache_shards = NULL;
+static int64_t cache_capacity = 0;
+
+static inline struct iod_cache_shard *cache_shard(unsigned char *hash)
+{
+	/* pick the partition and the chain off different bytes of the hash */
+	return &cache_shards[hash[CAPFS_MAXHASHLENGTH - 1] % IOD_CACHE_SHARDS];
+}
+
+static inline unsigned int cache_bucket(unsigned char *hash)
+{
+	unsigned int b;
+
+	memcpy(&b, hash, sizeof(b));
+	return b & (IOD_CACHE_BUCKETS - 1);
+}
+
+/* must be called with the shard lock held */
+static struct iod_cache_entry *cache_search(struct iod_cache_shard *shard, unsigned char *hash)
+{
+	struct list_head *head, *tmp;
+
+	head = &shard->cs_table[cache_bucket(hash)];
+	list_for_each(tmp, head) {
+		struct iod_cache_entry *entry = list_entry(tmp, struct iod_cache_entry, ce_link);
+		if (memcmp(entry->ce_hash, hash, CAPFS_MAXHASHLENGTH) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* must be called with the shard lock held */
+static void cache_evict(struct iod_cache_shard *shard, struct iod_cache_entry *entry)
+{
+	if (shard->cs_hand == &entry->ce_clock) {
+		shard->cs_hand = entry->ce_clock.next;
+	}
+	list_del(&entry->ce_link);
+	list_del(&entry->ce_clock);
+	shard->cs_bytes -= entry->ce_length;
+	shard->cs_entries--;
+	free(entry->ce_data);
+	free(entry);
+	return;
+}
+
+/*
+ * Advances the clock hand until size more bytes fit in the shard.
+ * must be called with the shard lock held
+ */
+static void cache_make_room(struct iod_cache_shard *shard, int size)
+{
+	while (shard->cs_bytes + size > shard->cs_capacity && shard->cs_entries > 0) {
+		struct iod_cache_entry *entry;
+
+		if (shard->cs_hand == &shard->cs_clock) {
+			shard->cs_hand = shard->cs_hand->next;
+			continue;
+		}
+		entry = list_entry(shard->cs_hand, struct iod_cache_entry, ce_clock);
+		if (entry->ce_referenced) {
+			/* give it a second chance */
+			entry->ce_referenced = 0;
+			shard->cs_hand = shard->cs_hand->next;
+			continue;
+		}
+		cache_evict(shard, entry);
+		shard->cs_evictions++;
+	}
+	return;
+}
+
+/* size is the number of bytes of memory to be used for caching chunks, 0 disables the cache */
+int iod_cache_init(int64_t size)
+{
+	int i, j;
+
+	if (size <= 0) {
+		cache_capacity = 0;
+		return 0;
+	}
+	cache_shards = (struct iod_cache_shard *) calloc(IOD_CACHE_SHARDS, sizeof(struct iod_cache_shard));
+	if (cache_shards == NULL) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < IOD_CACHE_SHARDS; i++) {
+		struct iod_cache_shard *shard = &cache_shards[i];
+
+		pthread_mutex_init(&shard->cs_lock, NULL);
+		for (j = 0; j < IOD_CACHE_BUCKETS; j++) {
+			INIT_LIST_HEAD(&shard->cs_table[j]);
+		}
+		INIT_LIST_HEAD(&shard->cs_clock);
+		shard->cs_hand = &shard->cs_clock;
+		shard->cs_capacity = size / IOD_CACHE_SHARDS;
+	}
+	cache_capacity = size;
+	LOG(stderr, INFO_MSG, SUBSYS_DATA, "chunk cache of %Ld bytes in %d shards\n",
+			(long long) size, IOD_CACHE_SHARDS);
+	return 0;
+}
+
+void iod_cache_finalize(void)
+{
+	int i;
+
+	if (cache_shards == NULL) {
+		return;
+	}
+	for (i = 0; i < IOD_CACHE_SHARDS; i++) {
+		struct iod_cache_shard *shard = &cache_shards[i];
+
+		pthread_mutex_lock(&shard->cs_lock);
+		while (!list_empty(&shard->cs_clock)) {
+			cache_evict(shard, list_entry(shard->cs_clock.next, struct iod_cache_entry, ce_clock));
+		}
+		pthread_mutex_unlock(&shard->cs_lock);
+		pthread_mutex_destroy(&shard->cs_lock);
+	}
+	free(cache_shards);
+	cache_shards = NULL;
+	cache_capacity = 0;
+	return;
+}
+
+int iod_cache_enabled(void)
+{
+	return (cache_shards != NULL);
+}
+
+/*
+ * Copies the cached contents of the chunk into buf.
+ * Returns the length of the chunk on a hit, -ENOENT on a miss
+ * (or if the chunk does not fit in size bytes).
+ */
+int iod_cache_get(unsigned char *hash, char *buf, int size)
+{
+	struct iod_cache_shard *shard;
+	struct iod_cache_entry *entry;
+	int ret = -ENOENT;
+
+	if (cache_shards == NULL) {
+		return -ENOENT;
+	}
+	shard = cache_shard(hash);
+	pthread_mutex_lock(&shard->cs_lock);
+	if ((entry = cache_search(shard, hash)) != NULL && entry->ce_length <= size) {
+		memcpy(buf, entry->ce_data, entry->ce_length);
+		entry->ce_referenced = 1;
+		ret = entry->ce_length;
+		shard->cs_hits++;
+	}
+	else {
+		shard->cs_misses++;
+	}
+	pthread_mutex_unlock(&shard->cs_lock);
+	return ret;
+}
+
+/*
+ * Returns a copy of the cached contents of the chunk, to be freed by the
+ * caller, or NULL on a miss (or if the chunk is not size bytes long).
+ * Nothing is allocated on a miss.
+ */
+char *iod_cache_dup(unsigned char *hash, int size)
+{
+	struct iod_cache_shard *shard;
+	struct iod_cache_entry *entry;
+	char *buf = NULL;
+
+	if (cache_shards == NULL) {
+		return NULL;
+	}
+	shard = cache_shard(hash);
+	pthread_mutex_lock(&shard->cs_lock);
+	if ((entry = cache_search(shard, hash)) != NULL && entry->ce_length == size
+			&& (buf = (char *) malloc(size)) != NULL) {
+		memcpy(buf, entry->ce_data, size);
+		entry->ce_referenced = 1;
+		shard->cs_hits++;
+	}
+	else {
+		shard->cs_misses++;
+	}
+	pthread_mutex_unlock(&shard->cs_lock);
+	return buf;
+}
+
+/* allocates an entry for size bytes of the chunk, or returns NULL if it should not be cached */
+static struct iod_cache_entry *cache_entry_alloc(unsigned char *hash, int size)
+{
+	struct iod_cache_entry *entry;
+
+	if (cache_shards == NULL || size <= 0 || size > cache_shard(hash)->cs_capacity) {
+		return NULL;
+	}
+	entry = (struct iod_cache_entry *) calloc(1, sizeof(struct iod_cache_entry));
+	if (entry == NULL) {
+		return NULL;
+	}
+	if ((entry->ce_data = (char *) malloc(size)) == NULL) {
+		free(entry);
+		return NULL;
+	}
+	memcpy(entry->ce_hash, hash, CAPFS_MAXHASHLENGTH);
+	entry->ce_length = size;
+	return entry;
+}
+
+/* makes a filled in entry visible, unless the chunk was cached meanwhile */
+static void cache_insert(struct iod_cache_entry *entry)
+{
+	unsigned char *hash = entry->ce_hash;
+	struct iod_cache_shard *shard = cache_shard(hash);
+	int size = entry->ce_length;
+
+	pthread_mutex_lock(&shard->cs_lock);
+	if (cache_search(shard, hash) != NULL) {
+		/* someone else beat us to it; contents are the same anyway */
+		pthread_mutex_unlock(&shard->cs_lock);
+		free(entry->ce_data);
+		free(entry);
+		return;
+	}
+	cache_make_room(shard, size);
+	list_add_tail(&entry->ce_link, &shard->cs_table[cache_bucket(hash)]);
+	/* new entries go just behind the hand, so they survive a full sweep */
+	list_add_tail(&entry->ce_clock, shard->cs_hand);
+	shard->cs_bytes += size;
+	shard->cs_entries++;
+	pthread_mutex_unlock(&shard->cs_lock);
+	return;
+}
+
+/*
+ * Adds the size bytes in buf as the contents of the chunk named by hash.
+ * buf must hold the entire chunk. Failures to cache are silently ignored.
+ */
+void iod_cache_put(unsigned char *hash, char *buf, int size)
+{
+	struct iod_cache_entry *entry;
+
+	/* copy the data outside the lock */
+	if ((entry = cache_entry_alloc(hash, size)) == NULL) {
+		return;
+	}
+	memcpy(entry->ce_data, buf, size);
+	cache_insert(entry);
+	return;
+}
+
+/*
+ * Same as iod_cache_put(), but the chunk is read from offset in fd
+ * straight into the entry.
+ */
+void iod_cache_put_fd(unsigned char *hash, int fd, off_t offset, int size)
+{
+	struct iod_cache_entry *entry;
+
+	if ((entry = cache_entry_alloc(hash, size)) == NULL) {
+		return;
+	}
+	if (pread(fd, entry->ce_data, size, offset) != size) {
+		free(entry->ce_data);
+		free(entry);
+		return;
+	}
+	cache_insert(entry);
+	return;
+}
+
+void iod_cache_stat(struct cas_iod_stat *stat)
+{
+	int i;
+
+	stat->is_cache_hits = stat->is_cache_misses = stat->is_cache_evictions = 0;
+	stat->is_cache_entries = stat->is_cache_bytes = 0;
+	stat->is_cache_capacity = cache_capacity;
+	if (cache_shards == NULL) {
+		return;
+	}
+	for (i = 0; i < IOD_CACHE_SHARDS; i++) {
+		struct iod_cache_shard *shard = &cache_shards[i];
+
+		pthread_mutex_lock(&shard->cs_lock);
+		stat->is_cache_hits += shard->cs_hits;
+		stat->is_cache_misses += shard->cs_misses;
+		stat->is_cache_evictions += shard->cs_evictions;
+		stat->is_cache_entries += shard->cs_entries;
+		stat->is_cache_bytes += shard->cs_bytes;
+		pthread_mutex_unlock(&shard->cs_lock);
+	}
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * In-memory cache of popular chunks for the CAS server.
+ */
+#ifndef _IOD_CACHE_H
+#define _IOD_CACHE_H
+
+#include <sys/types.h>
+#include "capfs_config.h"
+#include "cas.h"
+
+/* number of independently locked partitions of the cache */
+#define IOD_CACHE_SHARDS  64
+/* number of hash chains in every partition */
+#define IOD_CACHE_BUCKETS 1024
+
+extern int  iod_cache_init(int64_t size);
+extern void iod_cache_finalize(void);
+extern int  iod_cache_enabled(void);
+extern int  iod_cache_get(unsigned char *hash, char *buf, int size);
+extern char *iod_cache_dup(unsigned char *hash, int size);
+extern void iod_cache_put(unsigned char *hash, char *buf, int size);
+extern void iod_cache_put_fd(unsigned char *hash, int fd, off_t offset, int size);
+extern void iod_cache_stat(struct cas_iod_stat *stat);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Content-defined sub-chunking for the CAS server.
+ *
+ * Recipes address a file in fixed CAPFS_CHUNK_SIZE chunks, so inserting a
+ * few bytes into a file shifts the contents of every chunk after it and
+ * none of them match what is already stored. When enabled, the iod cuts
+ * every chunk it is asked to store into pieces at content-defined
+ * boundaries (see shared/cdc.c), which stay where they were relative to
+ * the data around them when it shifts. Each piece is stored as a chunk of
+ * its own, named by its hash, unless it is already there, and the chunk
+ * itself is stored as an iod_cdc_header followed by the length and hash of
+ * each of its pieces. So a shifted chunk only costs the pieces at its two
+ * ends. Chunks that come out as a single piece are stored as before.
+ *
+ * A chunk that is stored as pieces holds a reference on each of them
+ * (iod_ref.c), which is dropped when the chunk is removed, so pieces are
+ * reclaimed once no chunk uses them any more. Pieces are only ever
+ * referenced from chunks on the same iod, so how much is saved depends on
+ * shifted chunks landing on the iod that holds their old contents.
+ * Pieces themselves are never stored as pieces, and a chunk is only ever
+ * taken to be a list of pieces if the store says it was stored as one.
+ *
+ * Like compressed chunks, chunks stored as pieces are assembled on the
+ * way out and clients never see the difference. They remain readable
+ * when sub-chunking is turned off again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "capfs_config.h"
+#include "log.h"
+#include "sha.h"
+#include "cdc.h"
+#include "iod_cdc.h"
+
+/* chunks of the same hash are stored one at a time */
+#define IOD_CDC_LOCKS 64
+
+static struct cdc_params cdc_params;
+static int cdc_enabled = 0;
+static pthread_mutex_t cdc_locks[IOD_CDC_LOCKS];
+
+static pthread_mutex_t cdc_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t cdc_chunks = 0, cdc_bytes = 0, cdc_new_bytes = 0;
+
+/*
+ * Pieces are cut between min and max bytes long, avg bytes on average.
+ * An avg of 0 turns sub-chunking off.
+ */
+int iod_cdc_init(int min, int avg, int max)
+{
+	int i, ret;
+
+	cdc_enabled = 0;
+	if (avg <= 0) {
+		return 0;
+	}
+	if (min < IOD_CDC_MIN_PIECE || max > CAPFS_CHUNK_SIZE
+			|| (ret = cdc_init(&cdc_params, min, avg, max)) < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "invalid sub-chunk sizes %d/%d/%d (min %d, max %d)\n",
+				min, avg, max, IOD_CDC_MIN_PIECE, CAPFS_CHUNK_SIZE);
+		return -EINVAL;
+	}
+	for (i = 0; i < IOD_CDC_LOCKS; i++) {
+		pthread_mutex_init(&cdc_locks[i], NULL);
+	}
+	cdc_enabled = 1;
+	return 0;
+}
+
+int iod_cdc_enabled(void)
+{
+	return cdc_enabled;
+}
+
+/*
+ * Cuts the size bytes of the chunk in buf into pieces, and fills in the
+ * length and hash of each of them.
+ * Returns the number of pieces or -errno on failure.
+ */
+int iod_cdc_split(char *buf, int size, struct iod_cdc_piece *pieces)
+{
+	int n = 0, off = 0, ret;
+
+	while (off < size && n < IOD_CDC_MAXPIECES) {
+		unsigned char *hash = pieces[n].cp_hash;
+		size_t len;
+
+		pieces[n].cp_length = cdc_cut(&cdc_params, (unsigned char *) buf + off, size - off);
+		if ((ret = sha1(buf + off, pieces[n].cp_length, &hash, &len)) < 0) {
+			return ret;
+		}
+		off += pieces[n].cp_length;
+		n++;
+	}
+	/* cannot happen with pieces of at least IOD_CDC_MIN_PIECE bytes */
+	if (off < size) {
+		return -EINVAL;
+	}
+	return n;
+}
+
+/*
+ * Writes the list of the npieces pieces of a chunk of size bytes to dst,
+ * which must have room for IOD_CDC_MANIFEST_SIZE(npieces) bytes.
+ * Returns the number of bytes to be stored from dst.
+ */
+int iod_cdc_encode(struct iod_cdc_piece *pieces, int npieces, int size, char *dst)
+{
+	struct iod_cdc_header *hdr = (struct iod_cdc_header *) dst;
+
+	hdr->cm_magic = IOD_CDC_MAGIC;
+	hdr->cm_npieces = npieces;
+	hdr->cm_pad = 0;
+	hdr->cm_length = size;
+	memcpy(dst + sizeof(struct iod_cdc_header), pieces, npieces * sizeof(struct iod_cdc_piece));
+	return IOD_CDC_MANIFEST_SIZE(npieces);
+}
+
+/*
+ * stored holds (at least the first sizeof(struct iod_cdc_header) bytes of)
+ * a chunk of stored_len bytes that was stored as pieces.
+ * Returns the length of the chunk, or 0 if its header is invalid.
+ */
+int iod_cdc_peek(char *stored, int stored_len)
+{
+	struct iod_cdc_header *hdr = (struct iod_cdc_header *) stored;
+
+	if (stored_len < sizeof(struct iod_cdc_header) || stored_len >= CAPFS_CHUNK_SIZE) {
+		return 0;
+	}
+	if (hdr->cm_magic != IOD_CDC_MAGIC
+			|| hdr->cm_npieces < 2 || hdr->cm_npieces > IOD_CDC_MAXPIECES
+			|| stored_len != IOD_CDC_MANIFEST_SIZE(hdr->cm_npieces)
+			|| hdr->cm_length <= stored_len || hdr->cm_length > CAPFS_CHUNK_SIZE) {
+		return 0;
+	}
+	return hdr->cm_length;
+}
+
+/*
+ * Fills in the pieces of the chunk in stored (whose header iod_cdc_peek()
+ * accepted). Returns the number of pieces or -EIO if their lengths
+ * do not add up.
+ */
+int iod_cdc_decode(char *stored, int stored_len, struct iod_cdc_piece *pieces)
+{
+	struct iod_cdc_header *hdr = (struct iod_cdc_header *) stored;
+	int i, n = hdr->cm_npieces;
+	uint32_t total = 0;
+
+	memcpy(pieces, stored + sizeof(struct iod_cdc_header), n * sizeof(struct iod_cdc_piece));
+	for (i = 0; i < n; i++) {
+		total += pieces[i].cp_length;
+	}
+	if (total != hdr->cm_length) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "pieces of chunk add up to %u bytes instead of %u\n",
+				total, hdr->cm_length);
+		return -EIO;
+	}
+	return n;
+}
+
+void iod_cdc_lock(unsigned char *hash)
+{
+	pthread_mutex_lock(&cdc_locks[hash[0] % IOD_CDC_LOCKS]);
+	return;
+}
+
+void iod_cdc_unlock(unsigned char *hash)
+{
+	pthread_mutex_unlock(&cdc_locks[hash[0] % IOD_CDC_LOCKS]);
+	return;
+}
+
+/* A chunk of size bytes was stored as pieces, of which new_bytes worth were not already stored */
+void iod_cdc_account(int size, int new_bytes)
+{
+	pthread_mutex_lock(&cdc_stat_lock);
+	cdc_chunks++;
+	cdc_bytes += size;
+	cdc_new_bytes += new_bytes;
+	pthread_mutex_unlock(&cdc_stat_lock);
+	return;
+}
+
+void iod_cdc_stat(struct cas_iod_stat *stat)
+{
+	pthread_mutex_lock(&cdc_stat_lock);
+	stat->is_cdc_chunks = cdc_chunks;
+	stat->is_cdc_bytes = cdc_bytes;
+	stat->is_cdc_new_bytes = cdc_new_bytes;
+	pthread_mutex_unlock(&cdc_stat_lock);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
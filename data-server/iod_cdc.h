@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Content-defined sub-chunking for the CAS server.
+ */
+#ifndef _IOD_CDC_H
+#define _IOD_CDC_H
+
+#include <stdint.h>
+#include "capfs_config.h"
+#include "cas.h"
+
+#define IOD_CDC_MAGIC 0x43415050 /* "CAPP" */
+/* smallest piece we allow, which bounds the number of pieces of a chunk */
+#define IOD_CDC_MIN_PIECE 256
+#define IOD_CDC_MAXPIECES (CAPFS_CHUNK_SIZE / IOD_CDC_MIN_PIECE)
+
+/* on-disk header of a chunk that is stored as a list of pieces */
+struct iod_cdc_header {
+	uint32_t cm_magic;
+	uint16_t cm_npieces;
+	uint16_t cm_pad;
+	uint32_t cm_length; /* length of the chunk */
+};
+
+/* followed by cm_npieces of these, in order */
+struct iod_cdc_piece {
+	uint32_t cp_length;
+	unsigned char cp_hash[CAPFS_MAXHASHLENGTH];
+};
+
+#define IOD_CDC_MANIFEST_SIZE(n) (sizeof(struct iod_cdc_header) + (n) * sizeof(struct iod_cdc_piece))
+
+extern int  iod_cdc_init(int min, int avg, int max);
+extern int  iod_cdc_enabled(void);
+extern int  iod_cdc_split(char *buf, int size, struct iod_cdc_piece *pieces);
+extern int  iod_cdc_encode(struct iod_cdc_piece *pieces, int npieces, int size, char *dst);
+extern int  iod_cdc_peek(char *stored, int stored_len);
+extern int  iod_cdc_decode(char *stored, int stored_len, struct iod_cdc_piece *pieces);
+extern void iod_cdc_lock(unsigned char *hash);
+extern void iod_cdc_unlock(unsigned char *hash);
+extern void iod_cdc_account(int size, int new_bytes);
+extern void iod_cdc_stat(struct cas_iod_stat *stat);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
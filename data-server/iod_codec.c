@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Per-chunk compression for the CAS server.
+ *
+ * When a codec is configured, every chunk is compressed before it is
+ * handed to the store. If that saves at least 1/8th of its size, the
+ * chunk is stored as an iod_codec_header followed by the compressed
+ * payload, else it is stored verbatim so that incompressible data costs
+ * nothing on the way back out. The store records which chunks are
+ * compressed next to them (see chunk_store()); a chunk is never taken
+ * to be compressed because of what it holds. iod_codec_peek() only
+ * checks the magic, the codec and the lengths in the header.
+ *
+ * Chunks are decompressed on the way out, so clients never see the
+ * difference. Chunks written with any codec remain readable even if the
+ * configured codec is later changed (or compression turned off).
+ *
+ * New codecs only need a pack and an unpack routine and an entry in
+ * iod_codecs[] with an identifier that was never used before.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "capfs_config.h"
+#include "log.h"
+#include "iod_codec.h"
+
+static int zlib_pack(char *src, int srclen, char *dst, int dstlen)
+{
+	uLongf len = dstlen;
+	int ret;
+
+	/* favour speed, the disks and not the CPUs are the bottleneck */
+	ret = compress2((Bytef *) dst, &len, (Bytef *) src, srclen, Z_BEST_SPEED);
+	if (ret == Z_BUF_ERROR) {
+		return -ENOSPC;
+	}
+	else if (ret != Z_OK) {
+		return -ENOMEM;
+	}
+	return len;
+}
+
+static int zlib_unpack(char *src, int srclen, char *dst, int dstlen)
+{
+	uLongf len = dstlen;
+	int ret;
+
+	ret = uncompress((Bytef *) dst, &len, (Bytef *) src, srclen);
+	if (ret == Z_BUF_ERROR) {
+		return -ENOSPC;
+	}
+	else if (ret != Z_OK) {
+		return -EIO;
+	}
+	return len;
+}
+
+static struct iod_codec iod_codecs[] = {
+	{"none", IOD_CODEC_NONE, NULL,      NULL},
+	{"zlib", IOD_CODEC_ZLIB, zlib_pack, zlib_unpack},
+};
+
+#define IOD_NCODECS (sizeof(iod_codecs) / sizeof(struct iod_codec))
+
+/* codec used for compressing chunks, NULL if compression is off */
+static struct iod_codec *codec_current = NULL;
+
+static pthread_mutex_t codec_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t codec_packed = 0, codec_skipped = 0;
+static int64_t codec_raw_bytes = 0, codec_stored_bytes = 0;
+static int64_t codec_pack_usecs = 0, codec_unpack_usecs = 0;
+
+/* CPU time consumed by the calling thread in microseconds */
+static int64_t codec_cputime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) {
+		return 0;
+	}
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct iod_codec *codec_lookup(int id)
+{
+	int i;
+
+	for (i = 0; i < IOD_NCODECS; i++) {
+		if (iod_codecs[i].cd_id == id) {
+			return &iod_codecs[i];
+		}
+	}
+	return NULL;
+}
+
+/* name is the codec used to compress chunks, "none" turns compression off */
+int iod_codec_init(char *name)
+{
+	int i;
+
+	for (i = 0; i < IOD_NCODECS; i++) {
+		if (strcasecmp(iod_codecs[i].cd_name, name) == 0) {
+			codec_current = (iod_codecs[i].cd_pack != NULL) ? &iod_codecs[i] : NULL;
+			return 0;
+		}
+	}
+	LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "unknown compression codec %s\n", name);
+	return -EINVAL;
+}
+
+int iod_codec_enabled(void)
+{
+	return (codec_current != NULL);
+}
+
+/*
+ * Compresses the size bytes of the chunk in buf into dst, which must have
+ * room for size bytes. Returns the number of bytes to be stored from dst,
+ * or 0 if the chunk should be stored verbatim.
+ */
+int iod_codec_pack(char *buf, int size, char *dst)
+{
+	struct iod_codec_header *hdr = (struct iod_codec_header *) dst;
+	int64_t begin, elapsed;
+	int limit, ret;
+
+	if (codec_current == NULL) {
+		return 0;
+	}
+	/* anything that does not save 1/8th is not worth decompressing later */
+	limit = size - size / 8 - sizeof(struct iod_codec_header);
+	ret = 0;
+	if (limit > 0) {
+		begin = codec_cputime();
+		ret = codec_current->cd_pack(buf, size, dst + sizeof(struct iod_codec_header), limit);
+		elapsed = codec_cputime() - begin;
+		if (ret < 0 && ret != -ENOSPC) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "%s compression failed: %s\n",
+					codec_current->cd_name, strerror(-ret));
+		}
+	}
+	else {
+		elapsed = 0;
+	}
+	if (ret > 0) {
+		hdr->ch_magic = IOD_CODEC_MAGIC;
+		hdr->ch_codec = codec_current->cd_id;
+		hdr->ch_pad = 0;
+		hdr->ch_length = size;
+		hdr->ch_plength = ret;
+		ret += sizeof(struct iod_codec_header);
+	}
+	else {
+		ret = 0;
+	}
+	pthread_mutex_lock(&codec_stat_lock);
+	if (ret > 0) {
+		codec_packed++;
+	}
+	else {
+		codec_skipped++;
+	}
+	codec_raw_bytes += size;
+	codec_stored_bytes += (ret > 0) ? ret : size;
+	codec_pack_usecs += elapsed;
+	pthread_mutex_unlock(&codec_stat_lock);
+	return ret;
+}
+
+/*
+ * stored holds (at least the first sizeof(struct iod_codec_header) bytes of)
+ * a chunk of stored_len bytes that was stored compressed.
+ * Returns the uncompressed length of the chunk, or 0 if its header is invalid.
+ */
+int iod_codec_peek(char *stored, int stored_len)
+{
+	struct iod_codec_header *hdr = (struct iod_codec_header *) stored;
+	struct iod_codec *codec;
+
+	if (stored_len < sizeof(struct iod_codec_header) || stored_len >= CAPFS_CHUNK_SIZE) {
+		return 0;
+	}
+	if (hdr->ch_magic != IOD_CODEC_MAGIC
+			|| hdr->ch_plength != stored_len - sizeof(struct iod_codec_header)
+			|| hdr->ch_length <= stored_len || hdr->ch_length > CAPFS_CHUNK_SIZE) {
+		return 0;
+	}
+	if ((codec = codec_lookup(hdr->ch_codec)) == NULL || codec->cd_unpack == NULL) {
+		return 0;
+	}
+	return hdr->ch_length;
+}
+
+/*
+ * Decompresses the chunk in stored (whose header iod_codec_peek()
+ * accepted) into buf. Returns the uncompressed length or -errno on failure.
+ */
+int iod_codec_unpack(char *stored, int stored_len, char *buf, int size)
+{
+	struct iod_codec_header *hdr = (struct iod_codec_header *) stored;
+	struct iod_codec *codec;
+	int64_t begin, elapsed;
+	int ret;
+
+	if ((codec = codec_lookup(hdr->ch_codec)) == NULL || codec->cd_unpack == NULL) {
+		return -EINVAL;
+	}
+	if (hdr->ch_length > size) {
+		return -ENOSPC;
+	}
+	begin = codec_cputime();
+	ret = codec->cd_unpack(stored + sizeof(struct iod_codec_header), hdr->ch_plength, buf, size);
+	elapsed = codec_cputime() - begin;
+	if (ret >= 0 && ret != hdr->ch_length) {
+		ret = -EIO;
+	}
+	if (ret < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "%s decompression failed: %s\n",
+				codec->cd_name, strerror(-ret));
+	}
+	pthread_mutex_lock(&codec_stat_lock);
+	codec_unpack_usecs += elapsed;
+	pthread_mutex_unlock(&codec_stat_lock);
+	return ret;
+}
+
+void iod_codec_stat(struct cas_iod_stat *stat)
+{
+	pthread_mutex_lock(&codec_stat_lock);
+	stat->is_codec_packed = codec_packed;
+	stat->is_codec_skipped = codec_skipped;
+	stat->is_codec_raw_bytes = codec_raw_bytes;
+	stat->is_codec_stored_bytes = codec_stored_bytes;
+	stat->is_codec_pack_usecs = codec_pack_usecs;
+	stat->is_codec_unpack_usecs = codec_unpack_usecs;
+	pthread_mutex_unlock(&codec_stat_lock);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Per-chunk compression for the CAS server.
+ */
+#ifndef _IOD_CODEC_H
+#define _IOD_CODEC_H
+
+#include <stdint.h>
+#include "capfs_config.h"
+#include "cas.h"
+
+#define IOD_CODEC_MAGIC 0x4341505a /* "CAPZ" */
+
+/* codec identifiers, as stored in the chunk header. Never reuse one! */
+#define IOD_CODEC_NONE 0
+#define IOD_CODEC_ZLIB 1
+
+/* on-disk header that precedes the payload of a compressed chunk */
+struct iod_codec_header {
+	uint32_t ch_magic;
+	uint16_t ch_codec;
+	uint16_t ch_pad;
+	uint32_t ch_length;  /* length of the chunk when uncompressed */
+	uint32_t ch_plength; /* length of the compressed payload that follows */
+};
+
+/*
+ * A codec. Both routines return the number of bytes produced in dst
+ * or -errno on failure (-ENOSPC if the output does not fit in dstlen bytes).
+ */
+struct iod_codec {
+	char *cd_name;
+	int   cd_id;
+	int (*cd_pack)(char *src, int srclen, char *dst, int dstlen);
+	int (*cd_unpack)(char *src, int srclen, char *dst, int dstlen);
+};
+
+extern int  iod_codec_init(char *name);
+extern int  iod_codec_enabled(void);
+extern int  iod_codec_pack(char *buf, int size, char *dst);
+extern int  iod_codec_peek(char *stored, int stored_len);
+extern int  iod_codec_unpack(char *stored, int stored_len, char *buf, int size);
+extern void iod_codec_stat(struct cas_iod_stat *stat);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -35,6 +35,18 @@
  * write_buf 512
  * access_size 512
  * socket_buf 64
+ * enable_sendfile 1
+ * storage packed
+ * pack_size 1024
+ * pack_checkpoint 4096
+ * io_threads 8
+ * chunk_cache 64
+ * compression zlib
+ * reclaim_rate 64
+ * reclaim_delay 600
+ * cdc_min_size 512
+ * cdc_avg_size 2048
+ * cdc_max_size 8192
  * 
  * END OF SAMPLE CONFIG FILE
  *
@@ -77,8 +89,19 @@ struct iod_config  __iod_config = {
 	IOD_WRITE_BUFFER_SIZE,
 	IOD_SOCKET_BUFFER_SIZE,
 	CRITICAL_MSG | WARNING_MSG /* default log_level */,
-	0 /* enable sendfile */,
-	DEFAULT_THREADS
+	1 /* enable sendfile */,
+	DEFAULT_THREADS,
+	IOD_STORAGE_FILES,
+	IOD_PACK_SIZE,
+	IOD_PACK_CHECKPOINT,
+	IOD_IO_THREADS,
+	IOD_CHUNK_CACHE,
+	IOD_COMPRESSION,
+	IOD_RECLAIM_RATE,
+	IOD_RECLAIM_DELAY,
+	IOD_CDC_MIN_SIZE,
+	IOD_CDC_AVG_SIZE,
+	IOD_CDC_MAX_SIZE
 };
 
 int parse_config(char *fname)
@@ -256,6 +279,141 @@ int parse_config(char *fname)
 				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in num_threads\n");
 			}
 		}
+		/* STORAGE (eg. "storage packed" or "storage files") */
+		else if (!strcasecmp("storage", option)) {
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for storage");
+				continue;
+			}
+			while (isspace(*value)) value++;
+			if (!strcasecmp("files", value)) {
+				__iod_config.storage = IOD_STORAGE_FILES;
+			}
+			else if (!strcasecmp("packed", value)) {
+				__iod_config.storage = IOD_STORAGE_PACKED;
+			}
+			else {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: storage %s is invalid\n", value);
+				return(-1);
+			}
+		}
+		/* PACK_SIZE (eg. "pack_size 1024") */
+		else if (!strcasecmp("pack_size", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for pack_size");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.pack_size = (int64_t) strtol(value, &err, 10)*1024*1024; /* in MiB */
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in pack_size\n");
+			}
+		}
+		/* PACK_CHECKPOINT (eg. "pack_checkpoint 4096") */
+		else if (!strcasecmp("pack_checkpoint", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for pack_checkpoint");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.pack_checkpoint = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in pack_checkpoint\n");
+			}
+		}
+		/* IO_THREADS (eg. "io_threads 8") */
+		else if (!strcasecmp("io_threads", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for io_threads");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.io_threads = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in io_threads\n");
+			}
+		}
+		/* CHUNK_CACHE (eg. "chunk_cache 64") */
+		else if (!strcasecmp("chunk_cache", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for chunk_cache");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.chunk_cache = (int64_t) strtol(value, &err, 10)*1024*1024; /* in MiB */
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in chunk_cache\n");
+			}
+		}
+		/* COMPRESSION (eg. "compression zlib") */
+		else if (!strcasecmp("compression", option)) {
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for compression");
+				continue;
+			}
+			while (isspace(*value)) value++;
+			strncpy(__iod_config.compression, value, MAXOPTLEN);
+		}
+		/* RECLAIM_RATE (eg. "reclaim_rate 64") */
+		else if (!strcasecmp("reclaim_rate", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for reclaim_rate");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.reclaim_rate = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in reclaim_rate\n");
+			}
+		}
+		/* RECLAIM_DELAY (eg. "reclaim_delay 600") */
+		else if (!strcasecmp("reclaim_delay", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for reclaim_delay");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.reclaim_delay = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in reclaim_delay\n");
+			}
+		}
+		/* CDC_MIN_SIZE (eg. "cdc_min_size 512") */
+		else if (!strcasecmp("cdc_min_size", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for cdc_min_size");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.cdc_min_size = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in cdc_min_size\n");
+			}
+		}
+		/* CDC_AVG_SIZE (eg. "cdc_avg_size 2048") */
+		else if (!strcasecmp("cdc_avg_size", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for cdc_avg_size");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.cdc_avg_size = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in cdc_avg_size\n");
+			}
+		}
+		/* CDC_MAX_SIZE (eg. "cdc_max_size 8192") */
+		else if (!strcasecmp("cdc_max_size", option)) {
+			char *err;
+			if (!(strtok(value, " \t\n#"))) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "parse_config: error reducing string for cdc_max_size");
+			}
+			while (isspace(*value)) value++;
+			__iod_config.cdc_max_size = strtol(value, &err, 10);
+			if (*err) /* bad character in value */ {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA,  "trailing character(s) in cdc_max_size\n");
+			}
+		}
 		else {
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "unknown option: %s\n", option);
 		}
@@ -280,6 +438,17 @@ int dump_config(FILE *fp)
 	fprintf(fp,  "socket_buf %d\n", (__iod_config.socket_buf)/1024);
 	fprintf(fp,  "log_level %d\n", __iod_config.log_level);
 	fprintf(fp,  "enable_sendfile %d\n", __iod_config.enable_sendfile);
+	fprintf(fp,  "storage %s\n", (__iod_config.storage == IOD_STORAGE_PACKED) ? "packed" : "files");
+	fprintf(fp,  "pack_size %Ld\n", (long long) (__iod_config.pack_size)/(1024*1024));
+	fprintf(fp,  "pack_checkpoint %d\n", __iod_config.pack_checkpoint);
+	fprintf(fp,  "io_threads %d\n", __iod_config.io_threads);
+	fprintf(fp,  "chunk_cache %Ld\n", (long long) (__iod_config.chunk_cache)/(1024*1024));
+	fprintf(fp,  "compression %s\n", __iod_config.compression);
+	fprintf(fp,  "reclaim_rate %d\n", __iod_config.reclaim_rate);
+	fprintf(fp,  "reclaim_delay %d\n", __iod_config.reclaim_delay);
+	fprintf(fp,  "cdc_min_size %d\n", __iod_config.cdc_min_size);
+	fprintf(fp,  "cdc_avg_size %d\n", __iod_config.cdc_avg_size);
+	fprintf(fp,  "cdc_max_size %d\n", __iod_config.cdc_max_size);
 	return(0);
 } /* end of dump_config() */
 
@@ -389,6 +558,11 @@ int get_config_socket_buf(void)
 	return(__iod_config.socket_buf);
 }
 
+int get_config_storage(void)
+{
+	return(__iod_config.storage);
+}
+
 
 /*
  * Local variables:
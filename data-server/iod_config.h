@@ -10,6 +10,10 @@
 #define INBUFSZ 1024
 #define MAXOPTLEN 1024
 
+/* chunk storage backends */
+#define IOD_STORAGE_FILES  0 /* one file per chunk */
+#define IOD_STORAGE_PACKED 1 /* append-only container files */
+
 struct iod_config {
 	unsigned short port;
 	struct in_addr acc_addr;	/* in network byte order */
@@ -25,6 +29,17 @@ struct iod_config {
 	int log_level;
 	int enable_sendfile;
 	int num_threads;
+	int storage;
+	int64_t pack_size;
+	int pack_checkpoint;
+	int io_threads;
+	int64_t chunk_cache;
+	char compression[MAXOPTLEN];
+	int reclaim_rate;
+	int reclaim_delay;
+	int cdc_min_size;
+	int cdc_avg_size;
+	int cdc_max_size;
 };
 
 extern struct iod_config __iod_config;
@@ -37,6 +52,7 @@ char *get_config_logdir(void);
 int get_config_access_size(void);
 int get_config_write_buf(void);
 int get_config_socket_buf(void);
+int get_config_storage(void);
 /*
  * Local variables:
  *  c-indent-level: 3
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Batched chunk I/O engine for the CAS server.
+ *
+ * A single GET/PUT can name up to CAPFS_MAXHASHES chunks. Rather than
+ * reading/writing them one after the other, iod_io_submit() lets a
+ * dedicated pool of I/O threads (and the submitting thread itself) pull
+ * requests off the batch, so that up to nthreads + 1 chunk I/Os are
+ * outstanding to the disks at any given time. Requests complete in
+ * whatever order the disks return them; iod_io_submit() returns only
+ * when the whole batch is done.
+ *
+ * Only one work item per I/O thread is queued for a batch. The
+ * submitter always takes part in servicing its own batch, so a batch
+ * makes progress even if all the I/O threads are busy with other batches,
+ * and it does not wait for helpers that never got to run before the batch
+ * was drained (the last one to drop its reference frees the batch).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "log.h"
+#include "tp_proto.h"
+#include "iod_io.h"
+
+struct iod_io_batch {
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;    /* signalled when pending drops to 0 */
+	struct iod_io_req *reqs;
+	int                count;
+	int                next;    /* next request to be picked up */
+	int                pending; /* requests not yet completed */
+	int                refs;
+};
+
+static tp_id io_id = -1;
+static int   io_threads = 0;
+
+static void iod_io_worker(struct iod_io_batch *batch)
+{
+	struct iod_io_req *req;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		if (batch->next >= batch->count) {
+			pthread_mutex_unlock(&batch->lock);
+			break;
+		}
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		req = &batch->reqs[i];
+		req->result = req->fn(req->hash, req->buf, req->size);
+
+		pthread_mutex_lock(&batch->lock);
+		if (--batch->pending == 0) {
+			pthread_cond_broadcast(&batch->cond);
+		}
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return;
+}
+
+static void batch_put(struct iod_io_batch *batch)
+{
+	int last;
+
+	pthread_mutex_lock(&batch->lock);
+	last = (--batch->refs == 0);
+	pthread_mutex_unlock(&batch->lock);
+	if (last) {
+		pthread_cond_destroy(&batch->cond);
+		pthread_mutex_destroy(&batch->lock);
+		free(batch);
+	}
+	return;
+}
+
+static void *iod_io_helper(void *args)
+{
+	struct iod_io_batch *batch = (struct iod_io_batch *) args;
+
+	iod_io_worker(batch);
+	batch_put(batch);
+	return NULL;
+}
+
+/* 
+ * Starts nthreads I/O threads. 
+ * If nthreads is 0, all requests are serviced by the submitting thread.
+ */
+int iod_io_init(int nthreads)
+{
+	tp_info tinfo;
+
+	if (nthreads <= 0) {
+		io_threads = 0;
+		return 0;
+	}
+	tinfo.tpi_name = NULL;
+	tinfo.tpi_stack_size = -1;
+	tinfo.tpi_count = nthreads;
+	io_id = tp_init(&tinfo);
+	if (io_id < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Could not initialize I/O thread pool of %d threads\n", nthreads);
+		io_id = -1;
+		return -EINVAL;
+	}
+	io_threads = nthreads;
+	return 0;
+}
+
+void iod_io_finalize(void)
+{
+	if (io_id >= 0) {
+		tp_cleanup_by_id(io_id);
+		io_id = -1;
+	}
+	io_threads = 0;
+	return;
+}
+
+/* Services all count requests, and fills in their result fields */
+void iod_io_submit(struct iod_io_req *reqs, int count)
+{
+	struct iod_io_batch *batch = NULL;
+	int i, nhelpers;
+
+	nhelpers = (count - 1 < io_threads) ? count - 1 : io_threads;
+	if (nhelpers > 0) {
+		batch = (struct iod_io_batch *) calloc(1, sizeof(struct iod_io_batch));
+	}
+	/* nothing to overlap, or no memory: do it ourselves */
+	if (batch == NULL) {
+		for (i = 0; i < count; i++) {
+			reqs[i].result = reqs[i].fn(reqs[i].hash, reqs[i].buf, reqs[i].size);
+		}
+		return;
+	}
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+	batch->reqs = reqs;
+	batch->count = count;
+	batch->next = 0;
+	batch->pending = count;
+	batch->refs = 1 + nhelpers;
+	for (i = 0; i < nhelpers; i++) {
+		if (tp_assign_work_by_id(io_id, iod_io_helper, batch) < 0) {
+			break;
+		}
+	}
+	/* drop the references of helpers that could not be queued */
+	for (; i < nhelpers; i++) {
+		batch_put(batch);
+	}
+	/* do our share of the work */
+	iod_io_worker(batch);
+	pthread_mutex_lock(&batch->lock);
+	while (batch->pending > 0) {
+		pthread_cond_wait(&batch->cond, &batch->lock);
+	}
+	pthread_mutex_unlock(&batch->lock);
+	batch_put(batch);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Batched chunk I/O engine for the CAS server.
+ */
+#ifndef _IOD_IO_H
+#define _IOD_IO_H
+
+#include "capfs_config.h"
+
+/* chunk_read()/chunk_write() style routine that services a single request */
+typedef int (*iod_io_fn)(unsigned char *hash, char *buf, int size);
+
+struct iod_io_req {
+	iod_io_fn      fn;
+	unsigned char *hash;
+	char          *buf;
+	int            size;
+	int            result; /* return value of fn: bytes done or -errno */
+	int            tag;    /* opaque to the engine, for use by the caller */
+};
+
+extern int  iod_io_init(int nthreads);
+extern void iod_io_finalize(void);
+extern void iod_io_submit(struct iod_io_req *reqs, int count);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
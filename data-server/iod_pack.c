@@ -0,0 +1,1101 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Log-structured packed chunk store for the CAS server.
+ *
+ * Instead of storing every chunk in a file of its own (see get_fileName()),
+ * chunks are appended to a small number of large container files.
+ * Every chunk in a container is preceded by a pack_record that carries its
+ * hash, length and form, so that a container can always be re-scanned to
+ * rebuild the index. An in-memory hash table maps a chunk hash to its
+ * (container, offset, length) triple. A background thread checkpoints it
+ * every so many changes by appending the changes to PACK_LOG, and once the
+ * log has grown longer than the index, by writing the whole index out to
+ * PACK_INDEX and starting a new log. On startup we load the index, apply
+ * the log and then replay only the tails of the containers that were
+ * appended to after the last checkpoint was taken. Torn records at the end
+ * of a container are truncated away.
+ *
+ * Since the store is content-addressed, chunks are never overwritten.
+ * A put of a hash that is already present is simply a no-op.
+ *
+ * Chunks that are no longer referenced are dropped from the index by
+ * pack_remove(). Their space is given back at the next checkpoint, once the
+ * index or log without them is safely on disk: the data is punched out of the
+ * container and the record is marked dead so that a replay skips it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include "capfs_config.h"
+#include "list.h"
+#include "log.h"
+#include "iod_pack.h"
+
+#define PACK_RECORD_MAGIC 0x43415053 /* "CAPS" */
+#define PACK_RECORD_DEAD  0x43415044 /* "CAPD", chunk was removed */
+#define PACK_INDEX_MAGIC  0x43415049 /* "CAPI" */
+#define PACK_INDEX_VERSION 1
+#define PACK_LOG_MAGIC    0x4341504c /* "CAPL" */
+
+/* operations in the log */
+#define PACK_LOG_ADD    1 /* chunk added at pi_container, pi_offset */
+#define PACK_LOG_DEL    2 /* chunk at pi_container, pi_offset removed */
+#define PACK_LOG_COVER  3 /* pi_container is on disk up to pi_offset */
+#define PACK_LOG_COMMIT 4 /* ends a checkpoint; records after the last one are ignored */
+
+/* the form of a chunk (see pack_put()) is kept in the top bits of pr_length */
+#define PACK_FORM_SHIFT   24
+#define PACK_LENGTH_MASK  ((1 << PACK_FORM_SHIFT) - 1)
+
+/* on-disk header that precedes every chunk in a container */
+struct pack_record {
+	uint32_t pr_magic;
+	uint32_t pr_length; /* form << PACK_FORM_SHIFT | length */
+	unsigned char pr_hash[CAPFS_MAXHASHLENGTH];
+};
+
+/* on-disk header of the checkpointed index */
+struct pack_index_header {
+	uint32_t ph_magic;
+	uint32_t ph_version;
+	uint32_t ph_ncontainers;
+	uint32_t ph_pad;
+	uint64_t ph_nentries;
+	/* followed by ph_ncontainers 64 bit container lengths and ph_nentries pack_index_entry's */
+};
+
+struct pack_index_entry {
+	unsigned char pi_hash[CAPFS_MAXHASHLENGTH];
+	int32_t pi_container;
+	int32_t pi_length;
+	int32_t pi_form;
+	int64_t pi_offset;
+};
+
+/* on-disk record of the log */
+struct pack_log_record {
+	uint32_t pl_magic;
+	uint32_t pl_op;
+	struct pack_index_entry pl_entry;
+};
+
+/* in-memory location of a chunk */
+struct pack_entry {
+	struct list_head pe_link;
+	unsigned char pe_hash[CAPFS_MAXHASHLENGTH];
+	int32_t pe_container;
+	int32_t pe_length;
+	int32_t pe_form;
+	off_t pe_offset; /* offset of the chunk data (not the record) */
+};
+
+struct pack_container {
+	int pc_fd;
+	off_t pc_size;
+};
+
+/* a removed chunk whose space is given back at the next checkpoint */
+struct pack_dead {
+	struct list_head pd_link;
+	int32_t pd_container;
+	int32_t pd_length;
+	off_t pd_offset; /* offset of the chunk data (not the record) */
+};
+
+static struct list_head *pack_table = NULL;
+static uint64_t pack_nentries = 0;
+static pthread_rwlock_t pack_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct pack_container *pack_containers = NULL;
+static int pack_ncontainers = 0;
+/* serializes appends and rolling over to a new container */
+static pthread_mutex_t pack_append_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* serializes checkpoints, and protects the log and everything below it */
+static pthread_mutex_t pack_ckpt_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* how far each container is covered by the checkpoints on disk */
+static off_t *pack_covered = NULL;
+static int64_t *pack_lengths = NULL;
+static int pack_log_fd = -1;
+static off_t pack_log_size = 0;
+static int64_t pack_log_records = 0;
+/* the next checkpoint writes out the whole index */
+static int pack_need_compact = 0;
+
+static int64_t pack_container_size = 0;
+static int pack_checkpoint_interval = 0;
+static int pack_puts_since_checkpoint = 0;
+
+/* chunks removed since the last checkpoint, protected by pack_table_lock */
+static LIST_HEAD(pack_dead_list);
+static uint64_t pack_ndead = 0;
+/* changes to the index since the last checkpoint, protected by pack_table_lock */
+static struct pack_log_record *pack_pending = NULL;
+static int64_t pack_npending = 0, pack_maxpending = 0;
+/* a change could not be noted, so the next checkpoint has to write out the whole index */
+static int pack_pending_lost = 0;
+
+/* the checkpointer thread */
+static pthread_t pack_ckpt_thread;
+static int pack_ckpt_running = 0, pack_ckpt_stop = 0, pack_ckpt_wanted = 0;
+static pthread_mutex_t pack_ckpt_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pack_ckpt_cond = PTHREAD_COND_INITIALIZER;
+
+static void *pack_checkpointer(void *args);
+
+static inline unsigned int pack_bucket(unsigned char *hash)
+{
+	unsigned int b;
+
+	/* SHA-1 hashes are uniformly distributed; any 4 bytes will do */
+	memcpy(&b, hash, sizeof(b));
+	return b & (PACK_HASH_BUCKETS - 1);
+}
+
+/* must be called with pack_table_lock held */
+static struct pack_entry *pack_search(unsigned char *hash)
+{
+	struct list_head *head, *tmp;
+
+	head = &pack_table[pack_bucket(hash)];
+	list_for_each(tmp, head) {
+		struct pack_entry *entry = list_entry(tmp, struct pack_entry, pe_link);
+		if (memcmp(entry->pe_hash, hash, CAPFS_MAXHASHLENGTH) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Notes a change to the index for the next checkpoint to log.
+ * must be called with pack_table_lock held for writing
+ */
+static void pack_note(int op, unsigned char *hash, int container, off_t offset, int length, int form)
+{
+	struct pack_log_record *rec;
+
+	if (pack_npending == pack_maxpending) {
+		int64_t max = pack_maxpending ? 2 * pack_maxpending : 1024;
+
+		if ((rec = (struct pack_log_record *) realloc(pack_pending, max * sizeof(*rec))) == NULL) {
+			pack_pending_lost = 1;
+			return;
+		}
+		pack_pending = rec;
+		pack_maxpending = max;
+	}
+	rec = &pack_pending[pack_npending++];
+	memset(rec, 0, sizeof(*rec));
+	rec->pl_magic = PACK_LOG_MAGIC;
+	rec->pl_op = op;
+	memcpy(rec->pl_entry.pi_hash, hash, CAPFS_MAXHASHLENGTH);
+	rec->pl_entry.pi_container = container;
+	rec->pl_entry.pi_length = length;
+	rec->pl_entry.pi_form = form;
+	rec->pl_entry.pi_offset = offset;
+	return;
+}
+
+/*
+ * Returns 1 if the chunk was added to the index, 0 if it was there already.
+ * must be called with pack_table_lock held for writing
+ */
+static int pack_insert(unsigned char *hash, int container, off_t offset, int length, int form)
+{
+	struct pack_entry *entry;
+
+	if ((entry = pack_search(hash)) != NULL) {
+		/* duplicate record (e.g. replayed tail); the first copy wins */
+		return 0;
+	}
+	entry = (struct pack_entry *) calloc(1, sizeof(struct pack_entry));
+	if (entry == NULL) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
+		return -ENOMEM;
+	}
+	memcpy(entry->pe_hash, hash, CAPFS_MAXHASHLENGTH);
+	entry->pe_container = container;
+	entry->pe_offset = offset;
+	entry->pe_length = length;
+	entry->pe_form = form;
+	list_add_tail(&entry->pe_link, &pack_table[pack_bucket(hash)]);
+	pack_nentries++;
+	return 1;
+}
+
+/*
+ * Drops the chunk from the index if it is the one at container, offset.
+ * must be called with pack_table_lock held for writing
+ */
+static void pack_unindex(unsigned char *hash, int container, off_t offset)
+{
+	struct pack_entry *entry;
+
+	if ((entry = pack_search(hash)) != NULL
+			&& entry->pe_container == container && entry->pe_offset == offset) {
+		list_del(&entry->pe_link);
+		pack_nentries--;
+		free(entry);
+	}
+	return;
+}
+
+static int pack_open_container(int container, int create)
+{
+	char name[64];
+	int fd, flags = O_RDWR | O_APPEND;
+	struct stat statbuf;
+
+	if (container >= PACK_MAX_CONTAINERS) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "too many pack containers (%d)\n", container);
+		return -ENOSPC;
+	}
+	snprintf(name, 64, PACK_CONTAINER, container);
+	if (create) {
+		flags |= O_CREAT | O_EXCL;
+	}
+	if ((fd = open(name, flags, 0700)) < 0) {
+		return -errno;
+	}
+	if (fstat(fd, &statbuf) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+	pack_containers[container].pc_fd = fd;
+	pack_containers[container].pc_size = statbuf.st_size;
+	return 0;
+}
+
+/*
+ * Scan container records starting at "offset" and add them to the index.
+ * Records of removed chunks are skipped.
+ * A short or corrupt record marks the end of the valid part of the
+ * container (i.e. an append that did not complete), so we truncate there.
+ */
+static int pack_replay_container(int container, off_t offset)
+{
+	struct pack_container *pc = &pack_containers[container];
+	struct pack_record rec;
+	int length, ret, replayed = 0;
+
+	while (offset < pc->pc_size) {
+		if (pc->pc_size - offset < (off_t) sizeof(rec)
+				|| pread(pc->pc_fd, &rec, sizeof(rec), offset) != sizeof(rec)
+				|| (rec.pr_magic != PACK_RECORD_MAGIC && rec.pr_magic != PACK_RECORD_DEAD)
+				|| (length = rec.pr_length & PACK_LENGTH_MASK) > CAPFS_CHUNK_SIZE
+				|| pc->pc_size - offset - (off_t) sizeof(rec) < (off_t) length) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "truncating torn record in container %d at offset %Ld (size %Ld)\n",
+					container, (long long) offset, (long long) pc->pc_size);
+			if (ftruncate(pc->pc_fd, offset) < 0) {
+				return -errno;
+			}
+			pc->pc_size = offset;
+			break;
+		}
+		if (rec.pr_magic == PACK_RECORD_DEAD) {
+			offset += sizeof(rec) + length;
+			continue;
+		}
+		if ((ret = pack_insert(rec.pr_hash, container, offset + sizeof(rec), length,
+						rec.pr_length >> PACK_FORM_SHIFT)) < 0) {
+			return ret;
+		}
+		/* the next checkpoint logs what the last one missed */
+		if (ret > 0) {
+			pack_note(PACK_LOG_ADD, rec.pr_hash, container, offset + sizeof(rec), length,
+					rec.pr_length >> PACK_FORM_SHIFT);
+		}
+		offset += sizeof(rec) + length;
+		replayed++;
+	}
+	if (replayed > 0) {
+		LOG(stderr, INFO_MSG, SUBSYS_DATA, "replayed %d records from container %d\n", replayed, container);
+	}
+	return 0;
+}
+
+/*
+ * Load the checkpointed index. Fills in the length of each container
+ * that the checkpoint covers, so that only the tails need to be replayed.
+ * A missing or invalid checkpoint is not an error; everything is replayed then.
+ * Returns 0 on success, 1 if the checkpoint is invalid, -errno on failure.
+ */
+static int pack_load_index(off_t *covered, int max)
+{
+	FILE *fp;
+	struct pack_index_header hdr;
+	struct pack_index_entry pie;
+	uint64_t i;
+	uint32_t c;
+	int ret = 0;
+
+	if ((fp = fopen(PACK_INDEX, "r")) == NULL) {
+		return 0;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+			|| hdr.ph_magic != PACK_INDEX_MAGIC || hdr.ph_version != PACK_INDEX_VERSION
+			|| hdr.ph_ncontainers > (uint32_t) max) {
+		LOG(stderr, WARNING_MSG, SUBSYS_DATA, "ignoring invalid pack index %s\n", PACK_INDEX);
+		fclose(fp);
+		return 1;
+	}
+	for (c = 0; c < hdr.ph_ncontainers; c++) {
+		int64_t len;
+		if (fread(&len, sizeof(len), 1, fp) != 1) {
+			goto invalid;
+		}
+		covered[c] = len;
+	}
+	for (i = 0; i < hdr.ph_nentries; i++) {
+		if (fread(&pie, sizeof(pie), 1, fp) != 1
+				|| pie.pi_container < 0 || pie.pi_container >= (int32_t) hdr.ph_ncontainers) {
+			goto invalid;
+		}
+		if ((ret = pack_insert(pie.pi_hash, pie.pi_container, pie.pi_offset, pie.pi_length, pie.pi_form)) < 0) {
+			break;
+		}
+	}
+	fclose(fp);
+	return (ret < 0) ? ret : 0;
+invalid:
+	/* Throw away whatever we loaded and replay all containers from scratch */
+	LOG(stderr, WARNING_MSG, SUBSYS_DATA, "truncated pack index %s, replaying all containers\n", PACK_INDEX);
+	memset(covered, 0, max * sizeof(off_t));
+	fclose(fp);
+	return 1;
+}
+
+/*
+ * Applies the changes logged since the index was written, and extends
+ * the lengths of the containers covered accordingly. Records after the
+ * last PACK_LOG_COMMIT (i.e. of a checkpoint that did not complete) are
+ * ignored, and cut off when the log is next appended to.
+ * Returns 0 on success, 1 if the log is invalid, -errno on failure.
+ */
+static int pack_load_log(off_t *covered, int max)
+{
+	FILE *fp;
+	struct pack_log_record rec;
+	struct pack_index_entry *pie = &rec.pl_entry;
+	int64_t i, n = 0, end = 0;
+	int ret = 0;
+
+	if ((fp = fopen(PACK_LOG, "r")) == NULL) {
+		return (errno == ENOENT) ? 0 : -errno;
+	}
+	while (fread(&rec, sizeof(rec), 1, fp) == 1 && rec.pl_magic == PACK_LOG_MAGIC) {
+		n++;
+		if (rec.pl_op == PACK_LOG_COMMIT) {
+			end = n;
+		}
+	}
+	rewind(fp);
+	for (i = 0; i < end; i++) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+			ret = (errno != 0) ? -errno : -EIO;
+			break;
+		}
+		if (rec.pl_op != PACK_LOG_COMMIT && (pie->pi_container < 0 || pie->pi_container >= max)) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "invalid pack log %s, replaying all containers\n", PACK_LOG);
+			ret = 1;
+			break;
+		}
+		if (rec.pl_op == PACK_LOG_ADD) {
+			if ((ret = pack_insert(pie->pi_hash, pie->pi_container, pie->pi_offset, pie->pi_length, pie->pi_form)) < 0) {
+				break;
+			}
+			ret = 0;
+		}
+		else if (rec.pl_op == PACK_LOG_DEL) {
+			pack_unindex(pie->pi_hash, pie->pi_container, pie->pi_offset);
+		}
+		else if (rec.pl_op == PACK_LOG_COVER && pie->pi_offset > covered[pie->pi_container]) {
+			covered[pie->pi_container] = pie->pi_offset;
+		}
+	}
+	fclose(fp);
+	pack_log_size = end * sizeof(rec);
+	pack_log_records = end;
+	return ret;
+}
+
+static void pack_free_table(void)
+{
+	int i;
+
+	if (pack_table == NULL) {
+		return;
+	}
+	for (i = 0; i < PACK_HASH_BUCKETS; i++) {
+		while (pack_table[i].next != &pack_table[i]) {
+			struct pack_entry *entry = list_entry(pack_table[i].next, struct pack_entry, pe_link);
+			list_del(&entry->pe_link);
+			free(entry);
+		}
+	}
+	while (!list_empty(&pack_dead_list)) {
+		struct pack_dead *dead = list_entry(pack_dead_list.next, struct pack_dead, pd_link);
+		list_del(&dead->pd_link);
+		free(dead);
+	}
+	pack_nentries = 0;
+	pack_ndead = 0;
+	pack_npending = 0;
+	pack_pending_lost = 0;
+}
+
+/*
+ * Initialize the packed store in the current working directory.
+ * Returns 0 on success, -errno on failure.
+ */
+int pack_init(int64_t container_size, int checkpoint_interval)
+{
+	int i, ret;
+
+	pack_container_size = container_size;
+	pack_checkpoint_interval = checkpoint_interval;
+	if (mkdir(PACK_DIR, 0700) < 0 && errno != EEXIST) {
+		ret = -errno;
+		PERROR(SUBSYS_DATA, "pack_init: mkdir");
+		return ret;
+	}
+	pack_table = (struct list_head *) malloc(PACK_HASH_BUCKETS * sizeof(struct list_head));
+	pack_containers = (struct pack_container *) calloc(PACK_MAX_CONTAINERS, sizeof(struct pack_container));
+	pack_covered = (off_t *) calloc(PACK_MAX_CONTAINERS, sizeof(off_t));
+	pack_lengths = (int64_t *) calloc(PACK_MAX_CONTAINERS, sizeof(int64_t));
+	if (pack_table == NULL || pack_containers == NULL || pack_covered == NULL || pack_lengths == NULL) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
+		ret = -ENOMEM;
+		goto err;
+	}
+	for (i = 0; i < PACK_HASH_BUCKETS; i++) {
+		INIT_LIST_HEAD(&pack_table[i]);
+	}
+	pack_need_compact = 0;
+	if ((ret = pack_load_index(pack_covered, PACK_MAX_CONTAINERS)) == 0) {
+		ret = pack_load_log(pack_covered, PACK_MAX_CONTAINERS);
+	}
+	if (ret < 0) {
+		goto err;
+	}
+	else if (ret > 0) {
+		/* the log does not apply to a different index; start both over */
+		pack_free_table();
+		memset(pack_covered, 0, PACK_MAX_CONTAINERS * sizeof(off_t));
+		pack_need_compact = 1;
+	}
+	/* open all existing containers and replay whatever the checkpoints missed */
+	for (i = 0; i < PACK_MAX_CONTAINERS; i++) {
+		if ((ret = pack_open_container(i, 0)) < 0) {
+			if (ret == -ENOENT) {
+				break;
+			}
+			goto err;
+		}
+		pack_ncontainers = i + 1;
+		if (pack_covered[i] > pack_containers[i].pc_size) {
+			/* checkpoint covers data that never made it to disk. Start over */
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "container %d is shorter than its checkpoint, replaying all containers\n", i);
+			pack_free_table();
+			memset(pack_covered, 0, PACK_MAX_CONTAINERS * sizeof(off_t));
+			pack_need_compact = 1;
+			for (; i >= 0; i--) {
+				close(pack_containers[i].pc_fd);
+			}
+			pack_ncontainers = 0;
+			continue;
+		}
+		if ((ret = pack_replay_container(i, pack_covered[i])) < 0) {
+			goto err;
+		}
+	}
+	if (pack_ncontainers == 0 || pack_containers[pack_ncontainers - 1].pc_size >= pack_container_size) {
+		if ((ret = pack_open_container(pack_ncontainers, 1)) < 0) {
+			goto err;
+		}
+		pack_ncontainers++;
+	}
+	/* new checkpoints go after the last complete one */
+	if ((pack_log_fd = open(PACK_LOG, O_WRONLY | O_CREAT | O_APPEND, 0700)) < 0
+			|| ftruncate(pack_log_fd, pack_log_size) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	if (pack_checkpoint_interval > 0) {
+		pack_ckpt_stop = 0;
+		if ((ret = pthread_create(&pack_ckpt_thread, NULL, pack_checkpointer, NULL)) != 0) {
+			ret = -ret;
+			goto err;
+		}
+		pack_ckpt_running = 1;
+	}
+	LOG(stderr, INFO_MSG, SUBSYS_DATA, "packed store: %d containers, %Lu chunks\n",
+			pack_ncontainers, (unsigned long long) pack_nentries);
+	return 0;
+err:
+	errno = -ret;
+	PERROR(SUBSYS_DATA, "pack_init");
+	for (i = 0; i < pack_ncontainers; i++) {
+		close(pack_containers[i].pc_fd);
+	}
+	if (pack_log_fd >= 0) {
+		close(pack_log_fd);
+		pack_log_fd = -1;
+	}
+	pack_ncontainers = 0;
+	pack_free_table();
+	free(pack_table);
+	free(pack_containers);
+	free(pack_covered);
+	free(pack_lengths);
+	free(pack_pending);
+	pack_table = NULL;
+	pack_containers = NULL;
+	pack_covered = NULL;
+	pack_lengths = NULL;
+	pack_pending = NULL;
+	pack_maxpending = 0;
+	return ret;
+}
+
+/*
+ * Gives back the space of the removed chunks on the dead list. Unless the
+ * checkpoint that dropped them from the index made it to disk (done == 0),
+ * they are put back on the pack_dead_list for the next one.
+ * must be called with pack_ckpt_mutex held
+ */
+static void pack_release_dead(struct list_head *dead, int done)
+{
+	char name[64];
+	int fd = -1, container = -1;
+
+	if (!done) {
+		pthread_rwlock_wrlock(&pack_table_lock);
+		while (!list_empty(dead)) {
+			struct pack_dead *pd = list_entry(dead->next, struct pack_dead, pd_link);
+			list_del(&pd->pd_link);
+			list_add_tail(&pd->pd_link, &pack_dead_list);
+			pack_ndead++;
+		}
+		pthread_rwlock_unlock(&pack_table_lock);
+		return;
+	}
+	while (!list_empty(dead)) {
+		struct pack_dead *pd = list_entry(dead->next, struct pack_dead, pd_link);
+		uint32_t magic = PACK_RECORD_DEAD;
+
+		list_del(&pd->pd_link);
+		/* container descriptors are O_APPEND, so use one of our own for rewriting records */
+		if (pd->pd_container != container) {
+			if (fd >= 0) {
+				fdatasync(fd);
+				close(fd);
+			}
+			container = pd->pd_container;
+			snprintf(name, 64, PACK_CONTAINER, container);
+			if ((fd = open(name, O_WRONLY)) < 0) {
+				LOG(stderr, WARNING_MSG, SUBSYS_DATA, "could not open pack container %d: %s\n",
+						container, strerror(errno));
+			}
+		}
+		if (fd >= 0) {
+			/* mark the record first, a replay must not resurrect a chunk of zeroes */
+			if (pwrite(fd, &magic, sizeof(magic), pd->pd_offset - sizeof(struct pack_record)) == sizeof(magic)) {
+				fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pd->pd_offset, pd->pd_length);
+			}
+		}
+		free(pd);
+	}
+	if (fd >= 0) {
+		fdatasync(fd);
+		close(fd);
+	}
+	return;
+}
+
+/* Returns 0 if all len bytes of buf were written to fd, -errno otherwise */
+static int pack_write_all(int fd, void *buf, size_t len)
+{
+	char *ptr = (char *) buf;
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(fd, ptr, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		ptr += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/*
+ * Appends the nrecs changes in recs to the log, along with how far the
+ * containers that grew are now covered, and syncs it.
+ * must be called with pack_ckpt_mutex held
+ */
+static int pack_log_append(struct pack_log_record *recs, int64_t nrecs, int ncontainers)
+{
+	struct pack_log_record *tail;
+	int i, n = 0, ret;
+
+	if ((tail = (struct pack_log_record *) calloc(ncontainers + 1, sizeof(*tail))) == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < ncontainers; i++) {
+		if (pack_lengths[i] > pack_covered[i]) {
+			tail[n].pl_magic = PACK_LOG_MAGIC;
+			tail[n].pl_op = PACK_LOG_COVER;
+			tail[n].pl_entry.pi_container = i;
+			tail[n].pl_entry.pi_offset = pack_lengths[i];
+			n++;
+		}
+	}
+	tail[n].pl_magic = PACK_LOG_MAGIC;
+	tail[n].pl_op = PACK_LOG_COMMIT;
+	n++;
+	if ((ret = pack_write_all(pack_log_fd, recs, nrecs * sizeof(*recs))) == 0
+			&& (ret = pack_write_all(pack_log_fd, tail, n * sizeof(*tail))) == 0
+			&& fdatasync(pack_log_fd) < 0) {
+		ret = -errno;
+	}
+	free(tail);
+	if (ret < 0) {
+		/* don't leave a partial checkpoint behind */
+		ftruncate(pack_log_fd, pack_log_size);
+		return ret;
+	}
+	pack_log_size += (nrecs + n) * sizeof(*recs);
+	pack_log_records += nrecs + n;
+	return 0;
+}
+
+/*
+ * Writes out the whole index to PACK_INDEX and empties the log. The index
+ * is copied out a few buckets at a time, so that puts and gets are only
+ * held up briefly. It covers the containers up to pack_lengths, and leaves
+ * out chunks appended beyond that, which are replayed from their containers.
+ * Changes made while it is copied out go to the log afterwards; applying
+ * them again to an index that already has them does no harm.
+ * must be called with pack_ckpt_mutex held
+ */
+static int pack_compact(int ncontainers, uint64_t *nentries)
+{
+	struct pack_index_header hdr;
+	struct pack_index_entry *entries;
+	char tmpname[64];
+	uint64_t n = 0;
+	int64_t max = 4096, count;
+	int i, b, fd, ret = 0;
+
+	if ((entries = (struct pack_index_entry *) malloc(max * sizeof(*entries))) == NULL) {
+		return -ENOMEM;
+	}
+	snprintf(tmpname, 64, "%s.tmp", PACK_INDEX);
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0700)) < 0) {
+		free(entries);
+		return -errno;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ph_magic = PACK_INDEX_MAGIC;
+	hdr.ph_version = PACK_INDEX_VERSION;
+	hdr.ph_ncontainers = ncontainers;
+	/* the number of entries is filled in at the end */
+	if ((ret = pack_write_all(fd, &hdr, sizeof(hdr))) < 0
+			|| (ret = pack_write_all(fd, pack_lengths, ncontainers * sizeof(int64_t))) < 0) {
+		goto out;
+	}
+	for (b = 0; b < PACK_HASH_BUCKETS && ret == 0; b += PACK_COMPACT_BUCKETS) {
+		pthread_rwlock_rdlock(&pack_table_lock);
+		for (count = 0, i = b; i < b + PACK_COMPACT_BUCKETS; i++) {
+			struct list_head *tmp;
+
+			list_for_each(tmp, &pack_table[i]) {
+				struct pack_entry *entry = list_entry(tmp, struct pack_entry, pe_link);
+
+				if (entry->pe_container >= ncontainers
+						|| entry->pe_offset + entry->pe_length > pack_lengths[entry->pe_container]) {
+					continue;
+				}
+				if (count == max) {
+					struct pack_index_entry *more;
+
+					if ((more = (struct pack_index_entry *) realloc(entries, 2 * max * sizeof(*entries))) == NULL) {
+						ret = -ENOMEM;
+						break;
+					}
+					entries = more;
+					max *= 2;
+				}
+				memcpy(entries[count].pi_hash, entry->pe_hash, CAPFS_MAXHASHLENGTH);
+				entries[count].pi_container = entry->pe_container;
+				entries[count].pi_length = entry->pe_length;
+				entries[count].pi_form = entry->pe_form;
+				entries[count].pi_offset = entry->pe_offset;
+				count++;
+			}
+		}
+		pthread_rwlock_unlock(&pack_table_lock);
+		if (ret == 0) {
+			ret = pack_write_all(fd, entries, count * sizeof(*entries));
+			n += count;
+		}
+	}
+	hdr.ph_nentries = n;
+	if (ret == 0 && pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		ret = (errno != 0) ? -errno : -EIO;
+	}
+	if (ret == 0 && fsync(fd) < 0) {
+		ret = -errno;
+	}
+out:
+	close(fd);
+	free(entries);
+	if (ret == 0 && rename(tmpname, PACK_INDEX) < 0) {
+		ret = -errno;
+	}
+	if (ret < 0) {
+		unlink(tmpname);
+		return ret;
+	}
+	/* the changes in the log are all in the index now */
+	if (ftruncate(pack_log_fd, 0) < 0 || fdatasync(pack_log_fd) < 0) {
+		LOG(stderr, WARNING_MSG, SUBSYS_DATA, "could not empty pack log: %s\n", strerror(errno));
+	}
+	pack_log_size = 0;
+	pack_log_records = 0;
+	*nentries = n;
+	return 0;
+}
+
+/*
+ * Checkpoints the index: the changes made to it since the last checkpoint
+ * are appended to PACK_LOG, or, once the log has grown longer than the index,
+ * the whole index is written out to PACK_INDEX (see pack_compact()).
+ * The containers that were appended to are synced first, without any of the
+ * locks held, so that a checkpoint never covers data that is not on stable storage.
+ */
+int pack_checkpoint(void)
+{
+	struct pack_log_record *recs;
+	struct list_head dead;
+	int64_t nrecs;
+	uint64_t n = 0;
+	int i, ncontainers, compact, grown = 0, ret = 0;
+
+	if (pack_table == NULL) {
+		return 0;
+	}
+	INIT_LIST_HEAD(&dead);
+	pthread_mutex_lock(&pack_ckpt_mutex);
+	pthread_mutex_lock(&pack_append_mutex);
+	pthread_rwlock_wrlock(&pack_table_lock);
+	ncontainers = pack_ncontainers;
+	for (i = 0; i < ncontainers; i++) {
+		pack_lengths[i] = pack_containers[i].pc_size;
+	}
+	recs = pack_pending;
+	nrecs = pack_npending;
+	pack_pending = NULL;
+	pack_npending = pack_maxpending = 0;
+	compact = pack_need_compact || pack_pending_lost
+		|| pack_log_records + nrecs > 2 * pack_nentries + PACK_LOG_COMPACT_SLACK;
+	pack_pending_lost = 0;
+	/* the space of chunks removed so far can go once this checkpoint is on disk */
+	list_splice(&pack_dead_list, &dead);
+	INIT_LIST_HEAD(&pack_dead_list);
+	pack_ndead = 0;
+	pack_puts_since_checkpoint = 0;
+	pthread_rwlock_unlock(&pack_table_lock);
+	pthread_mutex_unlock(&pack_append_mutex);
+
+	for (i = 0; i < ncontainers && ret == 0; i++) {
+		if (pack_lengths[i] > pack_covered[i]) {
+			grown = 1;
+			if (fdatasync(pack_containers[i].pc_fd) < 0) {
+				ret = -errno;
+			}
+		}
+	}
+	if (ret == 0) {
+		if (compact) {
+			ret = pack_compact(ncontainers, &n);
+		}
+		else if (nrecs > 0 || grown || !list_empty(&dead)) {
+			ret = pack_log_append(recs, nrecs, ncontainers);
+		}
+	}
+	if (ret == 0) {
+		for (i = 0; i < ncontainers; i++) {
+			pack_covered[i] = pack_lengths[i];
+		}
+		pack_need_compact = 0;
+	}
+	else {
+		/* the changes are lost; the next checkpoint writes out the whole index instead */
+		pack_need_compact = 1;
+	}
+	pack_release_dead(&dead, ret == 0);
+	pthread_mutex_unlock(&pack_ckpt_mutex);
+	free(recs);
+	if (ret < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "pack_checkpoint failed: %s\n", strerror(-ret));
+	}
+	else if (compact) {
+		LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "checkpointed %Lu pack index entries\n", (unsigned long long) n);
+	}
+	else {
+		LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "logged %Ld pack index changes\n", (long long) nrecs);
+	}
+	return ret;
+}
+
+/* Takes checkpoints when pack_put() or pack_remove() ask for one */
+static void *pack_checkpointer(void *args)
+{
+	pthread_mutex_lock(&pack_ckpt_wait_mutex);
+	while (!pack_ckpt_stop) {
+		if (!pack_ckpt_wanted) {
+			pthread_cond_wait(&pack_ckpt_cond, &pack_ckpt_wait_mutex);
+			continue;
+		}
+		pack_ckpt_wanted = 0;
+		pthread_mutex_unlock(&pack_ckpt_wait_mutex);
+		pack_checkpoint();
+		pthread_mutex_lock(&pack_ckpt_wait_mutex);
+	}
+	pthread_mutex_unlock(&pack_ckpt_wait_mutex);
+	return NULL;
+}
+
+/* Asks the checkpointer thread for a checkpoint */
+static void pack_want_checkpoint(void)
+{
+	pthread_mutex_lock(&pack_ckpt_wait_mutex);
+	pack_ckpt_wanted = 1;
+	pthread_cond_signal(&pack_ckpt_cond);
+	pthread_mutex_unlock(&pack_ckpt_wait_mutex);
+	return;
+}
+
+void pack_finalize(void)
+{
+	int i;
+
+	if (pack_table == NULL) {
+		return;
+	}
+	if (pack_ckpt_running) {
+		pthread_mutex_lock(&pack_ckpt_wait_mutex);
+		pack_ckpt_stop = 1;
+		pthread_cond_signal(&pack_ckpt_cond);
+		pthread_mutex_unlock(&pack_ckpt_wait_mutex);
+		pthread_join(pack_ckpt_thread, NULL);
+		pack_ckpt_running = 0;
+	}
+	pack_checkpoint();
+	for (i = 0; i < pack_ncontainers; i++) {
+		close(pack_containers[i].pc_fd);
+	}
+	close(pack_log_fd);
+	pack_log_fd = -1;
+	pack_ncontainers = 0;
+	pack_free_table();
+	free(pack_table);
+	free(pack_containers);
+	free(pack_covered);
+	free(pack_lengths);
+	free(pack_pending);
+	pack_table = NULL;
+	pack_containers = NULL;
+	pack_covered = NULL;
+	pack_lengths = NULL;
+	pack_pending = NULL;
+	pack_maxpending = 0;
+	return;
+}
+
+/*
+ * Find where the chunk lives. The returned fd belongs to the store and
+ * must not be closed by the caller. It can be used with pread()/sendfile()
+ * at the returned offset. *form is set to the form it was stored with.
+ * Returns 0 on success, -ENOENT if we don't have the chunk.
+ */
+int pack_locate(unsigned char *hash, int *fd, off_t *offset, int *length, int *form)
+{
+	struct pack_entry *entry;
+	int ret = -ENOENT;
+
+	pthread_rwlock_rdlock(&pack_table_lock);
+	if ((entry = pack_search(hash)) != NULL) {
+		*fd = pack_containers[entry->pe_container].pc_fd;
+		*offset = entry->pe_offset;
+		*length = entry->pe_length;
+		*form = entry->pe_form;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&pack_table_lock);
+	return ret;
+}
+
+/*
+ * Read the chunk into buf, and set *form to the form it was stored with.
+ * Returns number of bytes read on success, -errno on failure.
+ */
+int pack_get(unsigned char *hash, char *buf, int size, int *form)
+{
+	int fd, length, ret;
+	off_t offset;
+
+	if ((ret = pack_locate(hash, &fd, &offset, &length, form)) < 0) {
+		return ret;
+	}
+	if (length > size) {
+		length = size;
+	}
+	if ((ret = pread(fd, buf, length, offset)) < 0) {
+		return -errno;
+	}
+	return ret;
+}
+
+/*
+ * Append the chunk to the current container unless it is already present.
+ * form is a small number that the caller uses to tell how the chunk was
+ * stored; the store only keeps it alongside the chunk for pack_locate().
+ * Returns number of bytes stored on success, -errno on failure.
+ */
+int pack_put(unsigned char *hash, char *buf, int size, int form)
+{
+	struct pack_record rec;
+	struct pack_container *pc;
+	struct iovec vec[2];
+	off_t offset;
+	int fd, length, oform, container, ret, do_checkpoint = 0;
+	ssize_t wsize;
+
+	if (size < 0 || size > CAPFS_CHUNK_SIZE || form < 0 || form > 0xff) {
+		return -EINVAL;
+	}
+	/* content-addressed; if we have it, we are done */
+	if (pack_locate(hash, &fd, &offset, &length, &oform) == 0) {
+		return size;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.pr_magic = PACK_RECORD_MAGIC;
+	rec.pr_length = ((uint32_t) form << PACK_FORM_SHIFT) | size;
+	memcpy(rec.pr_hash, hash, CAPFS_MAXHASHLENGTH);
+	vec[0].iov_base = &rec;
+	vec[0].iov_len = sizeof(rec);
+	vec[1].iov_base = buf;
+	vec[1].iov_len = size;
+
+	pthread_mutex_lock(&pack_append_mutex);
+	/* somebody may have beaten us to it */
+	if (pack_locate(hash, &fd, &offset, &length, &oform) == 0) {
+		pthread_mutex_unlock(&pack_append_mutex);
+		return size;
+	}
+	container = pack_ncontainers - 1;
+	pc = &pack_containers[container];
+	offset = pc->pc_size;
+	wsize = writev(pc->pc_fd, vec, 2);
+	if (wsize != (ssize_t) (sizeof(rec) + size)) {
+		ret = (wsize < 0) ? -errno : -EIO;
+		/* don't leave a partial record behind */
+		ftruncate(pc->pc_fd, offset);
+		pthread_mutex_unlock(&pack_append_mutex);
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "pack_put: append to container %d failed: %s\n",
+				container, strerror(-ret));
+		return ret;
+	}
+	pc->pc_size += wsize;
+	pthread_rwlock_wrlock(&pack_table_lock);
+	if ((ret = pack_insert(hash, container, offset + sizeof(rec), size, form)) > 0) {
+		pack_note(PACK_LOG_ADD, hash, container, offset + sizeof(rec), size, form);
+	}
+	pthread_rwlock_unlock(&pack_table_lock);
+	/* seal the container if it is full */
+	if (ret >= 0 && pc->pc_size >= pack_container_size) {
+		int err;
+
+		if ((err = pack_open_container(pack_ncontainers, 1)) == 0) {
+			pack_ncontainers++;
+		}
+		else {
+			/* keep appending to the current one; we will retry on the next put */
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not create pack container %d: %s\n",
+					pack_ncontainers, strerror(-err));
+		}
+	}
+	if (pack_checkpoint_interval > 0 && ++pack_puts_since_checkpoint >= pack_checkpoint_interval) {
+		pack_puts_since_checkpoint = 0;
+		do_checkpoint = 1;
+	}
+	pthread_mutex_unlock(&pack_append_mutex);
+	if (do_checkpoint) {
+		pack_want_checkpoint();
+	}
+	return (ret < 0) ? ret : size;
+}
+
+/*
+ * Drop the chunk from the store. Its space is reclaimed at the next checkpoint.
+ * Returns 0 on success, -ENOENT if we don't have the chunk.
+ */
+int pack_remove(unsigned char *hash)
+{
+	struct pack_entry *entry;
+	struct pack_dead *dead;
+	int do_checkpoint = 0;
+
+	if ((dead = (struct pack_dead *) calloc(1, sizeof(struct pack_dead))) == NULL) {
+		return -ENOMEM;
+	}
+	pthread_rwlock_wrlock(&pack_table_lock);
+	if ((entry = pack_search(hash)) == NULL) {
+		pthread_rwlock_unlock(&pack_table_lock);
+		free(dead);
+		return -ENOENT;
+	}
+	list_del(&entry->pe_link);
+	pack_nentries--;
+	pack_note(PACK_LOG_DEL, hash, entry->pe_container, entry->pe_offset, entry->pe_length, entry->pe_form);
+	dead->pd_container = entry->pe_container;
+	dead->pd_offset = entry->pe_offset;
+	dead->pd_length = entry->pe_length;
+	list_add_tail(&dead->pd_link, &pack_dead_list);
+	if (pack_checkpoint_interval > 0 && ++pack_ndead >= pack_checkpoint_interval) {
+		do_checkpoint = 1;
+	}
+	pthread_rwlock_unlock(&pack_table_lock);
+	free(entry);
+	if (do_checkpoint) {
+		pack_want_checkpoint();
+	}
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Packed chunk store for the CAS server.
+ */
+#ifndef _IOD_PACK_H
+#define _IOD_PACK_H
+
+#include <sys/types.h>
+#include "capfs_config.h"
+
+/* directory (relative to the datadir) that holds the containers and index */
+#define PACK_DIR 			"capfs.pack"
+#define PACK_INDEX 		PACK_DIR "/index"
+#define PACK_LOG 			PACK_DIR "/log"
+#define PACK_CONTAINER 	PACK_DIR "/cnt.%05d"
+
+/* hard limit on the number of container files */
+#define PACK_MAX_CONTAINERS 65536
+/* number of buckets in the in-memory hash -> location index */
+#define PACK_HASH_BUCKETS   (1 << 20)
+/* buckets of the index copied out at a time when it is written out in full */
+#define PACK_COMPACT_BUCKETS 4096
+/* the index is written out in full once the log has this many records more than twice its entries */
+#define PACK_LOG_COMPACT_SLACK 65536
+
+extern int  pack_init(int64_t container_size, int checkpoint_interval);
+extern void pack_finalize(void);
+extern int  pack_checkpoint(void);
+extern int  pack_locate(unsigned char *hash, int *fd, off_t *offset, int *length, int *form);
+extern int  pack_get(unsigned char *hash, char *buf, int size, int *form);
+extern int  pack_put(unsigned char *hash, char *buf, int size, int form);
+extern int  pack_remove(unsigned char *hash);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -6,6 +6,7 @@ typedef string dirname<CAPFS_MAXNAMELEN>;
 
 typedef sha1hash get_hashes<CAPFS_MAXHASHES>;
 typedef sha1hash put_hashes<CAPFS_MAXHASHES>;
+typedef sha1hash have_hashes<CAPFS_MAXHASHES>;
 
 struct get_req {
 	get_hashes h;
@@ -31,6 +32,22 @@ struct put_resp {
 	int64_t      put_time;
 };
 
+/*
+ * Existence query. Bit i of the returned bitmap is set if the
+ * server already stores the chunk named by the i-th hash, in which 
+ * case the client need not ship its contents with a subsequent CAPFS_PUT.
+ */
+typedef opaque have_bitmap<CAPFS_MAXHASHBITMAP>;
+
+struct have_req {
+	have_hashes h;
+};
+
+struct have_resp {
+	int         status;
+	have_bitmap bitmap;
+};
+
 struct iod_statfs {
     int f_type;
     int f_bsize;
@@ -48,10 +65,49 @@ struct cas_stat_resp {
 	iod_statfs sfs;
 };
 
+struct iod_stat_resp {
+	int         status;
+	uint64_t    cache_hits;
+	uint64_t    cache_misses;
+	uint64_t    cache_evictions;
+	uint64_t    cache_entries;
+	uint64_t    cache_bytes;
+	uint64_t    cache_capacity;
+	uint64_t    codec_packed;
+	uint64_t    codec_skipped;
+	uint64_t    codec_raw_bytes;
+	uint64_t    codec_stored_bytes;
+	uint64_t    codec_pack_usecs;
+	uint64_t    codec_unpack_usecs;
+	uint64_t    ref_chunks;
+	uint64_t    ref_pending;
+	uint64_t    ref_reclaimed;
+	uint64_t    cdc_chunks;
+	uint64_t    cdc_bytes;
+	uint64_t    cdc_new_bytes;
+};
+
+/*
+ * Reference count updates from the meta-server. The count of the chunk
+ * named by the i-th hash changes by the i-th delta.
+ */
+typedef int ref_deltas<CAPFS_MAXHASHES>;
+typedef sha1hash ref_hashes<CAPFS_MAXHASHES>;
+
+struct refs_req {
+	ref_hashes  h;
+	ref_deltas  deltas;
+};
+
+struct refs_resp {
+	int         status;
+};
+
 /* 
  * PLEASE DO NOT USE THE REMOVEALL RPC request, unless you know what you are doing!!! 
  * This will delete all the hashes rooted at the top-level directories named by "name".
- * This will be phased out once Jason's garbage collection code is done and well-tested.
+ * Unreferenced chunks are reclaimed by the iods themselves (see CAPFS_REFS), so
+ * this is only needed to wipe chunks stored before reference counting was in place.
  */
 
 struct removeall_req {
@@ -68,6 +124,9 @@ program CAPFS_IOD {
 		put_resp CAPFS_PUT(put_req) = 2;
 		cas_stat_resp CAPFS_DSTATFS(void) = 3;
 		removeall_resp CAPFS_REMOVEALL(removeall_req) = 4;
+		have_resp CAPFS_HAVE(have_req) = 5;
+		iod_stat_resp CAPFS_IODSTAT(void) = 6;
+		refs_resp CAPFS_REFS(refs_req) = 7;
 	} = 1;
 } = 0x20000003;
 
@@ -33,6 +33,10 @@ struct iod_entry {
 	CLIENT *clnt;
 	int    sockfd;
 	struct sockaddr_in our_addr;
+	/* set if the iod does not know CAS_GET_SIZED_REQ */
+	int    old_get;
+	/* set if the iod does not know have requests */
+	int    old_have;
 };
 
 static iod_entry iod_table[MAXIODS];
@@ -123,6 +127,8 @@ static CLIENT** get_clnt_handle(int tcp, struct sockaddr_in *iodaddr)
 		id = find_unused_id();
 		iod_host = inet_ntoa(iodaddr->sin_addr);
 		iod_table[id].used = USED;
+		iod_table[id].old_get = 0;
+		iod_table[id].old_have = 0;
 		memcpy(&iod_table[id].addr, iodaddr, sizeof(struct sockaddr_in));
 		iod_count++;
 		/* fill in the program number for the given host, port number combinations */
@@ -241,6 +247,8 @@ static int* get_clnt_sock(struct sockaddr_in *addr)
 		id = find_unused_id();
 		iod_table[id].used = USED;
 		iod_table[id].sockfd = sockNum;
+		iod_table[id].old_get = 0;
+		iod_table[id].old_have = 0;
 		memcpy(&iod_table[id].addr, addr, sizeof(struct sockaddr_in));
 		iod_count++;
 		set_sockopt(sockNum, SO_REUSEADDR, 1);
@@ -348,7 +356,7 @@ int cas_ping(int use_sockets, int tcp, struct sockaddr_in *addr)
 		numSent = blockingSend(*psock, &header, sizeof(cas_header));
 		if(numSent != sizeof(cas_header))
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n",numSent,sizeof(cas_header));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n",numSent,(int) sizeof(cas_header));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -356,7 +364,7 @@ int cas_ping(int use_sockets, int tcp, struct sockaddr_in *addr)
 		numSent = brecv(*psock, &reply_header, sizeof(cas_reply));
 		if (numSent != sizeof(cas_reply))
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, sizeof(cas_reply));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(cas_reply));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -435,7 +443,7 @@ int cas_statfs(int use_sockets, int tcp, struct sockaddr_in *addr, struct statfs
 		numSent = blockingSend(*psock, &header, sizeof(cas_header));
 		if(numSent != sizeof(cas_header))
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, sizeof(cas_header));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, (int) sizeof(cas_header));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -443,7 +451,7 @@ int cas_statfs(int use_sockets, int tcp, struct sockaddr_in *addr, struct statfs
 		numSent = brecv(*psock, &reply_header, sizeof(cas_reply));
 		if (numSent != sizeof(cas_reply))
 		{		
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, sizeof(cas_reply));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(cas_reply));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -468,6 +476,128 @@ int cas_statfs(int use_sockets, int tcp, struct sockaddr_in *addr, struct statfs
 	}
 }
 
+int cas_iod_stat(int use_sockets, int tcp, struct sockaddr_in *addr, struct cas_iod_stat *stat)
+{
+	if (use_sockets == 0)
+	{
+		CLIENT **clnt = NULL;
+		enum clnt_stat result;
+		iod_stat_resp resp;
+
+		memset(&resp, 0, sizeof(resp));
+		clnt = get_clnt_handle(tcp, addr);
+		if (clnt == NULL) {
+			errno = EINVAL;
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "cas_iod_stat: No registered CAS RPC service on the specified port!\n");
+			return -1;
+		}
+		if (*clnt == NULL) {
+			errno = ECONNREFUSED;
+			return -1;
+		}
+		result = capfs_iodstat_1(&resp, *clnt);
+		if (result != RPC_SUCCESS) {
+			/* older servers do not know about this call */
+			if (result == RPC_PROCUNAVAIL) {
+				put_clnt_handle(clnt, 0);
+				errno = EOPNOTSUPP;
+				return -1;
+			}
+			/* make it reconnect */
+			put_clnt_handle(clnt, 1);
+			errno = convert_to_errno(result);
+			return -1;
+		}
+		if (resp.status) {
+			put_clnt_handle(clnt, 0);
+			errno = -resp.status;
+			return -1;
+		}
+		stat->is_cache_hits = resp.cache_hits;
+		stat->is_cache_misses = resp.cache_misses;
+		stat->is_cache_evictions = resp.cache_evictions;
+		stat->is_cache_entries = resp.cache_entries;
+		stat->is_cache_bytes = resp.cache_bytes;
+		stat->is_cache_capacity = resp.cache_capacity;
+		stat->is_codec_packed = resp.codec_packed;
+		stat->is_codec_skipped = resp.codec_skipped;
+		stat->is_codec_raw_bytes = resp.codec_raw_bytes;
+		stat->is_codec_stored_bytes = resp.codec_stored_bytes;
+		stat->is_codec_pack_usecs = resp.codec_pack_usecs;
+		stat->is_codec_unpack_usecs = resp.codec_unpack_usecs;
+		stat->is_ref_chunks = resp.ref_chunks;
+		stat->is_ref_pending = resp.ref_pending;
+		stat->is_ref_reclaimed = resp.ref_reclaimed;
+		stat->is_cdc_chunks = resp.cdc_chunks;
+		stat->is_cdc_bytes = resp.cdc_bytes;
+		stat->is_cdc_new_bytes = resp.cdc_new_bytes;
+		put_clnt_handle(clnt, 0);
+		return 0;
+	}
+	else
+	{
+		int *psock = NULL;
+		int numSent;
+		cas_header header;
+		cas_reply reply_header;
+
+		/* We will use TCP only in case of sockets regardless */
+		psock = get_clnt_sock(addr);
+		if (psock == NULL)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "cas_iod_stat: No registered CAS listener "
+					"on the specified port! %s\n", strerror(errno));
+			return -1;
+		}
+		header.requestID = 0;
+		header.opcode = CAS_IODSTAT_REQ;
+		numSent = blockingSend(*psock, &header, sizeof(cas_header));
+		if(numSent != sizeof(cas_header))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, (int) sizeof(cas_header));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		numSent = brecv(*psock, &reply_header, sizeof(cas_reply));
+		if (numSent != sizeof(cas_reply))
+		{		
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(cas_reply));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		if (reply_header.opcode != CAS_IODSTAT_REPLY)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad opcode %d instead of %d\n", reply_header.opcode, CAS_IODSTAT_REPLY);
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			/* older servers do not know about this request */
+			errno = (reply_header.opcode == CAS_UNKNOWN_OPCODE) ? EOPNOTSUPP : EIO;
+			return -1;
+		}
+		/* the counters follow the header */
+		if (reply_header.nextMessageSize != (int) sizeof(struct cas_iod_stat))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "iod stats of %d bytes instead of %d\n",
+					reply_header.nextMessageSize, (int) sizeof(struct cas_iod_stat));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		numSent = brecv(*psock, stat, sizeof(struct cas_iod_stat));
+		if (numSent != (int) sizeof(struct cas_iod_stat))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(struct cas_iod_stat));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		put_clnt_sock(psock, 0);
+		return 0;
+	}
+}
+
 int cas_removeall(int use_sockets, int tcp, struct sockaddr_in *addr, char *dirname)
 {
 	if (use_sockets == 0)
@@ -535,7 +665,7 @@ int cas_removeall(int use_sockets, int tcp, struct sockaddr_in *addr, char *dirn
 		numSent = blockingSend(*psock, &header, sizeof(cas_header));
 		if(numSent != sizeof(cas_header))
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, sizeof(cas_header));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, (int) sizeof(cas_header));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -551,7 +681,7 @@ int cas_removeall(int use_sockets, int tcp, struct sockaddr_in *addr, char *dirn
 		numSent = brecv(*psock, &reply_header, sizeof(cas_reply));
 		if (numSent != sizeof(cas_reply)) 
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, sizeof(cas_reply));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(cas_reply));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -836,7 +966,7 @@ int cas_put(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 		numSent = blockingSend(*psock, &header, sizeof(cas_header));
 		if (numSent != sizeof(cas_header))
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, sizeof(cas_header));
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, (int) sizeof(cas_header));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -894,7 +1024,7 @@ int cas_put(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 		if (numSent != sizeof(cas_reply))
 		{
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "brecv (put) did not receive response! "
-					"%d bytes instead of %d: %s\n", numSent, sizeof(cas_reply), 
+					"%d bytes instead of %d: %s\n", numSent, (int) sizeof(cas_reply), 
 					(numSent < 0) ? strerror(errno) : "timed out");
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
@@ -929,6 +1059,286 @@ int cas_put(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 	}
 }
 
+/* does the iod at addr lack have requests? */
+static int iod_old_have(struct sockaddr_in *addr)
+{
+	int id, old = 0;
+
+	pthread_mutex_lock(&iod_mutex);
+	if ((id = find_id_of_host(addr)) >= 0) {
+		old = iod_table[id].old_have;
+	}
+	pthread_mutex_unlock(&iod_mutex);
+	return old;
+}
+
+static void iod_set_old_have(struct sockaddr_in *addr)
+{
+	int id;
+
+	pthread_mutex_lock(&iod_mutex);
+	if ((id = find_id_of_host(addr)) >= 0) {
+		iod_table[id].old_have = 1;
+	}
+	pthread_mutex_unlock(&iod_mutex);
+	LOG(stderr, WARNING_MSG, SUBSYS_DATA, "iod %s:%d does not know have requests, no longer asking it\n",
+			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	return;
+}
+
+/*
+ * Query the server for the existence of count chunks named by hashes.
+ * On success, bit i of bitmap (which must be able to hold count bits)
+ * is set if the server already stores the i-th chunk.
+ * Returns 0 on success and -1 on error. errno is set to EOPNOTSUPP
+ * if the server does not understand this request; it is not asked again.
+ */
+int cas_have(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes,
+		int count, unsigned char *bitmap)
+{
+	if (hashes == NULL || bitmap == NULL || count <= 0 || count > CAPFS_MAXHASHES) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "Invalid parameter to cas_have\n");
+		errno = EFAULT;
+		return -1;
+	}
+	if (iod_old_have(addr)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (use_sockets == 0)
+	{
+		have_req req;
+		have_resp resp;
+		CLIENT **clnt = NULL;
+		enum clnt_stat result;
+
+		memset(&req, 0, sizeof(req));
+		memset(&resp, 0, sizeof(resp));
+		req.h.have_hashes_len = count;
+		req.h.have_hashes_val = (sha1hash *) hashes;
+		/* Decode the bitmap directly into the caller's buffer */
+		resp.bitmap.have_bitmap_len = CAS_HAVE_BITMAP_SIZE(count);
+		resp.bitmap.have_bitmap_val = (char *) bitmap;
+		clnt = get_clnt_handle(tcp, addr);
+		if (clnt == NULL) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "cas_have: No registered CAS RPC service on the specified port!\n");
+			errno = EINVAL;
+			return -1;
+		}
+		if (*clnt == NULL) {
+			errno = ECONNREFUSED;
+			return -1;
+		}
+		result = capfs_have_1(req, &resp, *clnt);
+		if (result != RPC_SUCCESS) {
+			/* make it reconnect */
+			put_clnt_handle(clnt, 1);
+			if (result == RPC_PROCUNAVAIL) {
+				iod_set_old_have(addr);
+				errno = EOPNOTSUPP;
+			}
+			else {
+				errno = convert_to_errno(result);
+			}
+			return -1;
+		}
+		put_clnt_handle(clnt, 0);
+		if (resp.status) {
+			errno = -resp.status;
+			return -1;
+		}
+		if (resp.bitmap.have_bitmap_len != CAS_HAVE_BITMAP_SIZE(count)) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "cas_have: bitmap length %d instead of %d\n",
+					resp.bitmap.have_bitmap_len, CAS_HAVE_BITMAP_SIZE(count));
+			errno = EREMOTEIO;
+			return -1;
+		}
+		return 0;
+	}
+	else
+	{
+		int *psock = NULL;
+		int numSent;
+		cas_header header;
+		cas_reply reply_header;
+		static int have_id;
+
+		errno = EIO;
+		psock = get_clnt_sock(addr);
+		if (psock == NULL)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "cas_have: No registered CAS listener "
+					"on the specified port %s\n", strerror(errno));
+			return -1;
+		}
+		lock_seq();
+		header.requestID = have_id++;
+		unlock_seq();
+		header.opcode = CAS_HAVE_REQ;
+		header.req.have.numHashes = count;
+		numSent = blockingSend(*psock, &header, sizeof(cas_header));
+		if (numSent != sizeof(cas_header))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, (int) sizeof(cas_header));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		numSent = blockingSend(*psock, hashes, count * CAPFS_MAXHASHLENGTH);
+		if (numSent != (count * CAPFS_MAXHASHLENGTH))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n", numSent, (count * CAPFS_MAXHASHLENGTH));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		numSent = brecv(*psock, &reply_header, sizeof(cas_reply));
+		if (numSent != sizeof(cas_reply))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(cas_reply));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		if (reply_header.opcode != CAS_HAVE_REPLY)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad opcode %d instead of %d\n", reply_header.opcode, CAS_HAVE_REPLY);
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			if (reply_header.opcode == CAS_UNKNOWN_OPCODE) {
+				iod_set_old_have(addr);
+				errno = EOPNOTSUPP;
+			}
+			else {
+				errno = EIO;
+			}
+			return -1;
+		}
+		if (reply_header.errorCode != NO_ERROR
+				|| reply_header.nextMessageSize != CAS_HAVE_BITMAP_SIZE(count))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "error code %d, bitmap size %d\n", 
+					reply_header.errorCode, reply_header.nextMessageSize);
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		numSent = brecv(*psock, bitmap, reply_header.nextMessageSize);
+		if (numSent != reply_header.nextMessageSize)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, reply_header.nextMessageSize);
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		put_clnt_sock(psock, 0);
+		return 0;
+	}
+}
+
+int cas_refs(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes,
+		int *deltas, int count)
+{
+	if (hashes == NULL || deltas == NULL || count <= 0 || count > CAPFS_MAXHASHES) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "Invalid parameter to cas_refs\n");
+		errno = EFAULT;
+		return -1;
+	}
+	if (use_sockets == 0)
+	{
+		refs_req req;
+		refs_resp resp;
+		CLIENT **clnt = NULL;
+		enum clnt_stat result;
+
+		memset(&req, 0, sizeof(req));
+		memset(&resp, 0, sizeof(resp));
+		req.h.ref_hashes_len = count;
+		req.h.ref_hashes_val = (sha1hash *) hashes;
+		req.deltas.ref_deltas_len = count;
+		req.deltas.ref_deltas_val = deltas;
+		clnt = get_clnt_handle(tcp, addr);
+		if (clnt == NULL) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,  "cas_refs: No registered CAS RPC service on the specified port!\n");
+			errno = EINVAL;
+			return -1;
+		}
+		if (*clnt == NULL) {
+			errno = ECONNREFUSED;
+			return -1;
+		}
+		result = capfs_refs_1(req, &resp, *clnt);
+		if (result != RPC_SUCCESS) {
+			/* make it reconnect */
+			put_clnt_handle(clnt, 1);
+			errno = (result == RPC_PROCUNAVAIL) ? EOPNOTSUPP : convert_to_errno(result);
+			return -1;
+		}
+		put_clnt_handle(clnt, 0);
+		if (resp.status) {
+			errno = -resp.status;
+			return -1;
+		}
+		return 0;
+	}
+	else
+	{
+		int *psock = NULL;
+		int numSent;
+		cas_header header;
+		cas_reply reply_header;
+		static int refs_id;
+
+		errno = EIO;
+		psock = get_clnt_sock(addr);
+		if (psock == NULL)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "cas_refs: No registered CAS listener "
+					"on the specified port %s\n", strerror(errno));
+			return -1;
+		}
+		lock_seq();
+		header.requestID = refs_id++;
+		unlock_seq();
+		header.opcode = CAS_REFS_REQ;
+		header.req.refs.numHashes = count;
+		if (blockingSend(*psock, &header, sizeof(cas_header)) != sizeof(cas_header)
+				|| blockingSend(*psock, hashes, count * CAPFS_MAXHASHLENGTH) != (count * CAPFS_MAXHASHLENGTH)
+				|| blockingSend(*psock, deltas, count * sizeof(int)) != (count * sizeof(int)))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "cas_refs: could not send request\n");
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			errno = EIO;
+			return -1;
+		}
+		numSent = brecv(*psock, &reply_header, sizeof(cas_reply));
+		if (numSent != sizeof(cas_reply))
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "recvd %d instead of %d\n", numSent, (int) sizeof(cas_reply));
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			errno = EIO;
+			return -1;
+		}
+		if (reply_header.opcode != CAS_REFS_REPLY)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad opcode %d instead of %d\n", reply_header.opcode, CAS_REFS_REPLY);
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			errno = (reply_header.opcode == CAS_UNKNOWN_OPCODE) ? EOPNOTSUPP : EIO;
+			return -1;
+		}
+		put_clnt_sock(psock, 0);
+		if (reply_header.errorCode != NO_ERROR)
+		{
+			errno = -reply_header.errorCode;
+			return -1;
+		}
+		return 0;
+	}
+}
+
 static void gethashes_dtor(get_hashes *h)
 {
 	free(h->get_hashes_val);
@@ -999,6 +1409,71 @@ static int copy_to_job(struct cas_return *job, get_resp *resp)
 	return (ret == 0) ? total : ret;
 }
 
+/* does the iod at addr lack CAS_GET_SIZED_REQ? */
+static int iod_old_get(struct sockaddr_in *addr)
+{
+	int id, old = 0;
+
+	pthread_mutex_lock(&iod_mutex);
+	if ((id = find_id_of_host(addr)) >= 0) {
+		old = iod_table[id].old_get;
+	}
+	pthread_mutex_unlock(&iod_mutex);
+	return old;
+}
+
+static void iod_set_old_get(struct sockaddr_in *addr)
+{
+	int id;
+
+	pthread_mutex_lock(&iod_mutex);
+	if ((id = find_id_of_host(addr)) >= 0) {
+		iod_table[id].old_get = 1;
+	}
+	pthread_mutex_unlock(&iod_mutex);
+	LOG(stderr, WARNING_MSG, SUBSYS_DATA, "iod %s:%d does not know sized gets, falling back to plain ones\n",
+			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	return;
+}
+
+/*
+ * Receives the chunks of a reply to a plain CAS_GET_REQ, which sends every
+ * chunk in full and sparse ones as zeroes, straight into the user pointers.
+ */
+static int cas_get_recv_full(int *psock, cas_reply *reply_header, unsigned char *hashes, struct cas_return *job)
+{
+	static unsigned char zero_hash[CAPFS_MAXHASHLENGTH];
+	int i, numSent;
+
+	if (reply_header->nextMessageSize != job->count * CAPFS_CHUNK_SIZE)
+	{
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, " (get) Next message size = %d, should have been %d\n",
+				reply_header->nextMessageSize, job->count * CAPFS_CHUNK_SIZE);
+		/* make it reconnect */
+		put_clnt_sock(psock, 1);
+		return -1;
+	}
+	for (i = 0; i < job->count; i++)
+	{
+		numSent = brecv(*psock, job->buf[i].start, CAPFS_CHUNK_SIZE);
+		if (numSent != CAPFS_CHUNK_SIZE)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "brecv (get) did not receive data! "
+					"%d bytes instead of %d: %s\n", numSent, CAPFS_CHUNK_SIZE, 
+					(numSent < 0) ? strerror(errno) : "timed out");
+			/* make it reconnect */
+			put_clnt_sock(psock, 1);
+			return -1;
+		}
+		/* as below, the zeroes sent for a sparse block are not its contents */
+		job->buf[i].byteCount = memcmp(hashes + i * CAPFS_MAXHASHLENGTH, zero_hash, CAPFS_MAXHASHLENGTH) ? 
+			CAPFS_CHUNK_SIZE : 0;
+	}
+	job->server_time = reply_header->server_time;
+	put_clnt_sock(psock, 0);
+	return job->count * CAPFS_CHUNK_SIZE;
+}
+
 int cas_get(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes, struct cas_return *job)
 {
 	if (use_sockets == 0)
@@ -1066,8 +1541,10 @@ int cas_get(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 		int i, total_msg_size = 0, numSent = 0;
 		cas_header header;
 		cas_reply reply_header;
-		char *data = NULL, *ptr = NULL;
+		int *sizes = NULL;
 		static int get_id = 0;
+		/* only iods that know it send the size header */
+		int sized = !iod_old_get(addr);
 
 		errno = EIO;
 		psock = get_clnt_sock(addr);
@@ -1080,13 +1557,13 @@ int cas_get(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 		lock_seq();
 		header.requestID = get_id++;
 		unlock_seq();
-		header.opcode = CAS_GET_REQ;
+		header.opcode = sized ? CAS_GET_SIZED_REQ : CAS_GET_REQ;
 		header.req.get.numHashes = job->count;
 		numSent = blockingSend(*psock, &header, sizeof(cas_header));
 		if (numSent != sizeof(cas_header))
 		{
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "sent %d instead of %d\n",
-					numSent, sizeof(cas_header));
+					numSent, (int) sizeof(cas_header));
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -1107,16 +1584,23 @@ int cas_get(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 		if (numSent != sizeof(cas_reply))
 		{
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "brecv (get) did not receive response! "
-					"%d bytes instead of %d: %s\n", numSent, sizeof(cas_reply), 
+					"%d bytes instead of %d: %s\n", numSent, (int) sizeof(cas_reply), 
 					(numSent < 0) ? strerror(errno) : "timed out");
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
 		}
-		if (reply_header.opcode != CAS_GET_REPLY)
+		/* an older iod closes the connection, so ask again on a new one */
+		if (sized && reply_header.opcode == CAS_UNKNOWN_OPCODE)
+		{
+			put_clnt_sock(psock, 1);
+			iod_set_old_get(addr);
+			return cas_get(use_sockets, tcp, addr, hashes, job);
+		}
+		if (reply_header.opcode != (sized ? CAS_GET_SIZED_REPLY : CAS_GET_REPLY))
 		{
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "(get) Bad opcode %d instead of %d\n",
-					reply_header.opcode, CAS_GET_REPLY);
+					reply_header.opcode, sized ? CAS_GET_SIZED_REPLY : CAS_GET_REPLY);
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
@@ -1136,47 +1620,77 @@ int cas_get(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *h
 			put_clnt_sock(psock, 1);
 			return -1;
 		}
-		if (reply_header.nextMessageSize != job->count * CAPFS_CHUNK_SIZE)
+		if (!sized)
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, " (get) Next message size = %d, should have been %d\n",
-					reply_header.nextMessageSize, job->count * CAPFS_CHUNK_SIZE);
+			return cas_get_recv_full(psock, &reply_header, hashes, job);
+		}
+		sizes = (int *) calloc(job->count, sizeof(int));
+		if (sizes == NULL)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "(get) calloc of %d sizes failed!\n", job->count);
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
 		}
-		data = (char *) calloc(reply_header.nextMessageSize, 1);
-		if (data == NULL)
+		/* the per-hash size header */
+		numSent = brecv(*psock, sizes, job->count * sizeof(int));
+		if (numSent != job->count * sizeof(int))
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "(get) calloc of %d failed!\n", reply_header.nextMessageSize);
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "brecv (get) did not receive sizes! "
+					"%d bytes instead of %d: %s\n", numSent, (int) (job->count * sizeof(int)), 
+					(numSent < 0) ? strerror(errno) : "timed out");
+			free(sizes);
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
 		}
-		LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "[get %d] Waiting for data on socket %d\n", header.requestID, *psock);
-		numSent = brecv(*psock, data, reply_header.nextMessageSize);
-		if (numSent != reply_header.nextMessageSize)
+		total_msg_size = job->count * sizeof(int);
+		for (i = 0; i < job->count; i++)
 		{
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "brecv (get) did not receive data! "
-					"%d bytes instead of %d: %s\n", numSent, reply_header.nextMessageSize, 
-					(numSent < 0) ? strerror(errno) : "timed out");
-			free(data);
+			if (sizes[i] < 0 || sizes[i] > CAPFS_CHUNK_SIZE) 
+				break;
+			total_msg_size += sizes[i];
+		}
+		if (i != job->count || reply_header.nextMessageSize != total_msg_size)
+		{
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, " (get) Next message size = %d, should have been %d\n",
+					reply_header.nextMessageSize, total_msg_size);
+			free(sizes);
 			/* make it reconnect */
 			put_clnt_sock(psock, 1);
 			return -1;
 		}
+		LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "[get %d] Waiting for data on socket %d\n", header.requestID, *psock);
+		/* receive straight into the user pointers */
 		total_msg_size = 0;
-		/* copy to user pointers */
-		ptr = data;
 		for (i = 0; i < job->count; i++)
 		{
-			job->buf[i].byteCount = CAPFS_CHUNK_SIZE;
-			memcpy(job->buf[i].start, ptr, CAPFS_CHUNK_SIZE);
-			ptr += CAPFS_CHUNK_SIZE;
-			total_msg_size += CAPFS_CHUNK_SIZE;
+			/* sparse block */
+			if (sizes[i] == 0)
+			{
+				memset(job->buf[i].start, 0, CAPFS_CHUNK_SIZE);
+				/* nothing was received, so the caller must not treat this as the chunk's contents */
+				job->buf[i].byteCount = 0;
+				total_msg_size += CAPFS_CHUNK_SIZE;
+				continue;
+			}
+			numSent = brecv(*psock, job->buf[i].start, sizes[i]);
+			if (numSent != sizes[i])
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "brecv (get) did not receive data! "
+						"%d bytes instead of %d: %s\n", numSent, sizes[i], 
+						(numSent < 0) ? strerror(errno) : "timed out");
+				free(sizes);
+				/* make it reconnect */
+				put_clnt_sock(psock, 1);
+				return -1;
+			}
+			job->buf[i].byteCount = sizes[i];
+			total_msg_size += sizes[i];
 		}
 		job->server_time = reply_header.server_time;
 		put_clnt_sock(psock, 0);
-		free(data);
+		free(sizes);
 		return total_msg_size;
 	}
 }
@@ -10,6 +10,11 @@ extern int cas_ping(int use_sockets, int tcp, struct sockaddr_in *addr);
 extern int cas_statfs(int use_sockets, int tcp, struct sockaddr_in *addr, struct statfs *sfs);
 extern int cas_put(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes, struct cas_return *ret);
 extern int cas_get(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes, struct cas_return *ret);
+extern int cas_have(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes, 
+		int count, unsigned char *bitmap);
+extern int cas_iod_stat(int use_sockets, int tcp, struct sockaddr_in *addr, struct cas_iod_stat *stat);
+extern int cas_refs(int use_sockets, int tcp, struct sockaddr_in *addr, unsigned char *hashes,
+		int *deltas, int count);
 extern int cas_removeall(int use_sockets, int tcp, struct sockaddr_in *addr, char *dirname);
 
 #endif
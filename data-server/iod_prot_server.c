@@ -16,17 +16,24 @@
 #include <linux/dirent.h>
 #include <linux/unistd.h>
 #include <errno.h>
-#include <sys/select.h>
 #include <capfs_config.h>
 #include "list.h"
 #include "log.h"
 #include "sha.h"
 #include "cas.h"
 #include "sockio.h"
+#include "iod_config.h"
+#include "iod_pack.h"
+#include "iod_io.h"
+#include "iod_cache.h"
+#include "iod_codec.h"
+#include "iod_ref.h"
+#include "iod_cdc.h"
 
 #define ERR_MAX 256
 
-static char *zero_chunk = NULL;
+/* stands in for sparse chunks in replies to plain CAS_GET_REQ */
+static char zero_chunk[CAPFS_CHUNK_SIZE];
 
 int compare_to_zero(char *hash, int hash_len)
 {
@@ -38,12 +45,6 @@ int compare_to_zero(char *hash, int hash_len)
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
 			return -ENOMEM;
 		}
-		zero_chunk = (char *) calloc(sizeof(char), CAPFS_CHUNK_SIZE);
-		if (zero_chunk == NULL) {
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
-			free(zero_hash);
-			return -ENOMEM;
-		}
 	}
 	return memcmp(hash, zero_hash, hash_len);
 }
@@ -122,13 +123,594 @@ static int64_t time_diff(struct timeval *end, struct timeval *begin)
 	return difference;
 }
 
+/*
+ * Chunk storage helpers. Depending on the configured storage backend
+ * a chunk lives either in a file of its own (named by get_fileName()),
+ * or in one of the container files of the packed store (iod_pack.c).
+ *
+ * Chunks are stored as they are, compressed or as a list of their pieces.
+ * Which of those a stored chunk is gets recorded next to it, in the name
+ * of its file or in its pack record, since its contents are whatever
+ * the clients wrote and could look like anything.
+ */
+#define CHUNK_RAW    0 /* the chunk itself */
+#define CHUNK_CODEC  1 /* compressed, see iod_codec.c */
+#define CHUNK_PIECES 2 /* a list of its pieces, see iod_cdc.c */
+#define CHUNK_FORMS  3
+
+/* appended to the names of the files of chunks that are not stored as they are */
+static char *chunk_suffix[CHUNK_FORMS] = {"", ".z", ".p"};
+
+/* Returns the name of the file that holds the chunk in form, to be freed by the caller */
+static char *chunk_name(unsigned char *hash, int form)
+{
+	char *fileName, *name;
+
+	fileName = get_fileName(hash);
+	if ((name = (char *) realloc(fileName, strlen(fileName) + strlen(chunk_suffix[form]) + 1)) == NULL) {
+		free(fileName);
+		return NULL;
+	}
+	strcat(name, chunk_suffix[form]);
+	return name;
+}
+
+/*
+ * Looks for the file that holds the chunk, and returns its name in *fileName
+ * (to be freed by the caller). Returns the form of the chunk, -errno on failure.
+ */
+static int chunk_file(unsigned char *hash, char **fileName)
+{
+	char *name;
+	int form, ret = -ENOENT;
+
+	for (form = 0; form < CHUNK_FORMS; form++) {
+		if ((name = chunk_name(hash, form)) == NULL) {
+			return -ENOMEM;
+		}
+		if (access(name, F_OK) == 0) {
+			*fileName = name;
+			return form;
+		}
+		if (errno != ENOENT) {
+			ret = -errno;
+		}
+		free(name);
+	}
+	return ret;
+}
+
+/*
+ * Looks at the header of the chunk that is stored in form as the stored_len bytes at offset in fd.
+ * Returns the length of the chunk, -EIO if it is not a valid chunk of that form.
+ */
+static int chunk_peek(int fd, off_t offset, int stored_len, int form)
+{
+	union {
+		struct iod_codec_header codec;
+		struct iod_cdc_header cdc;
+	} hdr;
+	int len, ret = 0;
+
+	if (form == CHUNK_RAW) {
+		return stored_len;
+	}
+	len = (stored_len < sizeof(hdr)) ? stored_len : sizeof(hdr);
+	if (pread(fd, &hdr, len, offset) != len) {
+		return -EIO;
+	}
+	if (form == CHUNK_CODEC) {
+		ret = iod_codec_peek((char *) &hdr, stored_len);
+	}
+	else if (form == CHUNK_PIECES) {
+		ret = iod_cdc_peek((char *) &hdr, stored_len);
+	}
+	if (ret <= 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "invalid header on chunk stored in form %d\n", form);
+		return -EIO;
+	}
+	return ret;
+}
+
+/*
+ * Returns a file descriptor from which the *length bytes of the chunk as stored
+ * can be read starting at *offset or -errno on failure, and sets *form to how it
+ * was stored. The descriptor must be released with chunk_close().
+ */
+static int chunk_open(unsigned char *hash, off_t *offset, int *length, int *form)
+{
+	struct stat fileInfo;
+	char *fileName;
+	int fd;
+
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		int ret;
+
+		if ((ret = pack_locate(hash, &fd, offset, length, form)) < 0) {
+			return ret;
+		}
+		return fd;
+	}
+	*offset = 0;
+	if ((*form = chunk_file(hash, &fileName)) < 0) {
+		return *form;
+	}
+	fd = open(fileName, O_RDONLY);
+	free(fileName);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (fstat(fd, &fileInfo) < 0) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
+	*length = fileInfo.st_size;
+	return fd;
+}
+
+static void chunk_close(int fd)
+{
+	/* container descriptors are owned by the packed store */
+	if (__iod_config.storage != IOD_STORAGE_PACKED) {
+		close(fd);
+	}
+	return;
+}
+
+/* Returns the (uncompressed) size of the chunk or -errno on failure */
+static int chunk_size(unsigned char *hash)
+{
+	int fd, length, form, ret;
+	off_t offset;
+
+	if ((fd = chunk_open(hash, &offset, &length, &form)) < 0) {
+		return fd;
+	}
+	ret = chunk_peek(fd, offset, length, form);
+	chunk_close(fd);
+	return ret;
+}
+
+/*
+ * Reads the chunk as stored into buf and sets *form to how it was stored.
+ * Returns number of bytes read on success, -errno on failure
+ */
+static int chunk_fetch(unsigned char *hash, char *buf, int size, int *form)
+{
+	char *fileName;
+	int fd, ret;
+
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		return pack_get(hash, buf, size, form);
+	}
+	if ((*form = chunk_file(hash, &fileName)) < 0) {
+		return *form;
+	}
+	if ((fd = open(fileName, O_RDONLY)) < 0) {
+		ret = -errno;
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Could not open file %s\n", fileName);
+	}
+	else {
+		if ((ret = read(fd, buf, size)) < 0) {
+			ret = -errno;
+		}
+		close(fd);
+	}
+	free(fileName);
+	return ret;
+}
+
+static int chunk_load(unsigned char *hash, char *buf, int size, int piece);
+
+/*
+ * Reads the pieces of the chunk listed in the stored_len bytes of stored into buf.
+ * Returns the length of the chunk on success, -errno on failure.
+ */
+static int chunk_assemble(char *stored, int stored_len, char *buf, int size)
+{
+	struct iod_cdc_piece pieces[IOD_CDC_MAXPIECES];
+	int i, n, ret, off = 0;
+
+	if ((n = iod_cdc_decode(stored, stored_len, pieces)) < 0) {
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		if (off + pieces[i].cp_length > size) {
+			return -EINVAL;
+		}
+		if ((ret = chunk_load(pieces[i].cp_hash, buf + off, pieces[i].cp_length, 1)) < 0) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not load piece %d of chunk: %s\n", i, strerror(-ret));
+			return ret;
+		}
+		if (ret != pieces[i].cp_length) {
+			return -EIO;
+		}
+		off += ret;
+	}
+	return off;
+}
+
+/*
+ * Returns number of bytes read off the disk (after decompression and
+ * putting its pieces together) on success, -errno on failure.
+ * piece is nonzero if the chunk is a piece of another one. Pieces are
+ * never stored as pieces themselves, so one that claims to be is invalid.
+ */
+static int chunk_load(unsigned char *hash, char *buf, int size, int piece)
+{
+	char *stored;
+	int form, ret;
+
+	if ((ret = chunk_fetch(hash, buf, size, &form)) <= 0 || form == CHUNK_RAW) {
+		return ret;
+	}
+	if ((stored = (char *) malloc(ret)) == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(stored, buf, ret);
+	if (form == CHUNK_CODEC && iod_codec_peek(stored, ret) > 0) {
+		ret = iod_codec_unpack(stored, ret, buf, size);
+	}
+	else if (form == CHUNK_PIECES && !piece && iod_cdc_peek(stored, ret) > 0) {
+		ret = chunk_assemble(stored, ret, buf, size);
+	}
+	else {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "invalid %schunk stored in form %d\n", piece ? "piece of " : "", form);
+		ret = -EIO;
+	}
+	free(stored);
+	return ret;
+}
+
+/*
+ * Returns number of bytes read on success, -errno on failure.
+ * Callers always ask for the whole chunk, so whatever we read off the disk
+ * can be cached as is.
+ */
+static int chunk_read(unsigned char *hash, char *buf, int size)
+{
+	int ret;
+
+	if ((ret = iod_cache_get(hash, buf, size)) >= 0) {
+		return ret;
+	}
+	if ((ret = chunk_load(hash, buf, size, 0)) > 0) {
+		iod_cache_put(hash, buf, ret);
+	}
+	return ret;
+}
+
+/*
+ * Stores the length bytes of data under hash as they are. form says
+ * whether data is the chunk itself, a compressed form or a list of pieces.
+ * Returns length on success, -errno on failure
+ */
+static int chunk_store(unsigned char *hash, char *data, int length, int form)
+{
+	char *fileName, *tmpName = NULL;
+	int fd, ret, done = 0;
+
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		return pack_put(hash, data, length, form);
+	}
+	/* content-addressed; if we have it, we are done */
+	if ((ret = chunk_file(hash, &fileName)) >= 0) {
+		free(fileName);
+		return length;
+	}
+	if ((fileName = chunk_name(hash, form)) == NULL) {
+		return -ENOMEM;
+	}
+	/*
+	 * A crash could leave a compressed chunk or a list of pieces cut short
+	 * under its name, and it would then no longer decode. Those are written
+	 * to a file of their own and renamed into place once they are complete.
+	 * Whatever such files a crash leaves behind are removed at startup.
+	 */
+	if (form == CHUNK_RAW) {
+		fd = open(fileName, O_WRONLY | O_CREAT | O_EXCL, 0700);
+	}
+	else if ((tmpName = (char *) malloc(strlen(fileName) + 8)) == NULL) {
+		free(fileName);
+		return -ENOMEM;
+	}
+	else {
+		/* named after the chunk without the suffix, which is what the startup cleanup looks for */
+		sprintf(tmpName, "%.*s.XXXXXX", (int) (strlen(fileName) - strlen(chunk_suffix[form])), fileName);
+		if ((fd = mkstemp(tmpName)) >= 0) {
+			fchmod(fd, 0700);
+		}
+	}
+	if (fd < 0) {
+		ret = -errno;
+		/* someone else stored it meanwhile */
+		if (ret == -EEXIST) {
+			ret = length;
+		}
+		else {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Could not create file %s\n", tmpName ? tmpName : fileName);
+		}
+		goto out;
+	}
+	while (done < length) {
+		if ((ret = write(fd, data + done, length - done)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		done += ret;
+	}
+	close(fd);
+	if (done < length) {
+		ret = (ret < 0) ? -errno : -ENOSPC;
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "write operation on %s error %d\n", tmpName ? tmpName : fileName, ret);
+		unlink(tmpName ? tmpName : fileName);
+		goto out;
+	}
+	if (tmpName && rename(tmpName, fileName) < 0) {
+		ret = -errno;
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Could not rename %s to %s\n", tmpName, fileName);
+		unlink(tmpName);
+		goto out;
+	}
+	ret = length;
+out:
+	free(tmpName);
+	free(fileName);
+	return ret;
+}
+
+/*
+ * Stores the chunk, compressed if that is enabled and worthwhile.
+ * Returns number of bytes of the chunk written on success, -errno on failure
+ */
+static int chunk_pack(unsigned char *hash, char *buf, int size)
+{
+	char *data = buf, *packed = NULL;
+	int ret, length = size;
+
+	if (iod_codec_enabled() && (packed = (char *) malloc(size)) != NULL) {
+		if ((length = iod_codec_pack(buf, size, packed)) > 0) {
+			data = packed;
+		}
+		else {
+			length = size;
+		}
+	}
+	ret = chunk_store(hash, data, length, (data == buf) ? CHUNK_RAW : CHUNK_CODEC);
+	free(packed);
+	if (ret == length) {
+		ret = size;
+	}
+	return ret;
+}
+
+/*
+ * Stores the chunk as a list of its content-defined pieces (see iod_cdc.c),
+ * storing only those pieces that we do not have already.
+ * Returns number of bytes of the chunk written on success, -errno on failure
+ */
+static int chunk_write_pieces(unsigned char *hash, char *buf, int size)
+{
+	struct iod_cdc_piece pieces[IOD_CDC_MAXPIECES];
+	unsigned char *hashes = NULL;
+	int *deltas = NULL;
+	char manifest[IOD_CDC_MANIFEST_SIZE(IOD_CDC_MAXPIECES)];
+	int i, n, ret, length, off = 0, new_bytes = 0;
+
+	if ((n = iod_cdc_split(buf, size, pieces)) <= 1) {
+		return (n < 0) ? n : chunk_pack(hash, buf, size);
+	}
+	/* two writers of a chunk would both take references on its pieces */
+	iod_cdc_lock(hash);
+	if (chunk_exists(hash)) {
+		ret = size;
+		goto out;
+	}
+	hashes = (unsigned char *) malloc(n * CAPFS_MAXHASHLENGTH);
+	deltas = (int *) malloc(n * sizeof(int));
+	if (hashes == NULL || deltas == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		memcpy(hashes + i * CAPFS_MAXHASHLENGTH, pieces[i].cp_hash, CAPFS_MAXHASHLENGTH);
+		deltas[i] = 1;
+	}
+	/* referenced before they are looked for, so the reclaimer cannot delete them under us */
+	if ((ret = iod_ref_update(hashes, deltas, n, 0)) < 0) {
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!chunk_exists(pieces[i].cp_hash)) {
+			if ((ret = chunk_pack(pieces[i].cp_hash, buf + off, pieces[i].cp_length)) < 0) {
+				break;
+			}
+			new_bytes += pieces[i].cp_length;
+		}
+		off += pieces[i].cp_length;
+	}
+	if (ret >= 0) {
+		length = iod_cdc_encode(pieces, n, size, manifest);
+		if ((ret = chunk_store(hash, manifest, length, CHUNK_PIECES)) == length) {
+			iod_cdc_account(size, new_bytes);
+			ret = size;
+		}
+		else if (ret >= 0) {
+			ret = -EIO;
+		}
+	}
+	if (ret < 0) {
+		int err;
+
+		/* whatever pieces we did store are reclaimed in due course */
+		for (i = 0; i < n; i++) {
+			deltas[i] = -1;
+		}
+		if ((err = iod_ref_update(hashes, deltas, n, 0)) < 0) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "could not drop references to pieces: %s\n", strerror(-err));
+		}
+	}
+out:
+	iod_cdc_unlock(hash);
+	free(hashes);
+	free(deltas);
+	return ret;
+}
+
+/*
+ * Stores the chunk, as content-defined pieces or compressed if either is enabled.
+ * Returns number of bytes of the chunk written on success, -errno on failure
+ */
+static int chunk_write(unsigned char *hash, char *buf, int size)
+{
+	/* keep a chunk that a client is about to refer to from being reclaimed under it */
+	iod_ref_touch(hash);
+	if (iod_cdc_enabled()) {
+		return chunk_write_pieces(hash, buf, size);
+	}
+	return chunk_pack(hash, buf, size);
+}
+
+/*
+ * Sends size bytes of the (uncompressed) chunk on sock. Cached chunks are
+ * sent out of memory. Otherwise, if sendfile is enabled and the chunk is not
+ * stored compressed, it is streamed from the page cache straight to the socket,
+ * else it is staged through a buffer.
+ * Returns number of bytes sent or -1 on error.
+ */
+static int chunk_send(int sock, unsigned char *hash, char *fileName, int size)
+{
+	int fd, ret, length, form;
+	off_t offset;
+	char *buf;
+
+	if ((buf = iod_cache_dup(hash, size)) != NULL) {
+		ret = blockingSend(sock, buf, size);
+		free(buf);
+		return ret;
+	}
+	if (__iod_config.enable_sendfile) {
+		if ((fd = chunk_open(hash, &offset, &length, &form)) < 0) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not open chunk %s: %s\n", fileName, strerror(-fd));
+			return -1;
+		}
+		if (form == CHUNK_RAW) {
+			ret = blockingSendFileOffset(fd, sock, offset, size);
+			/* the chunk was just brought into the page cache, so this is cheap */
+			if (ret == size) {
+				iod_cache_put_fd(hash, fd, offset, size);
+			}
+			chunk_close(fd);
+			return ret;
+		}
+		/* compressed chunks need to be decompressed and pieces put together first */
+		chunk_close(fd);
+	}
+	if ((buf = (char *) malloc(size)) == NULL) {
+		return -1;
+	}
+	if ((ret = chunk_load(hash, buf, size, 0)) == size) {
+		iod_cache_put(hash, buf, size);
+		ret = blockingSend(sock, buf, size);
+	}
+	else if (ret >= 0) {
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+/*
+ * Deletes the chunk from the store. If it was stored as pieces, the
+ * references it held on them are dropped once it is gone; should we crash
+ * in between, the pieces are leaked rather than dropped twice.
+ * Called by the reclaimer, which keeps the chunk from being referred to meanwhile.
+ * Returns 0 on success (or if we did not have the chunk), -errno on failure
+ */
+int chunk_remove(unsigned char *hash)
+{
+	struct iod_cdc_piece pieces[IOD_CDC_MAXPIECES];
+	unsigned char hashes[IOD_CDC_MAXPIECES * CAPFS_MAXHASHLENGTH];
+	int deltas[IOD_CDC_MAXPIECES];
+	char manifest[IOD_CDC_MANIFEST_SIZE(IOD_CDC_MAXPIECES)];
+	char *fileName;
+	int i, n = 0, form, ret;
+
+	if ((ret = chunk_fetch(hash, manifest, sizeof(manifest), &form)) > 0
+			&& form == CHUNK_PIECES && iod_cdc_peek(manifest, ret) > 0) {
+		if ((n = iod_cdc_decode(manifest, ret, pieces)) < 0) {
+			n = 0;
+		}
+		for (i = 0; i < n; i++) {
+			memcpy(hashes + i * CAPFS_MAXHASHLENGTH, pieces[i].cp_hash, CAPFS_MAXHASHLENGTH);
+			deltas[i] = -1;
+		}
+	}
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		ret = pack_remove(hash);
+	}
+	else if ((ret = chunk_file(hash, &fileName)) >= 0) {
+		ret = (unlink(fileName) < 0) ? -errno : 0;
+		free(fileName);
+	}
+	if (ret == 0 && n > 0 && (ret = iod_ref_update(hashes, deltas, n, 0)) < 0) {
+		LOG(stderr, WARNING_MSG, SUBSYS_DATA, "could not drop references to pieces: %s\n", strerror(-ret));
+		ret = 0;
+	}
+	return (ret == -ENOENT) ? 0 : ret;
+}
+
+/* Returns 1 if the chunk is stored on this server, 0 if it is not */
+int chunk_exists(unsigned char *hash)
+{
+	int ret;
+
+	/* sparse blocks are never stored, but can always be served */
+	if (compare_to_zero((char *) hash, CAPFS_MAXHASHLENGTH) == 0) {
+		return 1;
+	}
+	if (__iod_config.storage == IOD_STORAGE_PACKED) {
+		int fd, length, form;
+		off_t offset;
+
+		ret = pack_locate(hash, &fd, &offset, &length, &form);
+	}
+	else {
+		char *fileName;
+
+		if ((ret = chunk_file(hash, &fileName)) >= 0) {
+			free(fileName);
+		}
+	}
+	return (ret < 0) ? 0 : 1;
+}
+
+/* Fills in bitmap for numHashes hashes. Bit i is set if the i-th chunk exists */
+static void chunk_have(unsigned char *hashes, int numHashes, unsigned char *bitmap)
+{
+	int i;
+
+	memset(bitmap, 0, CAS_HAVE_BITMAP_SIZE(numHashes));
+	for (i = 0; i < numHashes; i++) {
+		/* the client will not ship it, but it may well refer to it */
+		iod_ref_touch(hashes + i * CAPFS_MAXHASHLENGTH);
+		if (chunk_exists(hashes + i * CAPFS_MAXHASHLENGTH)) {
+			cas_have_set(bitmap, i);
+		}
+	}
+	return;
+}
+
 bool_t
 capfs_get_1_svc(get_req arg1, get_resp *result,  struct svc_req *rqstp)
 {
 	bool_t retval = 1;
-	int i;
-	char *fileName = NULL;
-	struct stat fileInfo;
+	int i, nreqs = 0;
+	struct iod_io_req *reqs;
 	struct timeval begin, end;
 
 	gettimeofday(&begin, NULL);
@@ -139,10 +721,14 @@ capfs_get_1_svc(get_req arg1, get_resp *result,  struct svc_req *rqstp)
 		opstatus_dtor(&result->status);
 		return retval;
 	}
+	reqs = (struct iod_io_req *) calloc(arg1.h.get_hashes_len + 1, sizeof(struct iod_io_req));
+	if (reqs == NULL) {
+		blocks_dtor(&result->blocks, arg1.h.get_hashes_len);
+		opstatus_dtor(&result->status);
+		return retval;
+	}
 	
 	for (i = 0; i < arg1.h.get_hashes_len; i++) {
-
-		fileName = get_fileName(arg1.h.get_hashes_val[i]);
 		/* if all the hashes are zeroes!, then we are sure that this is a sparse block */
 		if (compare_to_zero(arg1.h.get_hashes_val[i], CAPFS_MAXHASHLENGTH) == 0) {
 			/* just continue */
@@ -153,31 +739,31 @@ capfs_get_1_svc(get_req arg1, get_resp *result,  struct svc_req *rqstp)
 		{
 			char str[256];
 			hash2str(arg1.h.get_hashes_val[i], CAPFS_MAXHASHLENGTH, str);
-			LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "GET file name : %s : %s\n", fileName, str);
+			LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "GET hash : %s\n", str);
 		}
 #endif
-
-		if (stat(fileName, &fileInfo) < 0) {
-			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "access failed for %s\n", fileName);
-			result->status.op_status_val[i] = -errno;
+		reqs[nreqs].fn = chunk_read;
+		reqs[nreqs].hash = (unsigned char *) arg1.h.get_hashes_val[i];
+		reqs[nreqs].buf = result->blocks.data_blocks_val[i].data_val;
+		reqs[nreqs].size = CAPFS_CHUNK_SIZE;
+		reqs[nreqs].tag = i;
+		nreqs++;
+	}
+	/* issue all the reads at once */
+	iod_io_submit(reqs, nreqs);
+	for (i = 0; i < nreqs; i++) {
+		int ret = reqs[i].result, blk = reqs[i].tag;
+
+		if (ret < 0) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "access failed for chunk %d: %s\n", blk, strerror(-ret));
+			result->status.op_status_val[blk] = ret;
 		}
 		else {
-			int fd;
-
-			result->blocks.data_blocks_val[i].data_len = fileInfo.st_size;
-			fd = open(fileName, O_RDONLY);
-			if (fd < 0) {
-				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA,"Could not open file %s\n", fileName);
-				result->status.op_status_val[i] = -errno;
-			}
-			else {
-				read(fd, result->blocks.data_blocks_val[i].data_val, fileInfo.st_size);
-				result->status.op_status_val[i] = 0;
-			}
-			close(fd);
+			result->blocks.data_blocks_val[blk].data_len = ret;
+			result->status.op_status_val[blk] = 0;
 		}
-		free(fileName);
 	}
+	free(reqs);
 	gettimeofday(&end, NULL);
 	result->get_time = time_diff(&end, &begin);
 	return retval;	
@@ -188,6 +774,7 @@ capfs_put_1_svc(put_req arg1, put_resp *result,  struct svc_req *rqstp)
 {
 	bool_t retval = 1; 
 	int i;
+	struct iod_io_req *reqs;
 	struct timeval begin, end;
 
 	gettimeofday(&begin, NULL);
@@ -200,48 +787,81 @@ capfs_put_1_svc(put_req arg1, put_resp *result,  struct svc_req *rqstp)
 		opstatus_dtor(&result->status);
 		return retval;
 	}
+	reqs = (struct iod_io_req *) calloc(arg1.h.put_hashes_len + 1, sizeof(struct iod_io_req));
+	if (reqs == NULL) {
+		opstatus_dtor(&result->status);
+		return retval;
+	}
 	result->bytes_done = 0;
 	for (i = 0; i < arg1.h.put_hashes_len; i++) {
-		int fd;
-		char *fileName = NULL;
-
-		fileName = get_fileName(arg1.h.put_hashes_val[i]);
 #ifdef DEBUG 
 		{
 			char str[256];
 			hash2str(arg1.h.put_hashes_val[i], CAPFS_MAXHASHLENGTH, str);
-			LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "PUT file name : %s : %s\n", fileName, str);
+			LOG(stderr, DEBUG_MSG, SUBSYS_DATA, "PUT hash : %s\n", str);
 		}
 #endif
+		reqs[i].fn = chunk_write;
+		reqs[i].hash = (unsigned char *) arg1.h.put_hashes_val[i];
+		reqs[i].buf = arg1.blocks.data_blocks_val[i].data_val;
+		reqs[i].size = arg1.blocks.data_blocks_val[i].data_len;
+	}
+	/* issue all the writes at once */
+	iod_io_submit(reqs, arg1.h.put_hashes_len);
+	for (i = 0; i < arg1.h.put_hashes_len; i++) {
+		int wsize = reqs[i].result;
 
-		fd = open(fileName, O_RDWR | O_CREAT, 0700);
-		if (fd < 0) {
-			result->status.op_status_val[i] = -errno;
+		if (wsize < 0) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "capfs_put: write operation on chunk %d error %d\n", i, wsize);
+			result->status.op_status_val[i] = wsize;
 		}
 		else {
-			ssize_t wsize;
-
-			//flock(fd, LOCK_EX);
-			if ((wsize = write(fd, arg1.blocks.data_blocks_val[i].data_val, 
-							arg1.blocks.data_blocks_val[i].data_len)) < 0) {
-				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "capfs_put: write operation on (%s,%s) error %d\n", 
-						arg1.h.put_hashes_val[i], fileName, -errno);
-				result->status.op_status_val[i] = -errno;
-			}
-			else {
-				result->bytes_done += wsize;
-				result->status.op_status_val[i] = wsize;
-			}
-			//flock(fd, LOCK_UN);
+			result->bytes_done += wsize;
+			result->status.op_status_val[i] = wsize;
 		}
-		close(fd);
-		free(fileName);
 	}
+	free(reqs);
 	gettimeofday(&end, NULL);
 	result->put_time = time_diff(&end, &begin);
 	return retval;
 }
 
+bool_t
+capfs_have_1_svc(have_req arg1, have_resp *result,  struct svc_req *rqstp)
+{
+	bool_t retval = 1;
+	int len;
+
+	if (arg1.h.have_hashes_len > CAPFS_MAXHASHES) {
+		result->status = -E2BIG;
+		return retval;
+	}
+	len = CAS_HAVE_BITMAP_SIZE(arg1.h.have_hashes_len);
+	result->bitmap.have_bitmap_val = (char *) calloc(1, len ? len : 1);
+	if (result->bitmap.have_bitmap_val == NULL) {
+		result->status = -ENOMEM;
+		return retval;
+	}
+	result->bitmap.have_bitmap_len = len;
+	chunk_have((unsigned char *) arg1.h.have_hashes_val, arg1.h.have_hashes_len,
+			(unsigned char *) result->bitmap.have_bitmap_val);
+	result->status = 0;
+	return retval;
+}
+
+bool_t
+capfs_refs_1_svc(refs_req arg1, refs_resp *result,  struct svc_req *rqstp)
+{
+	if (arg1.h.ref_hashes_len > CAPFS_MAXHASHES
+			|| arg1.deltas.ref_deltas_len != arg1.h.ref_hashes_len) {
+		result->status = -EINVAL;
+		return 1;
+	}
+	result->status = iod_ref_update((unsigned char *) arg1.h.ref_hashes_val,
+			arg1.deltas.ref_deltas_val, arg1.h.ref_hashes_len, 1);
+	return 1;
+}
+
 bool_t
 capfs_dstatfs_1_svc(cas_stat_resp *result, struct svc_req *rqstp)
 {
@@ -268,6 +888,36 @@ capfs_dstatfs_1_svc(cas_stat_resp *result, struct svc_req *rqstp)
 	return retval;
 }
 
+bool_t
+capfs_iodstat_1_svc(iod_stat_resp *result, struct svc_req *rqstp)
+{
+	struct cas_iod_stat stat;
+
+	iod_cache_stat(&stat);
+	iod_codec_stat(&stat);
+	iod_ref_stat(&stat);
+	iod_cdc_stat(&stat);
+	result->status = 0;
+	result->cache_hits = (uint64_t) stat.is_cache_hits;
+	result->cache_misses = (uint64_t) stat.is_cache_misses;
+	result->cache_evictions = (uint64_t) stat.is_cache_evictions;
+	result->cache_entries = (uint64_t) stat.is_cache_entries;
+	result->cache_bytes = (uint64_t) stat.is_cache_bytes;
+	result->cache_capacity = (uint64_t) stat.is_cache_capacity;
+	result->codec_packed = (uint64_t) stat.is_codec_packed;
+	result->codec_skipped = (uint64_t) stat.is_codec_skipped;
+	result->codec_raw_bytes = (uint64_t) stat.is_codec_raw_bytes;
+	result->codec_stored_bytes = (uint64_t) stat.is_codec_stored_bytes;
+	result->codec_pack_usecs = (uint64_t) stat.is_codec_pack_usecs;
+	result->codec_unpack_usecs = (uint64_t) stat.is_codec_unpack_usecs;
+	result->ref_chunks = (uint64_t) stat.is_ref_chunks;
+	result->ref_pending = (uint64_t) stat.is_ref_pending;
+	result->ref_reclaimed = (uint64_t) stat.is_ref_reclaimed;
+	result->cdc_chunks = (uint64_t) stat.is_cdc_chunks;
+	result->cdc_bytes = (uint64_t) stat.is_cdc_bytes;
+	result->cdc_new_bytes = (uint64_t) stat.is_cdc_new_bytes;
+	return 1;
+}
 
 /* Internal routines to traverse an iod data directory */
 
@@ -453,40 +1103,25 @@ capfs_iod_1_freeresult (SVCXPRT *transp, xdrproc_t xdr_result, caddr_t result)
 	return 1;
 }
 
-extern fd_set global_readsock_set;
-extern fd_set aux_readsock_set;
-extern pthread_spinlock_t fdset_spinlock;
-
-static inline void fd_lock(void)
-{
-	pthread_spin_lock(&fdset_spinlock);
-}
-
-static inline void fd_unlock(void)
-{
-	pthread_spin_unlock(&fdset_spinlock);
-}
-
-
 /*
  * Slave thread function that services the actual requests.
  * The protocol here is that this function should
- * a) FD_CLR(sock) from aux_readsock_set in case there was/were *NO* error(s)
- * b) FD_CLR(sock) from aux_readsock_set and global_readsock_set in case of errors.
+ * a) iod_sock_rearm(sock) in case there was/were *NO* error(s)
+ * b) iod_sock_close(sock) in case of errors.
  */
 void *capfs_iod_worker(void *args)
 {
 	int numHashes, retVal ;
 	char *ptr, *fileName, *hashPtr;
 	int sock, bytesDone;
-	int i, fd, j, totalMessageSize;
+	int i, j, totalMessageSize;
 
 	char *get_fileNames[CAPFS_MAXHASHES];
 	
 	/* reply for a put: how many bytes were written. this will be an int
-	*  reply for a get: the first int is how many bytes in reply after this int
-	*    first send one int, for size of each file corres to a hash == (header)
-	*    then send out the files corres to the hashes themselves
+	*  reply for a get: the header says how many bytes in reply after it
+	*    first send one int per hash, for size of each file corres to a hash
+	*    (0 for sparse blocks) then send out the files corres to the hashes themselves
 	*/
 
 	/* the first field is the number of bytes read/written
@@ -494,7 +1129,7 @@ void *capfs_iod_worker(void *args)
 	*/  
 	int err;
 
-	struct stat fileInfo;
+	int size;
 	cas_request incoming_request;
 	cas_reply outgoing_reply_header;
 	
@@ -516,11 +1151,7 @@ void *capfs_iod_worker(void *args)
 		blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 		/* error path must close socket and return NULL right then and there */
-		fd_lock();
-		FD_CLR(sock, &global_readsock_set);
-		FD_CLR(sock, &aux_readsock_set);
-		close(sock);
-		fd_unlock();
+		iod_sock_close(sock);
 
 		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad request header] %d\n", sock);
 		return NULL;
@@ -543,11 +1174,7 @@ void *capfs_iod_worker(void *args)
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad blocking (cas_statfs_request send)\n");
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad statfs send reply] %d\n", sock);
 				return NULL;
@@ -555,6 +1182,33 @@ void *capfs_iod_worker(void *args)
 			/* Do not close the socket. This may be reused */
 			break;
 		}
+		case CAS_IODSTAT_REQ:
+		{
+			struct cas_iod_stat stat;
+
+			outgoing_reply_header.opcode = CAS_IODSTAT_REPLY;
+			outgoing_reply_header.errorCode = NO_ERROR;
+			memset(&stat, 0, sizeof(stat));
+			iod_cache_stat(&stat);
+			iod_codec_stat(&stat);
+			iod_ref_stat(&stat);
+			iod_cdc_stat(&stat);
+			/* the counters follow the header, which keeps its size */
+			outgoing_reply_header.nextMessageSize = sizeof(stat);
+			if (blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply)) != sizeof(cas_reply)
+					|| blockingSend(sock, (void*)(&stat), sizeof(stat)) != sizeof(stat))
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad blocking (cas_iodstat_request send)\n");
+
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad iodstat send reply] %d\n", sock);
+				return NULL;
+			}
+			/* Do not close the socket. This may be reused */
+			break;
+		}
 		case CAS_PING_REQ: 
 		{
 			outgoing_reply_header.errorCode = NO_ERROR;
@@ -565,11 +1219,7 @@ void *capfs_iod_worker(void *args)
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad blocking (cas_ping_request send)\n");
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad ping send reply] %d\n", sock);
 				return NULL;
@@ -578,13 +1228,16 @@ void *capfs_iod_worker(void *args)
 			break;
 		}
 		case CAS_GET_REQ:	
+		case CAS_GET_SIZED_REQ:
 		{
 			struct timeval begin, end;
+			/* clients that do not ask for the size header expect every chunk in full */
+			int sized = (incoming_request.header.opcode == CAS_GET_SIZED_REQ);
 
 			gettimeofday(&begin, NULL);
 			/* If this is a get, read data next*/
 			numHashes = incoming_request.header.req.get.numHashes;
-			outgoing_reply_header.opcode = CAS_GET_REPLY;
+			outgoing_reply_header.opcode = sized ? CAS_GET_SIZED_REPLY : CAS_GET_REPLY;
 			if (numHashes > CAPFS_MAXHASHES)
 			{
 				char ch[128];
@@ -595,11 +1248,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [invalid hashes] %d\n", sock);
 				return NULL;
@@ -618,16 +1267,12 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking recv on gethashes] %d\n", sock);
 				return NULL;
 			}
-			totalMessageSize = 0;
+			totalMessageSize = sized ? numHashes * sizeof(int) : 0;
 			hashPtr = incoming_request.req.get.hashes;
 			for (i = 0; i < numHashes; i++)
 			{
@@ -635,16 +1280,20 @@ void *capfs_iod_worker(void *args)
 				get_fileNames[i] = fileName;
 				/* if all the hashes are zeroes!, 
 				 * then we are sure that this is a sparse block 
+				 * and a client that reads the size header fills it in
+				 * without us sending anything.
 				 */
 				if (compare_to_zero(hashPtr, CAPFS_MAXHASHLENGTH) == 0)
 				{
 					incoming_request.req.get.blockSizes[i] = 0;
 					hashPtr += CAPFS_MAXHASHLENGTH;
-					totalMessageSize += CAPFS_CHUNK_SIZE;
+					if (!sized)
+						totalMessageSize += CAPFS_CHUNK_SIZE;
 					continue;
 				}
+				size = chunk_size((unsigned char *) hashPtr);
 				hashPtr += CAPFS_MAXHASHLENGTH;
-				if (stat(fileName, &fileInfo) != 0)
+				if (size < 0)
 				{
 					char ch[128];
 					sprintf(ch,"cas_get_req access failed for file %s\n", fileName);
@@ -653,38 +1302,37 @@ void *capfs_iod_worker(void *args)
 					blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 					/* error path must close socket and return NULL right then and there */
-					fd_lock();
-					FD_CLR(sock, &global_readsock_set);
-					FD_CLR(sock, &aux_readsock_set);
-					close(sock);
-					fd_unlock();
+					iod_sock_close(sock);
 
 					for (j = 0;j <=i; j++)
 						free(get_fileNames[j]);
 					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [no such hashfile for get] %d\n", sock);
 					return NULL;
 				}
-				incoming_request.req.get.blockSizes[i] = fileInfo.st_size;
-				totalMessageSize += fileInfo.st_size;
+				incoming_request.req.get.blockSizes[i] = size;
+				totalMessageSize += size;
 			}
 			gettimeofday(&end, NULL);
 			outgoing_reply_header.req.get.numHashes = numHashes;
 			outgoing_reply_header.errorCode = NO_ERROR;
 			outgoing_reply_header.nextMessageSize = totalMessageSize; 
 			outgoing_reply_header.server_time = time_diff(&end, &begin);
-			retVal = blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
-			if (retVal != sizeof(cas_reply))
+			/* 
+			 * Reply is the header, followed by the size of each chunk if the
+			 * client asked for them, followed by the chunks themselves.
+			 * Hold back partial frames until the whole reply has been queued.
+			 */
+			set_tcpopt(sock, TCP_CORK, 1);
+			if (blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply)) != sizeof(cas_reply)
+					|| (sized && blockingSend(sock, (void *) incoming_request.req.get.blockSizes, numHashes * sizeof(int))
+							!= numHashes * sizeof(int)))
 			{
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "bad blocking cas_get_reply send ");
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
-				for (j = 0;j <= i; j++)
+				for (j = 0;j < numHashes; j++)
 					free(get_fileNames[j]);
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking send header on gethashes] %d\n", sock);
 				return NULL;
@@ -693,19 +1341,15 @@ void *capfs_iod_worker(void *args)
 			{
 				if (incoming_request.req.get.blockSizes[i] == 0)
 				{
+					if (sized)
+						continue;
 					retVal = blockingSend(sock, zero_chunk, CAPFS_CHUNK_SIZE);
 					if (retVal != CAPFS_CHUNK_SIZE)
 					{
-						char ch[128];
-						sprintf(ch,"Bad blocking send of cas_get_req data\n");
-						LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "%s", ch);
+						LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Bad blocking send of cas_get_req data\n");
 
 						/* error path must close socket and return NULL right then and there */
-						fd_lock();
-						FD_CLR(sock, &global_readsock_set);
-						FD_CLR(sock, &aux_readsock_set);
-						close(sock);
-						fd_unlock();
+						iod_sock_close(sock);
 
 						for (j = 0;j < numHashes; j++)
 							free(get_fileNames[j]);
@@ -714,48 +1358,25 @@ void *capfs_iod_worker(void *args)
 					}
 					continue;
 				}
-				fd = open(get_fileNames[i], O_RDONLY);
-				if (fd < 0)
-				{
-					char ch[128];
-					sprintf(ch,"cas_get_reply of data couldnt open file %s\n", get_fileNames[i]);
-					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "%s", ch);
-
-					/* error path must close socket and return NULL right then and there */
-					fd_lock();
-					FD_CLR(sock, &global_readsock_set);
-					FD_CLR(sock, &aux_readsock_set);
-					close(sock);
-					fd_unlock();
-
-					for (j = 0;j < numHashes; j++)
-						free(get_fileNames[j]);
-					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [could not open hash file on gethashes] %d\n", sock);
-					return NULL;
-				}
-				retVal = blockingSendFile(fd, sock, incoming_request.req.get.blockSizes[i]);
+				retVal = chunk_send(sock, incoming_request.req.get.hashes + i * CAPFS_MAXHASHLENGTH, 
+						get_fileNames[i], incoming_request.req.get.blockSizes[i]);
 				if (retVal != incoming_request.req.get.blockSizes[i])
 				{
 					char ch[128];
-					sprintf(ch,"Couldnt sendfile of %s and sent %d\n", get_fileNames[i], retVal);
+					sprintf(ch,"Couldnt send chunk %s and sent %d\n", get_fileNames[i], retVal);
 					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "%s", ch);
 
 					/* error path must close socket and return NULL right then and there */
-					fd_lock();
-					FD_CLR(sock, &global_readsock_set);
-					FD_CLR(sock, &aux_readsock_set);
-					close(sock);
-					fd_unlock();
+					iod_sock_close(sock);
 
-					close(fd);
 					for (j = 0;j < numHashes; j++)
 						free(get_fileNames[j]);
-					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad sendfile on gethashes] %d\n", sock);
+					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad send of data on gethashes] %d\n", sock);
 					return NULL;
 				}
-				/* close the disk file */
-				close(fd);
 			}
+			/* push out whatever is still queued */
+			set_tcpopt(sock, TCP_CORK, 0);
 			for (j = 0;j < numHashes; j++)
 				free(get_fileNames[j]);
 			/* Do not close the socket. This may be reused */
@@ -764,6 +1385,7 @@ void *capfs_iod_worker(void *args)
 		case CAS_PUT_REQ: 
 		{
 			char *data;
+			struct iod_io_req *reqs;
 			struct timeval begin, end;
 
 			gettimeofday(&begin, NULL);
@@ -780,11 +1402,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [invalid number of put hashes] %d\n", sock);
 				return NULL;
@@ -802,11 +1420,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking recv on puthashes] %d\n", sock);
 				return NULL;
@@ -824,11 +1438,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				fprintf(stderr, "Closed socket [could not allocate memory] %d\n", sock);
 				return NULL;
@@ -847,71 +1457,57 @@ void *capfs_iod_worker(void *args)
 				free(data);
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking recv data on put] %d\n", sock);
 				return NULL;
 			}
-			/* now create and write out the files */
+			/* now create and write out the files, all at once */
+			reqs = (struct iod_io_req *) calloc(numHashes + 1, sizeof(struct iod_io_req));
+			if (reqs == NULL)
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "calloc of %d requests failed!\n", numHashes);
+				outgoing_reply_header.errorCode = -ENOMEM;
+				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
+				free(data);
+
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [could not allocate memory] %d\n", sock);
+				return NULL;
+			}
 			ptr = data;
 			for (i = 0;i < numHashes; hashPtr += CAPFS_MAXHASHLENGTH, i++)
 			{
-				fileName = get_fileName(hashPtr);
-				fd = open(fileName, O_WRONLY|O_CREAT, 0700);
-				if (fd < 0)
+				reqs[i].fn = chunk_write;
+				reqs[i].hash = (unsigned char *) hashPtr;
+				reqs[i].buf = ptr;
+				reqs[i].size = CAPFS_CHUNK_SIZE;
+				ptr += CAPFS_CHUNK_SIZE;
+			}
+			iod_io_submit(reqs, numHashes);
+			for (i = 0;i < numHashes; i++)
+			{
+				if ((err = reqs[i].result) != CAPFS_CHUNK_SIZE)
 				{
 					char ch[128];
-					sprintf(ch,"Couldnt create file %s\n", fileName);
+					sprintf(ch,"Couldnt store chunk %d. error no %d\n", i, err);
 					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "%s", ch);
 					outgoing_reply_header.errorCode = FILE_ERROR;
 					blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
+					free(reqs);
 					free(data);
-					free(fileName);
 
 					/* error path must close socket and return NULL right then and there */
-					fd_lock();
-					FD_CLR(sock, &global_readsock_set);
-					FD_CLR(sock, &aux_readsock_set);
-					close(sock);
-					fd_unlock();
-
-					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [could not create hashfile] %d\n", sock);
-					return NULL;
-				}
-				//flock(fd, LOCK_EX);
-				if (write(fd, ptr, CAPFS_CHUNK_SIZE) != CAPFS_CHUNK_SIZE)
-				{
-					char ch[128];
-					err = errno;
-					sprintf(ch,"Couldnt write to file %s. error no %d\n", fileName, err);
-					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "%s", ch);
-					outgoing_reply_header.errorCode = FILE_ERROR;
-					blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
-					free(data);
-					free(fileName);
+					iod_sock_close(sock);
 
-					/* error path must close socket and return NULL right then and there */
-					fd_lock();
-					FD_CLR(sock, &global_readsock_set);
-					FD_CLR(sock, &aux_readsock_set);
-					close(sock);
-					fd_unlock();
-
-					//flock(fd, LOCK_UN);
-					close(fd);
 					LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [could not write hashfile on put] %d\n", sock);
 					return NULL;
 				}
-				//flock(fd, LOCK_UN);
-				close(fd);
-				ptr += CAPFS_CHUNK_SIZE;
 				bytesDone += CAPFS_CHUNK_SIZE;
-				free(fileName);
 			}
+			free(reqs);
 			gettimeofday(&end, NULL);
 			free(data);
 			outgoing_reply_header.req.put.bytesDone = bytesDone;
@@ -920,11 +1516,7 @@ void *capfs_iod_worker(void *args)
 			if (blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply)) != sizeof(cas_reply))
 			{
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking send put hash reply] %d\n", sock);
 				return NULL;
@@ -932,6 +1524,102 @@ void *capfs_iod_worker(void *args)
 			/* Do not close the socket. This may be reused */
 			break;
 		}
+		case CAS_HAVE_REQ:
+		{
+			unsigned char bitmap[CAPFS_MAXHASHBITMAP];
+
+			numHashes = incoming_request.header.req.have.numHashes;
+			outgoing_reply_header.opcode = CAS_HAVE_REPLY;
+			if (numHashes < 0 || numHashes > CAPFS_MAXHASHES)
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Client requested too many cas_have_req hashes "
+						"simultaneously -- %d instead of %d(MAX)\n", numHashes, CAPFS_MAXHASHES);
+				outgoing_reply_header.errorCode = TOO_MANY_HASH_OPS;
+				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
+
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [invalid hashes] %d\n", sock);
+				return NULL;
+			}
+			retVal = brecv(sock, (void*) &incoming_request.req.have.hashes, numHashes * CAPFS_MAXHASHLENGTH); 
+			if (retVal != numHashes * CAPFS_MAXHASHLENGTH)
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Blocking recv of cas_have [%d] failed. Recvd %d instead of %d bytes\n",
+						incoming_request.header.requestID, retVal, numHashes * CAPFS_MAXHASHLENGTH);
+				outgoing_reply_header.errorCode = BLOCKING_RECV_ERROR;
+				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
+
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking recv on havehashes] %d\n", sock);
+				return NULL;
+			}
+			chunk_have(incoming_request.req.have.hashes, numHashes, bitmap);
+			outgoing_reply_header.errorCode = NO_ERROR;
+			outgoing_reply_header.req.have.numHashes = numHashes;
+			outgoing_reply_header.nextMessageSize = CAS_HAVE_BITMAP_SIZE(numHashes);
+			if (blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply)) != sizeof(cas_reply)
+					|| blockingSend(sock, bitmap, outgoing_reply_header.nextMessageSize) 
+							!= outgoing_reply_header.nextMessageSize)
+			{
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [blocking send reply havereq error] %d\n", sock);
+				return NULL;
+			}
+			/* Do not close the socket. This may be reused */
+			break;
+		}
+		case CAS_REFS_REQ:
+		{
+			numHashes = incoming_request.header.req.refs.numHashes;
+			outgoing_reply_header.opcode = CAS_REFS_REPLY;
+			if (numHashes < 0 || numHashes > CAPFS_MAXHASHES)
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Client requested too many cas_refs_req hashes "
+						"simultaneously -- %d instead of %d(MAX)\n", numHashes, CAPFS_MAXHASHES);
+				outgoing_reply_header.errorCode = TOO_MANY_HASH_OPS;
+				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
+
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [invalid hashes] %d\n", sock);
+				return NULL;
+			}
+			if (brecv(sock, (void*) &incoming_request.req.refs.hashes, numHashes * CAPFS_MAXHASHLENGTH) 
+						!= numHashes * CAPFS_MAXHASHLENGTH
+					|| brecv(sock, (void*) &incoming_request.req.refs.deltas, numHashes * sizeof(int))
+						!= numHashes * sizeof(int))
+			{
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Blocking recv of cas_refs [%d] failed\n",
+						incoming_request.header.requestID);
+				outgoing_reply_header.errorCode = BLOCKING_RECV_ERROR;
+				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
+
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking recv on refsreq] %d\n", sock);
+				return NULL;
+			}
+			outgoing_reply_header.errorCode = iod_ref_update(incoming_request.req.refs.hashes,
+					incoming_request.req.refs.deltas, numHashes, 1);
+			if (blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply)) != sizeof(cas_reply))
+			{
+				/* error path must close socket and return NULL right then and there */
+				iod_sock_close(sock);
+
+				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [blocking send reply refsreq error] %d\n", sock);
+				return NULL;
+			}
+			/* Do not close the socket. This may be reused */
+			break;
+		}
 		case CAS_REMOVE_REQ:
 		{
 			struct stat sbuf;
@@ -942,11 +1630,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void *)&outgoing_reply_header, sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [invalid namelength] %d\n", sock);
 				return NULL;
@@ -960,11 +1644,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void *)&outgoing_reply_header, sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad blocking recv on removereq] %d\n", sock);
 				return NULL;
@@ -975,11 +1655,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [no such directory on removereq] %d\n", sock);
 				return NULL;
@@ -990,11 +1666,7 @@ void *capfs_iod_worker(void *args)
 				blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [do_flatten_hierarchy error] %d\n", sock);
 				return NULL;
@@ -1003,11 +1675,7 @@ void *capfs_iod_worker(void *args)
 			if (blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply)) != sizeof(cas_reply))
 			{
 				/* error path must close socket and return NULL right then and there */
-				fd_lock();
-				FD_CLR(sock, &global_readsock_set);
-				FD_CLR(sock, &aux_readsock_set);
-				close(sock);
-				fd_unlock();
+				iod_sock_close(sock);
 
 				LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [blocking send reply removereq error] %d\n", sock);
 				return NULL;
@@ -1024,26 +1692,13 @@ void *capfs_iod_worker(void *args)
 			outgoing_reply_header.opcode = CAS_UNKNOWN_OPCODE;
 			blockingSend(sock, (void*)(&outgoing_reply_header), sizeof(cas_reply));
 
-			fd_lock();
-			FD_CLR(sock, &global_readsock_set);
-			FD_CLR(sock, &aux_readsock_set);
-			close(sock);
-			fd_unlock();
+			iod_sock_close(sock);
 
 			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "Closed socket [bad opcode] %d\n", sock);
 			return NULL;
 		}
 	}
-	if (CAPFS_CAS_CACHE_HANDLES == 1)
-	{
-		fd_lock();
-		/* Indicate to our parent thread that no one is servicing this sockfd by clearing it out from aux_readsock_set */
-		FD_CLR(sock, &aux_readsock_set);
-		fd_unlock();
-	}
-	else
-	{
-		close(sock);
-	}
+	/* Indicate to our parent thread that no one is servicing this sockfd any longer */
+	iod_sock_rearm(sock);
 	return NULL;
 }
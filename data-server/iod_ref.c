@@ -0,0 +1,537 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Chunk reference counts for the CAS server.
+ *
+ * The meta-server tells us (in batches) how many more or fewer recipes
+ * refer to each of our chunks as files are written, truncated and removed.
+ * Every batch is appended to the IOD_REF_JOURNAL and synced before it is
+ * applied to an in-memory table of counts, so the counts survive restarts.
+ * The journal is compacted into a snapshot of the table when it grows too long.
+ *
+ * Chunks we hold no count for (e.g. those stored before counting was in
+ * place) are never touched, and decrements for them are ignored. The
+ * meta-server's increments are refused for chunks we do not have, so that
+ * a recipe never comes to refer to a chunk that is gone.
+ * Once a chunk's count drops to zero, it is queued for reclamation.
+ * A background thread deletes at most reclaim_rate queued chunks a second,
+ * and only those that were neither referenced nor written for reclaim_delay
+ * seconds, since a client may have stored (or found via CAPFS_HAVE) a chunk
+ * that its commit to the meta-server is yet to refer to. A chunk is deleted
+ * without the lock held; while that is in progress, its entry is marked
+ * as being removed and whoever wants to refer to the chunk waits for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include "capfs_config.h"
+#include "list.h"
+#include "log.h"
+#include "capfs_iod.h"
+#include "iod_ref.h"
+
+struct iod_ref_entry {
+	struct list_head re_link; /* hash chain */
+	struct list_head re_zero; /* reclaim queue, empty while referenced */
+	unsigned char    re_hash[CAPFS_MAXHASHLENGTH];
+	int64_t          re_count;
+	time_t           re_since; /* when the chunk was last unreferenced or written */
+	int              re_removing; /* the reclaimer is deleting the chunk */
+};
+
+static struct list_head *ref_table = NULL;
+/* unreferenced chunks, oldest first */
+static LIST_HEAD(ref_zero);
+static int64_t ref_nentries = 0, ref_npending = 0, ref_reclaimed = 0;
+/* protects the table, the queue and the journal */
+static pthread_mutex_t ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int ref_fd = -1;
+static off_t ref_journal_size = 0;
+static int64_t ref_journal_records = 0;
+
+static int ref_reclaim_rate = 0, ref_reclaim_delay = 0;
+static pthread_t ref_reclaimer;
+static int ref_reclaimer_running = 0, ref_stop = 0;
+static pthread_cond_t ref_stop_cond = PTHREAD_COND_INITIALIZER;
+/* signalled whenever the reclaimer is done deleting a chunk */
+static pthread_cond_t ref_removed_cond = PTHREAD_COND_INITIALIZER;
+
+static inline unsigned int ref_bucket(unsigned char *hash)
+{
+	unsigned int b;
+
+	memcpy(&b, hash, sizeof(b));
+	return b & (IOD_REF_BUCKETS - 1);
+}
+
+/* must be called with ref_mutex held */
+static struct iod_ref_entry *ref_search(unsigned char *hash)
+{
+	struct list_head *head, *tmp;
+
+	head = &ref_table[ref_bucket(hash)];
+	list_for_each(tmp, head) {
+		struct iod_ref_entry *entry = list_entry(tmp, struct iod_ref_entry, re_link);
+		if (memcmp(entry->re_hash, hash, CAPFS_MAXHASHLENGTH) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* must be called with ref_mutex held */
+static void ref_queue(struct iod_ref_entry *entry, time_t now)
+{
+	if (list_empty(&entry->re_zero)) {
+		ref_npending++;
+	}
+	else {
+		list_del(&entry->re_zero);
+	}
+	entry->re_since = now;
+	list_add_tail(&entry->re_zero, &ref_zero);
+	return;
+}
+
+/* must be called with ref_mutex held */
+static void ref_drop(struct iod_ref_entry *entry)
+{
+	if (!list_empty(&entry->re_zero)) {
+		list_del(&entry->re_zero);
+		ref_npending--;
+	}
+	list_del(&entry->re_link);
+	ref_nentries--;
+	free(entry);
+	return;
+}
+
+/*
+ * Applies delta to the count of the chunk. A delta of 0 only shows up in a
+ * compacted journal, where it records a chunk that is known but unreferenced.
+ * must be called with ref_mutex held
+ */
+static int ref_apply(unsigned char *hash, int delta, time_t now)
+{
+	struct iod_ref_entry *entry;
+	int64_t old;
+
+	if ((entry = ref_search(hash)) == NULL) {
+		if (delta < 0) {
+			/* a chunk we never counted, leave it alone */
+			return 0;
+		}
+		entry = (struct iod_ref_entry *) calloc(1, sizeof(struct iod_ref_entry));
+		if (entry == NULL) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
+			return -ENOMEM;
+		}
+		memcpy(entry->re_hash, hash, CAPFS_MAXHASHLENGTH);
+		INIT_LIST_HEAD(&entry->re_zero);
+		list_add_tail(&entry->re_link, &ref_table[ref_bucket(hash)]);
+		ref_nentries++;
+		if (delta == 0) {
+			ref_queue(entry, now);
+			return 0;
+		}
+	}
+	old = entry->re_count;
+	entry->re_count += delta;
+	if (entry->re_count < 0) {
+		entry->re_count = 0;
+	}
+	if (old > 0 && entry->re_count == 0) {
+		ref_queue(entry, now);
+	}
+	else if (entry->re_count > 0 && !list_empty(&entry->re_zero)) {
+		list_del_init(&entry->re_zero);
+		ref_npending--;
+	}
+	return 0;
+}
+
+/*
+ * Rebuilds the table from the journal. A torn record at the end
+ * (i.e. an append that did not complete) is truncated away.
+ */
+static int ref_replay(void)
+{
+	struct iod_ref_record rec;
+	time_t now = time(NULL);
+	off_t offset = 0;
+	ssize_t n;
+	int ret;
+
+	while ((n = pread(ref_fd, &rec, sizeof(rec), offset)) == sizeof(rec)) {
+		if (rec.rr_magic != IOD_REF_MAGIC) {
+			break;
+		}
+		if ((ret = ref_apply(rec.rr_hash, rec.rr_delta, now)) < 0) {
+			return ret;
+		}
+		offset += sizeof(rec);
+		ref_journal_records++;
+	}
+	if (n < 0) {
+		return -errno;
+	}
+	if (n != 0) {
+		LOG(stderr, WARNING_MSG, SUBSYS_DATA, "truncating torn reference journal record at offset %Ld\n",
+				(long long) offset);
+		if (ftruncate(ref_fd, offset) < 0) {
+			return -errno;
+		}
+	}
+	ref_journal_size = offset;
+	return 0;
+}
+
+/*
+ * Replaces the journal with a snapshot of the table.
+ * must be called with ref_mutex held
+ */
+static int ref_compact(void)
+{
+	char tmpname[64];
+	struct iod_ref_record *recs;
+	int64_t n = 0;
+	int i, fd, ret = 0;
+	size_t len;
+
+	recs = (struct iod_ref_record *) calloc(ref_nentries ? ref_nentries : 1, sizeof(struct iod_ref_record));
+	if (recs == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < IOD_REF_BUCKETS; i++) {
+		struct list_head *tmp;
+		list_for_each(tmp, &ref_table[i]) {
+			struct iod_ref_entry *entry = list_entry(tmp, struct iod_ref_entry, re_link);
+			recs[n].rr_magic = IOD_REF_MAGIC;
+			recs[n].rr_delta = (entry->re_count > INT32_MAX) ? INT32_MAX : entry->re_count;
+			memcpy(recs[n].rr_hash, entry->re_hash, CAPFS_MAXHASHLENGTH);
+			n++;
+		}
+	}
+	snprintf(tmpname, 64, "%s.tmp", IOD_REF_JOURNAL);
+	/* the snapshot becomes the journal that later updates are appended to */
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0700)) < 0) {
+		free(recs);
+		return -errno;
+	}
+	len = n * sizeof(struct iod_ref_record);
+	if (write(fd, recs, len) != (ssize_t) len) {
+		ret = (errno != 0) ? -errno : -EIO;
+	}
+	else if (fsync(fd) < 0) {
+		ret = -errno;
+	}
+	free(recs);
+	if (ret == 0 && rename(tmpname, IOD_REF_JOURNAL) < 0) {
+		ret = -errno;
+	}
+	if (ret < 0) {
+		close(fd);
+		unlink(tmpname);
+		return ret;
+	}
+	close(ref_fd);
+	ref_fd = fd;
+	ref_journal_size = len;
+	ref_journal_records = n;
+	LOG(stderr, INFO_MSG, SUBSYS_DATA, "compacted reference journal to %Ld records\n", (long long) n);
+	return 0;
+}
+
+/* Deletes up to ref_reclaim_rate chunks that have been unreferenced for long enough */
+static void ref_reclaim(void)
+{
+	time_t now = time(NULL);
+	int i, ret;
+
+	pthread_mutex_lock(&ref_mutex);
+	for (i = 0; i < ref_reclaim_rate && !list_empty(&ref_zero); i++) {
+		struct iod_ref_entry *entry = list_entry(ref_zero.next, struct iod_ref_entry, re_zero);
+
+		if (entry->re_since + ref_reclaim_delay > now) {
+			break;
+		}
+		/*
+		 * Off the queue and marked, a write, CAPFS_HAVE or increment
+		 * waits for us rather than revive a chunk we are deleting.
+		 */
+		list_del_init(&entry->re_zero);
+		ref_npending--;
+		entry->re_removing = 1;
+		pthread_mutex_unlock(&ref_mutex);
+		ret = chunk_remove(entry->re_hash);
+		pthread_mutex_lock(&ref_mutex);
+		entry->re_removing = 0;
+		pthread_cond_broadcast(&ref_removed_cond);
+		if (ret < 0) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "could not reclaim chunk: %s\n", strerror(-ret));
+			/* try again later */
+			ref_queue(entry, now);
+			continue;
+		}
+		ref_drop(entry);
+		ref_reclaimed++;
+	}
+	pthread_mutex_unlock(&ref_mutex);
+	return;
+}
+
+static void *ref_reclaimer_thread(void *args)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	pthread_mutex_lock(&ref_mutex);
+	while (!ref_stop) {
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + 1;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		pthread_cond_timedwait(&ref_stop_cond, &ref_mutex, &ts);
+		if (ref_stop) {
+			break;
+		}
+		pthread_mutex_unlock(&ref_mutex);
+		ref_reclaim();
+		pthread_mutex_lock(&ref_mutex);
+	}
+	pthread_mutex_unlock(&ref_mutex);
+	return NULL;
+}
+
+/*
+ * Loads the reference counts in the current working directory.
+ * Unreferenced chunks are reclaimed at reclaim_rate chunks a second
+ * (never if it is 0), once they have stayed so for reclaim_delay seconds.
+ * Returns 0 on success, -errno on failure.
+ */
+int iod_ref_init(int reclaim_rate, int reclaim_delay)
+{
+	int i, ret;
+
+	ref_reclaim_rate = reclaim_rate;
+	ref_reclaim_delay = (reclaim_delay < 0) ? 0 : reclaim_delay;
+	ref_table = (struct list_head *) malloc(IOD_REF_BUCKETS * sizeof(struct list_head));
+	if (ref_table == NULL) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not allocate memory\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < IOD_REF_BUCKETS; i++) {
+		INIT_LIST_HEAD(&ref_table[i]);
+	}
+	if ((ref_fd = open(IOD_REF_JOURNAL, O_RDWR | O_CREAT | O_APPEND, 0700)) < 0) {
+		ret = -errno;
+		goto err;
+	}
+	if ((ret = ref_replay()) < 0) {
+		goto err;
+	}
+	if (ref_reclaim_rate > 0) {
+		ref_stop = 0;
+		if ((ret = pthread_create(&ref_reclaimer, NULL, ref_reclaimer_thread, NULL)) != 0) {
+			ret = -ret;
+			goto err;
+		}
+		ref_reclaimer_running = 1;
+	}
+	LOG(stderr, INFO_MSG, SUBSYS_DATA, "reference counts for %Ld chunks, %Ld unreferenced\n",
+			(long long) ref_nentries, (long long) ref_npending);
+	return 0;
+err:
+	errno = -ret;
+	PERROR(SUBSYS_DATA, "iod_ref_init");
+	iod_ref_finalize();
+	return ret;
+}
+
+void iod_ref_finalize(void)
+{
+	int i;
+
+	if (ref_reclaimer_running) {
+		pthread_mutex_lock(&ref_mutex);
+		ref_stop = 1;
+		pthread_cond_signal(&ref_stop_cond);
+		pthread_mutex_unlock(&ref_mutex);
+		pthread_join(ref_reclaimer, NULL);
+		ref_reclaimer_running = 0;
+	}
+	if (ref_fd >= 0) {
+		close(ref_fd);
+		ref_fd = -1;
+	}
+	if (ref_table == NULL) {
+		return;
+	}
+	for (i = 0; i < IOD_REF_BUCKETS; i++) {
+		while (!list_empty(&ref_table[i])) {
+			ref_drop(list_entry(ref_table[i].next, struct iod_ref_entry, re_link));
+		}
+	}
+	free(ref_table);
+	ref_table = NULL;
+	return;
+}
+
+/*
+ * Waits until the reclaimer is not deleting the chunk.
+ * must be called with ref_mutex held
+ */
+static void ref_wait(unsigned char *hash)
+{
+	struct iod_ref_entry *entry;
+
+	while ((entry = ref_search(hash)) != NULL && entry->re_removing) {
+		pthread_cond_wait(&ref_removed_cond, &ref_mutex);
+	}
+	return;
+}
+
+/*
+ * Returns 1 if the reclaimer is deleting a chunk that recs increments.
+ * must be called with ref_mutex held
+ */
+static int ref_removing(struct iod_ref_record *recs, int n)
+{
+	struct iod_ref_entry *entry;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (recs[i].rr_delta > 0 && (entry = ref_search(recs[i].rr_hash)) != NULL && entry->re_removing) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Journals and applies the updates in recs. If present is set, the updates
+ * are refused with -ENOENT if any of the chunks they increment is not stored here.
+ * must be called with ref_mutex held
+ */
+static int ref_update(struct iod_ref_record *recs, int n, int present)
+{
+	time_t now = time(NULL);
+	ssize_t len = n * sizeof(struct iod_ref_record), wsize;
+	int i, ret = 0;
+
+	while (ref_removing(recs, n)) {
+		pthread_cond_wait(&ref_removed_cond, &ref_mutex);
+	}
+	for (i = 0; present && i < n; i++) {
+		if (recs[i].rr_delta > 0 && !chunk_exists(recs[i].rr_hash)) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "refusing reference to a chunk we do not have\n");
+			return -ENOENT;
+		}
+	}
+	if (n > 0) {
+		wsize = write(ref_fd, recs, len);
+		if (wsize != len || fdatasync(ref_fd) < 0) {
+			ret = (wsize < 0 || wsize == len) ? -errno : -EIO;
+			/* don't leave a partial batch behind */
+			ftruncate(ref_fd, ref_journal_size);
+			LOG(stderr, CRITICAL_MSG, SUBSYS_DATA, "could not journal reference counts: %s\n", strerror(-ret));
+			return ret;
+		}
+		ref_journal_size += len;
+		ref_journal_records += n;
+	}
+	for (i = 0; i < n; i++) {
+		if ((ret = ref_apply(recs[i].rr_hash, recs[i].rr_delta, now)) < 0) {
+			break;
+		}
+	}
+	if (ref_journal_records > 2 * ref_nentries + IOD_REF_COMPACT_SLACK) {
+		int err;
+
+		if ((err = ref_compact()) < 0) {
+			LOG(stderr, WARNING_MSG, SUBSYS_DATA, "could not compact reference journal: %s\n", strerror(-err));
+		}
+	}
+	return ret;
+}
+
+/*
+ * Adds deltas[i] to the reference count of the chunk named by the i-th hash.
+ * If present is set, nothing is updated unless all the chunks that are
+ * incremented are stored here. The update is on stable storage by the time we return.
+ * Returns 0 on success, -errno on failure.
+ */
+int iod_ref_update(unsigned char *hashes, int *deltas, int count, int present)
+{
+	struct iod_ref_record *recs;
+	int i, n = 0, ret;
+
+	if (ref_table == NULL) {
+		return -EINVAL;
+	}
+	if ((recs = (struct iod_ref_record *) calloc(count ? count : 1, sizeof(struct iod_ref_record))) == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; i++) {
+		if (deltas[i] == 0) {
+			continue;
+		}
+		recs[n].rr_magic = IOD_REF_MAGIC;
+		recs[n].rr_delta = deltas[i];
+		memcpy(recs[n].rr_hash, hashes + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH);
+		n++;
+	}
+	pthread_mutex_lock(&ref_mutex);
+	ret = ref_update(recs, n, present);
+	pthread_mutex_unlock(&ref_mutex);
+	free(recs);
+	return ret;
+}
+
+/*
+ * Called when a chunk is written or found by CAPFS_HAVE, i.e. when a client
+ * may be about to commit a reference to it. Restarts its grace period if it is unreferenced.
+ * If the chunk is being reclaimed, waits until it is gone, so call this before looking for it.
+ */
+void iod_ref_touch(unsigned char *hash)
+{
+	struct iod_ref_entry *entry;
+
+	if (ref_table == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&ref_mutex);
+	ref_wait(hash);
+	if ((entry = ref_search(hash)) != NULL && entry->re_count == 0) {
+		ref_queue(entry, time(NULL));
+	}
+	pthread_mutex_unlock(&ref_mutex);
+	return;
+}
+
+void iod_ref_stat(struct cas_iod_stat *stat)
+{
+	pthread_mutex_lock(&ref_mutex);
+	stat->is_ref_chunks = ref_nentries;
+	stat->is_ref_pending = ref_npending;
+	stat->is_ref_reclaimed = ref_reclaimed;
+	pthread_mutex_unlock(&ref_mutex);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Chunk reference counts for the CAS server.
+ */
+#ifndef _IOD_REF_H
+#define _IOD_REF_H
+
+#include <stdint.h>
+#include "capfs_config.h"
+#include "cas.h"
+
+/* journal of reference count updates (relative to the datadir) */
+#define IOD_REF_JOURNAL      "capfs.refs"
+#define IOD_REF_MAGIC        0x43415052 /* "CAPR" */
+/* number of buckets in the in-memory hash -> count table */
+#define IOD_REF_BUCKETS      (1 << 20)
+/* the journal is compacted once it has this many records more than twice the live entries */
+#define IOD_REF_COMPACT_SLACK 65536
+
+/* on-disk journal record */
+struct iod_ref_record {
+	uint32_t rr_magic;
+	int32_t  rr_delta;
+	unsigned char rr_hash[CAPFS_MAXHASHLENGTH];
+};
+
+extern int  iod_ref_init(int reclaim_rate, int reclaim_delay);
+extern void iod_ref_finalize(void);
+extern int  iod_ref_update(unsigned char *hashes, int *deltas, int count, int present);
+extern void iod_ref_touch(unsigned char *hash);
+extern void iod_ref_stat(struct cas_iod_stat *stat);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <ctype.h>
 #include <arpa/inet.h>
 #include <sys/param.h>
 
@@ -56,6 +57,9 @@ struct iodtabinfo *my_parse_iodtab(char *fname)
 		/* blank lines get skipped here */
 		if (!(entry = strtok(inbuf, "#\n"))) continue;
 
+		/* the chunk placement line names no iod */
+		if (!strncmp(entry, "placement", 9) && isspace(entry[9])) continue;
+
 		for (port = entry; *port && *port != ':'; port++);
 		if (*port == ':') /* port number present */ {
 			char *err;
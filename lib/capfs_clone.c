@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * See LIBRARY_COPYING in top-level directory.
+ */
+
+/*
+ * capfs_clone() makes newname a copy of oldname without moving any data.
+ * The meta-data server duplicates the recipe of the file, and the copy
+ * shares all of its chunks with the original until either is written.
+ * Both names must be on the same CAPFS volume and newname must not exist.
+ */
+
+#include <lib.h>
+
+#include <sys/param.h>
+#include <meta.h>
+#include <errno.h>
+
+extern int capfs_checks_disabled;
+
+int capfs_clone(const char *oldname, const char *newname)
+{
+	int j, i;
+	mreq request;
+	mack ack;
+	struct sockaddr *saddr;
+	char *fn = NULL;
+	int64_t newfs_ino, oldfs_ino;
+	char bothnames[MAXPATHLEN+MAXPATHLEN+2];
+	int len, bothlen = 0;
+	struct capfs_options opt;
+
+	opt.tcp = MGR_USE_TCP;
+	opt.use_hcache = 0;
+
+	memset(&request, 0, sizeof(request));
+	if (!oldname || !newname) {
+		errno = EFAULT;
+		return(-1);
+	}
+	if (capfs_checks_disabled) {
+		errno = EOPNOTSUPP;
+		return(-1);
+	}
+	if ((j = capfs_detect(oldname, &fn, &saddr, &oldfs_ino, NULL, FOLLOW_LINK)) < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (fn != NULL) strncpy(bothnames, fn, MAXPATHLEN);
+
+	if ((i = capfs_detect(newname, &fn, &saddr, &newfs_ino, NULL, NOFOLLOW_LINK)) < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (i == 0 && j == 0) {
+		/* only CAPFS files can share their chunks */
+		errno = EOPNOTSUPP;
+		return(-1);
+	}
+	if (i == 0 || j == 0 || (newfs_ino != oldfs_ino)) {
+		errno = EXDEV; /* not on same file system! */
+		return(-1);
+	}
+	/* get both strings into one happy buffer */
+	len = strlen(bothnames);
+	bothlen = strlen(fn) + len + 1; /* don't count final terminator */
+	strncpy(&bothnames[len+1], fn, MAXPATHLEN);
+
+	/* Prepare request for file system  */
+	request.uid = getuid();
+	request.gid = getgid();
+	request.type = MGR_CLONE;
+	request.dsize = bothlen;
+
+	/* Send request to mgr */
+	if (send_mreq_saddr(&opt, saddr, &request, bothnames, &ack, NULL) < 0) {
+		int myeno = errno;
+		PERROR(SUBSYS_LIB,"capfs_clone: send_mreq_saddr -");
+		errno = myeno;
+		return(-1);
+	}
+	else if (ack.status) {
+		errno = ack.eno;
+		PERROR(SUBSYS_LIB,"capfs_clone:");
+	}
+	return ack.status;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
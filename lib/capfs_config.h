@@ -121,6 +121,33 @@
 #define CB_CLNT_TIMEOUT  90
 #define MGR_NUM_THREADS 2
 #define MGR_REQ_PORT 	3000
+/* chunk reference count decrements are sent to an iod MGR_REFS_BATCH at a time,
+ * or every MGR_REFS_INTERVAL seconds. At most MGR_REFS_BACKLOG batches are
+ * held for an iod that cannot be reached.
+ */
+#define MGR_REFS_BATCH    1024
+#define MGR_REFS_INTERVAL 5
+#define MGR_REFS_BACKLOG  64
+/* hcache callbacks to the sharers of a file are sent by MGR_CB_WINDOW threads,
+ * so that at most that many are in flight at once. A callback waits MGR_CB_COALESCE
+ * microseconds for callbacks on neighbouring chunks of the same file to merge with.
+ */
+#define MGR_CB_WINDOW     32
+#define MGR_CB_COALESCE   1000
+/* the meta-server keeps the recipes of up to MGR_RECIPE_FILES recently used files
+ * (MGR_RECIPE_CACHE_SIZE bytes of hashes in all) in memory. Recipes longer than
+ * MGR_RECIPE_MAXCHUNKS hashes are not cached. In write-back mode, dirty recipes
+ * are written out every MGR_RECIPE_INTERVAL seconds.
+ */
+#define MGR_RECIPE_FILES      1024
+#define MGR_RECIPE_CACHE_SIZE (64 * 1024 * 1024)
+#define MGR_RECIPE_MAXCHUNKS  (1024 * 1024)
+#define MGR_RECIPE_INTERVAL   1
+#define MGR_RECIPE_BUCKETS    1021
+/* hash trees over the recipes (see CAPFS_TREE_FANOUT) are kept for up to
+ * MGR_TREE_FILES recently used files.
+ */
+#define MGR_TREE_FILES        64
 #define CAPFS_MAXIODS 	512
 #define CAPFS_BACKLOG 		256
 /* File name restrictions imposed both at the RPC layer and md server disk-side protocol */
@@ -130,6 +157,10 @@
 #define CAPFS_MAXHASHLENGTH 20
 /* Parameters for the RPC communication used by meta-server and data-server */
 #define CAPFS_MAXHASHES  16384 
+/* Size of the bitmap returned by a CAPFS_HAVE query, one bit per hash (CAPFS_MAXHASHES / 8) */
+#define CAPFS_MAXHASHBITMAP 2048
+/* Each node of the hash tree of a recipe (CAPFS_GETTREE) is the hash of up to this many nodes of the level below */
+#define CAPFS_TREE_FANOUT 256
 
 /* Should we use UDP/TCP? Library uses UDP by default */
 #define MGR_USE_TCP 0
@@ -141,6 +172,10 @@
 #define CAPFS_HCACHE_COUNT 131072 /* i.e. it has a capacity of 131072 hashes (131072 * 20 bytes = 2.5 MB hcache) */
 #define CAPFS_DCACHE_BSIZE CAPFS_CHUNK_SIZE /* dcache also needs to know the chunk_size */
 #define CAPFS_DCACHE_COUNT 16384 /* i.e. the data cache has a capacity of 16384 data blocks (16384 * 16384 = 256 MB dcache) */
+#define CAPFS_DCACHE_DISK_COUNT 262144 /* i.e. the on-disk data cache, if any, holds 262144 data blocks (4 GB) */
+#define CAPFS_WB_CHUNKS 16 /* i.e. capfsd gathers up to 16 chunks (256 KB) of small writes per open file, if the plugin delays commits */
+#define CAPFS_HOLD_MAX_AGE 60 /* seconds capfsd may hold back writes before committing them, well under IOD_RECLAIM_DELAY */
+#define CAPFS_HOLD_CHECK_AGE (IOD_RECLAIM_DELAY / 4) /* seconds after which capfsd checks that the iods still have the chunks of writes it could not commit */
 
 /* cache client/socket handles policy */
 #define CAPFS_MGR_CACHE_HANDLES 		  1
@@ -196,6 +231,47 @@
 #define IOD_WRITE_BUFFER_SIZE (512*1024)
 #define IOD_SOCKET_BUFFER_SIZE (65535)
 
+/* IOD_PACK_SIZE - size at which a container of the packed chunk store is sealed
+ * IOD_PACK_CHECKPOINT - number of chunk appends between checkpoints of the
+ *   packed store index (0 checkpoints only at shutdown)
+ */
+#define IOD_PACK_SIZE ((int64_t) 1024*1024*1024)
+#define IOD_PACK_CHECKPOINT 4096
+
+/* IOD_IO_THREADS - number of threads that service the chunk reads/writes of
+ *   a multi-hash request concurrently (0 services them one after the other).
+ *   Must be less than the thread pool limit (TP_MAX_THREADS).
+ */
+#define IOD_IO_THREADS 8
+
+/* IOD_CHUNK_CACHE - bytes of memory used to cache the contents of popular
+ *   chunks on the iod (0 disables the cache)
+ */
+#define IOD_CHUNK_CACHE ((int64_t) 64*1024*1024)
+
+/* IOD_COMPRESSION - codec used to compress chunks before they are stored
+ *   on the iod ("none" or "zlib")
+ */
+#define IOD_COMPRESSION "none"
+
+/* IOD_RECLAIM_RATE - maximum number of unreferenced chunks the iod deletes
+ *   per second (0 keeps all chunks, i.e. reclamation is turned off)
+ */
+#define IOD_RECLAIM_RATE 0
+
+/* IOD_RECLAIM_DELAY - seconds a chunk must stay unreferenced (and
+ *   unwritten) before the iod may delete it
+ */
+#define IOD_RECLAIM_DELAY 600
+
+/* IOD_CDC_MIN_SIZE, IOD_CDC_AVG_SIZE, IOD_CDC_MAX_SIZE - smallest, average
+ *   and largest size of the content-defined pieces the iod cuts chunks into
+ *   before storing them (an average of 0 stores chunks whole)
+ */
+#define IOD_CDC_MIN_SIZE 512
+#define IOD_CDC_AVG_SIZE 0
+#define IOD_CDC_MAX_SIZE 8192
+
 /* IOCTL DEFINES - COULDN'T FIND A BETTER PLACE TO PUT THEM... */
 /* These are just arbitrary #s that linux doesn't seem to use. */
 #define GETPART     0x5601
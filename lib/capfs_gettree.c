@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * See LIBRARY_COPYING in top-level directory.
+ */
+
+/*
+ * capfs_gettree() fetches up to max_nodes nodes of one level of the hash tree
+ * over the recipe of a CAPFS file, starting at begin_node. Level 0 is the recipe
+ * itself, and node i of level l + 1 is the SHA-1 of nodes [i * CAPFS_TREE_FANOUT,
+ * (i + 1) * CAPFS_TREE_FANOUT) of level l, so node i of level l stands for chunks
+ * [i * CAPFS_TREE_FANOUT^l, (i + 1) * CAPFS_TREE_FANOUT^l). The length of the
+ * recipe and the level of the root (whose only node is node 0) are returned in
+ * *nchunks and *levels. Returns the number of nodes copied to pnodes, or -1.
+ */
+
+#include <capfs-header.h>
+#include <lib.h>
+#include <errno.h>
+#include <log.h>
+#include "mgr.h"
+
+int capfs_gettree(const char *path, int level, int64_t begin_node, int max_nodes, unsigned char *pnodes,
+		int64_t *nchunks, int *levels)
+{
+	int i;
+	mreq req;
+	mack ack;
+	struct sockaddr *saddr = NULL;
+	char *fn = NULL;
+	int64_t fs_ino;
+	struct ackdata_c ackdata;
+	struct capfs_options opt;
+
+	if (!path || !pnodes) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (level < 0 || begin_node < 0 || max_nodes < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* a full response is too large for UDP */
+	opt.tcp = 1;
+	opt.use_hcache = 0;
+	i = capfs_detect2(path, &fn, &saddr, &fs_ino, NULL, FOLLOW_LINK);
+	if (i < 0 || i > 2) /* error */ {
+		PERROR(SUBSYS_LIB,"Error finding file");
+		return(-1);
+	}
+	else if (i == 0 || i == 2) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.uid = getuid();
+	req.gid = getgid();
+	req.type = MGR_GETTREE;
+	req.dsize = strlen(fn);
+	req.req.gettree.level = level;
+	req.req.gettree.begin_node = begin_node;
+	req.req.gettree.nnodes = max_nodes;
+	ackdata.type = MGR_GETTREE;
+	ackdata.u.gettree.nnodes = max_nodes;
+	ackdata.u.gettree.buf = pnodes;
+	/* send request and receive ack */
+	memset(&ack, 0, sizeof(ack));
+	if (send_mreq_saddr(&opt, saddr, &req, fn, &ack, &ackdata) < 0) {
+		return -1;
+	}
+	if (ack.status != 0) {
+		errno = ack.eno;
+		return -1;
+	}
+	if (nchunks) {
+		*nchunks = ack.ack.gettree.nchunks;
+	}
+	if (levels) {
+		*levels = ack.ack.gettree.levels;
+	}
+	return ackdata.u.gettree.nnodes;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -73,8 +73,13 @@ int capfs_write_list(int     fd,
 int capfs_writev(int fd, const struct iovec *vector, size_t count);
 int capfs_symlink(const char* target_name, const char *link_name);
 int capfs_link(const char* target_name, const char *link_name);
+int capfs_clone(const char *oldname, const char *newname);
+int capfs_snapshot(const char *dirname, const char *snapname);
+int capfs_snapshot_remove(const char *dirname, const char *snapname);
 int capfs_readlink(const char *path, char *buf, size_t bufsiz);
 int capfs_gethashes(const char *path, unsigned char *phashes, int64_t begin_offset, int max_hashes);
+int capfs_gettree(const char *path, int level, int64_t begin_node, int max_nodes, unsigned char *pnodes,
+		int64_t *nchunks, int *levels);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * See LIBRARY_COPYING in top-level directory.
+ */
+
+/*
+ * capfs_snapshot() takes a read-only snapshot of the tree under dirname,
+ * which then shows up as dirname/.snapshot/snapname. Only the meta-data
+ * server is involved: the snapshot shares the recipes of the live files,
+ * and a live file gets a recipe of its own the next time it is written.
+ * capfs_snapshot_remove() drops a snapshot and releases the chunks that
+ * nothing else refers to. Only the owner of dirname may do either.
+ */
+
+#include <lib.h>
+
+#include <sys/param.h>
+#include <meta.h>
+#include <errno.h>
+
+extern int capfs_checks_disabled;
+
+static int snapshot_request(const char *dirname, const char *snapname, int remove)
+{
+	mreq request;
+	mack ack;
+	struct sockaddr *saddr;
+	char *fn = NULL;
+	int64_t fs_ino;
+	char bothnames[MAXPATHLEN+MAXPATHLEN+2];
+	int len, bothlen = 0;
+	struct capfs_options opt;
+
+	opt.tcp = MGR_USE_TCP;
+	opt.use_hcache = 0;
+
+	memset(&request, 0, sizeof(request));
+	if (!dirname || !snapname) {
+		errno = EFAULT;
+		return(-1);
+	}
+	if (capfs_checks_disabled) {
+		errno = EOPNOTSUPP;
+		return(-1);
+	}
+	if (strlen(snapname) >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	if ((len = capfs_detect(dirname, &fn, &saddr, &fs_ino, NULL, FOLLOW_LINK)) < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (len == 0 || fn == NULL) {
+		/* only CAPFS directories have snapshots */
+		errno = EOPNOTSUPP;
+		return(-1);
+	}
+	/* get both strings into one happy buffer */
+	strncpy(bothnames, fn, MAXPATHLEN);
+	len = strlen(bothnames);
+	bothlen = strlen(snapname) + len + 1; /* don't count final terminator */
+	strncpy(&bothnames[len+1], snapname, MAXPATHLEN);
+
+	/* Prepare request for file system  */
+	request.uid = getuid();
+	request.gid = getgid();
+	request.type = MGR_SNAPSHOT;
+	request.dsize = bothlen;
+	request.req.snapshot.remove = remove;
+
+	/* Send request to mgr */
+	if (send_mreq_saddr(&opt, saddr, &request, bothnames, &ack, NULL) < 0) {
+		int myeno = errno;
+		PERROR(SUBSYS_LIB,"capfs_snapshot: send_mreq_saddr -");
+		errno = myeno;
+		return(-1);
+	}
+	else if (ack.status) {
+		errno = ack.eno;
+		PERROR(SUBSYS_LIB,"capfs_snapshot:");
+	}
+	return ack.status;
+}
+
+int capfs_snapshot(const char *dirname, const char *snapname)
+{
+	return snapshot_request(dirname, snapname, 0);
+}
+
+int capfs_snapshot_remove(const char *dirname, const char *snapname)
+{
+	return snapshot_request(dirname, snapname, 1);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -28,6 +28,7 @@ typedef struct iodtabinfo iodtabinfo, *iodtabinfo_p;
 struct iodtabinfo
 {
 	int nodecount;
+	int placement; /* CAPFS_PLACE_* of new files, from a "placement" line */
 	struct sockaddr_in iod[CAPFS_MAXIODS];
 };
 
@@ -101,11 +101,15 @@ struct capfs_stat {
     } while (0);
 
 
+/* values of capfs_filestat.placement */
+#define CAPFS_PLACE_STRIPE 0 /* chunk goes to the iod its stripe maps to */
+#define CAPFS_PLACE_HASH   1 /* chunk goes to the iod its hash maps to (see shared/place.c) */
+
 struct capfs_filestat {
 	int32_t base;
 	int32_t pcount;
 	int32_t ssize;
-	int32_t __pad;  /* round up to 64-bit fields */
+	int32_t placement; /* CAPFS_PLACE_*, was padding (hence 0 in older files) */
 };
 
 typedef struct fmeta fmeta, *fmeta_p;
@@ -48,8 +48,11 @@ extern "C" {
 #define MGR_STAT     26
 #define MGR_GETHASHES 27
 #define MGR_WCOMMIT  28
+#define MGR_CLONE    29
+#define MGR_SNAPSHOT 30
+#define MGR_GETTREE  31
 
-#define MAX_MGR_REQ  28
+#define MAX_MGR_REQ  31
 
 /* structure for request to manager */
 typedef struct mreq mreq, *mreq_p;
@@ -150,6 +153,14 @@ struct mreq {
 			int64_t begin_chunk;
 			int64_t write_size;
 		} wcommit;
+		struct {
+			int32_t remove; /* drop the snapshot instead of taking it */
+		} snapshot;
+		struct {
+			int64_t begin_node;
+			int64_t nnodes;
+			int32_t level; /* 0 for the recipe itself */
+		} gettree;
 	} req;
 };
 
@@ -205,6 +216,14 @@ struct mack {
 			int64_t nhashes;
 			fmeta   meta;
 		} wcommit;
+		struct {
+			fmeta meta; /* metadata of the new copy */
+		} clone;
+		struct {
+			int64_t nchunks; /* length of the recipe */
+			int64_t nnodes;
+			int32_t levels;  /* level of the root */
+		} gettree;
 	} ack;
 };
 
@@ -31,6 +31,7 @@ struct cas_return {
 	struct dataArray* buf;
 	int count;
 	int64_t server_time;
+	int64_t bytes_saved; /* bytes that need not be shipped since the server had them */
 };
 
 struct cas_iod_worker_data {
@@ -41,6 +42,11 @@ struct cas_iod_worker_data {
 	int *returnValue; /* how many of the hashes were done for this iod */
 };
 
+/* Helpers to walk the bitmap returned by a have request */
+#define CAS_HAVE_BITMAP_SIZE(n)      (((n) + 7) / 8)
+#define cas_have_isset(bitmap, i)    ((bitmap)[(i) >> 3] & (1 << ((i) & 7)))
+#define cas_have_set(bitmap, i)      ((bitmap)[(i) >> 3] |= (1 << ((i) & 7)))
+
 /* REQUEST opcodes in use */
 enum {
 	CAS_PING_REQ=1,
@@ -48,6 +54,10 @@ enum {
 	CAS_GET_REQ=3,
 	CAS_STATFS_REQ=4,
 	CAS_REMOVE_REQ=5,
+	CAS_HAVE_REQ=6,
+	CAS_IODSTAT_REQ=7,
+	CAS_REFS_REQ=8,
+	CAS_GET_SIZED_REQ=9,
 };
 
 typedef struct cas_header cas_header;
@@ -66,6 +76,12 @@ struct cas_header {
 		struct {
 			int nameLen;
 		}remove;
+		struct {
+			int numHashes;
+		}have;
+		struct {
+			int numHashes; /* followed by the hashes and then numHashes int deltas */
+		}refs;
 	} req;
 };
 
@@ -84,6 +100,13 @@ struct cas_request {
 		struct {
 			unsigned char name[CAPFS_MAXNAMELEN];
 		}remove;
+		struct {
+			unsigned char hashes[CAPFS_MAXHASHLENGTH * CAPFS_MAXHASHES];
+		}have;
+		struct {
+			unsigned char hashes[CAPFS_MAXHASHLENGTH * CAPFS_MAXHASHES];
+			int deltas[CAPFS_MAXHASHES];
+		}refs;
 	}req;
 };
 
@@ -95,6 +118,36 @@ enum {
 	CAS_GET_REPLY=3,
 	CAS_STATFS_REPLY=4,
 	CAS_REMOVE_REPLY=5,
+	CAS_HAVE_REPLY=6,
+	CAS_IODSTAT_REPLY=7,
+	CAS_REFS_REPLY=8,
+	CAS_GET_SIZED_REPLY=9,
+};
+
+/* counters reported by an iod, sent after the header of a CAS_IODSTAT_REPLY */
+struct cas_iod_stat {
+	/* chunk cache */
+	int64_t is_cache_hits;
+	int64_t is_cache_misses;
+	int64_t is_cache_evictions;
+	int64_t is_cache_entries;  /* chunks currently cached */
+	int64_t is_cache_bytes;    /* bytes currently cached */
+	int64_t is_cache_capacity; /* 0 if the cache is disabled */
+	/* chunk compression */
+	int64_t is_codec_packed;       /* chunks stored compressed */
+	int64_t is_codec_skipped;      /* chunks stored verbatim since they did not compress */
+	int64_t is_codec_raw_bytes;    /* bytes handed to the store */
+	int64_t is_codec_stored_bytes; /* bytes that actually went to the store */
+	int64_t is_codec_pack_usecs;   /* time spent compressing */
+	int64_t is_codec_unpack_usecs; /* time spent decompressing */
+	/* reference counting */
+	int64_t is_ref_chunks;    /* chunks whose references are counted */
+	int64_t is_ref_pending;   /* unreferenced chunks waiting to be reclaimed */
+	int64_t is_ref_reclaimed; /* chunks reclaimed since startup */
+	/* content-defined chunking */
+	int64_t is_cdc_chunks;    /* chunks stored as pieces */
+	int64_t is_cdc_bytes;     /* bytes in those chunks */
+	int64_t is_cdc_new_bytes; /* bytes in pieces that were not already stored */
 };
 
 /* request structure for the cas-enabled client and iod*/
@@ -117,11 +170,19 @@ struct cas_reply {
 	int64_t server_time;
 	union {
 		struct {
+			/*
+			 * followed by the chunks, with sparse ones as CAPFS_CHUNK_SIZE zeroes. A reply
+			 * to CAS_GET_SIZED_REQ puts numHashes ints of chunk sizes in front of them
+			 * instead, and leaves out the sparse chunks (size 0).
+			 */
 			int numHashes;
 		}get;
 		struct {
 			int bytesDone;
 		}put;
+		struct {
+			int numHashes; /* followed by nextMessageSize bytes of bitmap */
+		}have;
 		struct {
 			struct statfs sfs;
 		}cas_statfs;
@@ -149,7 +210,12 @@ extern void clnt_get(int tcp, struct cas_iod_worker_data *iod_jobs, int count);
 extern void clnt_put(int tcp, struct cas_iod_worker_data *iod_jobs, int count);
 extern int clnt_ping(int tcp, struct sockaddr* iodAddress);
 extern int clnt_statfs_req(int tcp, struct sockaddr* iodAddress, struct statfs *sfs);
+extern int clnt_iod_stat(int tcp, struct sockaddr* iodAddress, struct cas_iod_stat *stat);
+extern int clnt_refs(int tcp, struct sockaddr* iodAddress, unsigned char *hashes, int *deltas, int count);
+extern int clnt_have(int tcp, struct sockaddr* iodAddress, unsigned char *hashes, int count, unsigned char *bitmap);
 extern int clnt_removeall(int tcp, struct sockaddr *serverAddress, char *dirname);
+extern void clnt_bytes_saved_add(int64_t bytes);
+extern int64_t clnt_bytes_saved_take(void);
 extern struct cas_iod_worker_data* convert_to_jobs(struct dataArray* da, int nChunks, struct iod_map* map,
 		fdesc* desc, unsigned char* hash, int *iodCount);
 extern void freeJobs(struct cas_iod_worker_data *jobs, int nIods);
@@ -72,6 +72,9 @@ struct instrumentation_s get_criticalPathTime;
 
 static int doInstrumentation = 1;
 int64_t server_get_time[CAPFS_STATS_MAX], server_put_time[CAPFS_STATS_MAX];
+/* number of bytes that were not sent to the servers since they already had the chunks */
+static int64_t put_bytes_saved;
+static pthread_mutex_t put_bytes_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static inline void initInstr(void)
 {
@@ -283,6 +286,8 @@ static int cas_return_ctor(struct cas_return *tmpdata, struct cas_return *data,
 	int i;
 
 	tmpdata->count = countHashes;
+	tmpdata->server_time = 0;
+	tmpdata->bytes_saved = 0;
 	tmpdata->buf   = (struct dataArray *) calloc(countHashes, sizeof(struct dataArray));
 	if (tmpdata->buf == NULL) {
 		return -ENOMEM;
@@ -384,6 +389,12 @@ static void* clnt_get_thread(void* input)
 		}
 
 		if (to_free == 1) {
+			int i;
+
+			/* let the caller know how much of each buffer was filled */
+			for (i = 0; i < currentRequest; i++) {
+				job->buf[startHashes + i].byteCount = curr_job.buf[i].byteCount;
+			}
 			cas_return_dtor(&curr_job);
 		}
 		bytesDone += bytes_read;
@@ -399,6 +410,74 @@ static void* clnt_get_thread(void* input)
 	return NULL;
 }
 
+/*
+ * Ask the server which of the chunks of this job it already stores,
+ * and ship the contents of only those that are missing.
+ * Returns the number of bytes that the server now holds for this job
+ * (including the ones that were not sent) or -1 on error.
+ */
+static int cas_put_missing(int tcp, struct sockaddr_in *serverAddress, 
+		unsigned char *hashes, struct cas_return *job, int64_t *saved)
+{
+	unsigned char bitmap[CAPFS_MAXHASHBITMAP];
+	unsigned char *missing_hashes = NULL;
+	struct cas_return missing;
+	int i, nmissing = 0, present_bytes = 0, ret;
+
+	memset(bitmap, 0, sizeof(bitmap));
+	/* this also fails right away for servers that do not know have requests */
+	if (cas_have(use_sockets, tcp, serverAddress, hashes, job->count, bitmap) < 0) {
+		/* just send everything */
+		return cas_put(use_sockets, tcp, serverAddress, hashes, job);
+	}
+	for (i = 0; i < job->count; i++) {
+		if (cas_have_isset(bitmap, i)) {
+			present_bytes += job->buf[i].byteCount;
+		}
+		else {
+			nmissing++;
+		}
+	}
+	if (nmissing == job->count) {
+		return cas_put(use_sockets, tcp, serverAddress, hashes, job);
+	}
+	*saved += present_bytes;
+	if (nmissing == 0) {
+		job->server_time = 0;
+		return present_bytes;
+	}
+	missing.count = nmissing;
+	missing.server_time = 0;
+	missing.bytes_saved = 0;
+	missing.buf = (struct dataArray *) calloc(nmissing, sizeof(struct dataArray));
+	missing_hashes = (unsigned char *) calloc(nmissing, CAPFS_MAXHASHLENGTH);
+	if (missing.buf == NULL || missing_hashes == NULL) {
+		free(missing.buf);
+		free(missing_hashes);
+		*saved -= present_bytes;
+		errno = ENOMEM;
+		return -1;
+	}
+	nmissing = 0;
+	for (i = 0; i < job->count; i++) {
+		if (cas_have_isset(bitmap, i)) {
+			continue;
+		}
+		memcpy(missing_hashes + nmissing * CAPFS_MAXHASHLENGTH, 
+				hashes + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH);
+		missing.buf[nmissing++] = job->buf[i];
+	}
+	ret = cas_put(use_sockets, tcp, serverAddress, missing_hashes, &missing);
+	job->server_time = missing.server_time;
+	free(missing.buf);
+	free(missing_hashes);
+	if (ret < 0) {
+		*saved -= present_bytes;
+		return ret;
+	}
+	return ret + present_bytes;
+}
+
 static void* clnt_put_thread(void* input)
 {
 	unsigned long long bytesDone = 0;
@@ -430,6 +509,7 @@ static void* clnt_put_thread(void* input)
 	returnValue = t_input->returnValue;
 	hashBlock = t_input->hashBlock;
 	job = t_input->data;
+	job->bytes_saved = 0;
 	remainingHashes = job->count;
 
 	if (remainingHashes == 0) {
@@ -468,9 +548,9 @@ static void* clnt_put_thread(void* input)
 		if (doInstrumentation) {
 			start_srvrTime_instrumentation(myInstr);
 		}
-		/* Make an RPC call to the CAS servers */
-		if ((bytes_written = cas_put(use_sockets, t_input->tcp, (struct sockaddr_in *) serverAddress, 
-						hashBlock, &curr_job)) < 0) 
+		/* Make an RPC call to the CAS servers, sending only the chunks they don't have */
+		if ((bytes_written = cas_put_missing(t_input->tcp, (struct sockaddr_in *) serverAddress, 
+						hashBlock, &curr_job, &job->bytes_saved)) < 0) 
 		{
 			LOG(stderr, DEBUG_MSG, SUBSYS_LIBCAS, "cas_put crapped out %d\n", -errno);
 			*returnValue = -errno;
@@ -661,6 +741,7 @@ void clnt_put(int tcp, struct cas_iod_worker_data *iod_jobs, int count)
 			LOG(stderr, DEBUG_MSG, SUBSYS_LIBCAS, "server_put_time[%d] = %Ld\n", iod_jobs[i].iodNumber,
 					server_put_time[iod_jobs[i].iodNumber]);
 		}
+		clnt_bytes_saved_add((iod_jobs[i].data)->bytes_saved);
 	}
 	free(tInput);
 	sem_destroy(&mySem);
@@ -690,6 +771,61 @@ int clnt_statfs_req(int tcp, struct sockaddr* serverAddress, struct statfs *sfs)
 	return 0;
 }
 
+/*
+ * returns 0 on success or -1 with errno set otherwise
+ * fills in the counters of the chunk cache of the iod
+ */
+int clnt_iod_stat(int tcp, struct sockaddr* serverAddress, struct cas_iod_stat *stat)
+{
+	if (cas_iod_stat(use_sockets, tcp, (struct sockaddr_in *) serverAddress, stat) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Changes the reference counts of count chunks on the iod by deltas.
+ */
+int clnt_refs(int tcp, struct sockaddr* serverAddress, unsigned char *hashes, int *deltas, int count)
+{
+	if (cas_refs(use_sockets, tcp, (struct sockaddr_in *) serverAddress, hashes, deltas, count) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* counts bytes that did not have to be sent to the servers */
+void clnt_bytes_saved_add(int64_t bytes)
+{
+	pthread_mutex_lock(&put_bytes_mutex);
+	put_bytes_saved += bytes;
+	pthread_mutex_unlock(&put_bytes_mutex);
+}
+
+/* returns the bytes saved since the last call and starts counting afresh */
+int64_t clnt_bytes_saved_take(void)
+{
+	int64_t bytes;
+
+	pthread_mutex_lock(&put_bytes_mutex);
+	bytes = put_bytes_saved;
+	put_bytes_saved = 0;
+	pthread_mutex_unlock(&put_bytes_mutex);
+	return bytes;
+}
+
+/*
+ * Asks the iod which of the count chunks named by hashes it stores.
+ * Bit i of bitmap is set if it has the i-th one.
+ */
+int clnt_have(int tcp, struct sockaddr* serverAddress, unsigned char *hashes, int count, unsigned char *bitmap)
+{
+	if (cas_have(use_sockets, tcp, (struct sockaddr_in *) serverAddress, hashes, count, bitmap) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Use this routine sparingly, and only if you know what you are doing.
  * Cleans up the entire data directories on IODs
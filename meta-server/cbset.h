@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Sets of callback identifiers (the hcache sharers of a file).
+ * The bitmap grows to fit the largest identifier in the set, so
+ * a file shared by a handful of clients costs a word or two.
+ */
+#ifndef _CBSET_H
+#define _CBSET_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* callback identifiers range from 0 to MAXCBS - 1 */
+#define MAXCBS 1024
+
+#define CBSET_BITS (8 * sizeof(unsigned long))
+
+typedef struct cbset {
+	int            cs_nwords;
+	unsigned long *cs_words;
+} cbset;
+
+static __inline__ void cbset_init(cbset *s)
+{
+	s->cs_nwords = 0;
+	s->cs_words = NULL;
+}
+
+static __inline__ void cbset_free(cbset *s)
+{
+	free(s->cs_words);
+	cbset_init(s);
+}
+
+static __inline__ int cbset_add(cbset *s, int id)
+{
+	int word = id / CBSET_BITS;
+
+	if (id < 0 || id >= MAXCBS) {
+		return -EINVAL;
+	}
+	if (word >= s->cs_nwords) {
+		unsigned long *words;
+
+		if ((words = (unsigned long *) realloc(s->cs_words, (word + 1) * sizeof(unsigned long))) == NULL) {
+			return -ENOMEM;
+		}
+		memset(words + s->cs_nwords, 0, (word + 1 - s->cs_nwords) * sizeof(unsigned long));
+		s->cs_words = words;
+		s->cs_nwords = word + 1;
+	}
+	s->cs_words[word] |= 1UL << (id % CBSET_BITS);
+	return 0;
+}
+
+static __inline__ void cbset_del(cbset *s, int id)
+{
+	if (id >= 0 && id / CBSET_BITS < s->cs_nwords) {
+		s->cs_words[id / CBSET_BITS] &= ~(1UL << (id % CBSET_BITS));
+	}
+}
+
+static __inline__ int cbset_test(cbset *s, int id)
+{
+	if (id < 0 || id / CBSET_BITS >= s->cs_nwords) {
+		return 0;
+	}
+	return (s->cs_words[id / CBSET_BITS] >> (id % CBSET_BITS)) & 1;
+}
+
+/* dst must have been initialized; its old contents are replaced */
+static __inline__ int cbset_copy(cbset *dst, cbset *src)
+{
+	unsigned long *words = NULL;
+
+	if (src->cs_nwords > 0) {
+		if ((words = (unsigned long *) malloc(src->cs_nwords * sizeof(unsigned long))) == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(words, src->cs_words, src->cs_nwords * sizeof(unsigned long));
+	}
+	free(dst->cs_words);
+	dst->cs_words = words;
+	dst->cs_nwords = src->cs_nwords;
+	return 0;
+}
+
+/* Moves the members of src into dst, leaving src empty */
+static __inline__ void cbset_move(cbset *dst, cbset *src)
+{
+	free(dst->cs_words);
+	*dst = *src;
+	cbset_init(src);
+}
+
+/* Returns the smallest member that is >= from, or -1 */
+static __inline__ int cbset_next(cbset *s, int from)
+{
+	int word;
+	unsigned long w;
+
+	if (from < 0) {
+		from = 0;
+	}
+	for (word = from / CBSET_BITS; word < s->cs_nwords; word++) {
+		w = s->cs_words[word];
+		if (word == from / CBSET_BITS) {
+			w &= ~0UL << (from % CBSET_BITS);
+		}
+		if (w) {
+			return word * CBSET_BITS + __builtin_ctzl(w);
+		}
+	}
+	return -1;
+}
+
+static __inline__ int cbset_count(cbset *s)
+{
+	int word, count = 0;
+
+	for (word = 0; word < s->cs_nwords; word++) {
+		count += __builtin_popcountl(s->cs_words[word]);
+	}
+	return count;
+}
+
+#define cbset_for_each(id, s) \
+	for ((id) = cbset_next((s), 0); (id) >= 0; (id) = cbset_next((s), (id) + 1))
+
+/*
+ * Returns the only member of the set other than which, or
+ * -1 if there is none or more than one (see OnlyOtherBitSet()).
+ */
+static __inline__ int cbset_only_other(cbset *s, int which)
+{
+	int id, other = -1;
+
+	cbset_for_each(id, s) {
+		if (id == which) {
+			continue;
+		}
+		if (other >= 0) {
+			return -1;
+		}
+		other = id;
+	}
+	return other;
+}
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -12,12 +12,15 @@
  * Note: a SINGLE entry is added to the list for an open file, 
  * no matter how many times the file has been opened.
  *
- * This is built on top of the llist.[ch] files
+ * Open files are kept in a hash table keyed by inode number, with
+ * a lock per shard of buckets (see flist.h).
  *
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <flist.h>
 #include <dfd_set.h>
@@ -25,105 +28,170 @@
 #include <pthread.h>
 
 /* prototypes for internal functions */
-static int f_ino_cmp(void *key, void *f_p);
+static int64_t f_version_next(void);
+
+#define FLIST_BUCKET(f_ino) ((unsigned long) (f_ino) % FLIST_BUCKETS)
+#define FLIST_LOCK(fl_p, b) (&(fl_p)->locks[(b) % FLIST_LOCKS])
 
 flist_p flist_new(void)
 {
 	flist_p fl;
+	int i;
+
 	fl = (flist_p) malloc(sizeof(flist));
 	if (fl) {
-		pthread_rwlock_init(&fl->lock, NULL);
-		fl->list = llist_new();
-		if (fl->list == NULL) {
-			free(fl);
-			return NULL;
+		for (i = 0; i < FLIST_LOCKS; i++) {
+			pthread_rwlock_init(&fl->locks[i], NULL);
 		}
+		for (i = 0; i < FLIST_BUCKETS; i++) {
+			INIT_QLIST_HEAD(&fl->buckets[i]);
+		}
+		fl->count = 0;
 	}
 	return fl;
 }
 
+/*
+ * The whole-table lock functions take every shard lock, always in
+ * the same order, and are meant for operations on all the files.
+ */
 void flist_wrlock(flist_p fl_p)
 {
-	pthread_rwlock_wrlock(&fl_p->lock);
+	int i;
+
+	for (i = 0; i < FLIST_LOCKS; i++) {
+		pthread_rwlock_wrlock(&fl_p->locks[i]);
+	}
 	return;
 }
 
 void flist_rdlock(flist_p fl_p)
 {
-	pthread_rwlock_rdlock(&fl_p->lock);
+	int i;
+
+	for (i = 0; i < FLIST_LOCKS; i++) {
+		pthread_rwlock_rdlock(&fl_p->locks[i]);
+	}
 	return;
 }
 
 void flist_unlock(flist_p fl_p)
 {
-	pthread_rwlock_unlock(&fl_p->lock);
+	int i;
+
+	for (i = FLIST_LOCKS - 1; i >= 0; i--) {
+		pthread_rwlock_unlock(&fl_p->locks[i]);
+	}
 	return;
 }
 
 int flist_tryrdlock(flist_p fl_p)
 {
-	return pthread_rwlock_tryrdlock(&fl_p->lock);
+	int i, ret;
+
+	for (i = 0; i < FLIST_LOCKS; i++) {
+		if ((ret = pthread_rwlock_tryrdlock(&fl_p->locks[i])) != 0) {
+			while (--i >= 0) {
+				pthread_rwlock_unlock(&fl_p->locks[i]);
+			}
+			return ret;
+		}
+	}
+	return 0;
 }
 
 int flist_trywrlock(flist_p fl_p)
 {
-	return pthread_rwlock_trywrlock(&fl_p->lock);
+	int i, ret;
+
+	for (i = 0; i < FLIST_LOCKS; i++) {
+		if ((ret = pthread_rwlock_trywrlock(&fl_p->locks[i])) != 0) {
+			while (--i >= 0) {
+				pthread_rwlock_unlock(&fl_p->locks[i]);
+			}
+			return ret;
+		}
+	}
+	return 0;
 }
 
 int flist_empty(flist_p fl_p)
 {
-	int empty;
-
-	flist_rdlock(fl_p);
-	empty = llist_empty(fl_p->list);
-	flist_unlock(fl_p);
-	return empty;
+	return (__sync_fetch_and_add(&fl_p->count, 0) == 0);
 }
 
 int f_add(flist_p fl_p, finfo_p f_p)
 {
-	int ret;
+	unsigned long b = FLIST_BUCKET(f_p->f_ino);
+
+	pthread_rwlock_wrlock(FLIST_LOCK(fl_p, b));
+	qlist_add(&f_p->f_hash, &fl_p->buckets[b]);
+	__sync_fetch_and_add(&fl_p->count, 1);
+	pthread_rwlock_unlock(FLIST_LOCK(fl_p, b));
+	return 0;
+}
+
+/* must be called with the lock of bucket b held */
+static finfo_p f_lookup(flist_p fl_p, unsigned long b, ino_t f_ino)
+{
+	struct qlist_head *tmp;
+
+	qlist_for_each(tmp, &fl_p->buckets[b]) {
+		finfo_p f_p = qlist_entry(tmp, finfo, f_hash);
 
-	flist_wrlock(fl_p);
-	ret = llist_add(fl_p->list, (void *) f_p);
-	flist_unlock(fl_p);
-	return ret;
+		if (f_p->f_ino == f_ino) {
+			return f_p;
+		}
+	}
+	return NULL;
 }
 
 finfo_p f_search(flist_p fl_p, ino_t f_ino)
 {
+	unsigned long b = FLIST_BUCKET(f_ino);
 	finfo_p f_p;
 
-	flist_rdlock(fl_p);
-	f_p = ((finfo_p) llist_search(fl_p->list, (void *) (&f_ino), f_ino_cmp));
-	flist_unlock(fl_p);
+	pthread_rwlock_rdlock(FLIST_LOCK(fl_p, b));
+	f_p = f_lookup(fl_p, b, f_ino);
+	pthread_rwlock_unlock(FLIST_LOCK(fl_p, b));
 	return f_p;
 }
 
 int f_rem(flist_p fl_p, ino_t f_ino)
 {
+	unsigned long b = FLIST_BUCKET(f_ino);
 	finfo_p f_p;
 	
-	flist_wrlock(fl_p);
-	f_p = (finfo_p) llist_rem(fl_p->list, (void *) (&f_ino), f_ino_cmp);
+	pthread_rwlock_wrlock(FLIST_LOCK(fl_p, b));
+	f_p = f_lookup(fl_p, b, f_ino);
 	if (f_p) {
+		qlist_del(&f_p->f_hash);
+		__sync_fetch_and_sub(&fl_p->count, 1);
+		pthread_rwlock_unlock(FLIST_LOCK(fl_p, b));
 		f_free(f_p);
-		flist_unlock(fl_p);
 		return(0);
 	}
-	flist_unlock(fl_p);
+	pthread_rwlock_unlock(FLIST_LOCK(fl_p, b));
 	return(-1);
 }
 
 void flist_cleanup(flist_p fl_p)
 {
-	llist_free(fl_p->list, f_free);
-}
+	struct qlist_head *tmp, *next;
+	int i;
 
-static int f_ino_cmp(void *key, void *f_p)
-{
-	if ((ino_t)(*(ino_t *) key) == ((finfo_p)f_p)->f_ino) return(0);
-	else return(1);
+	for (i = 0; i < FLIST_BUCKETS; i++) {
+		qlist_for_each_safe(tmp, next, &fl_p->buckets[i]) {
+			finfo_p f_p = qlist_entry(tmp, finfo, f_hash);
+
+			qlist_del(&f_p->f_hash);
+			f_free(f_p);
+		}
+	}
+	for (i = 0; i < FLIST_LOCKS; i++) {
+		pthread_rwlock_destroy(&fl_p->locks[i]);
+	}
+	free(fl_p);
 }
 
 finfo_p f_new(void) 
@@ -134,11 +202,22 @@ finfo_p f_new(void)
 		return(0);
 	memset(f_p, 0, sizeof(finfo));
 	pthread_rwlock_init(&f_p->lock, NULL);
+	pthread_mutex_init(&f_p->range_mutex, NULL);
+	pthread_cond_init(&f_p->range_cond, NULL);
+	INIT_QLIST_HEAD(&f_p->ranges);
+	pthread_mutex_init(&f_p->meta_mutex, NULL);
+	/* nothing a client saw of an earlier incarnation of the file is current */
+	f_p->versions = NULL;
+	f_p->nversions = 0;
+	f_p->version_tail = f_version_next();
 	f_p->cap = 0;
 	f_p->cnt = 1;
 	f_p->f_name = 0;
 	f_p->unlinked = -1;
+	f_p->unlinked_hashes = NULL;
+	f_p->unlinked_nhashes = 0;
 	f_p->utime_event = 0;
+	INIT_QLIST_HEAD(&f_p->f_hash);
 	dfd_init(&f_p->socks, 1);
 	return(f_p);
 }
@@ -174,19 +253,223 @@ void f_unlock(finfo_p f_p)
 	}
 }
 
+/* must be called with range_mutex held */
+static int f_range_conflicts(finfo_p f_p, struct f_range *range)
+{
+	struct qlist_head *tmp;
+
+	qlist_for_each(tmp, &f_p->ranges) {
+		struct f_range *held = qlist_entry(tmp, struct f_range, fr_link);
+
+		if (held->fr_begin < range->fr_end && range->fr_begin < held->fr_end
+				&& (held->fr_exclusive || range->fr_exclusive)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Locks nchunks chunks of the file starting at begin_chunk (the whole
+ * file if begin_chunk is -1), shared or exclusive. Commits to disjoint
+ * ranges of a file proceed in parallel, while f_wrlock() still excludes
+ * all of them. range is filled in here and must be handed to
+ * f_range_unlock().
+ */
+void f_range_lock(finfo_p f_p, struct f_range *range, int64_t begin_chunk, int64_t nchunks, int exclusive)
+{
+	if (f_p == NULL) {
+		return;
+	}
+	if (begin_chunk < 0) {
+		range->fr_begin = 0;
+		range->fr_end = INT64_MAX;
+	}
+	else {
+		range->fr_begin = begin_chunk;
+		/* an empty range still conflicts with a commit at its start */
+		range->fr_end = begin_chunk + ((nchunks > 0) ? nchunks : 1);
+	}
+	range->fr_exclusive = exclusive;
+	f_rdlock(f_p);
+	pthread_mutex_lock(&f_p->range_mutex);
+	while (f_range_conflicts(f_p, range)) {
+		LOG(stderr, DEBUG_MSG, SUBSYS_META, "[RANGE] Thread %lu about to block on [%Ld, %Ld)\n",
+				pthread_self(), range->fr_begin, range->fr_end);
+		pthread_cond_wait(&f_p->range_cond, &f_p->range_mutex);
+	}
+	qlist_add_tail(&range->fr_link, &f_p->ranges);
+	pthread_mutex_unlock(&f_p->range_mutex);
+	return;
+}
+
+void f_range_unlock(finfo_p f_p, struct f_range *range)
+{
+	if (f_p == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&f_p->range_mutex);
+	qlist_del(&range->fr_link);
+	pthread_cond_broadcast(&f_p->range_cond);
+	pthread_mutex_unlock(&f_p->range_mutex);
+	f_unlock(f_p);
+	return;
+}
+
+/* Serializes read-modify-write cycles of the metadata among range lockers */
+void f_meta_lock(finfo_p f_p)
+{
+	if (f_p) {
+		pthread_mutex_lock(&f_p->meta_mutex);
+	}
+	return;
+}
+
+void f_meta_unlock(finfo_p f_p)
+{
+	if (f_p) {
+		pthread_mutex_unlock(&f_p->meta_mutex);
+	}
+	return;
+}
+
+/*
+ * Recipe versions.
+ * Every commit stamps the version counters of the chunks it changed with
+ * the next value of a clock shared by all files, and a client is told the
+ * highest version of the chunks it read. If none of the chunks it goes on
+ * to commit has a higher version than that, none of them changed since it
+ * read them. The clock starts from the time the server was started, well
+ * above anything handed out before it was restarted.
+ */
+static int64_t f_version_clock = 0;
+static pthread_mutex_t f_version_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t f_version_next(void)
+{
+	int64_t v;
+
+	pthread_mutex_lock(&f_version_mutex);
+	if (f_version_clock == 0) {
+		f_version_clock = ((int64_t) time(NULL)) << 24;
+	}
+	v = ++f_version_clock;
+	pthread_mutex_unlock(&f_version_mutex);
+	return v;
+}
+
+/* must be called with range_mutex held */
+static int64_t f_version_of(finfo_p f_p, int64_t bucket)
+{
+	return (bucket < f_p->nversions) ? f_p->versions[bucket] : f_p->version_tail;
+}
+
+/*
+ * Returns the version of nchunks chunks of the file starting at
+ * begin_chunk (of the whole file if begin_chunk is -1).
+ * Should be called with the range locked.
+ */
+int64_t f_version_get(finfo_p f_p, int64_t begin_chunk, int64_t nchunks)
+{
+	int64_t b, first, last, v;
+
+	if (f_p == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&f_p->range_mutex);
+	if (begin_chunk < 0) {
+		first = 0;
+		last = f_p->nversions;
+	}
+	else {
+		first = begin_chunk / F_VERSION_CHUNKS;
+		last = (begin_chunk + ((nchunks > 0) ? nchunks : 1) - 1) / F_VERSION_CHUNKS;
+	}
+	v = f_version_of(f_p, first);
+	for (b = first + 1; b <= last; b++) {
+		int64_t bv = f_version_of(f_p, b);
+
+		if (bv > v) {
+			v = bv;
+		}
+	}
+	pthread_mutex_unlock(&f_p->range_mutex);
+	return v;
+}
+
+/*
+ * Records that nchunks chunks starting at begin_chunk were changed.
+ * Must be called with the range locked exclusively.
+ * Returns the new version of the range.
+ */
+int64_t f_version_bump(finfo_p f_p, int64_t begin_chunk, int64_t nchunks)
+{
+	int64_t b, first, last, v;
+
+	if (f_p == NULL) {
+		return 0;
+	}
+	v = f_version_next();
+	first = begin_chunk / F_VERSION_CHUNKS;
+	last = (begin_chunk + ((nchunks > 0) ? nchunks : 1) - 1) / F_VERSION_CHUNKS;
+	pthread_mutex_lock(&f_p->range_mutex);
+	if (last >= f_p->nversions) {
+		int64_t *versions;
+
+		versions = (int64_t *) realloc(f_p->versions, (last + 1) * sizeof(int64_t));
+		if (versions == NULL) {
+			/* everything past the table changes version; overly pessimistic, but safe */
+			f_p->version_tail = v;
+			last = f_p->nversions - 1;
+		}
+		else {
+			for (b = f_p->nversions; b <= last; b++) {
+				versions[b] = f_p->version_tail;
+			}
+			f_p->versions = versions;
+			f_p->nversions = last + 1;
+		}
+	}
+	for (b = first; b <= last; b++) {
+		f_p->versions[b] = v;
+	}
+	pthread_mutex_unlock(&f_p->range_mutex);
+	return v;
+}
+
+/*
+ * Records that every chunk from nchunks on was changed (by a truncate).
+ * Must be called with f_wrlock() held.
+ */
+void f_version_truncate(finfo_p f_p, int64_t nchunks)
+{
+	int64_t b, v;
+
+	if (f_p == NULL) {
+		return;
+	}
+	v = f_version_next();
+	pthread_mutex_lock(&f_p->range_mutex);
+	for (b = nchunks / F_VERSION_CHUNKS; b < f_p->nversions; b++) {
+		f_p->versions[b] = v;
+	}
+	f_p->version_tail = v;
+	pthread_mutex_unlock(&f_p->range_mutex);
+	return;
+}
+
 void f_free(void *f_p)
 {
 	dfd_finalize(&((finfo_p)f_p)->socks);
 	free(((finfo_p)f_p)->f_name);
+	free(((finfo_p)f_p)->unlinked_hashes);
+	free(((finfo_p)f_p)->versions);
 	free((finfo_p)f_p);
 }
 
 int flist_dump(flist_p fl_p)
 {
-	int ret;
-
-	ret = llist_doall(fl_p->list, f_dump);
-	return ret;
+	return forall_finfo(fl_p, f_dump);
 }
 
 int f_dump(void *v_p)
@@ -199,12 +482,23 @@ int f_dump(void *v_p)
 	return(0);
 }
 
+/*
+ * Calls fn on every open file. As with the list this replaced, the
+ * table is not locked while fn runs, so fn may f_rem() the file it
+ * is handed.
+ */
 int forall_finfo(flist_p fl_p, int (*fn)(void *))
 {
-	int ret;
+	struct qlist_head *tmp, *next;
+	int i;
 
-	ret = llist_doall(fl_p->list, fn);
-	return ret;
+	if (!fl_p || !fn) return(-1);
+	for (i = 0; i < FLIST_BUCKETS; i++) {
+		qlist_for_each_safe(tmp, next, &fl_p->buckets[i]) {
+			(*fn)(qlist_entry(tmp, finfo, f_hash));
+		}
+	}
+	return(0);
 }
 
 /*
@@ -17,19 +17,49 @@
 #include <meta.h>
 #include <dfd_set.h>
 #include <pthread.h>
+#include "quicklist.h"
 
 typedef struct flist flist, *flist_p;
 
+/*
+ * Open files are hashed by inode number into FLIST_BUCKETS chains.
+ * Bucket b is protected by locks[b % FLIST_LOCKS], so lookups of
+ * different files rarely contend for the same lock.
+ */
+#define FLIST_BUCKETS 4096
+#define FLIST_LOCKS   64
+
 struct flist {
-	pthread_rwlock_t lock;
-	llist_p list;
+	pthread_rwlock_t locks[FLIST_LOCKS];
+	struct qlist_head buckets[FLIST_BUCKETS];
+	int count; /* # of files in the table */
+};
+
+/* number of chunks of a recipe that share a version counter */
+#define F_VERSION_CHUNKS 16
+
+/* a range of chunks [fr_begin, fr_end) of a file locked by f_range_lock() */
+struct f_range {
+	int64_t fr_begin;
+	int64_t fr_end;
+	int fr_exclusive;
+	struct qlist_head fr_link;
 };
 
 typedef struct finfo finfo, *finfo_p;
 
 struct finfo {
-	pthread_rwlock_t lock; /* lock for serializing write commits */
+	pthread_rwlock_t lock; /* held shared by range lockers, exclusive for whole-file changes */
+	pthread_mutex_t range_mutex; /* protects ranges */
+	pthread_cond_t range_cond;   /* signalled when a range is unlocked */
+	struct qlist_head ranges;    /* chunk ranges currently locked */
+	pthread_mutex_t meta_mutex;  /* serializes updates to the metadata (size, times) */
+	int64_t *versions;     /* version of each F_VERSION_CHUNKS chunks of the recipe (under range_mutex) */
+	int64_t nversions;
+	int64_t version_tail;  /* version of the chunks past the end of versions */
 	int unlinked;     /* fd of metadata file or -1 */
+	unsigned char *unlinked_hashes; /* recipe of an unlinked file, released on last close */
+	int64_t unlinked_nhashes;
 	ino_t f_ino;      /* inode # of metadata file */
 	capfs_filestat p_stat; /* CAPFS metadata for file */
 	int cap;          /* max. capability assigned thusfar */
@@ -38,6 +68,7 @@ struct finfo {
 	dyn_fdset socks;  /* used to track what FDs have opened the file */
 	int64_t utime_modtime; /* last explicitly set modtime */
 	int64_t utime_event; /* used to track when a utime op. was performed */
+	struct qlist_head f_hash; /* chain of the flist bucket of f_ino */
 };
 
 flist_p flist_new(void);
@@ -48,6 +79,13 @@ finfo_p f_new(void);
 void f_wrlock(finfo_p f_p);
 void f_rdlock(finfo_p f_p);
 void f_unlock(finfo_p f_p);
+void f_range_lock(finfo_p f_p, struct f_range *range, int64_t begin_chunk, int64_t nchunks, int exclusive);
+void f_range_unlock(finfo_p f_p, struct f_range *range);
+void f_meta_lock(finfo_p f_p);
+void f_meta_unlock(finfo_p f_p);
+int64_t f_version_get(finfo_p f_p, int64_t begin_chunk, int64_t nchunks);
+int64_t f_version_bump(finfo_p f_p, int64_t begin_chunk, int64_t nchunks);
+void f_version_truncate(finfo_p f_p, int64_t nchunks);
 int f_rem(flist_p, ino_t);
 void flist_cleanup(flist_p);
 int f_dump(void *);
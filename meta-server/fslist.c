@@ -7,7 +7,8 @@
  * FSLIST.C - functions to handle the creation and modification of 
  * lists of filesystem information
  *
- * This is built on top of the llist.[ch] files
+ * File systems are kept in a small hash table keyed by the inode
+ * number of their root directory (see fslist.h).
  *
  */
 
@@ -18,90 +19,157 @@
 #include <log.h>
 
 /* prototypes for internal functions */
-static int fs_ino_cmp(void *key, void *fs_p);
-static void fs_free(void * fs_p);
+static void fs_free(fsinfo_p fs_p);
+
+#define FSLIST_BUCKET(fs_ino) ((unsigned long) (fs_ino) % FSLIST_BUCKETS)
 
 fslist_p fslist_new(void)
 {
 	fslist_p fsp;
+	int i;
+
 	fsp = (fslist_p) malloc(sizeof(fslist));
 	if (fsp) {
-		pthread_rwlock_init(&fsp->lock, NULL);
-		fsp->list = llist_new();
-		if (fsp->list == NULL) {
-			free(fsp);
-			return NULL;
+		for (i = 0; i < FSLIST_BUCKETS; i++) {
+			pthread_rwlock_init(&fsp->locks[i], NULL);
+			INIT_QLIST_HEAD(&fsp->buckets[i]);
 		}
 	}
 	return fsp;
 }
 
+/* The whole-table lock functions take every bucket lock, in order */
 void fslist_wrlock(fslist_p fs_p)
 {
-	pthread_rwlock_wrlock(&fs_p->lock);
+	int i;
+
+	for (i = 0; i < FSLIST_BUCKETS; i++) {
+		pthread_rwlock_wrlock(&fs_p->locks[i]);
+	}
 	return;
 }
 
 void fslist_unlock(fslist_p fs_p)
 {
-	pthread_rwlock_unlock(&fs_p->lock);
+	int i;
+
+	for (i = FSLIST_BUCKETS - 1; i >= 0; i--) {
+		pthread_rwlock_unlock(&fs_p->locks[i]);
+	}
 }
 
 void fslist_rdlock(fslist_p fs_p)
 {
-	pthread_rwlock_rdlock(&fs_p->lock);
+	int i;
+
+	for (i = 0; i < FSLIST_BUCKETS; i++) {
+		pthread_rwlock_rdlock(&fs_p->locks[i]);
+	}
 	return;
 }
 
 int fslist_tryrdlock(fslist_p fs_p)
 {
-	return pthread_rwlock_tryrdlock(&fs_p->lock);
+	int i, ret;
+
+	for (i = 0; i < FSLIST_BUCKETS; i++) {
+		if ((ret = pthread_rwlock_tryrdlock(&fs_p->locks[i])) != 0) {
+			while (--i >= 0) {
+				pthread_rwlock_unlock(&fs_p->locks[i]);
+			}
+			return ret;
+		}
+	}
+	return 0;
 }
 
 int fslist_trywrlock(fslist_p fs_p)
 {
-	return pthread_rwlock_trywrlock(&fs_p->lock);
+	int i, ret;
+
+	for (i = 0; i < FSLIST_BUCKETS; i++) {
+		if ((ret = pthread_rwlock_trywrlock(&fs_p->locks[i])) != 0) {
+			while (--i >= 0) {
+				pthread_rwlock_unlock(&fs_p->locks[i]);
+			}
+			return ret;
+		}
+	}
+	return 0;
 }
 
 int fs_add(fslist_p fsl_p, fsinfo_p fs_p)
 {
-	int ret;
+	unsigned long b = FSLIST_BUCKET(fs_p->fs_ino);
 
-	fslist_wrlock(fsl_p);
-	fs_p->fl_p = flist_new(); /* get new file list */
-	ret = llist_add(fsl_p->list, (void *) fs_p);
-	fslist_unlock(fsl_p);
-	return ret;
+	if ((fs_p->fl_p = flist_new()) == NULL) { /* get new file list */
+		return(-1);
+	}
+	pthread_rwlock_wrlock(&fsl_p->locks[b]);
+	qlist_add(&fs_p->fs_hash, &fsl_p->buckets[b]);
+	pthread_rwlock_unlock(&fsl_p->locks[b]);
+	return(0);
+}
+
+/* must be called with the lock of bucket b held */
+static fsinfo_p fs_lookup(fslist_p fsl_p, unsigned long b, ino_t fs_ino)
+{
+	struct qlist_head *tmp;
+
+	qlist_for_each(tmp, &fsl_p->buckets[b]) {
+		fsinfo_p fs_p = qlist_entry(tmp, fsinfo, fs_hash);
+
+		if (fs_p->fs_ino == fs_ino) {
+			return fs_p;
+		}
+	}
+	return NULL;
 }
 
 fsinfo_p fs_search(fslist_p fsl_p, ino_t fs_ino)
 {
+	unsigned long b = FSLIST_BUCKET(fs_ino);
 	fsinfo_p fs_p;
 
-	fslist_rdlock(fsl_p);
-	fs_p = (fsinfo_p) llist_search(fsl_p->list, (void *) (&fs_ino), fs_ino_cmp);
-	fslist_unlock(fsl_p);
+	pthread_rwlock_rdlock(&fsl_p->locks[b]);
+	fs_p = fs_lookup(fsl_p, b, fs_ino);
+	pthread_rwlock_unlock(&fsl_p->locks[b]);
 	return fs_p;
 }
 
 int fs_rem(fslist_p fsl_p, ino_t fs_ino)
 {
+	unsigned long b = FSLIST_BUCKET(fs_ino);
 	fsinfo_p fs_p;
 	
-	fslist_wrlock(fsl_p);
-	fs_p = (fsinfo_p) llist_rem(fsl_p->list, (void *) (&fs_ino), fs_ino_cmp);
+	pthread_rwlock_wrlock(&fsl_p->locks[b]);
+	fs_p = fs_lookup(fsl_p, b, fs_ino);
 	if (fs_p) {
+		qlist_del(&fs_p->fs_hash);
+		pthread_rwlock_unlock(&fsl_p->locks[b]);
 		fs_free(fs_p);
-		fslist_unlock(fsl_p);
 		return(0);
 	}
-	fslist_unlock(fsl_p);
+	pthread_rwlock_unlock(&fsl_p->locks[b]);
 	return(-1);
 }
 
+/*
+ * Calls fn on every file system. The table is not locked while fn
+ * runs, so fn may fs_rem() the file system it is handed.
+ */
 int forall_fs(fslist_p fsl_p, int (*fn)(void *))
 {
-	return(llist_doall(fsl_p->list, fn));
+	struct qlist_head *tmp, *next;
+	int i;
+
+	if (!fsl_p || !fn) return(-1);
+	for (i = 0; i < FSLIST_BUCKETS; i++) {
+		qlist_for_each_safe(tmp, next, &fsl_p->buckets[i]) {
+			(*fn)(qlist_entry(tmp, fsinfo, fs_hash));
+		}
+	}
+	return(0);
 }
 
 int fslist_dump(fslist_p fsl_p)
@@ -120,19 +188,27 @@ int fs_dump(void *v_p)
 
 void fslist_cleanup(fslist_p fsl_p)
 {
-	llist_free(fsl_p->list, fs_free);
-}
+	struct qlist_head *tmp, *next;
+	int i;
 
-static int fs_ino_cmp(void *key, void *fs_p)
-{
-	if (fs_p && (ino_t) (*(ino_t *)key) == ((fsinfo_p) fs_p)->fs_ino) return(0);
-	else return(1);
+	for (i = 0; i < FSLIST_BUCKETS; i++) {
+		qlist_for_each_safe(tmp, next, &fsl_p->buckets[i]) {
+			fsinfo_p fs_p = qlist_entry(tmp, fsinfo, fs_hash);
+
+			qlist_del(&fs_p->fs_hash);
+			fs_free(fs_p);
+		}
+		pthread_rwlock_destroy(&fsl_p->locks[i]);
+	}
+	free(fsl_p);
 }
 
-static void fs_free(void * fs_p)
+static void fs_free(fsinfo_p fs_p)
 {
-	flist_cleanup(((fsinfo_p) fs_p)->fl_p);
-	free((fsinfo_p) fs_p);
+	if (fs_p->fl_p) {
+		flist_cleanup(fs_p->fl_p);
+	}
+	free(fs_p);
 }
 
 /*
@@ -17,9 +17,12 @@
 
 typedef struct fslist fslist, *fslist_p;
 
+/* file systems are hashed by the inode number of their root, a lock per bucket */
+#define FSLIST_BUCKETS 16
+
 struct fslist {
-	pthread_rwlock_t lock;
-	llist_p list;
+	pthread_rwlock_t locks[FSLIST_BUCKETS];
+	struct qlist_head buckets[FSLIST_BUCKETS];
 };
 
 typedef struct fsinfo fsinfo, *fsinfo_p;
@@ -27,7 +30,9 @@ typedef struct fsinfo fsinfo, *fsinfo_p;
 struct fsinfo {
 	ino_t fs_ino;    /* inode # of root directory for this filesystem */
 	int nr_iods;     /* # of iods for this filesystem */
+	int placement;   /* CAPFS_PLACE_* given to new files */
 	flist_p fl_p;    /* list of open files for this filesystem */
+	struct qlist_head fs_hash; /* chain of the fslist bucket of fs_ino */
 	iod_info iod[1]; /* list of iod addresses */
 };
 
@@ -13,6 +13,9 @@
  * 
  * 1) Blank lines are ignored
  * 2) Lines starting with '#' are ignored
+ * 3) "placement stripe" (the default) or "placement hash" sets how new
+ *    files of the file system place their chunks on the iods
+ * 4) Every other line is an iod, as host[:port]
  *
  * Separate functions are used for reading the configuration file and
  * setting up the resulting environment.
@@ -23,7 +26,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <iodtab.h>
+#include <meta.h>
 #include <arpa/inet.h>
 #include <capfs_config.h>
 #include <log.h> 
@@ -45,6 +50,7 @@ struct iodtabinfo *parse_iodtab(char *fname)
 	}
 
 	iods.nodecount = 0;
+	iods.placement = CAPFS_PLACE_STRIPE;
 
 	while (fgets(inbuf, INBUFSZ, cfile)) {
 		if (iods.nodecount >= CAPFS_MAXIODS) {
@@ -57,6 +63,24 @@ struct iodtabinfo *parse_iodtab(char *fname)
 		/* blank lines get skipped here */
 		if (!(entry = strtok(inbuf, "#\n"))) continue;
 
+		/* "placement stripe" or "placement hash" picks how new files place their chunks */
+		if (!strncmp(entry, "placement", 9) && isspace(entry[9])) {
+			char *mode = strtok(entry + 9, " \t");
+
+			if (mode && !strcmp(mode, "hash")) {
+				iods.placement = CAPFS_PLACE_HASH;
+			}
+			else if (mode && !strcmp(mode, "stripe")) {
+				iods.placement = CAPFS_PLACE_STRIPE;
+			}
+			else {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_META, "parse_iodtab: bad placement\n");
+				fclose(cfile);
+				return(NULL);
+			}
+			continue;
+		}
+
 		for (port = entry; *port && *port != ':'; port++);
 		if (*port == ':') /* port number present */ {
 			char *err;
@@ -94,6 +118,9 @@ int dump_iodtab(FILE *fp)
 	char *outp;
 
 	fprintf(fp, "# IODTAB FILE -- AUTOMATICALLY GENERATED\n");
+	if (iods.placement == CAPFS_PLACE_HASH) {
+		fprintf(fp, "placement hash\n");
+	}
 	for (i=0; i < iods.nodecount; i++) {
 		outp = inet_ntoa(iods.iod[i].sin_addr);
 		fprintf(fp, "%s:%d\n", outp, ntohs(iods.iod[i].sin_port));
@@ -17,6 +17,8 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
@@ -213,6 +215,36 @@ int meta_hash_read(char *name, int64_t begin_chunk, int64_t* nchunks, unsigned c
 	return 0;
 }
 
+/*
+ * Writes the nchunks hashes in phashes at begin_chunk of the open hash file fd,
+ * gathering them into as few pwritev() calls as possible.
+ * Returns 0 on success, -1 on error (with errno set).
+ */
+int meta_hash_pwrite(int fd, int64_t begin_chunk, int64_t nchunks, unsigned char **phashes)
+{
+	struct iovec iov[IOV_MAX];
+	int64_t i, done = 0;
+	ssize_t ret;
+	int cnt;
+
+	while (done < nchunks) {
+		cnt = MIN(nchunks - done, IOV_MAX);
+		for (i = 0; i < cnt; i++) {
+			iov[i].iov_base = phashes[done + i];
+			iov[i].iov_len = CAPFS_MAXHASHLENGTH;
+		}
+		ret = pwritev(fd, iov, cnt, (begin_chunk + done) * CAPFS_MAXHASHLENGTH);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		/* a short write leaves us with a partial hash; redo that one */
+		done += ret / CAPFS_MAXHASHLENGTH;
+	}
+	return 0;
+}
+
 /* 
  * Write the hashes to the file's meta data. Definitely needs to be called with a write lock
  * on the finfo_p structure. Upto higher level to make sure that
@@ -222,7 +254,6 @@ int meta_hash_write(char *name, int64_t begin_chunk, int64_t nchunks, unsigned c
 {
 	char hashpath[MAXPATHLEN];
 	int fd;
-	int64_t i;
 	struct stat sbuf;
 
 	if (begin_chunk < 0 || nchunks <= 0) {
@@ -245,11 +276,9 @@ int meta_hash_write(char *name, int64_t begin_chunk, int64_t nchunks, unsigned c
 		close(fd);
 		return -1;
 	}
-	for (i = 0; i < nchunks; i++) {
-		if (pwrite(fd, phashes[i], CAPFS_MAXHASHLENGTH, (begin_chunk + i) * CAPFS_MAXHASHLENGTH) < 0) {
-			close(fd);
-			return -1;
-		}
+	if (meta_hash_pwrite(fd, begin_chunk, nchunks, phashes) < 0) {
+		close(fd);
+		return -1;
 	}
 	close(fd);
 	return 0;
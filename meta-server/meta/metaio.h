@@ -15,6 +15,7 @@ int meta_write(int fd, struct fmeta *meta_p);
 int meta_hash_read(char *name, int64_t begin_chunk, int64_t* nchunks, unsigned char **phashes);
 int meta_hash_write(char *name, int64_t begin_chunk, int64_t nchunks, unsigned char **phashes);
 int meta_hash_truncate(char *name, int64_t new_nchunks);
+int meta_hash_pwrite(int fd, int64_t begin_chunk, int64_t nchunks, unsigned char **phashes);
 int meta_close(int fd);
 int meta_unlink(char *pathname);
 int meta_access(int fd, char *pathname, uid_t uid, gid_t gid, int mode);
@@ -49,6 +49,7 @@
 #include <minmax.h>
 #include <capfs_config.h>
 #include <sys/uio.h>
+#include <cbset.h>
 
 #define NOFOLLOW_LINK 0
 #define FOLLOW_LINK   1
@@ -79,9 +80,13 @@ struct ackdata {
 			struct capfs_dirent *pdir;
 		} getdents;
 		struct {
+			/* IN parameter */
+			int     cb_id;
 			/* OUT parameters */
 			int64_t nhashes;
 			unsigned char *hashes;
+			int64_t version;
+			int     lease_msecs;
 		} gethashes;
 		struct {
 			/* IN parameter */
@@ -90,12 +95,15 @@ struct ackdata {
 			int64_t 				new_hash_len;
 			unsigned char   **new_hashes;
 			int				  force_commit;
+			/* IN: version presented instead of old hashes (0 if none), OUT: current version */
+			int64_t 			  version;
 			/* needed for hcache coherence */
 			int      		  desire_hcache_coherence;
 			int				  owner_cbid;
 			/* OUT parameter */
 			int64_t current_hash_len;
 			unsigned char   *current_hashes;
+			int     lease_msecs;
 		} wcommit;
 		struct {
 			/* OUT parameters */
@@ -110,6 +118,11 @@ struct ackdata {
 			int64_t fs_ino;
 			int64_t f_ino;
 		} unlink;
+		struct {
+			/* OUT parameters */
+			int64_t nnodes;
+			unsigned char *nodes;
+		} gettree;
 	} u;
 };
 
@@ -144,6 +157,11 @@ struct ackdata_c {
 			int nhashes;
 			unsigned char *buf;
 		} gethashes;
+		struct {
+			/* nnodes is an in-out sort of parameter */
+			int64_t nnodes;
+			unsigned char *buf;
+		} gettree;
 	} u;
 };
 
@@ -170,12 +188,63 @@ extern int cb_init(void);
 extern void cb_finalize(void);
 extern int add_callbacks(int64_t fs_ino, int64_t f_ino, char*, int cb_id);
 extern int del_callbacks(int64_t fs_ino, int64_t f_ino, int cb_id);
-extern unsigned long get_callbacks(int64_t fs_ino, int64_t f_ino, char **);
-extern unsigned long clear_callbacks(int64_t fs_ino, int64_t f_ino);
+extern int get_callbacks(int64_t fs_ino, int64_t f_ino, char **, cbset *sharers);
+extern int clear_callbacks(int64_t fs_ino, int64_t f_ino, cbset *sharers);
+
+/* chunk reference counting (server) */
+extern int refs_init(void);
+extern void refs_finalize(void);
+extern int refs_get_commit(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t begin_chunk, int64_t nchunks,
+		unsigned char **new_hashes, unsigned char *cur_hashes, int64_t ncur);
+extern void refs_put_commit(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t begin_chunk, int64_t nchunks,
+		unsigned char **new_hashes, unsigned char *cur_hashes, int64_t ncur, int committed);
+extern void refs_put_range(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t begin_chunk, int64_t nchunks,
+		unsigned char *hashes);
+
+/* recipe cache (server) */
+#define RECIPE_WRITEBACK    0 /* write recipes back on a timer, at last close and before their chunks are released */
+#define RECIPE_WRITETHROUGH 1 /* write recipes before a wcommit is acknowledged */
+#define RECIPE_SYNC         2 /* same, and wait for them to reach the disk */
+extern int recipe_init(int mode);
+extern void recipe_finalize(void);
+extern int recipe_read(char *name, int64_t begin_chunk, int64_t *nchunks, unsigned char **phashes);
+extern int recipe_write(char *name, int64_t begin_chunk, int64_t nchunks, unsigned char **phashes);
+extern int recipe_truncate(char *name, int64_t new_nchunks);
+extern void recipe_close(char *name);
+extern void recipe_forget(char *name, int flush);
+extern int recipe_sync(void);
+extern int64_t recipe_length(char *name);
+
+/* hash trees over recipes (server) */
+extern int tree_read(char *name, int level, int64_t begin_node, int64_t *nnodes, unsigned char **nodes,
+		int64_t *nchunks, int *levels);
+extern void tree_update(char *name, int64_t begin_chunk, int64_t nchunks);
+extern void tree_truncate(char *name, int64_t nchunks);
+extern void tree_forget(char *name);
+extern void tree_finalize(void);
+
+/* hcache leases (server) */
+extern int lease_init(int msecs);
+extern void lease_finalize(void);
+extern int lease_term(void);
+extern int lease_client(int cb_id);
+extern int lease_grant(int64_t fs_ino, int64_t f_ino, int cb_id, int64_t begin_chunk, int64_t nchunks);
+extern void lease_recall(int64_t fs_ino, int64_t f_ino, int owner, int64_t begin_chunk, int64_t nchunks);
+extern void lease_forget(int64_t fs_ino, int64_t f_ino);
+
+/* snapshots (server) */
+#define SNAP_DIR ".snapshot" /* the snapshots of <dir> are <dir>/.snapshot/<name> */
+extern int snap_path(char *name);
+extern int snap_shared(char *name);
+extern void snap_share_lock(void);
+extern void snap_share_unlock(void);
+extern int snap_unshare(fsinfo_p fs_p, finfo_p f_p, char *name, capfs_filestat *p_stat);
+extern int snap_create(fsinfo_p fs_p, char *dir_name, char *snap_name);
+extern int snap_remove(fsinfo_p fs_p, char *dir_name, char *snap_name);
 
 extern int capfs_cbreg(struct capfs_options* , struct sockaddr *mgr_host, int prog, int vers, int proto);
 extern int commit_write(struct capfs_options*, char *fname, int64_t begin_chunk, int64_t nchunks,
-		sha1_info *old_hashes, sha1_info *new_hashes, sha1_info *current_hashes);
+		sha1_info *old_hashes, sha1_info *new_hashes, sha1_info *current_hashes, int64_t *version);
 
 /* Compat routines (server) */
 extern int process_compat_req(mreq *req, mack *ack, char *buf_p, struct ackdata *ackdata_p);
@@ -183,9 +252,14 @@ extern int process_compat_req(mreq *req, mack *ack, char *buf_p, struct ackdata
 extern int encode_compat_req(struct capfs_options *, struct sockaddr* mgr, mreq *req, 
 		mack *ack, char *buf_p, struct ackdata_c *recv_p);
 
-extern void cb_update_hashes(char *fname, int cb_id, int64_t begin_chunk, int64_t nchunks, char *phashes);
-extern void cb_invalidate_hashes(char *, unsigned long bitmap, int owner, int64_t, int64_t);
-extern void cb_clear_hashes(char *, unsigned long bitmap, int owner);
+extern int cb_fanout_init(void);
+extern void cb_fanout_finalize(void);
+extern void cb_set_coalesce(int usec);
+extern void cb_stats_dump(void);
+extern void cb_update_hashes(char *fname, int owner, int cb_id, int64_t begin_chunk, int64_t nchunks, char *phashes);
+extern void cb_invalidate_hashes(char *, cbset *sharers, int owner, int64_t, int64_t);
+extern void cb_clear_hashes(char *, cbset *sharers, int owner);
+extern int cb_leases(int cb_id);
 #endif
 
 /*
@@ -15,11 +15,14 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <string.h>
-#include "bit.h" /* Really inefficient but portable bit-vector implementation */
+#include "cbset.h"
 #include "mquickhash.h"
 #include "quicklist.h"
 #include "log.h"
 
+extern int cb_fanout_init(void);
+extern void cb_fanout_finalize(void);
+
 /* Minimum and maximum values a `signed long long int' can hold.  */
 #ifndef LLONG_MAX
 #define LLONG_MAX						9223372036854775807LL
@@ -42,8 +45,8 @@ struct File {
 struct callback_entry {
 	struct File 		cb_file;
 	int	  				cb_fix, cb_nwaiters;
-	/* FIXME: This will mean that we can have only upto 32 sharers per file */
-	unsigned long 		cb_bitmap;
+	/* callback identifiers of the nodes that may have cached hashes of the file */
+	cbset					cb_sharers;
 	struct qlist_head cb_hash;
 	pthread_mutex_t  	*cb_mutex;
 	pthread_cond_t   	*cb_cv;
@@ -61,8 +64,8 @@ struct cb_options {
 	union {
 		int 	add_cb_id;
 		int   del_cb_id;
-		unsigned long lookup_bitmap;
-		unsigned long reset_bitmap;
+		cbset *lookup_sharers;
+		cbset *reset_sharers;
 	} u;
 	char *fname;
 };
@@ -77,14 +80,14 @@ static inline int check_sanity(struct cb_options *options)
 		return -EINVAL;
 	}
 	if (options->mode == ADD_CB) {
-		if (options->u.add_cb_id < 0 || options->u.add_cb_id >= BITS_PER_LONG) {
-			LOG(stderr, DEBUG_MSG, SUBSYS_META, "Add cb_id [%d] cannot be outside the range [ 0 - %d ]\n", options->u.add_cb_id, BITS_PER_LONG);
+		if (options->u.add_cb_id < 0 || options->u.add_cb_id >= MAXCBS) {
+			LOG(stderr, DEBUG_MSG, SUBSYS_META, "Add cb_id [%d] cannot be outside the range [ 0 - %d ]\n", options->u.add_cb_id, MAXCBS);
 			return -EINVAL;
 		}
 	}
 	else if (options->mode == DEL_CB) {
-		if (options->u.del_cb_id < 0 || options->u.del_cb_id >= BITS_PER_LONG) {
-			LOG(stderr,DEBUG_MSG, SUBSYS_META, "Del cb_id [%d] cannot be outside the range [ 0 - %d]\n", options->u.del_cb_id, BITS_PER_LONG);
+		if (options->u.del_cb_id < 0 || options->u.del_cb_id >= MAXCBS) {
+			LOG(stderr,DEBUG_MSG, SUBSYS_META, "Del cb_id [%d] cannot be outside the range [ 0 - %d]\n", options->u.del_cb_id, MAXCBS);
 			return -EINVAL;
 		}
 	}
@@ -94,7 +97,7 @@ static inline int check_sanity(struct cb_options *options)
 /*
  * Tries to lookup the object in the cache, and if it finds it, returns it
  * else adds it atomically.
- * Also tries to add the sharer to the bitmap.
+ * Also tries to add the sharer to the sharer set.
  */
 static int get_object(struct File* ref, struct cb_options *options, int *error) 
 {
@@ -183,28 +186,37 @@ retry:
 			o->cb_nwaiters = 0;
 			o->cb_mutex = NULL;
 			o->cb_cv = NULL;
-			/* Initial bitmap is all zeroes */
-			o->cb_bitmap = 0;
+			/* Initially there are no sharers */
+			cbset_init(&o->cb_sharers);
 			mqhash_add(cb_hash_table, ref, &o->cb_hash);
 		}
 	}
-	o->cb_fix++;
-	/* Add this callback id to the sharer bitmap */
+	/* Add this callback id to the sharer set */
 	if (options->mode == ADD_CB) {
-		SetBit((unsigned char *) &o->cb_bitmap, sizeof(o->cb_bitmap), options->u.add_cb_id);
+		if (cbset_add(&o->cb_sharers, options->u.add_cb_id) < 0) {
+			if (error) {
+				*error = -ENOMEM;
+			}
+			goto unlock_chain;
+		}
 	}
 	else if (options->mode == DEL_CB) {
-		ClearBit((unsigned char *) &o->cb_bitmap, sizeof(o->cb_bitmap), options->u.del_cb_id);
+		cbset_del(&o->cb_sharers, options->u.del_cb_id);
 		options->fname = o->cb_file.fname;
 	}
 	else if (options->mode == LOOKUP_CB) {
-		options->u.lookup_bitmap = o->cb_bitmap;
+		if (cbset_copy(options->u.lookup_sharers, &o->cb_sharers) < 0) {
+			if (error) {
+				*error = -ENOMEM;
+			}
+			goto unlock_chain;
+		}
 		options->fname = o->cb_file.fname;
 	}
 	else if (options->mode == RESET_CB) {
-		options->u.reset_bitmap = o->cb_bitmap;
-		o->cb_bitmap = 0;
+		cbset_move(options->u.reset_sharers, &o->cb_sharers);
 	}
+	o->cb_fix++;
 unlock_chain:
 	mqhash_unlock(&cb_hash_table->lock[hindex]);
 	return 0;
@@ -269,14 +281,13 @@ static void put_object(struct File *ref)
  * c) 1 if we could locate it and deallocate it.
  * This routine could be called by unlink() kind of functions
  * or an fsync() function where any cached meta-data needs to be revalidated.
- * Returns the callback sharer bitmap at the time of the delete.
+ * Returns the callback sharer set at the time of the delete in sharers.
  */
-unsigned long del_object(struct File *ref, int *error)
+static void del_object(struct File *ref, cbset *sharers, int *error)
 {
 	struct qlist_head *entry = NULL;
 	struct callback_entry *o = NULL;
 	int hindex = 0;
-	unsigned long bitmap = 0;
 
 	if (error)
 	{
@@ -309,12 +320,15 @@ retry:
 					o->cb_cv = NULL;
 					if (o->cb_file.fname)
 						free(o->cb_file.fname);
-					bitmap = o->cb_bitmap;
+					cbset_move(sharers, &o->cb_sharers);
 					free(o);
 				}
 				else
 				{
-				    bitmap = o->cb_bitmap;
+					if (cbset_copy(sharers, &o->cb_sharers) < 0 && error)
+					{
+						*error = -ENOMEM;
+					}
 				}
 				break;
 			}
@@ -360,7 +374,7 @@ retry:
 		}
 	}
 	mqhash_unlock(&cb_hash_table->lock[hindex]);
-	return bitmap;
+	return;
 }
 
 int add_callbacks(int64_t fs_ino, int64_t f_ino, char *fname, int cb_id)
@@ -408,38 +422,43 @@ int del_callbacks(int64_t fs_ino, int64_t f_ino, int cb_id)
 	return 0;
 }
 
-long get_callbacks(int64_t fs_ino, int64_t f_ino, char **fname)
+/*
+ * Returns the sharers of the file in sharers (which must have been
+ * initialized with cbset_init()) and its name in fname.
+ */
+int get_callbacks(int64_t fs_ino, int64_t f_ino, char **fname, cbset *sharers)
 {
 	struct File f;
 	int error = 0;
 	struct cb_options options;
 
-	if (fname == NULL)
+	if (fname == NULL || sharers == NULL)
 	{
-		return -1;
+		return -EINVAL;
 	}
 	f.fs_ino = fs_ino;
 	f.f_ino = f_ino;
 	options.mode = LOOKUP_CB;
+	options.u.lookup_sharers = sharers;
 	get_object(&f, &options, &error);
 	if (error < 0) {
 		return error;
 	}
 	put_object(&f);
 	*fname = options.fname;
-	return options.u.lookup_bitmap;
+	return 0;
 }
 
-unsigned long clear_callbacks(int64_t fs_ino, int64_t f_ino)
+/* Forgets about the file, returning the sharers it had in sharers */
+int clear_callbacks(int64_t fs_ino, int64_t f_ino, cbset *sharers)
 {
 	struct File f;
-	int error;
-	unsigned long bitmap;
+	int error = 0;
 
 	f.fs_ino = fs_ino;
 	f.f_ino = f_ino;
-	bitmap = del_object(&f, &error);
-	return bitmap;
+	del_object(&f, sharers, &error);
+	return error;
 }
 
 static int file_compare(void *key, struct mqhash_head *link)
@@ -471,11 +490,17 @@ int cb_init(void)
 	{
 		return -1;
 	}
+	if (cb_fanout_init() < 0)
+	{
+		mqhash_finalize(cb_hash_table);
+		return -1;
+	}
 	return 0;
 }
 
 void cb_finalize(void)
 {
+	cb_fanout_finalize();
 	mqhash_finalize(cb_hash_table);
 }
 /*
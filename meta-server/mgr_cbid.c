@@ -3,12 +3,24 @@
  * vilayann@cse.psu.edu
  * Try to get a callback identifier for a particular client host.
  * 
+ * Also sends the hcache callbacks to the client hosts. Callbacks to the sharers
+ * of a file are handed to a pool of MGR_CB_WINDOW threads, so that up to that many
+ * of them are in flight at once, and the caller waits for all of them to finish.
+ * Callbacks to the same host go out one at a time. The time each callback takes is
+ * accumulated per host, and cb_stats_dump() reports it.
+ * Before it is sent, a callback waits a short while (see cb_set_coalesce()) so that
+ * callbacks from other commits to the same file and host can be merged into it.
  */
 #include "capfs-header.h"
 #include "mgr_prot.h"
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -16,14 +28,13 @@
 #include <rpc/clnt.h>
 #include "capfs_config.h"
 #include "log.h"
-#include "bit.h"
+#include "cbset.h"
+#include "quicklist.h"
 #include "rpcutils.h"
 #include "capfsd_prot.h"
 
 enum {USED = 1, UNUSED = 0};
 
-#define MAXCBS 1024
-
 static pthread_mutex_t cb_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct cb_entry cb_entry;
@@ -35,6 +46,12 @@ struct cb_entry {
 	struct sockaddr_in addr;
 	CLIENT *clnt;
 	struct sockaddr_in our_addr;
+	/* serializes the callbacks to the host, which share clnt */
+	pthread_mutex_t lock;
+	/* latency of the callbacks to the host */
+	int64_t ncalls, nfailed, total_usec, max_usec;
+	/* registered with CAPFS_CBREG2, so it knows about hcache leases */
+	int leases;
 };
 
 static cb_entry cb_table[MAXCBS];
@@ -87,16 +104,19 @@ static int find_unused_cbid(void)
 	return -1;
 }
 
-int cbreg_svc(cb_args *cb, struct sockaddr_in *raddr)
+int cbreg_svc(cb_args *cb, struct sockaddr_in *raddr, int leases)
 {
 	int cbid;
 
 	pthread_mutex_lock(&cb_mutex);
 	if ((cbid = find_cbid_of_host(raddr)) < 0) {
-		cbid = find_unused_cbid();
-		cb_table[cbid].used = USED;
-		cb_table[cbid].clnt = NULL;
-		cb_count++;
+		if ((cbid = find_unused_cbid()) >= 0) {
+			cb_table[cbid].used = USED;
+			cb_table[cbid].clnt = NULL;
+			cb_table[cbid].ncalls = cb_table[cbid].nfailed = 0;
+			cb_table[cbid].total_usec = cb_table[cbid].max_usec = 0;
+			cb_count++;
+		}
 	}
 	if (cbid >= 0) 
 	{
@@ -104,6 +124,7 @@ int cbreg_svc(cb_args *cb, struct sockaddr_in *raddr)
 		cb_table[cbid].cb.svc_prog = cb->svc_prog;
 		cb_table[cbid].cb.svc_vers = cb->svc_vers;
 		cb_table[cbid].cb.svc_proto = cb->svc_proto;
+		cb_table[cbid].leases = leases;
 		memcpy(&cb_table[cbid].addr, raddr, sizeof(struct sockaddr_in));
 		cb_host = inet_ntoa(raddr->sin_addr);
 		LOG(stderr, DEBUG_MSG, SUBSYS_META, "Registered host %s -> callback id %d\n", cb_host, cbid);
@@ -112,6 +133,22 @@ int cbreg_svc(cb_args *cb, struct sockaddr_in *raddr)
 	return cbid;
 }
 
+/* Does the host with callback id cb_id know about hcache leases? */
+int cb_leases(int cb_id)
+{
+	int leases = 0;
+
+	if (cb_id < 0 || cb_id >= MAXCBS) {
+		return 0;
+	}
+	pthread_mutex_lock(&cb_mutex);
+	if (cb_table[cb_id].used == USED) {
+		leases = cb_table[cb_id].leases;
+	}
+	pthread_mutex_unlock(&cb_mutex);
+	return leases;
+}
+
 CLIENT** get_cb_handle(int cb_id)
 {
 	CLIENT *clnt = NULL, **pclnt = NULL;
@@ -202,122 +239,573 @@ static void upd_dtor(upd_args *upd)
 	return;
 }
 
+enum {CB_INVALIDATE = 0, CB_UPDATE = 1};
+
+#define CB_PENDING_BUCKETS 101
+
 /*
- * As the name implies, this routine
- * tries to update the entire sharer set's hcache for a particular
- * file for a specific set of chunks.
- * We do not resort to this routine, unless we know for sure
- * that there is *exactly* 1 sharer.
+ * A callback to one host about one file. While it waits out the
+ * coalescing window, callbacks from other commits on overlapping or
+ * adjacent chunks of the same file to the same host are merged into it.
  */
-void cb_update_hashes(char *fname, int cb_id, int64_t begin_chunk, int64_t nchunks, char *phashes)
+struct cb_pending {
+	struct qlist_head cp_link;
+	char    *cp_fname;
+	int      cp_cbid;
+	int      cp_type;
+	int64_t  cp_begin_chunk; /* -1 for the entire file */
+	int64_t  cp_nchunks;
+	char    *cp_hashes;      /* cp_nchunks hashes of a CB_UPDATE */
+	int      cp_sent, cp_done, cp_refs;
+};
+
+/* a set of callbacks sent in parallel */
+struct cb_batch {
+	int            cb_pending;
+	pthread_cond_t cb_done;
+};
+
+/* one host's share of a batch, queued for the callback threads */
+struct cb_call {
+	struct qlist_head  cc_link;
+	struct cb_pending *cc_pending;
+	struct cb_batch   *cc_batch;
+};
+
+static QLIST_HEAD(cb_queue);
+static pthread_mutex_t cb_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cb_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t cb_threads[MGR_CB_WINDOW];
+static int cb_nthreads = 0, cb_stop = 0;
+
+static struct qlist_head cb_pending_table[CB_PENDING_BUCKETS];
+static pthread_mutex_t cb_pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cb_pending_cond = PTHREAD_COND_INITIALIZER;
+static int cb_coalesce_usec = MGR_CB_COALESCE;
+
+/* Makes the callback to one host, and accounts for the time it took */
+static void cb_call_one(struct cb_pending *cp)
 {
-	CLIENT **pclnt = NULL;
-	if (fname == NULL)
+	CLIENT **pclnt;
+	struct timeval start, end;
+	enum clnt_stat result = RPC_FAILED;
+	int64_t usec;
+	int status = 0, cb_id = cp->cp_cbid;
+
+	if (cb_id < 0 || cb_id >= MAXCBS)
 	{
 		return;
 	}
-	LOG(stderr, DEBUG_MSG, SUBSYS_META, "cb_update_hashes called to update cb_id %d for %s from %Ld for %Ld chunks\n",
-			cb_id, fname, begin_chunk, nchunks);
+	pthread_mutex_lock(&cb_table[cb_id].lock);
+	gettimeofday(&start, NULL);
 	pclnt = get_cb_handle(cb_id);
 	if (*pclnt == NULL)
 	{
-		LOG(stderr, WARNING_MSG, SUBSYS_META, "cb_update_hashes: connection refused\n");
-		errno = ECONNREFUSED;
+		LOG(stderr, WARNING_MSG, SUBSYS_META, "callback to %d: connection refused\n", cb_id);
 	}
 	else
 	{
-		enum clnt_stat result;
-		upd_args arg;
-		upd_resp resp;
-
-		if (upd_ctor(&arg, nchunks, phashes) < 0)
-		{
-			LOG(stderr, WARNING_MSG, SUBSYS_META, "cb_update_hashes: could not malloc upd_args!\n");
-			errno = ENOMEM;
-			put_cb_handle(pclnt, 0);
-		}
-		else 
+		if (cp->cp_type == CB_UPDATE)
 		{
-			arg.id.type = FILEBYNAME;
-			arg.id.identify_u.name = fname;
-			arg.begin_chunk = begin_chunk;
-			result = capfsd_update_1(arg, &resp, *pclnt);
-			if (result != RPC_SUCCESS) 
+			upd_args arg;
+			upd_resp resp;
+
+			if (upd_ctor(&arg, cp->cp_nchunks, cp->cp_hashes) < 0)
 			{
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "capfsd_update_1 to %d returned %d\n", cb_id, result);
-				clnt_perror(*pclnt, "capfs_update_1 :");
-				/* make it reconnect */
-				put_cb_handle(pclnt, 1);
-			}
-			else {
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "capfsd_update_1 to %d returned %d\n", cb_id, resp.status);
+				LOG(stderr, WARNING_MSG, SUBSYS_META, "cb_call_one: could not malloc upd_args!\n");
 				put_cb_handle(pclnt, 0);
+				pthread_mutex_unlock(&cb_table[cb_id].lock);
+				return;
 			}
+			arg.id.type = FILEBYNAME;
+			arg.id.identify_u.name = cp->cp_fname;
+			arg.begin_chunk = cp->cp_begin_chunk;
+			result = capfsd_update_1(arg, &resp, *pclnt);
+			status = resp.status;
 			upd_dtor(&arg);
 		}
+		else
+		{
+			inv_args arg;
+			inv_resp resp;
+
+			arg.id.type = FILEBYNAME;
+			arg.id.identify_u.name = cp->cp_fname;
+			arg.begin_chunk = cp->cp_begin_chunk;
+			arg.nchunks = cp->cp_nchunks;
+			result = capfsd_invalidate_1(arg, &resp, *pclnt);
+			status = resp.status;
+		}
+		if (result != RPC_SUCCESS) 
+		{
+			LOG(stderr, DEBUG_MSG, SUBSYS_META, "callback [%d] to %d returned %d\n", cp->cp_type, cb_id, result);
+			clnt_perror(*pclnt, "capfsd callback :");
+			/* make it reconnect */
+			put_cb_handle(pclnt, 1);
+		}
+		else 
+		{
+			LOG(stderr, DEBUG_MSG, SUBSYS_META, "callback [%d] to %d returned %d\n", cp->cp_type, cb_id, status);
+			put_cb_handle(pclnt, 0);
+		}
 	}
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_usec - start.tv_usec);
+	cb_table[cb_id].ncalls++;
+	if (result != RPC_SUCCESS)
+	{
+		cb_table[cb_id].nfailed++;
+	}
+	cb_table[cb_id].total_usec += usec;
+	if (usec > cb_table[cb_id].max_usec)
+	{
+		cb_table[cb_id].max_usec = usec;
+	}
+	pthread_mutex_unlock(&cb_table[cb_id].lock);
+	LOG(stderr, DEBUG_MSG, SUBSYS_META, "callback [%d] to %d for %s from %Ld for %Ld chunks took %Ld usec\n",
+			cp->cp_type, cb_id, cp->cp_fname, cp->cp_begin_chunk, cp->cp_nchunks, usec);
 	return;
 }
 
-/*
- * As the name implies, this routine
- * tries to invalidate the entire sharer set's hcache for a particular
- * file for a specific set of chunks.
- * We take care to ensure that the owner node's hcache
- * is excluded, since the owner initiated the operation.
- */
-void cb_invalidate_hashes(char *fname, unsigned long bitmap, int owner_cb_id, int64_t begin_chunk, int64_t nchunks)
+static void *cb_thread(void *args)
 {
+	struct cb_call *cc;
+
+	pthread_mutex_lock(&cb_queue_mutex);
+	while (!cb_stop)
+	{
+		if (qlist_empty(&cb_queue))
+		{
+			pthread_cond_wait(&cb_queue_cond, &cb_queue_mutex);
+			continue;
+		}
+		cc = qlist_entry(cb_queue.next, struct cb_call, cc_link);
+		qlist_del(&cc->cc_link);
+		pthread_mutex_unlock(&cb_queue_mutex);
+		cb_call_one(cc->cc_pending);
+		pthread_mutex_lock(&cb_queue_mutex);
+		if (--cc->cc_batch->cb_pending == 0)
+		{
+			pthread_cond_broadcast(&cc->cc_batch->cb_done);
+		}
+	}
+	pthread_mutex_unlock(&cb_queue_mutex);
+	return NULL;
+}
+
+/* Sends the n callbacks, and returns once all of them are done */
+static void cb_send(struct cb_pending **cps, int n)
+{
+	struct cb_call *calls = NULL;
+	struct cb_batch batch;
 	int i;
 
-	if (fname == NULL)
+	if (n <= 0)
 	{
 		return;
 	}
-	LOG(stderr, DEBUG_MSG, SUBSYS_META, "cb_invalidate_hashes called by owner %d for %s from %Ld for %Ld chunks\n",
-			owner_cb_id, fname, begin_chunk, nchunks);
-	i = FindFirstBit((unsigned char *)&bitmap, sizeof(bitmap));
-	while (i >= 0)
+	/* a single callback is not worth a trip through the callback threads */
+	if (n == 1 || cb_nthreads == 0
+			|| (calls = (struct cb_call *) calloc(n, sizeof(struct cb_call))) == NULL)
+	{
+		for (i = 0; i < n; i++)
+		{
+			cb_call_one(cps[i]);
+		}
+		return;
+	}
+	pthread_cond_init(&batch.cb_done, NULL);
+	pthread_mutex_lock(&cb_queue_mutex);
+	batch.cb_pending = n;
+	for (i = 0; i < n; i++)
+	{
+		calls[i].cc_pending = cps[i];
+		calls[i].cc_batch = &batch;
+		qlist_add_tail(&calls[i].cc_link, &cb_queue);
+	}
+	pthread_cond_broadcast(&cb_queue_cond);
+	while (batch.cb_pending > 0)
 	{
-		CLIENT **pclnt;
+		pthread_cond_wait(&batch.cb_done, &cb_queue_mutex);
+	}
+	pthread_mutex_unlock(&cb_queue_mutex);
+	pthread_cond_destroy(&batch.cb_done);
+	free(calls);
+	return;
+}
+
+static unsigned int cb_pending_hash(char *fname, int cb_id)
+{
+	unsigned int h = cb_id;
+
+	while (*fname) {
+		h = h * 31 + (unsigned char) *fname++;
+	}
+	return h % CB_PENDING_BUCKETS;
+}
+
+/* must be called with cb_pending_mutex held */
+static struct cb_pending *cb_pending_find(char *fname, int cb_id)
+{
+	struct qlist_head *tmp;
+	struct cb_pending *cp;
+
+	qlist_for_each(tmp, &cb_pending_table[cb_pending_hash(fname, cb_id)]) {
+		cp = qlist_entry(tmp, struct cb_pending, cp_link);
+		if (cp->cp_cbid == cb_id && strcmp(cp->cp_fname, fname) == 0) {
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+static struct cb_pending *cb_pending_alloc(char *fname, int cb_id, int type,
+		int64_t begin_chunk, int64_t nchunks, char *phashes)
+{
+	struct cb_pending *cp;
+
+	if ((cp = (struct cb_pending *) calloc(1, sizeof(struct cb_pending))) == NULL) {
+		return NULL;
+	}
+	if ((cp->cp_fname = strdup(fname)) == NULL) {
+		free(cp);
+		return NULL;
+	}
+	if (type == CB_UPDATE) {
+		if ((cp->cp_hashes = (char *) malloc(nchunks * CAPFS_MAXHASHLENGTH)) == NULL) {
+			free(cp->cp_fname);
+			free(cp);
+			return NULL;
+		}
+		memcpy(cp->cp_hashes, phashes, nchunks * CAPFS_MAXHASHLENGTH);
+	}
+	cp->cp_cbid = cb_id;
+	cp->cp_type = type;
+	cp->cp_begin_chunk = begin_chunk;
+	cp->cp_nchunks = nchunks;
+	cp->cp_refs = 1;
+	return cp;
+}
+
+static void cb_pending_free(struct cb_pending *cp)
+{
+	free(cp->cp_hashes);
+	free(cp->cp_fname);
+	free(cp);
+}
+
+/* turns cp into an invalidate of the chunks it covers */
+static void cb_pending_invalidate(struct cb_pending *cp)
+{
+	cp->cp_type = CB_INVALIDATE;
+	free(cp->cp_hashes);
+	cp->cp_hashes = NULL;
+}
+
+/*
+ * Merges a callback for the chunks [begin_chunk, begin_chunk + nchunks)
+ * into cp, if the two ranges overlap or are adjacent. Two updates of
+ * adjacent ranges stay an update, anything else becomes an invalidate
+ * of both ranges (we cannot tell which of two overlapping updates is newer).
+ * Returns 1 if the callback was merged, 0 otherwise.
+ */
+static int cb_pending_merge(struct cb_pending *cp, int type,
+		int64_t begin_chunk, int64_t nchunks, char *phashes)
+{
+	int64_t begin, end;
+	char *hashes;
 
-		/* i is the cb_index using which we can now make RPC callbacks */
-		if (i == owner_cb_id)
+	if (cp->cp_begin_chunk < 0 || begin_chunk < 0) {
+		/* either one covers the entire file */
+		cb_pending_invalidate(cp);
+		cp->cp_begin_chunk = -1;
+		cp->cp_nchunks = 0;
+		return 1;
+	}
+	if (begin_chunk > cp->cp_begin_chunk + cp->cp_nchunks
+			|| cp->cp_begin_chunk > begin_chunk + nchunks) {
+		return 0;
+	}
+	begin = MIN(begin_chunk, cp->cp_begin_chunk);
+	end = MAX(begin_chunk + nchunks, cp->cp_begin_chunk + cp->cp_nchunks);
+	if (type == CB_UPDATE && cp->cp_type == CB_UPDATE
+			&& (begin_chunk == cp->cp_begin_chunk + cp->cp_nchunks
+				|| cp->cp_begin_chunk == begin_chunk + nchunks)
+			&& (hashes = (char *) malloc((end - begin) * CAPFS_MAXHASHLENGTH)) != NULL) {
+		memcpy(hashes + (cp->cp_begin_chunk - begin) * CAPFS_MAXHASHLENGTH, cp->cp_hashes,
+				cp->cp_nchunks * CAPFS_MAXHASHLENGTH);
+		memcpy(hashes + (begin_chunk - begin) * CAPFS_MAXHASHLENGTH, phashes,
+				nchunks * CAPFS_MAXHASHLENGTH);
+		free(cp->cp_hashes);
+		cp->cp_hashes = hashes;
+	}
+	else {
+		cb_pending_invalidate(cp);
+	}
+	cp->cp_begin_chunk = begin;
+	cp->cp_nchunks = end - begin;
+	return 1;
+}
+
+/*
+ * Sends a callback about fname to every host in targets, merging it
+ * into any callback about the same file still waiting out its window,
+ * and returns once all the callbacks that carry it have been made.
+ * An update pending for the owner itself that overlaps the chunks it
+ * just changed would be stale by the time it arrives, so it is turned
+ * into an invalidate.
+ */
+static void cb_coalesce(char *fname, int *targets, int ntargets, int owner_cb_id,
+		int type, int64_t begin_chunk, int64_t nchunks, char *phashes)
+{
+	struct cb_pending **cps, **led, *cp;
+	struct timeval start, end;
+	int i, nled = 0;
+
+	if (ntargets <= 0)
+	{
+		return;
+	}
+	gettimeofday(&start, NULL);
+	if ((cps = (struct cb_pending **) calloc(2 * ntargets, sizeof(struct cb_pending *))) == NULL)
+	{
+		goto nomem;
+	}
+	led = cps + ntargets;
+	/* allocate before taking the lock; whatever is not needed is freed later */
+	for (i = 0; i < ntargets; i++)
+	{
+		if ((led[i] = cb_pending_alloc(fname, targets[i], type, begin_chunk, nchunks, phashes)) == NULL)
 		{
-			LOG(stderr, DEBUG_MSG, SUBSYS_META, "skipping callback id %d\n", i);
-			i = FindNextBit((unsigned char *)&bitmap, 4, i + 1);
+			while (--i >= 0)
+			{
+				cb_pending_free(led[i]);
+			}
+			free(cps);
+			goto nomem;
+		}
+	}
+	pthread_mutex_lock(&cb_pending_mutex);
+	if (cb_coalesce_usec > 0 && owner_cb_id >= 0
+			&& (cp = cb_pending_find(fname, owner_cb_id)) != NULL
+			&& cp->cp_type == CB_UPDATE
+			&& (begin_chunk < 0 || (begin_chunk < cp->cp_begin_chunk + cp->cp_nchunks
+					&& cp->cp_begin_chunk < begin_chunk + nchunks)))
+	{
+		cb_pending_invalidate(cp);
+	}
+	for (i = 0; i < ntargets; i++)
+	{
+		cp = NULL;
+		if (cb_coalesce_usec > 0 && (cp = cb_pending_find(fname, targets[i])) != NULL
+				&& cb_pending_merge(cp, type, begin_chunk, nchunks, phashes))
+		{
+			cp->cp_refs++;
+			cps[i] = cp;
+			cb_pending_free(led[i]);
 			continue;
 		}
-		LOG(stderr, DEBUG_MSG, SUBSYS_META, "callback id %d\n", i);
-		pclnt = get_cb_handle(i);
-		if (*pclnt == NULL)
+		cps[i] = led[i];
+		led[nled++] = cps[i];
+		if (cb_coalesce_usec > 0 && cp == NULL)
 		{
-			errno = ECONNREFUSED;
+			qlist_add_tail(&cps[i]->cp_link, &cb_pending_table[cb_pending_hash(fname, targets[i])]);
 		}
 		else
 		{
-			enum clnt_stat result;
-			inv_args arg;
-			inv_resp resp;
+			/* not waiting for others to join it */
+			INIT_QLIST_HEAD(&cps[i]->cp_link);
+		}
+	}
+	pthread_mutex_unlock(&cb_pending_mutex);
+	if (nled > 0)
+	{
+		if (cb_coalesce_usec > 0)
+		{
+			usleep(cb_coalesce_usec);
+		}
+		pthread_mutex_lock(&cb_pending_mutex);
+		for (i = 0; i < nled; i++)
+		{
+			led[i]->cp_sent = 1;
+			qlist_del_init(&led[i]->cp_link);
+		}
+		pthread_mutex_unlock(&cb_pending_mutex);
+		cb_send(led, nled);
+	}
+	pthread_mutex_lock(&cb_pending_mutex);
+	for (i = 0; i < nled; i++)
+	{
+		led[i]->cp_done = 1;
+	}
+	if (nled > 0)
+	{
+		pthread_cond_broadcast(&cb_pending_cond);
+	}
+	for (i = 0; i < ntargets; i++)
+	{
+		while (!cps[i]->cp_done)
+		{
+			pthread_cond_wait(&cb_pending_cond, &cb_pending_mutex);
+		}
+		if (--cps[i]->cp_refs == 0)
+		{
+			cb_pending_free(cps[i]);
+		}
+	}
+	pthread_mutex_unlock(&cb_pending_mutex);
+	free(cps);
+	gettimeofday(&end, NULL);
+	LOG(stderr, DEBUG_MSG, SUBSYS_META, "callbacks to %d hosts (%d sent) for %s took %ld usec\n", ntargets, nled, fname,
+			(long) ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)));
+	return;
+nomem:
+	/* send them one by one, without coalescing */
+	LOG(stderr, WARNING_MSG, SUBSYS_META, "cb_coalesce: could not allocate callbacks for %s\n", fname);
+	for (i = 0; i < ntargets; i++)
+	{
+		struct cb_pending tmp;
 
-			arg.id.type = FILEBYNAME;
-			arg.id.identify_u.name = fname;
-			arg.begin_chunk = begin_chunk;
-			arg.nchunks = nchunks;
-			result = capfsd_invalidate_1(arg, &resp, *pclnt);
-			if (result != RPC_SUCCESS) {
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "capfsd_invalidate_1 [1] to %d returned %d\n", i, result);
-				clnt_perror(*pclnt, "capfs_invalidate_1 [1]:");
-				/* make it reconnect */
-				put_cb_handle(pclnt, 1);
-			}
-			else {
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "capfsd_invalidate_1 [1] to %d returned %d\n", i, resp.status);
-				put_cb_handle(pclnt, 0);
-			}
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.cp_fname = fname;
+		tmp.cp_cbid = targets[i];
+		tmp.cp_type = type;
+		tmp.cp_begin_chunk = begin_chunk;
+		tmp.cp_nchunks = nchunks;
+		tmp.cp_hashes = phashes;
+		cb_call_one(&tmp);
+	}
+	return;
+}
+
+/* Sends the callback to every host in sharers except owner_cb_id */
+static void cb_fanout(char *fname, cbset *sharers, int owner_cb_id, 
+		int type, int64_t begin_chunk, int64_t nchunks, char *phashes)
+{
+	int i, n = 0, *targets;
+
+	if ((targets = (int *) malloc(MAX(cbset_count(sharers), 1) * sizeof(int))) == NULL)
+	{
+		LOG(stderr, WARNING_MSG, SUBSYS_META, "cb_fanout: could not malloc targets!\n");
+		return;
+	}
+	cbset_for_each(i, sharers)
+	{
+		if (i != owner_cb_id)
+		{
+			targets[n++] = i;
 		}
-		i = FindNextBit((unsigned char *)&bitmap, 4, i + 1);
 	}
+	cb_coalesce(fname, targets, n, owner_cb_id, type, begin_chunk, nchunks, phashes);
+	free(targets);
+	return;
+}
+
+void cb_fanout_finalize(void)
+{
+	int i;
+
+	pthread_mutex_lock(&cb_queue_mutex);
+	cb_stop = 1;
+	pthread_cond_broadcast(&cb_queue_cond);
+	pthread_mutex_unlock(&cb_queue_mutex);
+	for (i = 0; i < cb_nthreads; i++)
+	{
+		pthread_join(cb_threads[i], NULL);
+	}
+	cb_nthreads = 0;
+	return;
+}
+
+int cb_fanout_init(void)
+{
+	int i, ret;
+
+	for (i = 0; i < MAXCBS; i++)
+	{
+		pthread_mutex_init(&cb_table[i].lock, NULL);
+	}
+	for (i = 0; i < CB_PENDING_BUCKETS; i++)
+	{
+		INIT_QLIST_HEAD(&cb_pending_table[i]);
+	}
+	cb_stop = 0;
+	for (cb_nthreads = 0; cb_nthreads < MGR_CB_WINDOW; cb_nthreads++)
+	{
+		if ((ret = pthread_create(&cb_threads[cb_nthreads], NULL, cb_thread, NULL)) != 0)
+		{
+			errno = ret;
+			PERROR(SUBSYS_META, "cb_fanout_init: pthread_create");
+			cb_fanout_finalize();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* 
+ * Sets how long (in microseconds) a callback waits for others to merge
+ * with before it is sent. 0 sends every callback right away.
+ */
+void cb_set_coalesce(int usec)
+{
+	cb_coalesce_usec = (usec > 0) ? usec : 0;
+	return;
+}
+
+/* Reports the latency of the callbacks to each host */
+void cb_stats_dump(void)
+{
+	int i;
+
+	for (i = 0; i < MAXCBS; i++)
+	{
+		if (cb_table[i].used != USED || cb_table[i].ncalls == 0)
+		{
+			continue;
+		}
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "callback id %d (%s): %Ld callbacks, %Ld failed, avg %Ld usec, max %Ld usec\n",
+				i, inet_ntoa(cb_table[i].addr.sin_addr), cb_table[i].ncalls, cb_table[i].nfailed,
+				cb_table[i].total_usec / cb_table[i].ncalls, cb_table[i].max_usec);
+	}
+	return;
+}
+
+/*
+ * As the name implies, this routine
+ * tries to update the entire sharer set's hcache for a particular
+ * file for a specific set of chunks.
+ * We do not resort to this routine, unless we know for sure
+ * that there is *exactly* 1 sharer.
+ */
+void cb_update_hashes(char *fname, int owner_cb_id, int cb_id, int64_t begin_chunk, int64_t nchunks, char *phashes)
+{
+	if (fname == NULL)
+	{
+		return;
+	}
+	LOG(stderr, DEBUG_MSG, SUBSYS_META, "cb_update_hashes called by owner %d to update cb_id %d for %s from %Ld for %Ld chunks\n",
+			owner_cb_id, cb_id, fname, begin_chunk, nchunks);
+	cb_coalesce(fname, &cb_id, 1, owner_cb_id, CB_UPDATE, begin_chunk, nchunks, phashes);
+	return;
+}
+
+/*
+ * As the name implies, this routine
+ * tries to invalidate the entire sharer set's hcache for a particular
+ * file for a specific set of chunks.
+ * We take care to ensure that the owner node's hcache
+ * is excluded, since the owner initiated the operation.
+ */
+void cb_invalidate_hashes(char *fname, cbset *sharers, int owner_cb_id, int64_t begin_chunk, int64_t nchunks)
+{
+	if (fname == NULL)
+	{
+		return;
+	}
+	LOG(stderr, DEBUG_MSG, SUBSYS_META, "cb_invalidate_hashes called by owner %d for %s from %Ld for %Ld chunks\n",
+			owner_cb_id, fname, begin_chunk, nchunks);
+	cb_fanout(fname, sharers, owner_cb_id, CB_INVALIDATE, begin_chunk, nchunks, NULL);
 	return;
 }
 
@@ -327,60 +815,15 @@ void cb_invalidate_hashes(char *fname, unsigned long bitmap, int owner_cb_id, in
  * We ensure that the owner who issued the operation
  * is not called back.
  */
-void cb_clear_hashes(char *fname, unsigned long bitmap, int owner_cb_id)
+void cb_clear_hashes(char *fname, cbset *sharers, int owner_cb_id)
 {
-	int i;
-
 	if (fname == NULL)
 	{
 		return;
 	}
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "cb_clear_hashes called by owner %d for %s\n", 
 			owner_cb_id, fname);
-	i = FindFirstBit((unsigned char *)&bitmap, sizeof(bitmap));
-	while (i >= 0)
-	{
-		CLIENT **pclnt;
-
-		/* i is the cb_index using which we can now make RPC callbacks */
-		if (i == owner_cb_id)
-		{
-			LOG(stderr, DEBUG_MSG, SUBSYS_META, "skipping callback id %d\n", i);
-			i = FindNextBit((unsigned char *)&bitmap, 4, i + 1);
-			continue;
-		}
-		LOG(stderr, DEBUG_MSG, SUBSYS_META, "callback id %d\n", i);
-		pclnt = get_cb_handle(i);
-		if (*pclnt == NULL)
-		{
-			errno = ECONNREFUSED;
-		}
-		else
-		{
-			enum clnt_stat result;
-			inv_args arg;
-			inv_resp resp;
-
-			arg.id.type = FILEBYNAME;
-			arg.id.identify_u.name = fname;
-			/* Special callback identifier to indicate entire file */
-			arg.begin_chunk = -1;
-			arg.nchunks = 0;
-			result = capfsd_invalidate_1(arg, &resp, *pclnt);
-			if (result != RPC_SUCCESS) 
-			{
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "capfsd_invalidate_1 [2] to %d returned %d\n", i, result);
-				clnt_perror(*pclnt, "capfs_invalidate_1 [2] :");
-				/* make it reconnect */
-				put_cb_handle(pclnt, 1);
-			}
-			else 
-			{
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "capfsd_invalidate_1 [2] to %d returned %d\n", i, resp.status);
-				put_cb_handle(pclnt, 0);
-			}
-		}
-		i = FindNextBit((unsigned char *)&bitmap, 4, i + 1);
-	}
+	/* Special callback identifier to indicate entire file */
+	cb_fanout(fname, sharers, owner_cb_id, CB_INVALIDATE, -1, 0, NULL);
 	return;
 }
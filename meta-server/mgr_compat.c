@@ -48,7 +48,6 @@
 #include "cas.h"
 #include "sha.h"
 #include "mgr_prot.h"
-#include "bit.h"
 
 #ifndef O_LARGEFILE
 #define O_LARGEFILE 0
@@ -92,6 +91,9 @@ static int do_rmdir(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ac
 static int do_getdents(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p);
 static int do_gethashes(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p);
 static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p);
+static int do_clone(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p);
+static int do_snapshot(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p);
+static int do_gettree(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p);
 
 static int send_open_ack(mreq_p req_p, mack_p ack_p, fsinfo_p fs_p, int cap, struct ackdata *ackdata_p);
 static fsinfo_p quick_mount(char *fname, int uid, int gid, mack_p ack_p, struct ackdata *ackdata_p);
@@ -132,6 +134,9 @@ static int (*reqfn[])(mreq_p, void *, mack_p, struct ackdata *) = {
 	do_stat,
 	do_gethashes,
 	do_wcommit,
+	do_clone,
+	do_snapshot,
+	do_gettree,
 };
 
 /* reqtest structure only used to print meaningful debug messages */
@@ -165,6 +170,9 @@ static char *reqtext[] = {
 	"stat",
 	"gethashes",
 	"wcommit",
+	"clone",
+	"snapshot",
+	"gettree",
 /*** ADD NEW CALLS ABOVE THIS LINE ***/
 	"error",
 	"error",
@@ -208,6 +216,54 @@ extern int get_dmeta(char * fname, dmeta_p dir);
 
 
 /* FUNCTIONS */
+
+/*
+ * Returns 1 if the request would change something within a snapshot.
+ * fchmod and fchown are turned away by do_chmod() and do_chown().
+ */
+static int snap_write(mreq *req, char *buf_p)
+{
+	char *second = buf_p;
+
+	if (buf_p == NULL || req->dsize <= 0) {
+		return 0;
+	}
+	switch (req->type) {
+		case MGR_OPEN:
+			if (!(req->req.open.flag & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC))) {
+				return 0;
+			}
+			return snap_path(buf_p);
+		case MGR_ACCESS:
+			return (req->req.access.mode & W_OK) && snap_path(buf_p);
+		case MGR_UNLINK:
+		case MGR_MKDIR:
+		case MGR_RMDIR:
+		case MGR_TRUNCATE:
+		case MGR_UTIME:
+		case MGR_CTIME:
+		case MGR_WCOMMIT:
+			return snap_path(buf_p);
+		case MGR_LINK:
+			/* a symbolic link may point anywhere */
+			if (req->req.link.soft) {
+				return snap_path(buf_p);
+			}
+			/* fall through */
+		case MGR_RENAME:
+			for (;*second;second++);
+			second++;
+			return snap_path(buf_p) || snap_path(second);
+		case MGR_CLONE:
+			/* files can be cloned out of a snapshot, though */
+			for (;*second;second++);
+			second++;
+			return snap_path(second);
+		default:
+			return 0;
+	}
+}
+
 #define MAX_REASONABLE_TRAILER 16384
 int process_compat_req(mreq *req, mack *ack, char *buf_p, struct ackdata *ackdata_p)
 {
@@ -295,6 +351,12 @@ int process_compat_req(mreq *req, mack *ack, char *buf_p, struct ackdata *ackdat
 	ack->status     = 0;
 	ack->dsize      = 0;
 	ack->eno        = 0;
+	/* snapshots are read-only */
+	if (snap_write(req, buf_p)) {
+		ack->status = -1;
+		ack->eno    = EROFS;
+		return 0;
+	}
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "req: %s\n", reqtext[req->type]);
 	err = (reqfn[req->type])(req, buf_p, ack, ackdata_p); /* handle request */
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "Completed: type=[%s]\n", 
@@ -311,6 +373,11 @@ static int do_chmod(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ac
 {
 	/* check for reserved name first */
 	if (resv_name(data_p) == 0) {
+		if (snap_path(data_p)) {
+			ack_p->status = -1;
+			ack_p->eno = EROFS;
+			return 0;
+		}
 		ack_p->status = md_chmod(req_p, (char *)data_p); /* 0 on success */
 		ack_p->eno = errno;
 	}
@@ -325,6 +392,11 @@ static int do_chown(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ac
 {
 	/* check for reserved name first */
 	if (resv_name(data_p) == 0) {
+		if (snap_path(data_p)) {
+			ack_p->status = -1;
+			ack_p->eno = EROFS;
+			return 0;
+		}
 		ack_p->status          = md_chown(req_p, data_p); /* 0 on success */
 		ack_p->eno             = errno;
 	}
@@ -428,6 +500,8 @@ static int do_truncate(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata
 	fmeta meta;
    int64_t newhash_count = 0;
    int64_t oldhash_count = 0;
+	int64_t ndropped = 0;
+	unsigned char *dropped = NULL;
 
 	/* check for reserved name first */
 	if (resv_name(data_p) != 0) {
@@ -486,13 +560,44 @@ static int do_truncate(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata
 		{
 			f_wrlock(f_p);
 		}
+		/* a recipe shared with a snapshot is copied before it is cut */
+		if (snap_unshare(fs_p, f_p, data_p, &meta.p_stat) < 0)
+		{
+			ack_p->status = -1;
+			ack_p->eno = errno;
+			if (f_p)
+			{
+				f_unlock(f_p);
+			}
+			return 0;
+		}
+		/* remember the hashes that are about to be cut off so that their chunks can be released */
+		if (newhash_count < oldhash_count)
+		{
+			ndropped = oldhash_count - newhash_count;
+			if (recipe_read(data_p, newhash_count, &ndropped, &dropped) < 0)
+			{
+				ndropped = 0;
+				dropped = NULL;
+			}
+		}
 		/* if file was not open, treat it like no races possible. Technically incorrect here though */
-		meta_hash_truncate(data_p, newhash_count);
+		if (recipe_truncate(data_p, newhash_count) < 0)
+		{
+			ndropped = 0;
+		}
+		/* every hash past the shorter of the two lengths was dropped or appeared */
+		f_version_truncate(f_p, MIN(newhash_count, oldhash_count));
 		/* unlock it after the operation is done */
 		if (f_p)
 		{
 			f_unlock(f_p);
 		}
+		if (ndropped > 0)
+		{
+			refs_put_range(fs_p, &meta.p_stat, newhash_count, ndropped, dropped);
+		}
+		free(dropped);
 		/* if the new file is smaller than the previous one */
 		if (newhash_count < oldhash_count)
 		{
@@ -1071,6 +1176,9 @@ static int do_unlink(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *a
 	finfo_p f_p;
 	ireq iodreq;
 	fmeta meta;
+	struct stat sbuf;
+	int64_t nhashes = 0;
+	unsigned char *hashes = NULL;
 
 	/* check for reserved name first */
 	if (resv_name(data_p) != 0) {
@@ -1085,14 +1193,34 @@ static int do_unlink(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *a
 		ack_p->eno = errno;
 		return 0;
 	}
+	/*
+	 * md_unlink removes the recipe along with the metadata file, so grab it
+	 * first to release its chunks. Files with other hard links keep their chunks,
+	 * and so do files whose recipe is shared with a snapshot.
+	 */
+	snap_share_lock();
+	if (capfs_mode == 1 && lstat(data_p, &sbuf) == 0 
+			&& S_ISREG(sbuf.st_mode) && sbuf.st_nlink == 1 && !snap_shared(data_p))
+	{
+		if (recipe_read(data_p, -1, &nhashes, &hashes) < 0)
+		{
+			nhashes = 0;
+			hashes = NULL;
+		}
+	}
 	/* md_unlink returns -1 on failure, or an open fd to metadata file on
 	 * success.  This is so we can hold on to the inode if we need to.
 	 */
-	if ((fd = md_unlink(req_p, &meta, (char *)data_p, &is_link)) < 0) {
+	fd = md_unlink(req_p, &meta, (char *)data_p, &is_link);
+	snap_share_unlock();
+	if (fd < 0) {
 		ack_p->status = fd;
 		ack_p->eno = errno;
+		free(hashes);
 		return 0;
 	}
+	/* whatever the cache has not written back of the recipe is of no use anymore */
+	recipe_forget(data_p, 0);
 	/* only if it is a normal file should this be done */
 	if (is_link != 1) 
 	{
@@ -1108,10 +1236,19 @@ static int do_unlink(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *a
 			/* don't delete this one yet */
 			LOG(stderr, DEBUG_MSG, SUBSYS_META, " do_unlink: file open, delaying unlink\n");
 			f_p->unlinked = fd;
+			/* its chunks are released on the last close */
+			free(f_p->unlinked_hashes);
+			f_p->unlinked_hashes = hashes;
+			f_p->unlinked_nhashes = nhashes;
+			hashes = NULL;
 		}
 		else /* need to close FD and do IOD call */ 
 		{
 			meta_close(fd);
+			if (nhashes > 0)
+			{
+				refs_put_range(fs_p, &meta.p_stat, 0, nhashes, hashes);
+			}
 			if (capfs_mode == 0) 
 			{
 				memset(&iodreq, 0, sizeof(iodreq));
@@ -1130,6 +1267,7 @@ static int do_unlink(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *a
 			}
 		}
 	}
+	free(hashes);
 	return(0);
 }
 
@@ -1225,8 +1363,14 @@ static int do_close(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ac
 				}
 			}
 			meta_close(f_p->unlinked); /* close the FD that was kept around */
+			if (f_p->unlinked_nhashes > 0)
+			{
+				refs_put_range(fs_p, &f_p->p_stat, 0, f_p->unlinked_nhashes, f_p->unlinked_hashes);
+			}
 		}
 		else {
+			/* write back the recipe of the file */
+			recipe_close(f_p->f_name);
 			/* call md_close() to update times and such */
 #ifdef MGR_USE_CACHED_FILE_SIZE
 			md_close(req_p, f_p->f_name, fs_p);
@@ -1289,6 +1433,7 @@ static int do_mount(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ac
 	}
 	memset(fs_p, 0, sizeof(fsinfo)+sizeof(iod_info)*((tab_p->nodecount)-1));
 	fs_p->nr_iods = tab_p->nodecount;
+	fs_p->placement = tab_p->placement;
 	fs_p->fs_ino  = dir.fs_ino;
 	fs_p->fl_p    = NULL;
 	for (niods = 0; niods < tab_p->nodecount; niods++) {
@@ -1300,6 +1445,7 @@ static int do_mount(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ac
 		PERROR(SUBSYS_META,"fs_add in do_mount");
 		ack_p->status = -1;
 		ack_p->eno = errno;
+		free(fs_p);
 		return 0;
 	}
 	return 0;
@@ -1313,6 +1459,7 @@ static int do_open(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ack
 	int ret, new_entry=0, new_file=0, myerr;
 	fsinfo_p fs_p;
 	finfo_p f_p;
+	struct f_range range;
 	ireq iodreq;
 
 	memset(&iodreq, 0, sizeof(ireq));
@@ -1350,6 +1497,16 @@ static int do_open(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ack
 	if (RQ_PSTAT.pcount == -1) RQ_PSTAT.pcount = fs_p->nr_iods; 
 	if (RQ_PSTAT.ssize == -1)  RQ_PSTAT.ssize  = default_ssize;
 
+	/*
+	 * New files take the placement of the file system. Chunks placed by
+	 * their hash are spread over all the iods, whatever base and pcount
+	 * were asked for, so that identical chunks meet on the same iod.
+	 */
+	RQ_PSTAT.placement = fs_p->placement;
+	if (RQ_PSTAT.placement == CAPFS_PLACE_HASH) {
+		RQ_PSTAT.base = 0;
+		RQ_PSTAT.pcount = fs_p->nr_iods;
+	}
 	if (RQ_PSTAT.base == -1) {
 		if (random_base) {
 			/* pick a random base node number */
@@ -1484,6 +1641,7 @@ static int do_open(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ack
 
 			if (new_file) {
 				/* now get rid of the metadata file */
+				recipe_forget(data_p, 0);
 				meta_unlink(data_p);
 			}
 
@@ -1496,10 +1654,10 @@ static int do_open(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ack
 	}
 	ackdata_p->type = MGR_OPEN;
 	/* now RD lock the hashes file and obtain ALL the hashes only if requested and only if needs to be locked */
-	f_rdlock(f_p);
-	ret = meta_hash_read(data_p, -1, &ackdata_p->u.open.nhashes, &ackdata_p->u.open.hashes);
+	f_range_lock(f_p, &range, -1, 0, 0);
+	ret = recipe_read(data_p, -1, &ackdata_p->u.open.nhashes, &ackdata_p->u.open.hashes);
 	/* now unlock the hashes file */
-	f_unlock(f_p);
+	f_range_unlock(f_p, &range);
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "open on %s yielded %Ld hashes\n", (char *)data_p,
 			ackdata_p->u.open.nhashes);
 
@@ -1604,6 +1762,7 @@ static int do_gethashes(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata
 {
 	fsinfo_p fs_p;
 	finfo_p f_p;
+	struct f_range range;
 	int fd, ret;
 	fmeta meta;
 
@@ -1656,12 +1815,18 @@ static int do_gethashes(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata
 	}
 	ackdata_p->type = MGR_GETHASHES;
 	ackdata_p->u.gethashes.nhashes = req_p->req.gethashes.nchunks;
-	/* now RD lock the hashes file and obtain the requested hashes if the consistency policy requires so*/
-	f_rdlock(f_p);
-	ret = meta_hash_read(data_p, req_p->req.gethashes.begin_chunk,
+	/* now RD lock the requested range of the hashes file and obtain the hashes if the consistency policy requires so*/
+	f_range_lock(f_p, &range, req_p->req.gethashes.begin_chunk, req_p->req.gethashes.nchunks, 0);
+	ackdata_p->u.gethashes.version = f_version_get(f_p, req_p->req.gethashes.begin_chunk, req_p->req.gethashes.nchunks);
+	ret = recipe_read(data_p, req_p->req.gethashes.begin_chunk,
 			&ackdata_p->u.gethashes.nhashes, &ackdata_p->u.gethashes.hashes);
+	/* the lease must be in place before a commit to the range can get in */
+	if (ret == 0) {
+		ackdata_p->u.gethashes.lease_msecs = lease_grant(meta.fs_ino, meta.u_stat.st_ino, ackdata_p->u.gethashes.cb_id,
+				req_p->req.gethashes.begin_chunk, req_p->req.gethashes.nchunks);
+	}
 	/* now unlock the hashes file and obtain the requested hashes if the consistency policy requires so*/
-	f_unlock(f_p);
+	f_range_unlock(f_p, &range);
 
 	if (ackdata_p->u.gethashes.nhashes < 0) {
 		LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "BADNESS in gethashes.nhashes = %Ld for %s\n",
@@ -1723,6 +1888,7 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 {
 	fsinfo_p fs_p;
 	finfo_p f_p;
+	struct f_range range;
 	int fd, ret;
 	fmeta meta;
 
@@ -1776,8 +1942,12 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 		return 0;
 	}
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "Thread %lu about to wcommit for file %Ld\n", pthread_self(), meta.u_stat.st_ino);
-	/* obtain a write lock on f_p */
-	f_wrlock(f_p);
+	/*
+	 * Lock just the chunks being committed, so that commits to disjoint
+	 * parts of a shared file do not wait for each other. Truncates still
+	 * take f_wrlock() and exclude all of them.
+	 */
+	f_range_lock(f_p, &range, req_p->req.wcommit.begin_chunk, ackdata_p->u.wcommit.new_hash_len, 1);
 	do {
 		int hcache_optimization = 0;
 		/* 
@@ -1787,7 +1957,7 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 		 * it was issued.
 		 */
 		ackdata_p->u.wcommit.current_hash_len = ackdata_p->u.wcommit.new_hash_len;
-		ret = meta_hash_read(data_p, req_p->req.wcommit.begin_chunk,
+		ret = recipe_read(data_p, req_p->req.wcommit.begin_chunk,
 				&ackdata_p->u.wcommit.current_hash_len, &ackdata_p->u.wcommit.current_hashes);
 		if (ret < 0) {
 			LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "wcommit: Could not read current set of hashes: %s\n",
@@ -1844,6 +2014,14 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 		{
 			ret = 1;
 		}
+		/*
+		 * Else if the client presented the version of the range it read, none of the chunks
+		 * may have changed since, i.e. none of them may have a later version.
+		 */
+		else if (ackdata_p->u.wcommit.version != 0) {
+			ret = (f_version_get(f_p, req_p->req.wcommit.begin_chunk, ackdata_p->u.wcommit.new_hash_len)
+					<= ackdata_p->u.wcommit.version);
+		}
 		/* Else we check if the presented hashes match in length & values with what we have on disk! */
 		else {
 			ret = compare_presented_hash(ackdata_p->u.wcommit.old_hash_len,
@@ -1858,6 +2036,9 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 			ack_p->status = -1;
 			ack_p->eno = EAGAIN; /* special error number asking clients to retry */
 			ack_p->ack.wcommit.nhashes = ackdata_p->u.wcommit.current_hash_len;
+			/* the client can retry with the version of what we hand back */
+			ackdata_p->u.wcommit.version = f_version_get(f_p, req_p->req.wcommit.begin_chunk,
+					ackdata_p->u.wcommit.new_hash_len);
 			break;
 		}
 		/* old hashes matched. so we succeed */
@@ -1877,31 +2058,74 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 				}
 			}
 #endif
+			/* a recipe shared with a snapshot is copied before it is written to */
+			if (snap_unshare(fs_p, f_p, data_p, &meta.p_stat) < 0) {
+				ack_p->status = -1;
+				ack_p->eno = errno;
+				break;
+			}
+			/*
+			 * The iods must count the new chunks as referenced before the recipe
+			 * refers to them. If that fails, the increments that did make it are
+			 * leaked rather than undone, since a spurious decrement could free a
+			 * chunk that some other recipe still uses.
+			 */
+			if (refs_get_commit(fs_p, &meta.p_stat, req_p->req.wcommit.begin_chunk,
+					ackdata_p->u.wcommit.new_hash_len, ackdata_p->u.wcommit.new_hashes,
+					ackdata_p->u.wcommit.current_hashes, ackdata_p->u.wcommit.current_hash_len) < 0) {
+				LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "wcommit: could not reference new chunks on the iods: %s\n",
+						strerror(errno));
+				ack_p->status = -1;
+				ack_p->eno = EIO;
+				break;
+			}
 			/*
 			 * If they do, we write the new hashes to the file 
 			 */
-			ret = meta_hash_write(data_p, req_p->req.wcommit.begin_chunk,
+			ret = recipe_write(data_p, req_p->req.wcommit.begin_chunk,
 					ackdata_p->u.wcommit.new_hash_len, ackdata_p->u.wcommit.new_hashes);
 			if (ret < 0) {
 				LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "wcommit: could not write new set of hashes to disk!: %s\n",
 						strerror(errno));
 				ack_p->status = -1;
 				ack_p->eno = errno;
+				refs_put_commit(fs_p, &meta.p_stat, req_p->req.wcommit.begin_chunk,
+						ackdata_p->u.wcommit.new_hash_len, ackdata_p->u.wcommit.new_hashes,
+						ackdata_p->u.wcommit.current_hashes, ackdata_p->u.wcommit.current_hash_len, 0);
 				break;
 			}
-			/* if the write was successful, we free up the current hashes thingie and re-read the current hashes */
+			/* the hashes that were just replaced are no longer referenced from this recipe */
+			refs_put_commit(fs_p, &meta.p_stat, req_p->req.wcommit.begin_chunk,
+					ackdata_p->u.wcommit.new_hash_len, ackdata_p->u.wcommit.new_hashes,
+					ackdata_p->u.wcommit.current_hashes, ackdata_p->u.wcommit.current_hash_len, 1);
+			ackdata_p->u.wcommit.version = f_version_bump(f_p, req_p->req.wcommit.begin_chunk,
+					ackdata_p->u.wcommit.new_hash_len);
+			/* the committer may cache the hashes it just wrote */
+			ackdata_p->u.wcommit.lease_msecs = lease_grant(meta.fs_ino, meta.u_stat.st_ino, ackdata_p->u.wcommit.owner_cbid,
+					req_p->req.wcommit.begin_chunk, ackdata_p->u.wcommit.new_hash_len);
+			/*
+			 * if the write was successful, the current hashes are the new ones.
+			 * We hold the range, so there is no need to read them back from disk.
+			 */
 			free(ackdata_p->u.wcommit.current_hashes);
 			ackdata_p->u.wcommit.current_hashes = NULL;
-			/* Re-read the current set of hashes */
-			ackdata_p->u.wcommit.current_hash_len = ackdata_p->u.wcommit.new_hash_len;
-			ret = meta_hash_read(data_p, req_p->req.wcommit.begin_chunk,
-					&ackdata_p->u.wcommit.current_hash_len, &ackdata_p->u.wcommit.current_hashes);
-			if (ret < 0) {
-				LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "wcommit: could not re-read the old set of hashes from disk!: %s\n",
-						strerror(errno));
-				ack_p->status = -1;
-				ack_p->eno = errno;
-				break;
+			ackdata_p->u.wcommit.current_hash_len = 0;
+			if (ackdata_p->u.wcommit.new_hash_len > 0) {
+				int64_t i;
+
+				ackdata_p->u.wcommit.current_hashes = (unsigned char *)
+					malloc(ackdata_p->u.wcommit.new_hash_len * CAPFS_MAXHASHLENGTH);
+				if (ackdata_p->u.wcommit.current_hashes == NULL) {
+					LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "wcommit: could not allocate memory\n");
+					ack_p->status = -1;
+					ack_p->eno = ENOMEM;
+					break;
+				}
+				for (i = 0; i < ackdata_p->u.wcommit.new_hash_len; i++) {
+					memcpy(ackdata_p->u.wcommit.current_hashes + i * CAPFS_MAXHASHLENGTH,
+							ackdata_p->u.wcommit.new_hashes[i], CAPFS_MAXHASHLENGTH);
+				}
+				ackdata_p->u.wcommit.current_hash_len = ackdata_p->u.wcommit.new_hash_len;
 			}
 			LOG(stderr, DEBUG_MSG, SUBSYS_META, "WCOMMIT [CB %d]: reading back %Ld CURRENT hashes\n",
 					ackdata_p->u.wcommit.owner_cbid, ackdata_p->u.wcommit.current_hash_len);
@@ -1919,56 +2143,76 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 			ack_p->status = 0;
 			ack_p->eno = 0;
 			ack_p->ack.wcommit.nhashes = ackdata_p->u.wcommit.current_hash_len;
-			/* go ahead and set the access and modification time */
-			meta.u_stat.mtime = time(NULL);
-			meta.u_stat.atime = time(NULL);
-			/* write the meta data of the file with the updated file's size */
-			if (meta.u_stat.st_size < req_p->req.wcommit.write_size) 
-			{
-				meta.u_stat.st_size = req_p->req.wcommit.write_size;
-				LOG(stderr, INFO_MSG, SUBSYS_META, "%s: Updating new file size on disk to %Ld [mtime: %llu, atime: %llu]\n",
-						(char *) data_p, req_p->req.wcommit.write_size, meta.u_stat.mtime, meta.u_stat.atime);
-			}
-			else {
-				LOG(stderr, INFO_MSG, SUBSYS_META, "%s: Not updating file size on disk [mtime: %llu, atime: %llu]\n",
-						(char *) data_p, meta.u_stat.mtime, meta.u_stat.atime);
-			}
+			/*
+			 * Commits to other ranges may have changed the size since we read
+			 * the metadata, so read it again and update it under the metadata lock.
+			 */
+			f_meta_lock(f_p);
 			fd = meta_open(data_p, O_RDWR);
 			/* huh? the file does not exist */
 			if (fd < 0) {
 				PERROR(SUBSYS_META,"do_wcommit: meta_open");
 				ack_p->status = -1;
 				ack_p->eno = errno;
+				f_meta_unlock(f_p);
 				break;
 			}
 			/* checking permission is pretty cheesy here, since credentials are faked */
-			if (meta_access(fd, data_p, req_p->uid, req_p->gid, R_OK | W_OK) < 0) {
+			if (meta_access(fd, data_p, req_p->uid, req_p->gid, R_OK | W_OK) < 0
+					|| meta_read(fd, &meta) < 0) {
 				PERROR(SUBSYS_META,"do_wcommit: meta_access");
 				ack_p->status = -1;
 				ack_p->eno = errno;
 				meta_close(fd);
+				f_meta_unlock(f_p);
 				break;
 			}
+			/* go ahead and set the access and modification time */
+			meta.u_stat.mtime = time(NULL);
+			meta.u_stat.atime = time(NULL);
+			/* write the meta data of the file with the updated file's size */
+			if (meta.u_stat.st_size < req_p->req.wcommit.write_size) 
+			{
+				meta.u_stat.st_size = req_p->req.wcommit.write_size;
+				LOG(stderr, INFO_MSG, SUBSYS_META, "%s: Updating new file size on disk to %Ld [mtime: %llu, atime: %llu]\n",
+						(char *) data_p, req_p->req.wcommit.write_size, meta.u_stat.mtime, meta.u_stat.atime);
+			}
+			else {
+				LOG(stderr, INFO_MSG, SUBSYS_META, "%s: Not updating file size on disk [mtime: %llu, atime: %llu]\n",
+						(char *) data_p, meta.u_stat.mtime, meta.u_stat.atime);
+			}
 			/* Something would be fishy if all these tests were to fail */
 			if (meta_write(fd, &meta) < 0) {
 				PERROR(SUBSYS_META,"do_wcommit: meta_write");
 				ack_p->status = -1;
 				ack_p->eno = errno;
 				meta_close(fd);
+				f_meta_unlock(f_p);
 				break;
 			}
 			memcpy(&ack_p->ack.wcommit.meta, &meta, sizeof(meta));
 			meta_close(fd);
-			/* If we are asked to send hcache updates/invalidates and if we think it is necessary, then we do so now */
+			f_meta_unlock(f_p);
+			/* With leases, the other hcaches drop the old hashes by themselves; we just wait for them to */
+			if (lease_term() > 0)
+			{
+				lease_recall(meta.fs_ino, meta.u_stat.st_ino, ackdata_p->u.wcommit.owner_cbid,
+						req_p->req.wcommit.begin_chunk, ackdata_p->u.wcommit.new_hash_len);
+			}
+			/*
+			 * If we are asked to send hcache updates/invalidates and if we think it is necessary, then we do so now.
+			 * With leases, only clients that do not know about them have callbacks registered.
+			 */
 			if (ackdata_p->u.wcommit.desire_hcache_coherence == 1 && hcache_optimization == 0)
 			{
-				unsigned long bitmap;
+				cbset sharers;
 				int position;
 				char *fname = NULL;
 
-				bitmap = get_callbacks(meta.fs_ino, meta.u_stat.st_ino, &fname);
-				LOG(stderr, DEBUG_MSG, SUBSYS_META, "WCOMMIT [CB %d] Obtained callbacks for <%Ld,%Ld> -> 0x%lx\n", 
-					ackdata_p->u.wcommit.owner_cbid, meta.fs_ino, meta.u_stat.st_ino, bitmap);
+				cbset_init(&sharers);
+				get_callbacks(meta.fs_ino, meta.u_stat.st_ino, &fname, &sharers);
+				LOG(stderr, DEBUG_MSG, SUBSYS_META, "WCOMMIT [CB %d] Obtained callbacks for <%Ld,%Ld> -> %d sharers\n", 
+					ackdata_p->u.wcommit.owner_cbid, meta.fs_ino, meta.u_stat.st_ino, cbset_count(&sharers));
 				/* 
 				 * wcommit commits a set of hashes for <fname> from <arg1.begin_chunk> for <arg1.new_hashes.sha1_hashes_len> 
 				 * If there is only 1 other sharer, then we choose to send hcache updates
@@ -1978,18 +2222,18 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 				 */
 				if (fname)
 				{
-					if ((position = OnlyOtherBitSet((unsigned char *)&bitmap, 4, ackdata_p->u.wcommit.owner_cbid)) < 0) 
+					if ((position = cbset_only_other(&sharers, ackdata_p->u.wcommit.owner_cbid)) < 0) 
 					{
 						LOG(stderr, DEBUG_MSG, SUBSYS_META, "WCOMMIT [CB %d] Starting to send invalidates\n", ackdata_p->u.wcommit.owner_cbid);
-						cb_invalidate_hashes(fname, bitmap, ackdata_p->u.wcommit.owner_cbid,
+						cb_invalidate_hashes(fname, &sharers, ackdata_p->u.wcommit.owner_cbid,
 								req_p->req.wcommit.begin_chunk, ackdata_p->u.wcommit.new_hash_len);
 						LOG(stderr, DEBUG_MSG, SUBSYS_META, "Finished sending invalidates\n");
 					}
-					/* if there is only 1 bit set in the bitmap in addition to us, we can do a hash update */
+					/* if there is only 1 sharer in addition to us, we can do a hash update */
 					else {
 						LOG(stderr, DEBUG_MSG, SUBSYS_META, "WCOMMIT [CB %d] Starting to send updates to %d\n", ackdata_p->u.wcommit.owner_cbid,
 								position);
-						cb_update_hashes(fname, position, req_p->req.wcommit.begin_chunk, 
+						cb_update_hashes(fname, ackdata_p->u.wcommit.owner_cbid, position, req_p->req.wcommit.begin_chunk, 
 								ackdata_p->u.wcommit.current_hash_len, ackdata_p->u.wcommit.current_hashes);
 						LOG(stderr, DEBUG_MSG, SUBSYS_META, "Finished sending updates\n");
 					}
@@ -1998,6 +2242,7 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 				{
 					LOG(stderr, WARNING_MSG, SUBSYS_META, "WCOMMIT [CB %d] found NULL fname (%s?)!!!\n", ackdata_p->u.wcommit.owner_cbid, (char *) data_p);
 				}
+				cbset_free(&sharers);
 			}
 			else if (hcache_optimization == 1)
 			{
@@ -2011,8 +2256,8 @@ static int do_wcommit(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *
 			}
 		}
 	} while (0);
-	/* unlock the file */
-	f_unlock(f_p);
+	/* unlock the range */
+	f_range_unlock(f_p, &range);
 	return 0;
 }
 
@@ -2137,9 +2382,12 @@ static int do_rename(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *a
 	else {
 		char hashpath[MAXPATHLEN];
 
+		recipe_forget(new_name, 0);
 		sprintf(hashpath, "%s.hashes", new_name);
 		unlink(hashpath);
 	}
+	/* the recipe cache knows files by name; write back what it has under the old one */
+	recipe_forget(old_name, 1);
 	/* move to new name */
    if (rename(old_name, new_name) < 0) {
       PERROR(SUBSYS_META,"do_rename: rename");
@@ -2153,6 +2401,8 @@ static int do_rename(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *a
 		sprintf(oldhashpath, "%s.hashes", old_name);
 		sprintf(hashpath, "%s.hashes", new_name);
 		rename(oldhashpath, hashpath);
+		/* in case a wcommit got the old name back into the cache meanwhile */
+		recipe_forget(old_name, 1);
 	}
 	return(0); 
 }
@@ -2263,6 +2513,371 @@ static int do_readlink(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata
 }
 
 
+/*
+ * Copies a file by duplicating its metadata and recipe. The chunks are
+ * shared with the original, so no data moves at all; their reference
+ * counts are bumped before the copy is made visible. The new file is put
+ * together under a temporary name and linked into place empty (which
+ * claims the name); it is given its recipe and only then its size, so
+ * nobody sees data it has no hashes for. It must not exist already.
+ */
+static int do_clone(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p)
+{
+	char *c_p = data_p, *src_name, *dst_name;
+	char temp[MAXPATHLEN], tmp_name[MAXPATHLEN], hashpath[MAXPATHLEN], tmphashpath[MAXPATHLEN];
+	fsinfo_p fs_p, dst_fs_p;
+	finfo_p f_p;
+	struct f_range range;
+	struct stat sbuf;
+	fmeta meta, new_meta;
+	dmeta dir;
+	int fd, length, err = 0, gid = req_p->gid;
+	int64_t j, nhashes = 0;
+	unsigned char *hashes = NULL, **phashes = NULL;
+
+	/* set pointers to source and destination filenames */
+	src_name = c_p;
+	for (;*c_p;c_p++);
+	dst_name = ++c_p;
+
+	if (resv_name(src_name) != 0 || resv_name(dst_name) != 0) {
+		ack_p->status = -1;
+		ack_p->eno = ENOENT;
+		return 0;
+	}
+	/* without recipes, the data lives in per-file objects on the iods */
+	if (capfs_mode == 0) {
+		ack_p->status = -1;
+		ack_p->eno = ENOSYS;
+		return 0;
+	}
+	if ((fs_p = quick_mount(src_name, req_p->uid, req_p->gid, ack_p, ackdata_p)) == NULL
+			|| (dst_fs_p = quick_mount(dst_name, req_p->uid, req_p->gid, ack_p, ackdata_p)) == NULL)
+	{
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if (fs_p != dst_fs_p) {
+		ack_p->status = -1;
+		ack_p->eno = EXDEV;
+		return 0;
+	}
+	if (lstat(dst_name, &sbuf) == 0) {
+		ack_p->status = -1;
+		ack_p->eno = EEXIST;
+		return 0;
+	}
+	else if (errno != ENOENT) {
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if (snprintf(tmp_name, MAXPATHLEN, "%s.clone-%lu", dst_name, (unsigned long) pthread_self()) >= MAXPATHLEN - 8) {
+		ack_p->status = -1;
+		ack_p->eno = ENAMETOOLONG;
+		return 0;
+	}
+	/* check for write/execute permissions on the parent directory of the copy */
+	strncpy(temp, dst_name, MAXPATHLEN);
+	length = get_parent(temp);
+	if (length >= 0) {
+		if (meta_access(0, temp, req_p->uid, req_p->gid, X_OK | W_OK) < 0
+				|| get_dmeta(temp, &dir) < 0) {
+			PERROR(SUBSYS_META,"do_clone: meta_access (dir)");
+			ack_p->status = -1;
+			ack_p->eno = errno;
+			return 0;
+		}
+		if (dir.dr_mode & S_ISGID) {
+			gid = dir.dr_gid;
+		}
+	}
+
+	/* read the source's metadata; it needs to be readable by the caller */
+	if ((fd = meta_open(src_name, O_RDONLY)) < 0) {
+		PERROR(SUBSYS_META,"do_clone: meta_open");
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if (meta_access(fd, src_name, req_p->uid, req_p->gid, R_OK) < 0
+			|| meta_read(fd, &meta) < 0) {
+		PERROR(SUBSYS_META,"do_clone: meta_access");
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		meta_close(fd);
+		return 0;
+	}
+	if (!S_ISREG(meta.u_stat.st_mode)) {
+		ack_p->status = -1;
+		ack_p->eno = EINVAL;
+		meta_close(fd);
+		return 0;
+	}
+	/*
+	 * Keep commits to the source out until its chunks are referenced by
+	 * the copy too; one could otherwise release a chunk we are about to share.
+	 */
+	f_p = f_search(fs_p->fl_p, meta.u_stat.st_ino);
+	f_range_lock(f_p, &range, -1, 0, 0);
+	f_meta_lock(f_p);
+	if (meta_read(fd, &meta) < 0) {
+		err = errno;
+	}
+	f_meta_unlock(f_p);
+	meta_close(fd);
+	if (err == 0 && recipe_read(src_name, -1, &nhashes, &hashes) < 0) {
+		err = errno;
+	}
+	if (err == 0 && nhashes > 0) {
+		if ((phashes = (unsigned char **) malloc(nhashes * sizeof(unsigned char *))) == NULL) {
+			err = ENOMEM;
+		}
+		else {
+			for (j = 0; j < nhashes; j++) {
+				phashes[j] = hashes + j * CAPFS_MAXHASHLENGTH;
+			}
+			/* as in do_wcommit(), increments that did go through are leaked if this fails */
+			if (refs_get_commit(fs_p, &meta.p_stat, 0, nhashes, phashes, NULL, 0) < 0) {
+				err = EIO;
+			}
+		}
+	}
+	f_range_unlock(f_p, &range);
+	if (err) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "do_clone: could not copy the recipe of %s: %s\n",
+				src_name, strerror(err));
+		goto out;
+	}
+
+	/* put the copy together under the temporary name */
+	if ((fd = meta_creat(tmp_name, O_RDWR)) < 0) {
+		err = errno;
+		PERROR(SUBSYS_META,"do_clone: meta_creat");
+		goto release;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		err = errno;
+		meta_close(fd);
+		goto unlink_tmp;
+	}
+	new_meta = meta;
+	COPY_STAT_TO_PSTAT(&new_meta.u_stat, &sbuf);
+	new_meta.u_stat.st_uid = req_p->uid;
+	new_meta.u_stat.st_gid = gid;
+	new_meta.u_stat.st_mode = S_IFREG | ((S_IRWXO | S_IRWXG | S_IRWXU) & meta.u_stat.st_mode);
+	new_meta.u_stat.st_size = 0;
+	if (meta_write(fd, &new_meta) < 0) {
+		err = errno;
+		meta_close(fd);
+		goto unlink_tmp;
+	}
+	meta_close(fd);
+	if (nhashes > 0 && meta_hash_write(tmp_name, 0, nhashes, phashes) < 0) {
+		err = errno;
+		goto unlink_tmp;
+	}
+	/*
+	 * Claim the name before anything is moved; link() fails with EEXIST if
+	 * somebody created it since the check above. Only once the name is ours
+	 * may the recipe be renamed over any leftover dst.hashes.
+	 */
+	if (link(tmp_name, dst_name) < 0) {
+		err = errno;
+		goto unlink_tmp;
+	}
+	unlink(tmp_name);
+	/*
+	 * The copy is visible but empty. Keep commits to it out (should it
+	 * have been opened already) while the recipe goes in and the size
+	 * follows it.
+	 */
+	snprintf(tmphashpath, MAXPATHLEN, "%s.hashes", tmp_name);
+	snprintf(hashpath, MAXPATHLEN, "%s.hashes", dst_name);
+	f_p = f_search(fs_p->fl_p, new_meta.u_stat.st_ino);
+	f_range_lock(f_p, &range, -1, 0, 0);
+	recipe_forget(dst_name, 0);
+	if (nhashes > 0 && rename(tmphashpath, hashpath) < 0) {
+		err = errno;
+		PERROR(SUBSYS_META,"do_clone: rename");
+		f_range_unlock(f_p, &range);
+		unlink(tmphashpath);
+		unlink(dst_name);
+		goto release;
+	}
+	if ((fd = meta_open(dst_name, O_RDWR)) < 0) {
+		err = errno;
+		PERROR(SUBSYS_META,"do_clone: meta_open");
+	}
+	else {
+		f_meta_lock(f_p);
+		if (meta_read(fd, &new_meta) < 0) {
+			err = errno;
+		}
+		else if (new_meta.u_stat.st_size == 0) {
+			new_meta.u_stat.st_size = meta.u_stat.st_size;
+			if (meta_write(fd, &new_meta) < 0) {
+				err = errno;
+			}
+		}
+		f_meta_unlock(f_p);
+		meta_close(fd);
+	}
+	f_range_unlock(f_p, &range);
+	if (err) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "do_clone: could not size %s: %s\n",
+				dst_name, strerror(err));
+		meta_unlink(dst_name);
+		goto release;
+	}
+	memcpy(&ack_p->ack.clone.meta, &new_meta, sizeof(new_meta));
+	LOG(stderr, DEBUG_MSG, SUBSYS_META, "cloned %s (%Ld hashes) to %s\n", src_name, nhashes, dst_name);
+	goto out;
+
+unlink_tmp:
+	meta_unlink(tmp_name);
+release:
+	if (nhashes > 0) {
+		refs_put_range(fs_p, &meta.p_stat, 0, nhashes, hashes);
+	}
+out:
+	free(phashes);
+	free(hashes);
+	if (err) {
+		ack_p->status = -1;
+		ack_p->eno = err;
+	}
+	return 0;
+}
+
+/*
+ * do_snapshot() - takes (or drops) a read-only snapshot of a directory tree.
+ * Only the owner of the directory may do so.
+ */
+static int do_snapshot(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p)
+{
+	char *c_p = data_p, *dir_name, *snap_name;
+	fsinfo_p fs_p;
+	struct stat sbuf;
+	dmeta dir;
+	int ret;
+
+	/* set pointers to directory and snapshot names */
+	dir_name = c_p;
+	for (;*c_p;c_p++);
+	snap_name = ++c_p;
+
+	if (resv_name(dir_name) != 0) {
+		ack_p->status = -1;
+		ack_p->eno = ENOENT;
+		return 0;
+	}
+	if (snap_path(dir_name)) {
+		ack_p->status = -1;
+		ack_p->eno = EROFS;
+		return 0;
+	}
+	/* a snapshot name is a single name that a file could have */
+	if (*snap_name == '\0' || strchr(snap_name, '/') != NULL || !strcmp(snap_name, ".")
+			|| !strcmp(snap_name, "..") || resv_name(snap_name) != 0) {
+		ack_p->status = -1;
+		ack_p->eno = EINVAL;
+		return 0;
+	}
+	/* snapshots share recipes */
+	if (capfs_mode == 0) {
+		ack_p->status = -1;
+		ack_p->eno = ENOSYS;
+		return 0;
+	}
+	if ((fs_p = quick_mount(dir_name, req_p->uid, req_p->gid, ack_p, ackdata_p)) == NULL) {
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if (lstat(dir_name, &sbuf) < 0 || get_dmeta(dir_name, &dir) < 0) {
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if (!S_ISDIR(sbuf.st_mode)) {
+		ack_p->status = -1;
+		ack_p->eno = ENOTDIR;
+		return 0;
+	}
+	if (req_p->uid != 0 && req_p->uid != dir.dr_uid) {
+		ack_p->status = -1;
+		ack_p->eno = EPERM;
+		return 0;
+	}
+	if (req_p->req.snapshot.remove) {
+		ret = snap_remove(fs_p, dir_name, snap_name);
+	}
+	else {
+		ret = snap_create(fs_p, dir_name, snap_name);
+	}
+	if (ret < 0) {
+		ack_p->status = -1;
+		ack_p->eno = errno;
+	}
+	return 0;
+}
+
+/*
+ * do_gettree() - returns nodes of the hash tree over the recipe of a file
+ * (see mgr_tree.c). Unlike gethashes, the file need not be open.
+ */
+static int do_gettree(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p)
+{
+	fsinfo_p fs_p;
+	int64_t nnodes;
+	int fd, levels = 0;
+
+	if (resv_name(data_p) != 0) {
+		ack_p->status = -1;
+		ack_p->eno = ENOENT;
+		return 0;
+	}
+	/* there are no recipes to speak of */
+	if (capfs_mode == 0) {
+		ack_p->status = -1;
+		ack_p->eno = ENOSYS;
+		return 0;
+	}
+	if ((fs_p = quick_mount(data_p, req_p->uid, req_p->gid, ack_p, ackdata_p)) == NULL) {
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if ((fd = meta_open(data_p, O_RDONLY)) < 0) {
+		PERROR(SUBSYS_META,"do_gettree: meta_open");
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	if (meta_access(fd, data_p, req_p->uid, req_p->gid, R_OK) < 0) {
+		PERROR(SUBSYS_META,"do_gettree: meta_access");
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		meta_close(fd);
+		return 0;
+	}
+	meta_close(fd);
+	nnodes = MIN(req_p->req.gettree.nnodes, CAPFS_MAXHASHES);
+	ackdata_p->type = MGR_GETTREE;
+	if (tree_read(data_p, req_p->req.gettree.level, req_p->req.gettree.begin_node, &nnodes,
+				&ackdata_p->u.gettree.nodes, &ack_p->ack.gettree.nchunks, &levels) < 0) {
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return 0;
+	}
+	ack_p->ack.gettree.levels = levels;
+	ack_p->ack.gettree.nnodes = nnodes;
+	ackdata_p->u.gettree.nnodes = nnodes;
+	return 0;
+}
+
 /* do_iod_info() - returns information on iods
  */
 static int do_iod_info(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata *ackdata_p)
@@ -2495,7 +3110,8 @@ static int do_getdents(mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata
 			break;
 		}
 
-		if (!resv_name(dir.d_name)) {
+		/* snapshots are reached by name, but are not listed */
+		if (!resv_name(dir.d_name) && strcmp(dir.d_name, SNAP_DIR)) {
 			pdir[opos].handle = dir.d_ino;
 			pdir[opos].off = off;
 			strcpy(pdir[opos].name, dir.d_name);
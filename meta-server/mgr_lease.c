@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * hcache leases, an alternative to keeping client hcaches coherent with callbacks.
+ *
+ * Hashes handed out by gethashes (and the hashes a client just committed) come
+ * with a lease on their range for lease_msecs milliseconds, and clients drop
+ * cached hashes that are not covered by an unexpired lease. A commit, truncate
+ * or unlink that changes a range waits out the leases that other clients hold
+ * on it before it is acknowledged, so no callbacks are needed at all.
+ * While a writer waits, no new leases are granted on its range, so that a
+ * steady stream of readers cannot hold it off forever.
+ *
+ * Leases are granted while the range lock of the file is held, so a lease is
+ * either in place before a commit to the range, or covers the hashes it wrote.
+ * Only clients that registered with CAPFS_CBREG2 are granted leases; older ones
+ * are still kept coherent with callbacks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "mgr.h"
+#include "capfs_config.h"
+#include "quicklist.h"
+#include "log.h"
+
+#define LEASE_BUCKETS 101
+#define LEASE_EOF     ((int64_t) 0x7fffffffffffffffLL)
+
+/* a lease on the chunks [l_begin, l_end) of a file */
+struct lease {
+	struct qlist_head l_link;
+	int               l_cbid;
+	int64_t           l_begin, l_end;
+	struct timeval    l_expires;
+};
+
+/* a commit waiting for the leases on [w_begin, w_end) to run out */
+struct lease_writer {
+	struct qlist_head w_link;
+	int64_t           w_begin, w_end;
+};
+
+struct lease_file {
+	struct qlist_head lf_link;
+	int64_t           lf_fs_ino, lf_f_ino;
+	struct qlist_head lf_leases;
+	struct qlist_head lf_writers;
+};
+
+static struct qlist_head lease_table[LEASE_BUCKETS];
+static pthread_mutex_t lease_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lease_cond = PTHREAD_COND_INITIALIZER;
+static int lease_msecs = 0;
+
+static unsigned int lease_hash(int64_t fs_ino, int64_t f_ino)
+{
+	return (unsigned int) ((fs_ino * 31 + f_ino) % LEASE_BUCKETS);
+}
+
+/* must be called with lease_mutex held */
+static struct lease_file *lease_file_find(int64_t fs_ino, int64_t f_ino, int create)
+{
+	struct qlist_head *tmp, *bucket = &lease_table[lease_hash(fs_ino, f_ino)];
+	struct lease_file *lf;
+
+	qlist_for_each(tmp, bucket) {
+		lf = qlist_entry(tmp, struct lease_file, lf_link);
+		if (lf->lf_fs_ino == fs_ino && lf->lf_f_ino == f_ino) {
+			return lf;
+		}
+	}
+	if (!create || (lf = (struct lease_file *) calloc(1, sizeof(struct lease_file))) == NULL) {
+		return NULL;
+	}
+	lf->lf_fs_ino = fs_ino;
+	lf->lf_f_ino = f_ino;
+	INIT_QLIST_HEAD(&lf->lf_leases);
+	INIT_QLIST_HEAD(&lf->lf_writers);
+	qlist_add(&lf->lf_link, bucket);
+	return lf;
+}
+
+/* frees lf if there is nothing left in it. must be called with lease_mutex held */
+static void lease_file_put(struct lease_file *lf)
+{
+	if (qlist_empty(&lf->lf_leases) && qlist_empty(&lf->lf_writers)) {
+		qlist_del(&lf->lf_link);
+		free(lf);
+	}
+}
+
+/* drops the leases that expired before now. must be called with lease_mutex held */
+static void lease_prune(struct lease_file *lf, struct timeval *now)
+{
+	struct qlist_head *tmp, *next;
+	struct lease *l;
+
+	qlist_for_each_safe(tmp, next, &lf->lf_leases) {
+		l = qlist_entry(tmp, struct lease, l_link);
+		if (!timercmp(&l->l_expires, now, >)) {
+			qlist_del(&l->l_link);
+			free(l);
+		}
+	}
+}
+
+int lease_init(int msecs)
+{
+	int i;
+
+	for (i = 0; i < LEASE_BUCKETS; i++) {
+		INIT_QLIST_HEAD(&lease_table[i]);
+	}
+	lease_msecs = (msecs > 0) ? msecs : 0;
+	if (lease_msecs > 0) {
+		LOG(stderr, INFO_MSG, SUBSYS_META, "hcache coherence through leases of %d msecs\n", lease_msecs);
+	}
+	return 0;
+}
+
+/* drops all the leases on lf. must be called with lease_mutex held */
+static void lease_drop_all(struct lease_file *lf)
+{
+	struct qlist_head *tmp, *next;
+
+	qlist_for_each_safe(tmp, next, &lf->lf_leases) {
+		struct lease *l = qlist_entry(tmp, struct lease, l_link);
+
+		qlist_del(&l->l_link);
+		free(l);
+	}
+	lease_file_put(lf);
+}
+
+void lease_finalize(void)
+{
+	struct qlist_head *tmp, *next;
+	int i;
+
+	pthread_mutex_lock(&lease_mutex);
+	for (i = 0; i < LEASE_BUCKETS; i++) {
+		qlist_for_each_safe(tmp, next, &lease_table[i]) {
+			lease_drop_all(qlist_entry(tmp, struct lease_file, lf_link));
+		}
+	}
+	pthread_mutex_unlock(&lease_mutex);
+	return;
+}
+
+/* Returns the lease term in msecs, or 0 if hcaches are kept coherent with callbacks */
+int lease_term(void)
+{
+	return lease_msecs;
+}
+
+/* Does cb_id keep its hcache coherent through leases, rather than callbacks? */
+int lease_client(int cb_id)
+{
+	return lease_msecs > 0 && cb_leases(cb_id);
+}
+
+/*
+ * Grants cb_id a lease on nchunks chunks from begin_chunk.
+ * Returns the lease term in msecs, or 0 if no lease was granted.
+ * Must be called with the range locked.
+ */
+int lease_grant(int64_t fs_ino, int64_t f_ino, int cb_id, int64_t begin_chunk, int64_t nchunks)
+{
+	struct qlist_head *tmp, *next;
+	struct lease_file *lf;
+	struct lease *l;
+	struct timeval now, term;
+	int64_t end = begin_chunk + nchunks;
+
+	if (lease_msecs <= 0 || cb_id < 0 || begin_chunk < 0 || nchunks <= 0 || !cb_leases(cb_id)) {
+		return 0;
+	}
+	pthread_mutex_lock(&lease_mutex);
+	if ((lf = lease_file_find(fs_ino, f_ino, 1)) == NULL) {
+		pthread_mutex_unlock(&lease_mutex);
+		return 0;
+	}
+	gettimeofday(&now, NULL);
+	lease_prune(lf, &now);
+	/* a writer is waiting for the range to drain */
+	qlist_for_each(tmp, &lf->lf_writers) {
+		struct lease_writer *w = qlist_entry(tmp, struct lease_writer, w_link);
+
+		if (w->w_begin < end && begin_chunk < w->w_end) {
+			lease_file_put(lf);
+			pthread_mutex_unlock(&lease_mutex);
+			return 0;
+		}
+	}
+	/* the new lease outlasts the ones cb_id holds within the range */
+	qlist_for_each_safe(tmp, next, &lf->lf_leases) {
+		l = qlist_entry(tmp, struct lease, l_link);
+		if (l->l_cbid == cb_id && l->l_begin >= begin_chunk && l->l_end <= end) {
+			qlist_del(&l->l_link);
+			free(l);
+		}
+	}
+	if ((l = (struct lease *) malloc(sizeof(struct lease))) == NULL) {
+		lease_file_put(lf);
+		pthread_mutex_unlock(&lease_mutex);
+		return 0;
+	}
+	l->l_cbid = cb_id;
+	l->l_begin = begin_chunk;
+	l->l_end = end;
+	term.tv_sec = lease_msecs / 1000;
+	term.tv_usec = (lease_msecs % 1000) * 1000;
+	timeradd(&now, &term, &l->l_expires);
+	qlist_add_tail(&l->l_link, &lf->lf_leases);
+	pthread_mutex_unlock(&lease_mutex);
+	return lease_msecs;
+}
+
+/*
+ * Waits until no client other than owner_cb_id holds a lease on nchunks
+ * chunks from begin_chunk (on the entire file if begin_chunk is -1).
+ */
+void lease_recall(int64_t fs_ino, int64_t f_ino, int owner_cb_id, int64_t begin_chunk, int64_t nchunks)
+{
+	struct qlist_head *tmp;
+	struct lease_file *lf;
+	struct lease_writer w;
+	struct timeval start, now, latest;
+	struct timespec ts;
+	int waited = 0;
+
+	if (lease_msecs <= 0) {
+		return;
+	}
+	if (begin_chunk < 0) {
+		w.w_begin = 0;
+		w.w_end = LEASE_EOF;
+	}
+	else {
+		w.w_begin = begin_chunk;
+		w.w_end = begin_chunk + nchunks;
+	}
+	pthread_mutex_lock(&lease_mutex);
+	if ((lf = lease_file_find(fs_ino, f_ino, 0)) == NULL) {
+		pthread_mutex_unlock(&lease_mutex);
+		return;
+	}
+	gettimeofday(&start, NULL);
+	qlist_add_tail(&w.w_link, &lf->lf_writers);
+	for (;;) {
+		gettimeofday(&now, NULL);
+		lease_prune(lf, &now);
+		timerclear(&latest);
+		qlist_for_each(tmp, &lf->lf_leases) {
+			struct lease *l = qlist_entry(tmp, struct lease, l_link);
+
+			if (l->l_cbid != owner_cb_id && l->l_begin < w.w_end && w.w_begin < l->l_end
+					&& timercmp(&l->l_expires, &latest, >)) {
+				latest = l->l_expires;
+			}
+		}
+		if (!timerisset(&latest)) {
+			break;
+		}
+		waited = 1;
+		ts.tv_sec = latest.tv_sec;
+		ts.tv_nsec = latest.tv_usec * 1000;
+		pthread_cond_timedwait(&lease_cond, &lease_mutex, &ts);
+	}
+	qlist_del(&w.w_link);
+	lease_file_put(lf);
+	pthread_mutex_unlock(&lease_mutex);
+	if (waited) {
+		LOG(stderr, DEBUG_MSG, SUBSYS_META, "lease_recall: <%Ld,%Ld> waited %ld usec for leases from %Ld for %Ld chunks\n",
+				fs_ino, f_ino, (long) ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec)),
+				begin_chunk, nchunks);
+	}
+	return;
+}
+
+/* Drops the leases on a file that is gone */
+void lease_forget(int64_t fs_ino, int64_t f_ino)
+{
+	struct lease_file *lf;
+
+	if (lease_msecs <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&lease_mutex);
+	if ((lf = lease_file_find(fs_ino, f_ino, 0)) != NULL) {
+		lease_drop_all(lf);
+	}
+	pthread_mutex_unlock(&lease_mutex);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
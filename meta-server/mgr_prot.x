@@ -335,6 +335,46 @@ struct readlink_resp {
 	filename link_name;
 };
 
+struct clone_args {
+	creds credentials;
+	filename src_name;
+	filename dst_name;
+};
+
+struct clone_resp {
+	opstatus status;
+	fm meta;
+};
+
+struct snapshot_args {
+	creds credentials;
+	filename dir_name;
+	filename snap_name;
+	int32_t  remove;
+};
+
+struct snapshot_resp {
+	opstatus status;
+};
+
+struct gettree_args {
+	creds credentials;
+	filename name;
+	/* 0 for the recipe itself, up to the level of the root */
+	int32_t  level;
+	int64_t  begin_node;
+	int64_t  nnodes;
+};
+
+struct gettree_resp {
+	opstatus status;
+	/* number of hashes in the recipe */
+	int64_t  nchunks;
+	/* level of the root */
+	int32_t  levels;
+	sha1_hashes h;
+};
+
 union hbytype switch(htypeid type) {
 	case HASHBYNAME:
 		filename name;
@@ -382,6 +422,39 @@ struct wcommit_resp {
 	fm meta;
 };
 
+/*
+ * CAPFS_GETHASHES2 and CAPFS_WCOMMIT2 also carry the versions of recipe ranges
+ * and hcache leases, which only clients registered with CAPFS_CBREG2 are granted.
+ * Clients fall back to the older procedures with meta-servers that lack them.
+ */
+struct cb2_resp {
+	cb_resp  resp;
+	/* hcache lease term in msecs, or 0 if hcaches are kept coherent with callbacks */
+	int32_t  lease_msecs;
+};
+
+struct gethashes2_resp {
+	gethashes_resp resp;
+	/* version of the requested range, to be presented to wcommit */
+	int64_t  recipe_version;
+	/* msecs for which the hashes may be cached (0 if there is no lease) */
+	int32_t  lease_msecs;
+};
+
+struct wcommit2_args {
+	wcommit_args args;
+	/* version of the range when it was read. If non-zero, it is checked instead of old_hashes */
+	int64_t  recipe_version;
+};
+
+struct wcommit2_resp {
+	wcommit_resp resp;
+	/* version of the range after the commit (or the current one if it failed) */
+	int64_t  recipe_version;
+	/* msecs for which the new hashes may be cached (0 if there is no lease) */
+	int32_t  lease_msecs;
+};
+
 program CAPFS_MGR {
 	version mgrv1 {
 		cb_resp    CAPFS_CBREG(cb_args) = 1;
@@ -411,5 +484,11 @@ program CAPFS_MGR {
 		stat_resp  CAPFS_STAT(stat_args)   = 25;
 		gethashes_resp CAPFS_GETHASHES(gethashes_args) = 26;
 		wcommit_resp CAPFS_WCOMMIT(wcommit_args) = 27;
+		clone_resp CAPFS_CLONE(clone_args) = 28;
+		snapshot_resp CAPFS_SNAPSHOT(snapshot_args) = 29;
+		gettree_resp CAPFS_GETTREE(gettree_args) = 30;
+		gethashes2_resp CAPFS_GETHASHES2(gethashes_args) = 31;
+		wcommit2_resp CAPFS_WCOMMIT2(wcommit2_args) = 32;
+		cb2_resp   CAPFS_CBREG2(cb_args) = 33;
 	} = 1;
 } = 0x20000001;
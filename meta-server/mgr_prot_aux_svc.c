@@ -39,6 +39,9 @@ static int is_daemon = 1;
 static int use_tpool = 1;
 static int mgr_port = MGR_REQ_PORT;
 int default_ssize = DEFAULT_SSIZE;
+static int recipe_mode = RECIPE_WRITETHROUGH;
+static int cb_coalesce_usec = MGR_CB_COALESCE;
+static int lease_msecs = 0;
 static int num_threads = MGR_NUM_THREADS;
 static pthread_attr_t attr;
 static pthread_t  tid;
@@ -97,6 +100,8 @@ static void do_signal(int sig_nr, siginfo_t *info, void *unused)
    
 	LOG(stderr, CRITICAL_MSG, SUBSYS_META,   "\nOPEN FILES:\n");
 	fslist_dump(active_p);
+	LOG(stderr, CRITICAL_MSG, SUBSYS_META,   "\nCALLBACKS:\n");
+	cb_stats_dump();
 
    if (sig_nr == SIGSEGV)
    {
@@ -163,7 +168,10 @@ static void usage(char *str)
 	fprintf(stderr, "Usage: %s -c (don't use a thread pool) -n <number of threads>"
 			" -t <timeout> -d {daemonize or not} "
 			"-p <port> -b <default stripe size> -l<log level> -s {use sockets for cas servers}"
-			"-o {operate in legacy/pvfs mode}\n", str);
+			"-o {operate in legacy/pvfs mode} "
+			"-r <recipe write mode: 0 write-back, 1 write-through (default), 2 write-through and sync> "
+			"-w <usecs to hold hcache callbacks for coalescing, 0 to send right away> "
+			"-L <msecs of hcache leases, 0 to keep hcaches coherent with callbacks>\n", str);
 	return;
 }
 
@@ -400,7 +408,7 @@ tpi_stack_size:-1, /* default stack size is good enough */
 	random_base = 1;
 #endif
 
-	while ((opt = getopt(argc, argv, "csn:t:dp:b:l:o")) != EOF) {
+	while ((opt = getopt(argc, argv, "csn:t:dp:b:l:or:w:L:")) != EOF) {
 		switch (opt) {
 			case 's':
 				cas_options.use_sockets = 1;
@@ -436,6 +444,19 @@ tpi_stack_size:-1, /* default stack size is good enough */
 			case 'o':
 				capfs_mode = 0;
 				break;
+			case 'r':
+				recipe_mode = atoi(optarg);
+				if (recipe_mode < RECIPE_WRITEBACK || recipe_mode > RECIPE_SYNC) {
+					usage(argv[0]);
+					return -1;
+				}
+				break;
+			case 'w':
+				cb_coalesce_usec = atoi(optarg);
+				break;
+			case 'L':
+				lease_msecs = atoi(optarg);
+				break;
 			default:
 				usage(argv[0]);
 				return -1;
@@ -457,6 +478,8 @@ tpi_stack_size:-1, /* default stack size is good enough */
 		fprintf(stderr,  "Could not initialize callback hash tables\n");
 		return -1;
 	}
+	cb_set_coalesce(cb_coalesce_usec);
+	lease_init(lease_msecs);
 	if (use_tpool) {
 		/* Fire up a thread pool for servicing future requests */
 		id = tp_init(&tinfo);
@@ -471,6 +494,27 @@ tpi_stack_size:-1, /* default stack size is good enough */
 	 * like to tunnel the garbage cleaner stuff through this interface.
 	 */
 	clnt_init(&cas_options, 1, CAPFS_CHUNK_SIZE);
+	/* Start caching recipes */
+	if (recipe_init(recipe_mode) < 0) {
+		cb_finalize();
+		clnt_finalize();
+		if (use_tpool) {
+			tp_cleanup_by_id(id);
+		}
+		fprintf(stderr,  "Could not start the recipe cache!\n");
+		return -1;
+	}
+	/* Start sending chunk reference count updates to the CAS servers */
+	if (refs_init() < 0) {
+		cb_finalize();
+		recipe_finalize();
+		clnt_finalize();
+		if (use_tpool) {
+			tp_cleanup_by_id(id);
+		}
+		fprintf(stderr,  "Could not start reference count updates!\n");
+		return -1;
+	}
 	/* Start up the local RPC service on both TCP and UDP */
 	if (setup_service(CAPFS_MGR /* prog# */,
 				mgrv1 /* version */,
@@ -480,6 +524,8 @@ tpi_stack_size:-1, /* default stack size is good enough */
 				&info) < 0) 
 	{
 		cb_finalize();
+		refs_finalize();
+		recipe_finalize();
 		clnt_finalize();
 		if (use_tpool) {
 			tp_cleanup_by_id(id);
@@ -490,6 +536,8 @@ tpi_stack_size:-1, /* default stack size is good enough */
 	/* Should not return */
 	fprintf(stderr,  "Panic! setup_service returned!\n");
 	cb_finalize();
+	refs_finalize();
+	recipe_finalize();
 	clnt_finalize();
 	if (use_tpool) {
 		tp_cleanup_by_id(id);
@@ -503,6 +551,11 @@ static void capfs_cleanup(void)
 	LOG(stderr, INFO_MSG, SUBSYS_META, "About to turn off RPC service\n");
 	/* cleanup the RPC service */
 	cleanup_service(&info);
+	lease_finalize();
+	LOG(stderr, INFO_MSG, SUBSYS_META, "About to flush reference count updates\n");
+	refs_finalize();
+	LOG(stderr, INFO_MSG, SUBSYS_META, "About to write back cached recipes\n");
+	recipe_finalize();
 	LOG(stderr, INFO_MSG, SUBSYS_META, "About to cleanup CAS Engine\n");
 	/* cas engine cleanup */
 	clnt_finalize();
@@ -48,6 +48,9 @@ static int do_fchmod(struct capfs_options*, struct sockaddr *, mreq_p req_p, voi
 static int do_rmdir(struct capfs_options*, struct sockaddr *, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p);
 static int do_getdents(struct capfs_options*, struct sockaddr *, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p);
 static int do_gethashes(struct capfs_options*, struct sockaddr *, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p);
+static int do_clone(struct capfs_options*, struct sockaddr *, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p);
+static int do_snapshot(struct capfs_options*, struct sockaddr *, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p);
+static int do_gettree(struct capfs_options*, struct sockaddr *, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p);
 
 /* GLOBALS */
 static int (*reqfn[])(struct capfs_options*, struct sockaddr *, mreq_p, void *, mack_p, struct ackdata_c *) = {
@@ -79,6 +82,10 @@ static int (*reqfn[])(struct capfs_options*, struct sockaddr *, mreq_p, void *,
 	do_readlink,
 	do_stat,
 	do_gethashes,
+	do_noop, /* wcommits go through commit_write() */
+	do_clone,
+	do_snapshot,
+	do_gettree,
 };
 
 /* reqtest structure only used to print meaningful debug messages */
@@ -111,6 +118,10 @@ static char *reqtext[] = {
 	"readlink",
 	"stat",
 	"gethashes",
+	"wcommit",
+	"clone",
+	"snapshot",
+	"gettree",
 /*** ADD NEW CALLS ABOVE THIS LINE ***/
 	"error",
 	"error",
@@ -120,7 +131,7 @@ static char *reqtext[] = {
 };
 
 extern int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk, 
-	int64_t nchunks, int64_t prefetch_index, void *buf, fmeta *meta);
+	int64_t nchunks, int64_t prefetch_index, void *buf, fmeta *meta, int64_t *version);
 
 static inline void init_defaults(mack *ack, int type)
 {
@@ -152,12 +163,16 @@ struct mgr_entry {
 	struct sockaddr_in addr;
 	CLIENT *clnt;
 	struct sockaddr_in our_addr;
+	/* set if the meta-server does not know CAPFS_CBREG2, CAPFS_GETHASHES2 and CAPFS_WCOMMIT2 */
+	int old_procs;
 };
 static mgr_entry mgr_table[MAXMGRS];
 static int mgr_count = 0;
 
 /* callback id to be used on opens/closes of files */
 static int my_cb_id = -1;
+/* hcache lease term of the meta-server, 0 if it keeps the hcache coherent with callbacks */
+static int my_lease_msecs = 0;
 /* This variable decides if the callback registration is needed or not, */
 extern int check_for_registration;
 
@@ -247,6 +262,7 @@ static CLIENT** get_clnt_handle(int tcp, struct sockaddr_in *mgraddr)
 		id = find_unused_id();
 		mgr_host = inet_ntoa(mgraddr->sin_addr);
 		mgr_table[id].used = USED;
+		mgr_table[id].old_procs = 0;
 		memcpy(&mgr_table[id].addr, mgraddr, sizeof(struct sockaddr_in));
 		mgr_count++;
 		
@@ -324,6 +340,33 @@ static void put_clnt_handle(CLIENT **pclnt, int force_put)
 	return;
 }
 
+/* does the meta-server at mgraddr lack the versioned procedures? */
+static int mgr_old_procs(struct sockaddr_in *mgraddr)
+{
+	int id, old = 0;
+
+	pthread_mutex_lock(&mgr_mutex);
+	if ((id = find_id_of_host(mgraddr)) >= 0) {
+		old = mgr_table[id].old_procs;
+	}
+	pthread_mutex_unlock(&mgr_mutex);
+	return old;
+}
+
+static void mgr_set_old_procs(struct sockaddr_in *mgraddr)
+{
+	int id;
+
+	pthread_mutex_lock(&mgr_mutex);
+	if ((id = find_id_of_host(mgraddr)) >= 0 && mgr_table[id].old_procs == 0) {
+		mgr_table[id].old_procs = 1;
+		LOG(stderr, WARNING_MSG, SUBSYS_META, "meta-server %s does not know versioned commits or leases, "
+				"falling back to comparing hashes and callbacks\n", inet_ntoa(mgraddr->sin_addr));
+	}
+	pthread_mutex_unlock(&mgr_mutex);
+	return;
+}
+
 /* What address should we register for callback with this manager? */
 static struct sockaddr* get_registration_address(struct sockaddr_in *mgr_addr)
 {
@@ -351,7 +394,8 @@ int capfs_cbreg(struct capfs_options* opt, struct sockaddr *mgr_host, int prog,
 	cb_args args;
 	cb_resp resp;
 	CLIENT **clnt = NULL;
-	enum clnt_stat result;
+	enum clnt_stat result = RPC_PROCUNAVAIL;
+	int lease_msecs = 0;
 	int tcp;
 	char *my = NULL;
 	struct sockaddr_in *my_address;
@@ -384,7 +428,22 @@ int capfs_cbreg(struct capfs_options* opt, struct sockaddr *mgr_host, int prog,
 	args.svc_vers = vers;
 	args.svc_proto = proto;
 
-	result = capfs_cbreg_1(args, &resp, *clnt);
+	if (!mgr_old_procs((struct sockaddr_in *)mgr_host)) {
+		cb2_resp resp2;
+
+		memset(&resp2, 0, sizeof(resp2));
+		result = capfs_cbreg2_1(args, &resp2, *clnt);
+		resp = resp2.resp;
+		lease_msecs = resp2.lease_msecs;
+		if (result == RPC_PROCUNAVAIL) {
+			mgr_set_old_procs((struct sockaddr_in *)mgr_host);
+		}
+	}
+	/* an older meta-server keeps our hcache coherent with callbacks */
+	if (result == RPC_PROCUNAVAIL) {
+		lease_msecs = 0;
+		result = capfs_cbreg_1(args, &resp, *clnt);
+	}
 	if (result != RPC_SUCCESS) {
 		clnt_perror(*clnt, "capfs_cbreg_1 :");
 		/* make it reconnect */
@@ -403,8 +462,9 @@ int capfs_cbreg(struct capfs_options* opt, struct sockaddr *mgr_host, int prog,
 			return -1;
 		}
 		my_cb_id = resp.cb_id;
-		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "[%s] Successfully registered prog #: %x, version #: %d, proto: %s -> callback id = %d\n",
-				my, prog, vers, proto == IPPROTO_TCP ? "tcp" : "udp", my_cb_id);
+		my_lease_msecs = lease_msecs;
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "[%s] Successfully registered prog #: %x, version #: %d, proto: %s -> callback id = %d"
+				" lease = %d msecs\n", my, prog, vers, proto == IPPROTO_TCP ? "tcp" : "udp", my_cb_id, my_lease_msecs);
 		return 0;
 	}
 }
@@ -1691,6 +1751,152 @@ static int do_link(struct capfs_options* opt, struct sockaddr *mgr, mreq_p req_p
 	return 0;
 }
 
+static int do_clone(struct capfs_options* opt, struct sockaddr *mgr, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p)
+{
+	clone_args args;
+	clone_resp resp;
+	CLIENT **clnt = NULL;
+	enum clnt_stat ans;
+	char *ptr = (char *) data_p;
+	int tcp;
+
+	/* Use what is provided, else default to tcp */
+	tcp = (opt ? opt->tcp : 1);
+	memset(&args, 0, sizeof(args));
+	memset(&resp, 0, sizeof(resp));
+	init_defaults(ack_p, req_p->type);
+	copy_to_credentials(req_p, &args.credentials);
+	args.src_name = ptr;
+	for (;*ptr;ptr++);
+	args.dst_name = ++ptr;
+
+	clnt = get_clnt_handle(tcp, (struct sockaddr_in *)mgr);
+	if (*clnt == NULL) {
+		errno = ECONNREFUSED;
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return -1;
+	}
+	ans = capfs_clone_1(args, &resp, *clnt);
+	if (ans != RPC_SUCCESS) {
+		clnt_perror(*clnt, "capfs_clone_1:");
+		errno = convert_to_errno(ans);
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		/* make it reconnect */
+		put_clnt_handle(clnt, 1);
+		return -1;
+	}
+	init_ackstatus(ack_p, &resp.status);
+	copy_from_fm_to_fmeta(&resp.meta, &ack_p->ack.clone.meta);
+	/* drop it if the cache handle policy says so! */
+	put_clnt_handle(clnt, 0);
+	return 0;
+}
+
+static int do_snapshot(struct capfs_options* opt, struct sockaddr *mgr, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p)
+{
+	snapshot_args args;
+	snapshot_resp resp;
+	CLIENT **clnt = NULL;
+	enum clnt_stat ans;
+	char *ptr = (char *) data_p;
+	int tcp;
+
+	/* Use what is provided, else default to tcp */
+	tcp = (opt ? opt->tcp : 1);
+	memset(&args, 0, sizeof(args));
+	memset(&resp, 0, sizeof(resp));
+	init_defaults(ack_p, req_p->type);
+	copy_to_credentials(req_p, &args.credentials);
+	args.dir_name = ptr;
+	for (;*ptr;ptr++);
+	args.snap_name = ++ptr;
+	args.remove = req_p->req.snapshot.remove;
+
+	clnt = get_clnt_handle(tcp, (struct sockaddr_in *)mgr);
+	if (*clnt == NULL) {
+		errno = ECONNREFUSED;
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return -1;
+	}
+	ans = capfs_snapshot_1(args, &resp, *clnt);
+	if (ans != RPC_SUCCESS) {
+		clnt_perror(*clnt, "capfs_snapshot_1:");
+		errno = convert_to_errno(ans);
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		/* make it reconnect */
+		put_clnt_handle(clnt, 1);
+		return -1;
+	}
+	init_ackstatus(ack_p, &resp.status);
+	/* drop it if the cache handle policy says so! */
+	put_clnt_handle(clnt, 0);
+	return 0;
+}
+
+static int do_gettree(struct capfs_options* opt, struct sockaddr *mgr, mreq_p req_p, void *data_p, mack_p ack_p, struct ackdata_c *recv_p)
+{
+	gettree_args args;
+	gettree_resp resp;
+	CLIENT **clnt = NULL;
+	enum clnt_stat ans;
+	int i, tcp;
+
+	/* Use what is provided, else default to tcp */
+	tcp = (opt ? opt->tcp : 1);
+	memset(&args, 0, sizeof(args));
+	memset(&resp, 0, sizeof(resp));
+	init_defaults(ack_p, req_p->type);
+	copy_to_credentials(req_p, &args.credentials);
+	args.name = (char *) data_p;
+	args.level = req_p->req.gettree.level;
+	args.begin_node = req_p->req.gettree.begin_node;
+	args.nnodes = minimum(req_p->req.gettree.nnodes, recv_p->u.gettree.nnodes);
+	if (hash_ctor(&resp.h) < 0) {
+		errno = ENOMEM;
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return -1;
+	}
+
+	clnt = get_clnt_handle(tcp, (struct sockaddr_in *)mgr);
+	if (*clnt == NULL) {
+		hash_dtor(&resp.h);
+		errno = ECONNREFUSED;
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		return -1;
+	}
+	ans = capfs_gettree_1(args, &resp, *clnt);
+	if (ans != RPC_SUCCESS) {
+		clnt_perror(*clnt, "capfs_gettree_1:");
+		hash_dtor(&resp.h);
+		errno = convert_to_errno(ans);
+		ack_p->status = -1;
+		ack_p->eno = errno;
+		/* make it reconnect */
+		put_clnt_handle(clnt, 1);
+		return -1;
+	}
+	init_ackstatus(ack_p, &resp.status);
+	if (ack_p->status == 0) {
+		ack_p->ack.gettree.nchunks = resp.nchunks;
+		ack_p->ack.gettree.levels = resp.levels;
+		recv_p->u.gettree.nnodes = minimum(resp.h.sha1_hashes_len, args.nnodes);
+		for (i = 0; i < recv_p->u.gettree.nnodes; i++) {
+			memcpy(recv_p->u.gettree.buf + i * CAPFS_MAXHASHLENGTH, resp.h.sha1_hashes_val[i], CAPFS_MAXHASHLENGTH);
+		}
+		ack_p->ack.gettree.nnodes = recv_p->u.gettree.nnodes;
+	}
+	hash_dtor(&resp.h);
+	/* drop it if the cache handle policy says so! */
+	put_clnt_handle(clnt, 0);
+	return 0;
+}
+
 static int readlink_ctor(readlink_resp *resp)
 {
 	resp->link_name = (char *) calloc(CAPFS_MAXNAMELEN, 1);
@@ -1787,7 +1993,7 @@ static int do_gethashes(struct capfs_options* opt, struct sockaddr *mgr, mreq_p
 	init_defaults(ack_p, req_p->type);
 	/* No hcache prefetches for the library */
 	ret = get_hashes(opt->use_hcache, data_p, req_p->req.gethashes.begin_chunk, 
-		req_p->req.gethashes.nchunks, -1, recv_p->u.gethashes.buf, NULL);
+		req_p->req.gethashes.nchunks, -1, recv_p->u.gethashes.buf, NULL, NULL);
 	if (ret < 0) {
 		ack_p->status = -1;
 		ack_p->eno = errno;
@@ -1904,22 +2110,238 @@ post_io(void* p, int nframes, char **buffers,
 		return uptr;
 }
 
+/*
+ * When the meta-server hands out leases instead of calling us back,
+ * hashes may be served from the hcache only as long as a lease covers them.
+ * Leases are kept per file name, as the ranges [hl_begin, hl_end) of chunks.
+ */
+#define HLEASE_BUCKETS 101
+
+struct hlease {
+	struct qlist_head hl_link;
+	int64_t           hl_begin, hl_end;
+	struct timeval    hl_expires;
+};
+
+struct hlease_file {
+	struct qlist_head hf_link;
+	char             *hf_name;
+	struct qlist_head hf_leases;
+};
+
+static struct qlist_head hlease_table[HLEASE_BUCKETS];
+static int hlease_ready = 0;
+static pthread_mutex_t hlease_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with hlease_mutex held */
+static struct hlease_file *hlease_file_find(char *name, int create)
+{
+	struct qlist_head *tmp, *bucket;
+	struct hlease_file *hf;
+	unsigned int h = 0;
+	char *p;
+
+	if (!hlease_ready) {
+		for (h = 0; h < HLEASE_BUCKETS; h++) {
+			INIT_QLIST_HEAD(&hlease_table[h]);
+		}
+		hlease_ready = 1;
+		h = 0;
+	}
+	for (p = name; *p; p++) {
+		h = h * 31 + (unsigned char) *p;
+	}
+	bucket = &hlease_table[h % HLEASE_BUCKETS];
+	qlist_for_each(tmp, bucket) {
+		hf = qlist_entry(tmp, struct hlease_file, hf_link);
+		if (strcmp(hf->hf_name, name) == 0) {
+			return hf;
+		}
+	}
+	if (!create || (hf = (struct hlease_file *) calloc(1, sizeof(struct hlease_file))) == NULL) {
+		return NULL;
+	}
+	if ((hf->hf_name = strdup(name)) == NULL) {
+		free(hf);
+		return NULL;
+	}
+	INIT_QLIST_HEAD(&hf->hf_leases);
+	qlist_add(&hf->hf_link, bucket);
+	return hf;
+}
+
+/* drops the leases that expired before now (all of them if now is NULL) */
+static void hlease_prune(struct hlease_file *hf, struct timeval *now)
+{
+	struct qlist_head *tmp, *next;
+	struct hlease *hl;
+
+	qlist_for_each_safe(tmp, next, &hf->hf_leases) {
+		hl = qlist_entry(tmp, struct hlease, hl_link);
+		if (now == NULL || !timercmp(&hl->hl_expires, now, >)) {
+			qlist_del(&hl->hl_link);
+			free(hl);
+		}
+	}
+	if (qlist_empty(&hf->hf_leases)) {
+		qlist_del(&hf->hf_link);
+		free(hf->hf_name);
+		free(hf);
+	}
+}
+
+/*
+ * Records a lease of msecs on nchunks chunks from begin_chunk.
+ * start is when the request that obtained it was sent, since the
+ * meta-server started counting some time after that.
+ */
+static void hlease_add(char *name, int64_t begin_chunk, int64_t nchunks, struct timeval *start, int msecs)
+{
+	struct qlist_head *tmp, *next;
+	struct hlease_file *hf;
+	struct hlease *hl;
+	struct timeval term;
+
+	if (msecs <= 0 || nchunks <= 0 || begin_chunk < 0) {
+		return;
+	}
+	if ((hl = (struct hlease *) malloc(sizeof(struct hlease))) == NULL) {
+		return;
+	}
+	hl->hl_begin = begin_chunk;
+	hl->hl_end = begin_chunk + nchunks;
+	term.tv_sec = msecs / 1000;
+	term.tv_usec = (msecs % 1000) * 1000;
+	timeradd(start, &term, &hl->hl_expires);
+	pthread_mutex_lock(&hlease_mutex);
+	if ((hf = hlease_file_find(name, 1)) == NULL) {
+		pthread_mutex_unlock(&hlease_mutex);
+		free(hl);
+		return;
+	}
+	/* leases within the new one that it outlasts are of no more use */
+	qlist_for_each_safe(tmp, next, &hf->hf_leases) {
+		struct hlease *old = qlist_entry(tmp, struct hlease, hl_link);
+
+		if (old->hl_begin >= hl->hl_begin && old->hl_end <= hl->hl_end
+				&& !timercmp(&old->hl_expires, &hl->hl_expires, >)) {
+			qlist_del(&old->hl_link);
+			free(old);
+		}
+	}
+	qlist_add_tail(&hl->hl_link, &hf->hf_leases);
+	pthread_mutex_unlock(&hlease_mutex);
+	return;
+}
+
+/*
+ * Clears the hashes of the chunks from begin_chunk to begin_chunk + nchunks
+ * that no unexpired lease covers out of the hcache, so that they are fetched
+ * (and leased) again. The hcache is not called with hlease_mutex held,
+ * since it calls hlease_add() when it fetches hashes.
+ */
+static void hlease_check(char *name, int64_t begin_chunk, int64_t nchunks)
+{
+	struct qlist_head *tmp;
+	struct hlease_file *hf;
+	struct timeval now;
+	int64_t cur = begin_chunk, end = begin_chunk + nchunks, next;
+
+	if (my_lease_msecs <= 0) {
+		return;
+	}
+	while (cur < end) {
+		pthread_mutex_lock(&hlease_mutex);
+		gettimeofday(&now, NULL);
+		next = end;
+		if ((hf = hlease_file_find(name, 0)) != NULL) {
+			hlease_prune(hf, &now);
+		}
+		if ((hf = hlease_file_find(name, 0)) != NULL) {
+			int covered;
+
+			/* skip over the leased chunks from cur onwards */
+			do {
+				covered = 0;
+				qlist_for_each(tmp, &hf->hf_leases) {
+					struct hlease *hl = qlist_entry(tmp, struct hlease, hl_link);
+
+					if (hl->hl_begin <= cur && cur < hl->hl_end) {
+						cur = hl->hl_end;
+						covered = 1;
+					}
+				}
+			} while (covered && cur < end);
+			/* and find where the next lease begins */
+			qlist_for_each(tmp, &hf->hf_leases) {
+				struct hlease *hl = qlist_entry(tmp, struct hlease, hl_link);
+
+				if (hl->hl_begin > cur && hl->hl_begin < next) {
+					next = hl->hl_begin;
+				}
+			}
+		}
+		pthread_mutex_unlock(&hlease_mutex);
+		if (cur >= end) {
+			break;
+		}
+		LOG(stderr, DEBUG_MSG, SUBSYS_META, "hlease_check: %s from %Ld for %Ld chunks is not leased\n",
+				name, cur, next - cur);
+		hcache_clear_range(name, cur, (int) (next - cur));
+		cur = next;
+	}
+	return;
+}
+
+/* Forgets the leases on a file whose hashes were cleared */
+static void hlease_forget(char *name)
+{
+	struct hlease_file *hf;
+
+	pthread_mutex_lock(&hlease_mutex);
+	if ((hf = hlease_file_find(name, 0)) != NULL) {
+		hlease_prune(hf, NULL);
+	}
+	pthread_mutex_unlock(&hlease_mutex);
+	return;
+}
+
 /*
  * RPC call to meta-data server to fetch the hashes
- * for this file.
+ * for this file. *version and *lease_msecs are set to the version
+ * of the range and its lease, or to 0 if the meta-server does not
+ * hand them out.
  */
 static int fetch_hashes(int tcp, struct sockaddr* mgr, gethashes_args *args,
-		gethashes_resp *resp)
+		gethashes_resp *resp, int64_t *version, int *lease_msecs)
 {
-	enum clnt_stat ans;
+	enum clnt_stat ans = RPC_PROCUNAVAIL;
 	CLIENT **clnt = NULL;
 
+	*version = 0;
+	*lease_msecs = 0;
 	clnt = get_clnt_handle(tcp, (struct sockaddr_in *)mgr);
 	if (*clnt == NULL) {
 		errno = ECONNREFUSED;
 		return -1;
 	}
-	ans = capfs_gethashes_1(*args, resp, *clnt);
+	if (!mgr_old_procs((struct sockaddr_in *)mgr)) {
+		gethashes2_resp resp2;
+
+		resp2.resp = *resp;
+		resp2.recipe_version = 0;
+		resp2.lease_msecs = 0;
+		ans = capfs_gethashes2_1(*args, &resp2, *clnt);
+		*resp = resp2.resp;
+		*version = resp2.recipe_version;
+		*lease_msecs = resp2.lease_msecs;
+		if (ans == RPC_PROCUNAVAIL) {
+			mgr_set_old_procs((struct sockaddr_in *)mgr);
+		}
+	}
+	if (ans == RPC_PROCUNAVAIL) {
+		ans = capfs_gethashes_1(*args, resp, *clnt);
+	}
 	if (ans != RPC_SUCCESS) {
 		errno = convert_to_errno(ans);
 		clnt_perror(*clnt, "capfs_gethashes_1 :");
@@ -1945,6 +2367,9 @@ static void do_fetch_hashes(struct user_ptr *uptr)
 	int64_t nchunks = 0, i;
 	char host[1024];
 	struct sockaddr mgr;
+	struct timeval start;
+	int64_t version;
+	int lease_msecs;
 
 	memset(&args, 0, sizeof(gethashes_args));
 	memset(&resp, 0, sizeof(gethashes_resp));
@@ -2000,7 +2425,8 @@ static void do_fetch_hashes(struct user_ptr *uptr)
 	LOG(stderr, DEBUG_MSG, SUBSYS_META,  "RPC fetch hashes for file %s, begin_chunk: %Ld, nchunks: %Ld\n",
 			skip_to_filename(name), args.begin_chunk, args.nchunks);
 
-	if (fetch_hashes(1, &mgr, &args, &resp) < 0) {
+	gettimeofday(&start, NULL);
+	if (fetch_hashes(1, &mgr, &args, &resp, &version, &lease_msecs) < 0) {
 		for (i = 0; i < uptr->nframes; i++) {
 			uptr->completed[i] = -errno;
 		}
@@ -2032,6 +2458,7 @@ static void do_fetch_hashes(struct user_ptr *uptr)
 			uptr->completed[i] = 0;
 			memset(uptr->buffers[i], 0, CAPFS_MAXHASHLENGTH);
 		}
+		hlease_add(name, args.begin_chunk, args.nchunks, &start, lease_msecs);
 	}
 	/* operation was an error.. */
 	else {
@@ -2154,10 +2581,16 @@ void cleanup_hashes(void)
  * entire address of the manager embedded),
  * Try to get the specified number of hashes into the specified buffer,
  * Returns the actual number of hashes that could be retrieved successfully.
+ * If version is not NULL, it is set to the version of the range that
+ * a commit to it may present instead of the hashes, or to 0 if there is none
+ * (hashes that come out of the hcache may have been fetched at different times).
  */
 int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk, 
-		int64_t nchunks, int64_t prefetch_index, void *buf, fmeta *meta)
+		int64_t nchunks, int64_t prefetch_index, void *buf, fmeta *meta, int64_t *version)
 {
+	if (version) {
+		*version = 0;
+	}
 	/* 
 	 * This is the place, where we can choose to disable the hcache by not
 	 * accessing it at all. Instead every call should be made out to the
@@ -2167,6 +2600,9 @@ int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk,
 	if (use_hcache == 1) 
 	{
 		int64_t ret;
+
+		/* without callbacks, only leased hashes can be trusted */
+		hlease_check(name, begin_chunk, nchunks);
 		if ((ret = hcache_get(name, begin_chunk, nchunks, prefetch_index, buf)) < 0) {
 			LOG(stderr, CRITICAL_MSG, SUBSYS_META,  "get_hashes: could not get hashes: %s\n", strerror(errno));
 			return -1;
@@ -2181,6 +2617,8 @@ int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk,
 		/* Issue an RPC to fetch the hashes for the file */
 		gethashes_args args;
 		gethashes_resp resp;
+		int64_t recipe_version;
+		int lease_msecs;
 		char host[256];
 		struct sockaddr mgr;
 		static char mgr_host[]="xxx.xxx.xxx.xxx\0";
@@ -2226,7 +2664,7 @@ int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk,
 			return -1;
 		}
 
-		if (fetch_hashes(1, &mgr, &args, &resp) < 0) {
+		if (fetch_hashes(1, &mgr, &args, &resp, &recipe_version, &lease_msecs) < 0) {
 			hash_dtor(&resp.h);
 			return -1;
 		}
@@ -2251,6 +2689,9 @@ int64_t get_hashes(int use_hcache, char *name, int64_t begin_chunk,
 			if (meta) {
 				copy_from_fm_to_fmeta(&resp.meta, meta);
 			}
+			if (version) {
+				*version = recipe_version;
+			}
 			return resp.h.sha1_hashes_len;
 		}
 		else {
@@ -2284,6 +2725,7 @@ int64_t put_hashes(char *name, int64_t begin_chunk, int64_t nchunks, void *buf)
  */
 int clear_hashes(char *name)
 {
+	hlease_forget(name);
 	return hcache_clear(name);
 }
 
@@ -2355,9 +2797,11 @@ static void wcommit_dtor(wcommit_args *args)
  * write to the file. Remember that
  * fname is also the long version that includes the machine name,
  * port number etc...
+ * If *version is non-zero, the meta-data server checks it instead of the old hashes.
+ * On return it holds the version of the range that current_hashes belong to.
  */
 int commit_write(struct capfs_options *opt, char *fname, int64_t begin_chunk, int64_t write_size, 
-		sha1_info *old_hashes, sha1_info *new_hashes, sha1_info *current_hashes)
+		sha1_info *old_hashes, sha1_info *new_hashes, sha1_info *current_hashes, int64_t *version)
 {
 	wcommit_args args;
 	wcommit_resp resp;
@@ -2366,6 +2810,9 @@ int commit_write(struct capfs_options *opt, char *fname, int64_t begin_chunk, in
 	struct sockaddr mgr;
 	char host[1024];
 	int desire_hcache_coherence, use_tcp, force_commit;
+	int64_t recipe_version;
+	int lease_msecs = 0;
+	struct timeval start;
 
 	/* Use what is provided, else default to no hcache */
 	if (opt && opt->use_hcache == 1)
@@ -2419,7 +2866,32 @@ int commit_write(struct capfs_options *opt, char *fname, int64_t begin_chunk, in
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "commit hashes for file %s, begin_chunk: %Ld, write_size: %Ld\n",
 			skip_to_filename(fname), args.begin_chunk, args.write_size);
 
-	ans = capfs_wcommit_1(args, &resp, *clnt);
+	gettimeofday(&start, NULL);
+	recipe_version = version ? *version : 0;
+	ans = RPC_PROCUNAVAIL;
+	if (!mgr_old_procs((struct sockaddr_in *)&mgr)) {
+		wcommit2_args args2;
+		wcommit2_resp resp2;
+
+		args2.args = args;
+		args2.recipe_version = recipe_version;
+		resp2.resp = resp;
+		resp2.recipe_version = 0;
+		resp2.lease_msecs = 0;
+		ans = capfs_wcommit2_1(args2, &resp2, *clnt);
+		resp = resp2.resp;
+		recipe_version = resp2.recipe_version;
+		lease_msecs = resp2.lease_msecs;
+		if (ans == RPC_PROCUNAVAIL) {
+			mgr_set_old_procs((struct sockaddr_in *)&mgr);
+		}
+	}
+	/* the old procedure compares the old hashes and returns no version or lease */
+	if (ans == RPC_PROCUNAVAIL) {
+		recipe_version = 0;
+		lease_msecs = 0;
+		ans = capfs_wcommit_1(args, &resp, *clnt);
+	}
 	if (ans != RPC_SUCCESS) {
 		errno = convert_to_errno(ans);
 		clnt_perror(*clnt, "capfs_wcommit_1 :");
@@ -2436,9 +2908,16 @@ int commit_write(struct capfs_options *opt, char *fname, int64_t begin_chunk, in
 	if (resp.status.status) {
 		errno = resp.status.eno;
 	}
+	/* the caller puts the new hashes in the hcache */
+	else if (new_hashes) {
+		hlease_add(fname, begin_chunk, new_hashes->sha1_info_len, &start, lease_msecs);
+	}
 	/* copy the response from the server i.e. the current hashes to the caller regardless of success/failure of operation */
 	copy_resp_to_current_hashes(&resp.current_hashes, current_hashes);
 	hash_dtor(&resp.current_hashes);
+	if (version) {
+		*version = recipe_version;
+	}
 	return resp.status.status;
 }
 
@@ -14,7 +14,7 @@
 #include "mgr_prot_common.h"
 
 /* callback registration (server) returns the callback identifiers */
-extern int cbreg_svc(cb_args *cb, struct sockaddr_in *raddr);
+extern int cbreg_svc(cb_args *cb, struct sockaddr_in *raddr, int leases);
 /* callback client handle stuff */
 extern CLIENT** get_cb_handle(int cb_id);
 extern void put_cb_handle(CLIENT **pclnt, int force_put);
@@ -42,17 +42,16 @@ static inline void init_opstatus(opstatus *status, mack *ack)
 	return;
 }
 
-bool_t
-capfs_cbreg_1_svc(cb_args arg1, cb_resp *result,  struct svc_req *rqstp)
+/* clients that register with CAPFS_CBREG2 know about hcache leases */
+static void cbreg(cb_args *arg1, cb_resp *result, int leases)
 {
-	bool_t retval = 1;
 	struct sockaddr_in remote_address;
 	int cbid = 0;
 
 	/*remote_address = svc_getcaller(rqstp->rq_xprt);*/
 	memset(&remote_address, 0, sizeof(struct sockaddr_in));
-	remote_address.sin_addr.s_addr = arg1.svc_addr;
-	cbid = cbreg_svc(&arg1, &remote_address);
+	remote_address.sin_addr.s_addr = arg1->svc_addr;
+	cbid = cbreg_svc(arg1, &remote_address, leases);
 	if (cbid < 0) {
 		result->status.status = -1;
 		/* hijacked some other errno! */
@@ -63,7 +62,22 @@ capfs_cbreg_1_svc(cb_args arg1, cb_resp *result,  struct svc_req *rqstp)
 		result->status.eno = 0;
 	}
 	result->cb_id = cbid;
-	return retval;
+	return;
+}
+
+bool_t
+capfs_cbreg_1_svc(cb_args arg1, cb_resp *result,  struct svc_req *rqstp)
+{
+	cbreg(&arg1, result, 0);
+	return 1;
+}
+
+bool_t
+capfs_cbreg2_1_svc(cb_args arg1, cb2_resp *result,  struct svc_req *rqstp)
+{
+	cbreg(&arg1, &result->resp, 1);
+	result->lease_msecs = lease_term();
+	return 1;
 }
 
 bool_t
@@ -248,6 +262,9 @@ static int copy_sha1_hashes(sha1_hashes *h, struct ackdata *ackdata)
 					h->sha1_hashes_len, ackdata->u.wcommit.current_hash_len);
 		}
 	}
+	else if (ackdata->type == MGR_GETTREE) {
+		h->sha1_hashes_len = MIN(CAPFS_MAXHASHES, ackdata->u.gettree.nnodes);
+	}
 #undef MIN
 	if (h->sha1_hashes_len > 0) {
 		if ((h->sha1_hashes_val = 
@@ -266,6 +283,10 @@ static int copy_sha1_hashes(sha1_hashes *h, struct ackdata *ackdata)
 				free(ackdata->u.wcommit.current_hashes);
 				ackdata->u.wcommit.current_hashes = NULL;
 			}
+			else if (ackdata->type == MGR_GETTREE) {
+				free(ackdata->u.gettree.nodes);
+				ackdata->u.gettree.nodes = NULL;
+			}
 			return -1;
 		}
 	}
@@ -283,6 +304,9 @@ static int copy_sha1_hashes(sha1_hashes *h, struct ackdata *ackdata)
 		else if (ackdata->type == MGR_WCOMMIT) {
 			memcpy(h->sha1_hashes_val[i], ackdata->u.wcommit.current_hashes + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH);
 		}
+		else if (ackdata->type == MGR_GETTREE) {
+			memcpy(h->sha1_hashes_val[i], ackdata->u.gettree.nodes + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH);
+		}
 	}
 	if (ackdata->type == MGR_OPEN) {
 		free(ackdata->u.open.hashes);
@@ -296,6 +320,10 @@ static int copy_sha1_hashes(sha1_hashes *h, struct ackdata *ackdata)
 		free(ackdata->u.wcommit.current_hashes);
 		ackdata->u.wcommit.current_hashes = NULL;
 	}
+	else if (ackdata->type == MGR_GETTREE) {
+		free(ackdata->u.gettree.nodes);
+		ackdata->u.gettree.nodes = NULL;
+	}
 	return 0;
 }
 
@@ -354,8 +382,8 @@ capfs_open_1_svc(open_args arg1, open_resp *result,  struct svc_req *rqstp)
 			}
 		}
 	}
-	/* and add callbacks for this node and file */
-	if (ack.status == 0 && arg1.request_hashes == 1) 
+	/* and add callbacks for this node and file, unless leases take care of coherence */
+	if (ack.status == 0 && arg1.request_hashes == 1 && !lease_client(arg1.cb_id)) 
 	{
 		/*
 		 * Note that this implies that we do need to keep
@@ -376,7 +404,7 @@ capfs_unlink_1_svc(unlink_args arg1, unlink_resp *result,  struct svc_req *rqstp
 	char *buf_p = NULL;
 	struct ackdata ackdata;
 	int err;
-	unsigned long bitmap = 0;
+	cbset sharers;
 
 	memset(&req, 0, sizeof(req));
 	memset(&ack, 0, sizeof(ack));
@@ -390,13 +418,22 @@ capfs_unlink_1_svc(unlink_args arg1, unlink_resp *result,  struct svc_req *rqstp
 	 * okay, now we need to expunge this object 
 	 * from the callback hashtables and also evict
 	 * the hashes for this object from other hcaches
-	 * if need be
+	 * if need be. With leases, we wait for the other
+	 * hcaches to drop them instead; clients that do not
+	 * know about leases still get callbacks.
 	 */
+	if (ack.status == 0 && lease_term() > 0)
+	{
+		lease_recall(ackdata.u.unlink.fs_ino, ackdata.u.unlink.f_ino, arg1.cb_id, -1, 0);
+		lease_forget(ackdata.u.unlink.fs_ino, ackdata.u.unlink.f_ino);
+	}
 	if (ack.status == 0 && arg1.desire_hcache_coherence == 1)
 	{
-		bitmap = clear_callbacks(ackdata.u.unlink.fs_ino, ackdata.u.unlink.f_ino);
+		cbset_init(&sharers);
+		clear_callbacks(ackdata.u.unlink.fs_ino, ackdata.u.unlink.f_ino, &sharers);
 		/* We will let errors slide by for now... */
-		cb_clear_hashes(buf_p, bitmap, arg1.cb_id);
+		cb_clear_hashes(buf_p, &sharers, arg1.cb_id);
+		cbset_free(&sharers);
 	}
 	init_opstatus(&result->status, &ack);
 
@@ -651,12 +688,21 @@ capfs_truncate_1_svc(truncate_args arg1, truncate_resp *result,  struct svc_req
 	result->old_length = ackdata.u.truncate.old_length;
 
 	/* in case we are using the hcache, we need to possibly invalidate them on all client nodes */
+	if (ack.status == 0 && lease_term() > 0)
+	{
+		if (ackdata.u.truncate.begin_chunk >= 0)
+		{
+			lease_recall(ackdata.u.truncate.fs_ino, ackdata.u.truncate.f_ino, arg1.cb_id,
+					ackdata.u.truncate.begin_chunk, ackdata.u.truncate.nchunks);
+		}
+	}
 	if (ack.status == 0 && arg1.desire_hcache_coherence == 1)
 	{
-		unsigned long bitmap;
+		cbset sharers;
 		char *fname = NULL;
 
-		bitmap = get_callbacks(ackdata.u.truncate.fs_ino, ackdata.u.truncate.f_ino, &fname);
+		cbset_init(&sharers);
+		get_callbacks(ackdata.u.truncate.fs_ino, ackdata.u.truncate.f_ino, &fname, &sharers);
 		/*
 		 * Invalidate the truncated part of the file in client nodes hcache
 		 * if fname exists.
@@ -664,8 +710,9 @@ capfs_truncate_1_svc(truncate_args arg1, truncate_resp *result,  struct svc_req
 		if (fname != NULL && ackdata.u.truncate.begin_chunk >= 0)
 		{
 			/* We will let errors in the invalidate hashes routine slide for now */
-			cb_invalidate_hashes(fname, bitmap, arg1.cb_id, ackdata.u.truncate.begin_chunk, ackdata.u.truncate.nchunks);
+			cb_invalidate_hashes(fname, &sharers, arg1.cb_id, ackdata.u.truncate.begin_chunk, ackdata.u.truncate.nchunks);
 		}
+		cbset_free(&sharers);
 	}
 	return retval;
 }
@@ -852,6 +899,109 @@ capfs_link_1_svc(link_args arg1, link_resp *result,  struct svc_req *rqstp)
 	return retval;
 }
 
+bool_t
+capfs_clone_1_svc(clone_args arg1, clone_resp *result,  struct svc_req *rqstp)
+{
+	bool_t retval = 1;
+	mreq req;
+	mack ack;
+	char *buf_p = NULL;
+	struct ackdata ackdata;
+	int err, len1 = 0, len2 = 0;
+
+	memset(&req, 0, sizeof(req));
+	memset(&ack, 0, sizeof(ack));
+	memset(&ackdata, 0, sizeof(ackdata));
+	init_defaults(&req, MGR_CLONE, &arg1.credentials);
+	len1 = strlen(arg1.src_name);
+	len2 = strlen(arg1.dst_name);
+	req.dsize = len1 + len2 + 1;
+	buf_p = (char *) calloc(req.dsize + 1, 1);
+	if (buf_p == NULL) {
+		result->status.status = -1;
+		result->status.eno = ENOMEM;
+		return retval;
+	}
+	strcpy(buf_p, arg1.src_name);
+	strcpy(&buf_p[len1+1], arg1.dst_name);
+
+	err = process_compat_req(&req, &ack, buf_p, &ackdata);
+	free(buf_p);
+	init_opstatus(&result->status, &ack);
+	copy_from_fmeta_to_fm(&ack.ack.clone.meta, &result->meta);
+
+	return retval;
+}
+
+bool_t
+capfs_snapshot_1_svc(snapshot_args arg1, snapshot_resp *result,  struct svc_req *rqstp)
+{
+	bool_t retval = 1;
+	mreq req;
+	mack ack;
+	char *buf_p = NULL;
+	struct ackdata ackdata;
+	int err, len1 = 0, len2 = 0;
+
+	memset(&req, 0, sizeof(req));
+	memset(&ack, 0, sizeof(ack));
+	memset(&ackdata, 0, sizeof(ackdata));
+	init_defaults(&req, MGR_SNAPSHOT, &arg1.credentials);
+	len1 = strlen(arg1.dir_name);
+	len2 = strlen(arg1.snap_name);
+	req.dsize = len1 + len2 + 1;
+	buf_p = (char *) calloc(req.dsize + 1, 1);
+	if (buf_p == NULL) {
+		result->status.status = -1;
+		result->status.eno = ENOMEM;
+		return retval;
+	}
+	strcpy(buf_p, arg1.dir_name);
+	strcpy(&buf_p[len1+1], arg1.snap_name);
+	req.req.snapshot.remove = arg1.remove;
+
+	err = process_compat_req(&req, &ack, buf_p, &ackdata);
+	free(buf_p);
+	init_opstatus(&result->status, &ack);
+
+	return retval;
+}
+
+bool_t
+capfs_gettree_1_svc(gettree_args arg1, gettree_resp *result,  struct svc_req *rqstp)
+{
+	bool_t retval = 1;
+	mreq req;
+	mack ack;
+	char *buf_p = NULL;
+	struct ackdata ackdata;
+	int err;
+
+	memset(&req, 0, sizeof(req));
+	memset(&ack, 0, sizeof(ack));
+	memset(&ackdata, 0, sizeof(ackdata));
+	init_defaults(&req, MGR_GETTREE, &arg1.credentials);
+	req.dsize = strlen(arg1.name);
+	buf_p = arg1.name;
+	req.req.gettree.level = arg1.level;
+	req.req.gettree.begin_node = arg1.begin_node;
+	req.req.gettree.nnodes = arg1.nnodes;
+	err = process_compat_req(&req, &ack, buf_p, &ackdata);
+
+	init_opstatus(&result->status, &ack);
+	result->nchunks = ack.ack.gettree.nchunks;
+	result->levels = ack.ack.gettree.levels;
+	result->h.sha1_hashes_len = 0;
+	result->h.sha1_hashes_val = NULL;
+	if (ack.status == 0 && ackdata.u.gettree.nodes != NULL) {
+		if (copy_sha1_hashes(&result->h, &ackdata) < 0) {
+			result->status.status = -1;
+			result->status.eno = ENOMEM;
+		}
+	}
+	return retval;
+}
+
 bool_t
 capfs_readlink_1_svc(readlink_args arg1, readlink_resp *result,  struct svc_req *rqstp)
 {
@@ -904,10 +1054,9 @@ capfs_stat_1_svc(stat_args arg1, stat_resp *result,  struct svc_req *rqstp)
 	return retval;
 }
 
-bool_t
-capfs_gethashes_1_svc(gethashes_args arg1, gethashes_resp *result,  struct svc_req *rqstp)
+/* shared by CAPFS_GETHASHES and CAPFS_GETHASHES2, which also returns the version and lease of the range */
+static void gethashes_svc(gethashes_args *arg1, gethashes_resp *result, int64_t *version, int *lease_msecs)
 {
-	bool_t retval = 1;
 	mreq req;
 	mack ack;
 	char *buf_p = NULL;
@@ -919,18 +1068,21 @@ capfs_gethashes_1_svc(gethashes_args arg1, gethashes_resp *result,  struct svc_r
 	memset(&ackdata, 0, sizeof(ackdata));
 	/* FIXME: Need to add credentials to the RPC structure? */
 	init_defaults(&req, MGR_GETHASHES, NULL);
-	buf_p = (char *)arg1.type.hbytype_u.name;
+	buf_p = (char *)arg1->type.hbytype_u.name;
 	req.dsize = strlen(buf_p);
-	req.req.gethashes.begin_chunk = arg1.begin_chunk;
-	req.req.gethashes.nchunks = arg1.nchunks;
+	req.req.gethashes.begin_chunk = arg1->begin_chunk;
+	req.req.gethashes.nchunks = arg1->nchunks;
+	ackdata.u.gethashes.cb_id = arg1->cb_id;
 	err = process_compat_req(&req, &ack, buf_p, &ackdata);
-	/* We need to add callbacks for this file */
-	if (ack.status == 0 && arg1.cb_id >= 0)
+	/* We need to add callbacks for this file, unless it was leased */
+	if (ack.status == 0 && arg1->cb_id >= 0 && !lease_client(arg1->cb_id))
 	{
-		add_callbacks(ack.ack.gethashes.meta.fs_ino, ack.ack.gethashes.meta.u_stat.st_ino, buf_p, arg1.cb_id);
+		add_callbacks(ack.ack.gethashes.meta.fs_ino, ack.ack.gethashes.meta.u_stat.st_ino, buf_p, arg1->cb_id);
 	}
 	init_opstatus(&result->status, &ack);
 	copy_from_fmeta_to_fm(&ack.ack.gethashes.meta, &result->meta);
+	*version = ackdata.u.gethashes.version;
+	*lease_msecs = ackdata.u.gethashes.lease_msecs;
 	result->h.sha1_hashes_len = 0;
 	result->h.sha1_hashes_val = NULL;
 	if (ack.status == 0 && ackdata.u.gethashes.hashes != NULL) {
@@ -939,7 +1091,24 @@ capfs_gethashes_1_svc(gethashes_args arg1, gethashes_resp *result,  struct svc_r
 			result->status.eno = ENOMEM;
 		}
 	}
-	return retval;
+	return;
+}
+
+bool_t
+capfs_gethashes_1_svc(gethashes_args arg1, gethashes_resp *result,  struct svc_req *rqstp)
+{
+	int64_t version;
+	int lease_msecs;
+
+	gethashes_svc(&arg1, result, &version, &lease_msecs);
+	return 1;
+}
+
+bool_t
+capfs_gethashes2_1_svc(gethashes_args arg1, gethashes2_resp *result,  struct svc_req *rqstp)
+{
+	gethashes_svc(&arg1, &result->resp, &result->recipe_version, &result->lease_msecs);
+	return 1;
 }
 
 
@@ -991,11 +1160,14 @@ static void wcommit_dtor(struct ackdata *ackdata)
  * But we don't have any mechanisms for ensuring that all hcache 
  * /updates happen automatically. Consequently, we resort to using
  * hcache invalidates instead of hcache updates for now.
+ *
+ * Shared by CAPFS_WCOMMIT and CAPFS_WCOMMIT2. A non-zero *version is checked
+ * instead of the old hashes, and on return it holds the current version.
+ * *lease_msecs is set to the lease on the new hashes.
  */
-bool_t
-capfs_wcommit_1_svc(wcommit_args arg1, wcommit_resp *result,  struct svc_req *rqstp)
+static void wcommit_svc(wcommit_args *argp, wcommit_resp *result, int64_t *version, int *lease_msecs)
 {
-	bool_t retval = 1;
+	wcommit_args arg1 = *argp;
 	mreq req;
 	mack ack;
 	char *buf_p = NULL;
@@ -1015,13 +1187,15 @@ capfs_wcommit_1_svc(wcommit_args arg1, wcommit_resp *result,  struct svc_req *rq
 	ackdata.u.wcommit.desire_hcache_coherence = arg1.desire_hcache_coherence;
 	ackdata.u.wcommit.owner_cbid = arg1.cb_id;
 	ackdata.u.wcommit.force_commit = arg1.force_wcommit;
+	ackdata.u.wcommit.version = *version;
 
 	result->current_hashes.sha1_hashes_len = 0;
 	result->current_hashes.sha1_hashes_val = NULL;
+	*lease_msecs = 0;
 	if (wcommit_ctor(&arg1, &ackdata) < 0) {
 		result->status.status = -1;
 		result->status.eno = ENOMEM;
-		return retval;
+		return;
 	}
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "[CB %d] Server commit with %d OLD hashes from %Ld\n",
 		arg1.cb_id, arg1.old_hashes.sha1_hashes_len, arg1.begin_chunk);
@@ -1053,6 +1227,8 @@ capfs_wcommit_1_svc(wcommit_args arg1, wcommit_resp *result,  struct svc_req *rq
 	
 	init_opstatus(&result->status, &ack);
 	copy_from_fmeta_to_fm(&ack.ack.wcommit.meta, &result->meta);
+	*version = ackdata.u.wcommit.version;
+	*lease_msecs = ackdata.u.wcommit.lease_msecs;
 	wcommit_dtor(&ackdata);
 
 	if (ackdata.u.wcommit.current_hashes != NULL) {
@@ -1063,8 +1239,26 @@ capfs_wcommit_1_svc(wcommit_args arg1, wcommit_resp *result,  struct svc_req *rq
 	}
 	LOG(stderr, DEBUG_MSG, SUBSYS_META, "Committed writes for file %s for %Ld bytes. file size is now %Ld\n",
 			buf_p, arg1.write_size, result->meta.u_stat.st_size);
+	return;
+}
 
-	return retval;
+bool_t
+capfs_wcommit_1_svc(wcommit_args arg1, wcommit_resp *result,  struct svc_req *rqstp)
+{
+	/* without a version, the old hashes are compared */
+	int64_t version = 0;
+	int lease_msecs;
+
+	wcommit_svc(&arg1, result, &version, &lease_msecs);
+	return 1;
+}
+
+bool_t
+capfs_wcommit2_1_svc(wcommit2_args arg1, wcommit2_resp *result,  struct svc_req *rqstp)
+{
+	result->recipe_version = arg1.recipe_version;
+	wcommit_svc(&arg1.args, &result->resp, &result->recipe_version, &result->lease_msecs);
+	return 1;
 }
 
 int
@@ -0,0 +1,711 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * In-memory cache of the recipes (the <file>.hashes files) of recently used files.
+ *
+ * Every gethashes, open and wcommit used to open, fstat and read or write the
+ * recipe of the file. Instead, the recipe of a file is read in whole the first
+ * time it is needed and is then served from memory, along with an open
+ * descriptor of its .hashes file. What happens to a wcommit's hashes depends on
+ * the mode the cache is started in:
+ *
+ * RECIPE_WRITEBACK: they are only written to memory. The extent of each recipe
+ * that has changed since it was last written is written back by a background
+ * thread every MGR_RECIPE_INTERVAL seconds, at the last close of the file, and
+ * before any chunk reference decrements are sent to the iods (see refs_flush()),
+ * so that a crash can at worst leak chunks and never have a recipe on disk
+ * refer to a chunk that has been released. Commits acknowledged in the last
+ * MGR_RECIPE_INTERVAL seconds may be lost in a crash, and since the new size
+ * of the file is written right away, the file may then end up longer than
+ * its recipe on disk. Hence this has to be asked for.
+ *
+ * RECIPE_WRITETHROUGH (the default): they are written to the .hashes file
+ * before the wcommit is acknowledged, like before.
+ *
+ * RECIPE_SYNC: they are also fdatasync()ed before the wcommit is acknowledged.
+ *
+ * Entries are keyed by the name of the metadata file. Callers must make
+ * the cache forget about a name before the file is unlinked or renamed.
+ * Changes to a recipe are passed on to its hash tree (see mgr_tree.c).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "mgr.h"
+#include "capfs_config.h"
+#include "quicklist.h"
+#include "metaio.h"
+#include "log.h"
+
+struct recipe {
+	struct qlist_head r_hash_link;
+	struct qlist_head r_lru_link;   /* least recently used first */
+	struct qlist_head r_dirty_link; /* on recipe_dirty while it has an extent to write back */
+	char  *r_name;
+	int    r_refs;   /* users of the entry; protected by recipe_mutex */
+	int    r_gone;   /* forgotten; freed by the last user */
+	pthread_mutex_t r_mutex; /* protects everything below */
+	int    r_loaded;
+	int    r_bypass; /* too long to be cached; go to the disk every time */
+	int    r_fd;
+	unsigned char *r_hashes;
+	int64_t r_nchunks, r_alloc;
+	/* extent of the recipe that needs to be written back */
+	int64_t r_dirty_begin, r_dirty_end;
+};
+
+static struct qlist_head recipe_table[MGR_RECIPE_BUCKETS];
+static QLIST_HEAD(recipe_lru);
+static QLIST_HEAD(recipe_dirty);
+static pthread_mutex_t recipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recipe_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t recipe_flusher;
+static int recipe_running = 0, recipe_stop = 0, recipe_mode = RECIPE_WRITETHROUGH;
+static int recipe_count = 0;
+static int64_t recipe_bytes = 0;
+
+static unsigned int recipe_hash(char *name)
+{
+	unsigned int h = 0;
+
+	while (*name) {
+		h = h * 31 + (unsigned char) *name++;
+	}
+	return h % MGR_RECIPE_BUCKETS;
+}
+
+/* must be called with recipe_mutex held, and only on entries nobody is using */
+static void recipe_free(struct recipe *r)
+{
+	if (!r->r_gone) {
+		qlist_del(&r->r_hash_link);
+		qlist_del(&r->r_lru_link);
+		recipe_count--;
+	}
+	if (!qlist_empty(&r->r_dirty_link)) {
+		qlist_del(&r->r_dirty_link);
+	}
+	recipe_bytes -= r->r_alloc * CAPFS_MAXHASHLENGTH;
+	if (r->r_fd >= 0) {
+		close(r->r_fd);
+	}
+	pthread_mutex_destroy(&r->r_mutex);
+	free(r->r_hashes);
+	free(r->r_name);
+	free(r);
+	return;
+}
+
+/*
+ * Drops unused entries that have nothing to write back, least recently used
+ * first, until the cache is within its limits.
+ * must be called with recipe_mutex held
+ */
+static void recipe_evict(void)
+{
+	struct qlist_head *tmp, *scratch;
+
+	qlist_for_each_safe(tmp, scratch, &recipe_lru) {
+		struct recipe *r = qlist_entry(tmp, struct recipe, r_lru_link);
+
+		if (recipe_count <= MGR_RECIPE_FILES && recipe_bytes <= MGR_RECIPE_CACHE_SIZE) {
+			break;
+		}
+		if (r->r_refs == 0 && qlist_empty(&r->r_dirty_link)) {
+			recipe_free(r);
+		}
+	}
+	return;
+}
+
+/* Returns the entry for name, creating it if need be. Must be released with recipe_put() */
+static struct recipe *recipe_get(char *name)
+{
+	struct qlist_head *tmp, *bucket;
+	struct recipe *r;
+
+	bucket = &recipe_table[recipe_hash(name)];
+	pthread_mutex_lock(&recipe_mutex);
+	qlist_for_each(tmp, bucket) {
+		r = qlist_entry(tmp, struct recipe, r_hash_link);
+		if (strcmp(r->r_name, name) == 0) {
+			r->r_refs++;
+			qlist_del(&r->r_lru_link);
+			qlist_add_tail(&r->r_lru_link, &recipe_lru);
+			pthread_mutex_unlock(&recipe_mutex);
+			return r;
+		}
+	}
+	if ((r = (struct recipe *) calloc(1, sizeof(struct recipe))) == NULL
+			|| (r->r_name = strdup(name)) == NULL) {
+		pthread_mutex_unlock(&recipe_mutex);
+		free(r);
+		errno = ENOMEM;
+		return NULL;
+	}
+	r->r_refs = 1;
+	r->r_fd = -1;
+	pthread_mutex_init(&r->r_mutex, NULL);
+	INIT_QLIST_HEAD(&r->r_dirty_link);
+	qlist_add_tail(&r->r_hash_link, bucket);
+	qlist_add_tail(&r->r_lru_link, &recipe_lru);
+	recipe_count++;
+	recipe_evict();
+	pthread_mutex_unlock(&recipe_mutex);
+	return r;
+}
+
+static void recipe_put(struct recipe *r)
+{
+	pthread_mutex_lock(&recipe_mutex);
+	/* entries that could not be read in are not kept around */
+	if (--r->r_refs == 0 && (r->r_gone || !r->r_loaded)) {
+		recipe_free(r);
+	}
+	else {
+		recipe_evict();
+	}
+	pthread_mutex_unlock(&recipe_mutex);
+	return;
+}
+
+/*
+ * Makes room for nchunks hashes in the entry.
+ * must be called with r->r_mutex held
+ */
+static int recipe_grow(struct recipe *r, int64_t nchunks)
+{
+	unsigned char *hashes;
+	int64_t alloc;
+
+	if (nchunks <= r->r_alloc) {
+		return 0;
+	}
+	for (alloc = MAX(r->r_alloc, 64); alloc < nchunks; alloc *= 2)
+		;
+	alloc = MIN(alloc, MGR_RECIPE_MAXCHUNKS);
+	if ((hashes = (unsigned char *) realloc(r->r_hashes, alloc * CAPFS_MAXHASHLENGTH)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(hashes + r->r_alloc * CAPFS_MAXHASHLENGTH, 0, (alloc - r->r_alloc) * CAPFS_MAXHASHLENGTH);
+	pthread_mutex_lock(&recipe_mutex);
+	recipe_bytes += (alloc - r->r_alloc) * CAPFS_MAXHASHLENGTH;
+	pthread_mutex_unlock(&recipe_mutex);
+	r->r_hashes = hashes;
+	r->r_alloc = alloc;
+	return 0;
+}
+
+/*
+ * Reads in the whole recipe the first time the entry is used.
+ * must be called with r->r_mutex held
+ */
+static int recipe_load(struct recipe *r)
+{
+	char hashpath[MAXPATHLEN];
+	struct stat sbuf;
+	int64_t nchunks;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (r->r_loaded) {
+		return 0;
+	}
+	snprintf(hashpath, MAXPATHLEN, "%s.hashes", r->r_name);
+	if ((r->r_fd = open(hashpath, O_RDWR)) < 0) {
+		int err = errno;
+
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "recipe_load: hash file for %s has not yet been created?\n", r->r_name);
+		errno = err;
+		return -1;
+	}
+	if (fstat(r->r_fd, &sbuf) < 0 || sbuf.st_size % CAPFS_MAXHASHLENGTH != 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "recipe_load: corrupted hash file %s's size is %Ld not a multiple of %d\n",
+				hashpath, (int64_t) sbuf.st_size, CAPFS_MAXHASHLENGTH);
+		close(r->r_fd);
+		r->r_fd = -1;
+		errno = EINVAL;
+		return -1;
+	}
+	nchunks = sbuf.st_size / CAPFS_MAXHASHLENGTH;
+	if (nchunks > MGR_RECIPE_MAXCHUNKS) {
+		close(r->r_fd);
+		r->r_fd = -1;
+		r->r_bypass = 1;
+		r->r_loaded = 1;
+		return 0;
+	}
+	if (recipe_grow(r, nchunks) < 0) {
+		close(r->r_fd);
+		r->r_fd = -1;
+		return -1;
+	}
+	while (done < sbuf.st_size) {
+		if ((ret = pread(r->r_fd, r->r_hashes + done, sbuf.st_size - done, done)) <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			/* somebody else cut it short; take what we got */
+			break;
+		}
+		done += ret;
+	}
+	r->r_nchunks = done / CAPFS_MAXHASHLENGTH;
+	r->r_loaded = 1;
+	return 0;
+}
+
+/*
+ * Writes out the extent of the recipe that has changed since it was last written.
+ * must be called with r->r_mutex held
+ */
+static int recipe_flush(struct recipe *r)
+{
+	int64_t off, end;
+	ssize_t ret;
+
+	if (r->r_dirty_begin >= r->r_dirty_end) {
+		return 0;
+	}
+	off = r->r_dirty_begin * CAPFS_MAXHASHLENGTH;
+	end = r->r_dirty_end * CAPFS_MAXHASHLENGTH;
+	while (off < end) {
+		if ((ret = pwrite(r->r_fd, r->r_hashes + off, end - off, off)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			r->r_dirty_begin = off / CAPFS_MAXHASHLENGTH;
+			LOG(stderr, WARNING_MSG, SUBSYS_META, "recipe: could not write back the recipe of %s: %s\n",
+					r->r_name, strerror(errno));
+			return -1;
+		}
+		off += ret;
+	}
+	if (recipe_mode == RECIPE_SYNC) {
+		fdatasync(r->r_fd);
+	}
+	r->r_dirty_begin = r->r_dirty_end = 0;
+	return 0;
+}
+
+/*
+ * Writes back every recipe with something to write back.
+ * Returns 0 on success, -1 if any of them could not be written.
+ */
+int recipe_sync(void)
+{
+	QLIST_HEAD(todo);
+	struct recipe *r;
+	int ret = 0;
+
+	pthread_mutex_lock(&recipe_mutex);
+	qlist_splice(&recipe_dirty, &todo);
+	INIT_QLIST_HEAD(&recipe_dirty);
+	while (!qlist_empty(&todo)) {
+		r = qlist_entry(todo.next, struct recipe, r_dirty_link);
+		qlist_del_init(&r->r_dirty_link);
+		r->r_refs++;
+		pthread_mutex_unlock(&recipe_mutex);
+
+		pthread_mutex_lock(&r->r_mutex);
+		if (recipe_flush(r) < 0) {
+			ret = -1;
+			pthread_mutex_lock(&recipe_mutex);
+			if (qlist_empty(&r->r_dirty_link)) {
+				qlist_add_tail(&r->r_dirty_link, &recipe_dirty);
+			}
+			pthread_mutex_unlock(&recipe_mutex);
+		}
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+
+		pthread_mutex_lock(&recipe_mutex);
+	}
+	pthread_mutex_unlock(&recipe_mutex);
+	return ret;
+}
+
+static void *recipe_flusher_thread(void *args)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	pthread_mutex_lock(&recipe_mutex);
+	while (!recipe_stop) {
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + MGR_RECIPE_INTERVAL;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		pthread_cond_timedwait(&recipe_cond, &recipe_mutex, &ts);
+		pthread_mutex_unlock(&recipe_mutex);
+		recipe_sync();
+		pthread_mutex_lock(&recipe_mutex);
+	}
+	pthread_mutex_unlock(&recipe_mutex);
+	return NULL;
+}
+
+int recipe_init(int mode)
+{
+	int i, ret;
+
+	for (i = 0; i < MGR_RECIPE_BUCKETS; i++) {
+		INIT_QLIST_HEAD(&recipe_table[i]);
+	}
+	recipe_mode = mode;
+	recipe_stop = 0;
+	if (recipe_mode != RECIPE_WRITEBACK) {
+		return 0;
+	}
+	if ((ret = pthread_create(&recipe_flusher, NULL, recipe_flusher_thread, NULL)) != 0) {
+		errno = ret;
+		PERROR(SUBSYS_META, "recipe_init: pthread_create");
+		return -1;
+	}
+	recipe_running = 1;
+	return 0;
+}
+
+void recipe_finalize(void)
+{
+	if (recipe_running) {
+		pthread_mutex_lock(&recipe_mutex);
+		recipe_stop = 1;
+		pthread_cond_signal(&recipe_cond);
+		pthread_mutex_unlock(&recipe_mutex);
+		pthread_join(recipe_flusher, NULL);
+		recipe_running = 0;
+	}
+	recipe_sync();
+	pthread_mutex_lock(&recipe_mutex);
+	while (!qlist_empty(&recipe_lru)) {
+		recipe_free(qlist_entry(recipe_lru.next, struct recipe, r_lru_link));
+	}
+	pthread_mutex_unlock(&recipe_mutex);
+	tree_finalize();
+	return;
+}
+
+/*
+ * Same as meta_hash_read(). Returns the nchunks hashes of the recipe
+ * starting at begin_chunk (all of them if begin_chunk < 0) in a buffer
+ * allocated in *phashes, and the number of hashes that were found in *nchunks.
+ * Returns 0 on success, -1 on failure with *nchunks set to -errno.
+ */
+int recipe_read(char *name, int64_t begin_chunk, int64_t *nchunks, unsigned char **phashes)
+{
+	struct recipe *r;
+	int64_t count;
+	size_t req_size;
+
+	if ((r = recipe_get(name)) == NULL) {
+		*nchunks = -errno;
+		return -1;
+	}
+	pthread_mutex_lock(&r->r_mutex);
+	if (recipe_load(r) < 0) {
+		*nchunks = -errno;
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		return -1;
+	}
+	if (r->r_bypass) {
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		return meta_hash_read(name, begin_chunk, nchunks, phashes);
+	}
+	if (begin_chunk < 0) {
+		begin_chunk = 0;
+		req_size = r->r_nchunks * CAPFS_MAXHASHLENGTH;
+	}
+	else {
+		req_size = (*nchunks) * CAPFS_MAXHASHLENGTH;
+	}
+	if ((*phashes = (unsigned char *) calloc(1, req_size)) == NULL) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "could not allocate memory\n");
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		*nchunks = -ENOMEM;
+		return -1;
+	}
+	count = MIN((int64_t) (req_size / CAPFS_MAXHASHLENGTH), MAX(r->r_nchunks - begin_chunk, 0));
+	memcpy(*phashes, r->r_hashes + begin_chunk * CAPFS_MAXHASHLENGTH, count * CAPFS_MAXHASHLENGTH);
+	*nchunks = count;
+	pthread_mutex_unlock(&r->r_mutex);
+	recipe_put(r);
+	return 0;
+}
+
+/*
+ * Same as meta_hash_write(). Replaces the nchunks hashes of the recipe
+ * starting at begin_chunk with the ones in phashes.
+ * Returns 0 on success, -1 on failure (with errno set), in which case the recipe is unchanged.
+ */
+int recipe_write(char *name, int64_t begin_chunk, int64_t nchunks, unsigned char **phashes)
+{
+	struct recipe *r;
+	int64_t i, end;
+
+	if (begin_chunk < 0 || nchunks <= 0) {
+		errno = EINVAL;
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "recipe_write: invalid value of begin_chunk %Ld, nchunks: %Ld\n",
+				begin_chunk, nchunks);
+		return -1;
+	}
+	if ((r = recipe_get(name)) == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&r->r_mutex);
+	if (recipe_load(r) < 0) {
+		goto err;
+	}
+	end = begin_chunk + nchunks;
+	if (!r->r_bypass && end > MGR_RECIPE_MAXCHUNKS) {
+		/* it has outgrown the cache; write back what we have and stop caching it */
+		if (recipe_flush(r) < 0) {
+			goto err;
+		}
+		pthread_mutex_lock(&recipe_mutex);
+		if (!qlist_empty(&r->r_dirty_link)) {
+			qlist_del_init(&r->r_dirty_link);
+		}
+		recipe_bytes -= r->r_alloc * CAPFS_MAXHASHLENGTH;
+		pthread_mutex_unlock(&recipe_mutex);
+		free(r->r_hashes);
+		r->r_hashes = NULL;
+		r->r_nchunks = r->r_alloc = 0;
+		close(r->r_fd);
+		r->r_fd = -1;
+		r->r_bypass = 1;
+	}
+	if (r->r_bypass) {
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		if (meta_hash_write(name, begin_chunk, nchunks, phashes) < 0) {
+			return -1;
+		}
+		tree_update(name, begin_chunk, nchunks);
+		return 0;
+	}
+	if (recipe_grow(r, end) < 0) {
+		goto err;
+	}
+	if (recipe_mode != RECIPE_WRITEBACK) {
+		if (meta_hash_pwrite(r->r_fd, begin_chunk, nchunks, phashes) < 0
+				|| (recipe_mode == RECIPE_SYNC && fdatasync(r->r_fd) < 0)) {
+			LOG(stderr, CRITICAL_MSG, SUBSYS_META, "recipe_write: could not write the recipe of %s: %s\n",
+					name, strerror(errno));
+			goto err;
+		}
+	}
+	for (i = 0; i < nchunks; i++) {
+		memcpy(r->r_hashes + (begin_chunk + i) * CAPFS_MAXHASHLENGTH, phashes[i], CAPFS_MAXHASHLENGTH);
+	}
+	r->r_nchunks = MAX(r->r_nchunks, end);
+	if (recipe_mode == RECIPE_WRITEBACK) {
+		if (r->r_dirty_begin >= r->r_dirty_end) {
+			r->r_dirty_begin = begin_chunk;
+			r->r_dirty_end = end;
+			pthread_mutex_lock(&recipe_mutex);
+			if (qlist_empty(&r->r_dirty_link)) {
+				qlist_add_tail(&r->r_dirty_link, &recipe_dirty);
+			}
+			pthread_mutex_unlock(&recipe_mutex);
+		}
+		else {
+			r->r_dirty_begin = MIN(r->r_dirty_begin, begin_chunk);
+			r->r_dirty_end = MAX(r->r_dirty_end, end);
+		}
+		/* forgotten while we were at it (by a rename); nobody else is going to write it back */
+		if (r->r_gone) {
+			recipe_flush(r);
+		}
+	}
+	pthread_mutex_unlock(&r->r_mutex);
+	recipe_put(r);
+	tree_update(name, begin_chunk, nchunks);
+	return 0;
+err:
+	pthread_mutex_unlock(&r->r_mutex);
+	recipe_put(r);
+	return -1;
+}
+
+/* Same as meta_hash_truncate(). The .hashes file is truncated right away */
+int recipe_truncate(char *name, int64_t new_nchunks)
+{
+	struct recipe *r;
+	int bypass;
+
+	if ((r = recipe_get(name)) == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&r->r_mutex);
+	if (recipe_load(r) < 0) {
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		return -1;
+	}
+	bypass = r->r_bypass;
+	if (bypass || new_nchunks > MGR_RECIPE_MAXCHUNKS) {
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		if (!bypass) {
+			/* would outgrow the cache; drop it from the cache first */
+			recipe_forget(name, 1);
+		}
+		if (meta_hash_truncate(name, new_nchunks) < 0) {
+			return -1;
+		}
+		tree_truncate(name, new_nchunks);
+		return 0;
+	}
+	if (recipe_grow(r, new_nchunks) < 0 || ftruncate(r->r_fd, new_nchunks * CAPFS_MAXHASHLENGTH) < 0) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "recipe_truncate: could not truncate file for %s to nchunks %Ld\n",
+				name, new_nchunks);
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		return -1;
+	}
+	if (new_nchunks < r->r_nchunks) {
+		memset(r->r_hashes + new_nchunks * CAPFS_MAXHASHLENGTH, 0, (r->r_nchunks - new_nchunks) * CAPFS_MAXHASHLENGTH);
+		r->r_dirty_end = MIN(r->r_dirty_end, new_nchunks);
+	}
+	r->r_nchunks = new_nchunks;
+	pthread_mutex_unlock(&r->r_mutex);
+	recipe_put(r);
+	tree_truncate(name, new_nchunks);
+	return 0;
+}
+
+/* Returns the number of hashes in the recipe of name, or -1 with errno set */
+int64_t recipe_length(char *name)
+{
+	char hashpath[MAXPATHLEN];
+	struct recipe *r;
+	struct stat sbuf;
+	int64_t nchunks;
+
+	if ((r = recipe_get(name)) == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&r->r_mutex);
+	if (recipe_load(r) < 0) {
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		return -1;
+	}
+	if (!r->r_bypass) {
+		nchunks = r->r_nchunks;
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		return nchunks;
+	}
+	pthread_mutex_unlock(&r->r_mutex);
+	recipe_put(r);
+	snprintf(hashpath, MAXPATHLEN, "%s.hashes", name);
+	if (stat(hashpath, &sbuf) < 0) {
+		return -1;
+	}
+	return sbuf.st_size / CAPFS_MAXHASHLENGTH;
+}
+
+/* Writes back the recipe of a file that is no longer open */
+void recipe_close(char *name)
+{
+	struct qlist_head *tmp;
+	struct recipe *r = NULL;
+
+	pthread_mutex_lock(&recipe_mutex);
+	qlist_for_each(tmp, &recipe_table[recipe_hash(name)]) {
+		struct recipe *e = qlist_entry(tmp, struct recipe, r_hash_link);
+
+		if (strcmp(e->r_name, name) == 0) {
+			if (!qlist_empty(&e->r_dirty_link)) {
+				qlist_del_init(&e->r_dirty_link);
+				e->r_refs++;
+				r = e;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&recipe_mutex);
+	if (r == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&r->r_mutex);
+	if (recipe_flush(r) < 0) {
+		pthread_mutex_lock(&recipe_mutex);
+		if (qlist_empty(&r->r_dirty_link)) {
+			qlist_add_tail(&r->r_dirty_link, &recipe_dirty);
+		}
+		pthread_mutex_unlock(&recipe_mutex);
+	}
+	pthread_mutex_unlock(&r->r_mutex);
+	recipe_put(r);
+	return;
+}
+
+/*
+ * Drops the entries of name and of everything underneath it (if it is a directory),
+ * writing back what they have to write back first if flush is set.
+ * To be called before the files are renamed or unlinked.
+ */
+void recipe_forget(char *name, int flush)
+{
+	QLIST_HEAD(gone);
+	struct qlist_head *tmp, *scratch;
+	size_t len = strlen(name);
+	struct recipe *r;
+
+	pthread_mutex_lock(&recipe_mutex);
+	qlist_for_each_safe(tmp, scratch, &recipe_lru) {
+		r = qlist_entry(tmp, struct recipe, r_lru_link);
+		if (strncmp(r->r_name, name, len) != 0 || (r->r_name[len] != '\0' && r->r_name[len] != '/')) {
+			continue;
+		}
+		/* nobody can find it from now on */
+		qlist_del(&r->r_hash_link);
+		qlist_del(&r->r_lru_link);
+		recipe_count--;
+		r->r_gone = 1;
+		r->r_refs++;
+		if (!qlist_empty(&r->r_dirty_link)) {
+			qlist_del(&r->r_dirty_link);
+		}
+		qlist_add_tail(&r->r_dirty_link, &gone);
+	}
+	while (!qlist_empty(&gone)) {
+		r = qlist_entry(gone.next, struct recipe, r_dirty_link);
+		qlist_del_init(&r->r_dirty_link);
+		pthread_mutex_unlock(&recipe_mutex);
+		pthread_mutex_lock(&r->r_mutex);
+		if (flush && r->r_loaded && !r->r_bypass) {
+			recipe_flush(r);
+		}
+		pthread_mutex_unlock(&r->r_mutex);
+		recipe_put(r);
+		pthread_mutex_lock(&recipe_mutex);
+	}
+	pthread_mutex_unlock(&recipe_mutex);
+	tree_forget(name);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
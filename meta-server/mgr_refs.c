@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Keeps the iods' chunk reference counts in step with the recipes.
+ *
+ * Whenever a recipe starts referring to a chunk, the iod that stores it is
+ * told to increment its count before the recipe is written, and the write
+ * fails if that does not go through. Losing an increment could get a chunk
+ * that is still in use reclaimed, whereas losing a decrement only leaks
+ * the space of a chunk. So decrements (for chunks that were overwritten,
+ * truncated away or unlinked) are queued instead, and sent to each iod in
+ * batches by a background thread, once MGR_REFS_BATCH of them have piled
+ * up or every MGR_REFS_INTERVAL seconds. Batches for an iod that cannot
+ * be reached are retried, but no more than MGR_REFS_BACKLOG of them are kept.
+ * Before a round of decrements is sent, the recipe cache is told to write back
+ * the recipes they were dropped from, so that a recipe on disk never refers
+ * to a chunk that may have been reclaimed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "mgr.h"
+#include "capfs_config.h"
+#include "quicklist.h"
+#include "log.h"
+#include "cas.h"
+#include "place.h"
+
+struct refs_batch {
+	struct qlist_head rb_link;
+	int rb_count;
+	unsigned char rb_hashes[MGR_REFS_BATCH * CAPFS_MAXHASHLENGTH];
+	int rb_deltas[MGR_REFS_BATCH];
+};
+
+/* decrements waiting to be sent to an iod */
+struct refs_queue {
+	struct qlist_head rq_link;
+	struct sockaddr_in rq_addr;
+	struct qlist_head rq_batches; /* oldest first */
+	int rq_nbatches;
+	struct qlist_head rq_sending; /* taken off rq_batches by refs_flush() */
+};
+
+static QLIST_HEAD(refs_queues);
+static pthread_mutex_t refs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refs_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t refs_sender;
+static int refs_running = 0, refs_stop = 0, refs_full = 0;
+
+static int refs_sparse(unsigned char *hash)
+{
+	int i;
+
+	for (i = 0; i < CAPFS_MAXHASHLENGTH; i++) {
+		if (hash[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Returns the address of the iod that stores the chunk of the file.
+ * This must agree with the way the clients place chunks (see map_chunk()).
+ */
+static struct sockaddr_in *refs_iod(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t chunk, unsigned char *hash)
+{
+	int base, j;
+
+	if (p_stat->pcount <= 0 || p_stat->ssize <= 0 || fs_p->nr_iods <= 0) {
+		return NULL;
+	}
+	base = (p_stat->base < 0) ? 0 : p_stat->base;
+	if (p_stat->placement == CAPFS_PLACE_HASH) {
+		j = place_chunk(hash, fs_p->iod, base, MIN(p_stat->pcount, fs_p->nr_iods), fs_p->nr_iods);
+	}
+	else if (p_stat->pcount == 1) {
+		j = 0;
+	}
+	else {
+		j = (base + (chunk * CAPFS_CHUNK_SIZE) / p_stat->ssize) % p_stat->pcount;
+	}
+	/* the file's j-th iod, as handed out by send_open_ack() */
+	return &fs_p->iod[(base + j) % fs_p->nr_iods].addr;
+}
+
+/* must be called with refs_mutex held */
+static struct refs_queue *refs_lookup(struct sockaddr_in *addr)
+{
+	struct qlist_head *tmp;
+	struct refs_queue *rq;
+
+	qlist_for_each(tmp, &refs_queues) {
+		rq = qlist_entry(tmp, struct refs_queue, rq_link);
+		if (rq->rq_addr.sin_addr.s_addr == addr->sin_addr.s_addr
+				&& rq->rq_addr.sin_port == addr->sin_port) {
+			return rq;
+		}
+	}
+	if ((rq = (struct refs_queue *) calloc(1, sizeof(struct refs_queue))) == NULL) {
+		return NULL;
+	}
+	rq->rq_addr = *addr;
+	INIT_QLIST_HEAD(&rq->rq_batches);
+	INIT_QLIST_HEAD(&rq->rq_sending);
+	qlist_add_tail(&rq->rq_link, &refs_queues);
+	return rq;
+}
+
+/* Queues a decrement for the chunk on the iod at addr */
+static void refs_queue_put(struct sockaddr_in *addr, unsigned char *hash)
+{
+	struct refs_queue *rq;
+	struct refs_batch *rb = NULL;
+
+	pthread_mutex_lock(&refs_mutex);
+	if ((rq = refs_lookup(addr)) == NULL) {
+		pthread_mutex_unlock(&refs_mutex);
+		LOG(stderr, WARNING_MSG, SUBSYS_META, "refs: could not allocate memory, leaking a chunk\n");
+		return;
+	}
+	if (!qlist_empty(&rq->rq_batches)) {
+		rb = qlist_entry(rq->rq_batches.prev, struct refs_batch, rb_link);
+	}
+	if (rb == NULL || rb->rb_count == MGR_REFS_BATCH) {
+		if (rq->rq_nbatches >= MGR_REFS_BACKLOG) {
+			/* the iod has been unreachable for a while; give up on the oldest batch */
+			rb = qlist_entry(rq->rq_batches.next, struct refs_batch, rb_link);
+			qlist_del(&rb->rb_link);
+			rq->rq_nbatches--;
+			LOG(stderr, WARNING_MSG, SUBSYS_META, "refs: dropping %d reference updates for iod %s:%d\n",
+					rb->rb_count, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+			rb->rb_count = 0;
+		}
+		else if ((rb = (struct refs_batch *) malloc(sizeof(struct refs_batch))) == NULL) {
+			pthread_mutex_unlock(&refs_mutex);
+			LOG(stderr, WARNING_MSG, SUBSYS_META, "refs: could not allocate memory, leaking a chunk\n");
+			return;
+		}
+		else {
+			rb->rb_count = 0;
+		}
+		qlist_add_tail(&rb->rb_link, &rq->rq_batches);
+		rq->rq_nbatches++;
+	}
+	memcpy(rb->rb_hashes + rb->rb_count * CAPFS_MAXHASHLENGTH, hash, CAPFS_MAXHASHLENGTH);
+	rb->rb_deltas[rb->rb_count++] = -1;
+	if (rb->rb_count == MGR_REFS_BATCH) {
+		refs_full = 1;
+		pthread_cond_signal(&refs_cond);
+	}
+	pthread_mutex_unlock(&refs_mutex);
+	return;
+}
+
+/*
+ * Sends all queued batches. Stops at the first batch an iod fails to
+ * take, so that it and the ones after it are retried the next time around.
+ * Nothing is sent if the recipes could not all be written back first.
+ * must be called with refs_mutex held
+ */
+static void refs_flush(void)
+{
+	struct qlist_head *tmp;
+	int failed;
+
+	/* new decrements go to fresh batches while we are sending these */
+	qlist_for_each(tmp, &refs_queues) {
+		struct refs_queue *rq = qlist_entry(tmp, struct refs_queue, rq_link);
+
+		qlist_splice(&rq->rq_batches, &rq->rq_sending);
+		INIT_QLIST_HEAD(&rq->rq_batches);
+		rq->rq_nbatches = 0;
+	}
+	pthread_mutex_unlock(&refs_mutex);
+	/* a recipe on disk may still refer to the chunks being released */
+	if ((failed = (recipe_sync() < 0)) != 0) {
+		LOG(stderr, WARNING_MSG, SUBSYS_META, "refs: holding back reference updates until the recipes are written\n");
+	}
+	pthread_mutex_lock(&refs_mutex);
+	qlist_for_each(tmp, &refs_queues) {
+		struct refs_queue *rq = qlist_entry(tmp, struct refs_queue, rq_link);
+
+		while (!failed && !qlist_empty(&rq->rq_sending)) {
+			struct refs_batch *rb = qlist_entry(rq->rq_sending.next, struct refs_batch, rb_link);
+			int ret;
+
+			qlist_del(&rb->rb_link);
+			pthread_mutex_unlock(&refs_mutex);
+			ret = clnt_refs(1, (struct sockaddr *) &rq->rq_addr, rb->rb_hashes, rb->rb_deltas, rb->rb_count);
+			pthread_mutex_lock(&refs_mutex);
+			if (ret < 0) {
+				LOG(stderr, WARNING_MSG, SUBSYS_META, "refs: could not send %d reference updates to iod %s:%d: %s\n",
+						rb->rb_count, inet_ntoa(rq->rq_addr.sin_addr), ntohs(rq->rq_addr.sin_port), strerror(errno));
+				qlist_add(&rb->rb_link, &rq->rq_sending);
+				break;
+			}
+			free(rb);
+		}
+		/* put back what is left ahead of the newer batches */
+		while (!qlist_empty(&rq->rq_sending)) {
+			struct refs_batch *rb = qlist_entry(rq->rq_sending.prev, struct refs_batch, rb_link);
+
+			qlist_del(&rb->rb_link);
+			qlist_add(&rb->rb_link, &rq->rq_batches);
+			rq->rq_nbatches++;
+		}
+	}
+	return;
+}
+
+static void *refs_sender_thread(void *args)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	pthread_mutex_lock(&refs_mutex);
+	while (!refs_stop) {
+		if (!refs_full) {
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec + MGR_REFS_INTERVAL;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&refs_cond, &refs_mutex, &ts);
+		}
+		refs_full = 0;
+		refs_flush();
+	}
+	/* one last time on the way out */
+	refs_flush();
+	pthread_mutex_unlock(&refs_mutex);
+	return NULL;
+}
+
+int refs_init(void)
+{
+	int ret;
+
+	refs_stop = 0;
+	if ((ret = pthread_create(&refs_sender, NULL, refs_sender_thread, NULL)) != 0) {
+		errno = ret;
+		PERROR(SUBSYS_META, "refs_init: pthread_create");
+		return -1;
+	}
+	refs_running = 1;
+	return 0;
+}
+
+void refs_finalize(void)
+{
+	if (!refs_running) {
+		return;
+	}
+	pthread_mutex_lock(&refs_mutex);
+	refs_stop = 1;
+	pthread_cond_signal(&refs_cond);
+	pthread_mutex_unlock(&refs_mutex);
+	pthread_join(refs_sender, NULL);
+	refs_running = 0;
+	while (!qlist_empty(&refs_queues)) {
+		struct refs_queue *rq = qlist_entry(refs_queues.next, struct refs_queue, rq_link);
+
+		while (!qlist_empty(&rq->rq_batches)) {
+			struct refs_batch *rb = qlist_entry(rq->rq_batches.next, struct refs_batch, rb_link);
+			qlist_del(&rb->rb_link);
+			free(rb);
+		}
+		qlist_del(&rq->rq_link);
+		free(rq);
+	}
+	return;
+}
+
+/*
+ * A wcommit is about to replace the nchunks hashes of the file starting
+ * at begin_chunk with new_hashes. The first ncur of the hashes it replaces
+ * are in cur_hashes. Increments the counts of the chunks that are new to
+ * these positions, and does not return until the iods have recorded that.
+ * Returns 0 on success, -1 on failure (with errno set), in which case
+ * the wcommit must fail and none, some or all of the increments may have been made.
+ */
+int refs_get_commit(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t begin_chunk, int64_t nchunks,
+		unsigned char **new_hashes, unsigned char *cur_hashes, int64_t ncur)
+{
+	struct sockaddr_in *addrs[CAPFS_MAXIODS], *addr;
+	unsigned char *hashes;
+	int *deltas, k, niods = 0, err = 0;
+	int64_t j, n, sent;
+
+	if (nchunks <= 0) {
+		return 0;
+	}
+	hashes = (unsigned char *) malloc(nchunks * CAPFS_MAXHASHLENGTH);
+	deltas = (int *) malloc(nchunks * sizeof(int));
+	if (hashes == NULL || deltas == NULL) {
+		free(hashes);
+		free(deltas);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (j = 0; j < nchunks; j++) {
+		deltas[j] = 1;
+	}
+	/* find the iods involved */
+	for (j = 0; j < nchunks; j++) {
+		if ((addr = refs_iod(fs_p, p_stat, begin_chunk + j, new_hashes[j])) == NULL) {
+			continue;
+		}
+		for (k = 0; k < niods && addrs[k] != addr; k++)
+			;
+		if (k == niods) {
+			addrs[niods++] = addr;
+		}
+	}
+	/* and send each of them the increments for its chunks */
+	for (k = 0; k < niods && err == 0; k++) {
+		for (j = 0, n = 0; j < nchunks; j++) {
+			if (refs_sparse(new_hashes[j])
+					|| (j < ncur && memcmp(new_hashes[j], cur_hashes + j * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH) == 0)
+					|| refs_iod(fs_p, p_stat, begin_chunk + j, new_hashes[j]) != addrs[k]) {
+				continue;
+			}
+			memcpy(hashes + n * CAPFS_MAXHASHLENGTH, new_hashes[j], CAPFS_MAXHASHLENGTH);
+			n++;
+		}
+		for (sent = 0; sent < n; sent += CAPFS_MAXHASHES) {
+			int count = MIN(n - sent, CAPFS_MAXHASHES);
+
+			if (clnt_refs(1, (struct sockaddr *) addrs[k], hashes + sent * CAPFS_MAXHASHLENGTH, deltas, count) < 0) {
+				err = errno;
+				LOG(stderr, CRITICAL_MSG, SUBSYS_META, "refs: could not send %d reference increments to iod %s:%d: %s\n",
+						count, inet_ntoa(addrs[k]->sin_addr), ntohs(addrs[k]->sin_port), strerror(err));
+				break;
+			}
+		}
+	}
+	free(hashes);
+	free(deltas);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Counterpart of refs_get_commit(). If the wcommit went through (committed != 0),
+ * queues decrements for the replaced hashes in cur_hashes, else for the new_hashes
+ * whose counts refs_get_commit() may have incremented.
+ */
+void refs_put_commit(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t begin_chunk, int64_t nchunks,
+		unsigned char **new_hashes, unsigned char *cur_hashes, int64_t ncur, int committed)
+{
+	struct sockaddr_in *addr;
+	unsigned char *hash;
+	int64_t j;
+
+	for (j = 0; j < nchunks; j++) {
+		if (j < ncur && memcmp(new_hashes[j], cur_hashes + j * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH) == 0) {
+			continue;
+		}
+		if (committed) {
+			if (j >= ncur) {
+				break;
+			}
+			hash = cur_hashes + j * CAPFS_MAXHASHLENGTH;
+		}
+		else {
+			hash = new_hashes[j];
+		}
+		if (refs_sparse(hash) || (addr = refs_iod(fs_p, p_stat, begin_chunk + j, hash)) == NULL) {
+			continue;
+		}
+		refs_queue_put(addr, hash);
+	}
+	return;
+}
+
+/*
+ * Queues decrements for the nchunks hashes of the file starting at begin_chunk
+ * that were truncated away or unlinked.
+ */
+void refs_put_range(fsinfo_p fs_p, capfs_filestat *p_stat, int64_t begin_chunk, int64_t nchunks,
+		unsigned char *hashes)
+{
+	struct sockaddr_in *addr;
+	int64_t j;
+
+	for (j = 0; j < nchunks; j++) {
+		unsigned char *hash = hashes + j * CAPFS_MAXHASHLENGTH;
+
+		if (refs_sparse(hash) || (addr = refs_iod(fs_p, p_stat, begin_chunk + j, hash)) == NULL) {
+			continue;
+		}
+		refs_queue_put(addr, hash);
+	}
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
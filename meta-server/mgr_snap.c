@@ -0,0 +1,503 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Read-only point-in-time snapshots of directory trees.
+ *
+ * A snapshot of <dir> named <name> lives in <dir>/.snapshot/<name>, and
+ * is a copy of the metadata tree under <dir> made on the meta-server alone.
+ * Directories and symbolic links are copied, and every file gets a metadata
+ * file of its own whose recipe is a hard link to the recipe of the live file.
+ * No data is read or written, and no chunk references change: as long as a
+ * recipe has more than one link, the chunks it refers to are referenced once
+ * on behalf of all of its names.
+ *
+ * A recipe that has other links is never written to. Before the first
+ * wcommit or truncate of a live file after a snapshot, snap_unshare() gives
+ * the file a private copy of its recipe and references its chunks again on
+ * the iods, after which the snapshot is the sole owner of the old recipe.
+ * When the last name of a recipe goes away, its chunks are released.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "mgr.h"
+#include "capfs_config.h"
+#include "metaio.h"
+#include "log.h"
+
+extern int resv_name(char *);
+extern int md_mkdir(char *dirpath, dmeta_p dir);
+extern int get_dmeta(char * fname, dmeta_p dir);
+
+/* snapshots are taken and dropped one at a time */
+static pthread_mutex_t snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* links to recipes are counted, made and dropped under share_mutex */
+static pthread_mutex_t share_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Held by whoever decides from the link count of a recipe whether its
+ * chunks are to be released, until the link it drops is gone.
+ */
+void snap_share_lock(void)
+{
+	pthread_mutex_lock(&share_mutex);
+}
+
+void snap_share_unlock(void)
+{
+	pthread_mutex_unlock(&share_mutex);
+}
+
+/* Returns 1 if the name lies within a snapshot (or is a .snapshot directory), 0 otherwise */
+int snap_path(char *name)
+{
+	char *c_p = name;
+	int len = strlen(SNAP_DIR);
+
+	while (c_p != NULL && *c_p != '\0') {
+		while (*c_p == '/') {
+			c_p++;
+		}
+		if (!strncmp(c_p, SNAP_DIR, len) && (c_p[len] == '/' || c_p[len] == '\0')) {
+			return 1;
+		}
+		c_p = strchr(c_p, '/');
+	}
+	return 0;
+}
+
+/* Returns 1 if the recipe of the file is shared with a snapshot, 0 otherwise */
+int snap_shared(char *name)
+{
+	char hashpath[MAXPATHLEN];
+	struct stat sbuf;
+
+	snprintf(hashpath, MAXPATHLEN, "%s.hashes", name);
+	if (stat(hashpath, &sbuf) < 0) {
+		return 0;
+	}
+	return (sbuf.st_nlink > 1);
+}
+
+/*
+ * Gives the file a private copy of its recipe if it shares it with a snapshot,
+ * and references the chunks of the copy on the iods. Must be called before
+ * the recipe is written to, with the range being written locked.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int snap_unshare(fsinfo_p fs_p, finfo_p f_p, char *name, capfs_filestat *p_stat)
+{
+	char hashpath[MAXPATHLEN], tmppath[MAXPATHLEN];
+	int fd, err = 0;
+	int64_t j, nhashes = 0;
+	unsigned char *hashes = NULL, **phashes = NULL;
+
+	if (!snap_shared(name)) {
+		return 0;
+	}
+	/* commits to other ranges may be trying to do the same */
+	f_meta_lock(f_p);
+	if (!snap_shared(name)) {
+		f_meta_unlock(f_p);
+		return 0;
+	}
+	snprintf(hashpath, MAXPATHLEN, "%s.hashes", name);
+	/* the recipe of "x.hashes" is a name that no file can have */
+	snprintf(tmppath, MAXPATHLEN, "%s.hashes.hashes", name);
+	/* nothing is ever written to a shared recipe, so the cache has nothing to write back */
+	recipe_forget(name, 0);
+	if (meta_hash_read(name, -1, &nhashes, &hashes) < 0) {
+		err = errno;
+		goto out;
+	}
+	if ((fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU | S_IRGRP | S_IROTH)) < 0) {
+		err = errno;
+		goto out;
+	}
+	if (nhashes > 0) {
+		if ((phashes = (unsigned char **) malloc(nhashes * sizeof(unsigned char *))) == NULL) {
+			err = ENOMEM;
+			goto unlink_tmp;
+		}
+		for (j = 0; j < nhashes; j++) {
+			phashes[j] = hashes + j * CAPFS_MAXHASHLENGTH;
+		}
+		if (meta_hash_pwrite(fd, 0, nhashes, phashes) < 0 || fdatasync(fd) < 0) {
+			err = errno;
+			goto unlink_tmp;
+		}
+		/* as in do_wcommit(), increments that did go through are leaked if this fails */
+		if (refs_get_commit(fs_p, p_stat, 0, nhashes, phashes, NULL, 0) < 0) {
+			err = EIO;
+			goto unlink_tmp;
+		}
+	}
+	close(fd);
+	snap_share_lock();
+	/* the snapshot was dropped meanwhile, leaving the recipe to this file alone */
+	if (!snap_shared(name)) {
+		snap_share_unlock();
+		if (nhashes > 0) {
+			refs_put_range(fs_p, p_stat, 0, nhashes, hashes);
+		}
+		unlink(tmppath);
+		goto out;
+	}
+	if (rename(tmppath, hashpath) < 0) {
+		err = errno;
+		snap_share_unlock();
+		unlink(tmppath);
+		goto out;
+	}
+	snap_share_unlock();
+	/* in case a reader got the shared recipe back into the cache meanwhile */
+	recipe_forget(name, 0);
+	LOG(stderr, DEBUG_MSG, SUBSYS_META, "snap_unshare: %s got its own recipe of %Ld hashes\n", name, nhashes);
+	goto out;
+
+unlink_tmp:
+	close(fd);
+	unlink(tmppath);
+out:
+	f_meta_unlock(f_p);
+	free(phashes);
+	free(hashes);
+	if (err) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "snap_unshare: could not copy the recipe of %s: %s\n",
+				name, strerror(err));
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* makes dst a read-only copy of the directory src, without its contents */
+static int snap_mkdir(char *src, char *dst)
+{
+	dmeta dir;
+
+	if (get_dmeta(src, &dir) < 0 || mkdir(dst, 0775) < 0) {
+		return -1;
+	}
+	dir.dr_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	if (md_mkdir(dst, &dir) < 0) {
+		rmdir(dst);
+		return -1;
+	}
+	return 0;
+}
+
+static int snap_symlink(char *src, char *dst, struct stat *sbuf)
+{
+	char target[MAXPATHLEN];
+	int len;
+
+	if ((len = readlink(src, target, MAXPATHLEN - 1)) < 0) {
+		return -1;
+	}
+	target[len] = '\0';
+	if (symlink(target, dst) < 0 || lchown(dst, sbuf->st_uid, sbuf->st_gid) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* freezes the file src as dst: a new metadata file that shares the recipe of src */
+static int snap_file(fsinfo_p fs_p, char *src, char *dst)
+{
+	char srchash[MAXPATHLEN], dsthash[MAXPATHLEN];
+	finfo_p f_p;
+	struct f_range range;
+	struct stat sbuf;
+	fmeta meta, snap_meta;
+	int fd, err = 0;
+
+	if ((fd = meta_open(src, O_RDONLY)) < 0) {
+		/* removed meanwhile */
+		return (errno == ENOENT) ? 0 : -1;
+	}
+	if (meta_read(fd, &meta) < 0) {
+		err = errno;
+		meta_close(fd);
+		errno = err;
+		return -1;
+	}
+	/* keep commits to the file out until the recipe is shared */
+	f_p = f_search(fs_p->fl_p, meta.u_stat.st_ino);
+	f_range_lock(f_p, &range, -1, 0, 0);
+	f_meta_lock(f_p);
+	if (meta_read(fd, &meta) < 0) {
+		err = errno;
+	}
+	f_meta_unlock(f_p);
+	meta_close(fd);
+	if (err) {
+		goto out;
+	}
+	/* the recipe on disk must be complete before it is shared */
+	recipe_forget(src, 1);
+	if ((fd = meta_creat(dst, O_RDWR)) < 0) {
+		err = errno;
+		goto out;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		err = errno;
+		meta_close(fd);
+		goto out;
+	}
+	snap_meta = meta;
+	snap_meta.u_stat.st_ino = sbuf.st_ino;
+	snap_meta.u_stat.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	if (meta_write(fd, &snap_meta) < 0) {
+		err = errno;
+		meta_close(fd);
+		goto out;
+	}
+	meta_close(fd);
+	/* replace the empty recipe meta_creat() made with the live one */
+	snprintf(srchash, MAXPATHLEN, "%s.hashes", src);
+	snprintf(dsthash, MAXPATHLEN, "%s.hashes", dst);
+	unlink(dsthash);
+	snap_share_lock();
+	if (link(srchash, dsthash) < 0) {
+		err = errno;
+		/* files that never had a recipe keep an empty one */
+		if (err == ENOENT && (fd = open(dsthash, O_RDWR | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH)) >= 0) {
+			close(fd);
+			err = 0;
+		}
+	}
+	snap_share_unlock();
+out:
+	f_range_unlock(f_p, &range);
+	if (err) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "snap_file: could not freeze %s as %s: %s\n",
+				src, dst, strerror(err));
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* copies the tree under src to dst, leaving out the snapshots within it */
+static int snap_copy(fsinfo_p fs_p, char *src, char *dst)
+{
+	char src_name[MAXPATHLEN], dst_name[MAXPATHLEN];
+	struct dirent *de;
+	struct stat sbuf;
+	DIR *dp;
+	int err = 0;
+
+	if (snap_mkdir(src, dst) < 0 || (dp = opendir(src)) == NULL) {
+		return -1;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")
+				|| !strcmp(de->d_name, SNAP_DIR) || resv_name(de->d_name)) {
+			continue;
+		}
+		/* leave room for the ".hashes" */
+		if (snprintf(src_name, MAXPATHLEN, "%s/%s", src, de->d_name) >= MAXPATHLEN - 8
+				|| snprintf(dst_name, MAXPATHLEN, "%s/%s", dst, de->d_name) >= MAXPATHLEN - 8) {
+			err = ENAMETOOLONG;
+			break;
+		}
+		if (lstat(src_name, &sbuf) < 0) {
+			if (errno == ENOENT) {
+				continue;
+			}
+			err = errno;
+			break;
+		}
+		if ((S_ISDIR(sbuf.st_mode) && snap_copy(fs_p, src_name, dst_name) < 0)
+				|| (S_ISLNK(sbuf.st_mode) && snap_symlink(src_name, dst_name, &sbuf) < 0)
+				|| (S_ISREG(sbuf.st_mode) && snap_file(fs_p, src_name, dst_name) < 0)) {
+			err = errno;
+			break;
+		}
+	}
+	closedir(dp);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* removes a file of a snapshot, and releases its chunks if nothing else refers to them */
+static int snap_drop_file(fsinfo_p fs_p, char *name)
+{
+	finfo_p f_p;
+	fmeta meta;
+	int fd;
+	int64_t nhashes = 0;
+	unsigned char *hashes = NULL;
+
+	recipe_forget(name, 0);
+	if ((fd = meta_open(name, O_RDONLY)) < 0 || meta_read(fd, &meta) < 0) {
+		if (fd >= 0) {
+			meta_close(fd);
+		}
+		/* not a file of ours; just get rid of it */
+		return unlink(name);
+	}
+	snap_share_lock();
+	if (!snap_shared(name) && meta_hash_read(name, -1, &nhashes, &hashes) < 0) {
+		nhashes = 0;
+		hashes = NULL;
+	}
+	if (meta_unlink(name) < 0) {
+		snap_share_unlock();
+		meta_close(fd);
+		free(hashes);
+		return -1;
+	}
+	snap_share_unlock();
+	/* as in do_unlink(), the chunks of a file that is open are released on its last close */
+	if ((f_p = f_search(fs_p->fl_p, meta.u_stat.st_ino)) != NULL) {
+		f_p->unlinked = fd;
+		free(f_p->unlinked_hashes);
+		f_p->unlinked_hashes = hashes;
+		f_p->unlinked_nhashes = nhashes;
+		return 0;
+	}
+	meta_close(fd);
+	if (nhashes > 0) {
+		refs_put_range(fs_p, &meta.p_stat, 0, nhashes, hashes);
+	}
+	free(hashes);
+	return 0;
+}
+
+/* removes the tree under name, which is (part of) a snapshot */
+static int snap_purge(fsinfo_p fs_p, char *name)
+{
+	char path[MAXPATHLEN];
+	struct dirent *de;
+	struct stat sbuf;
+	DIR *dp;
+	int err = 0;
+
+	if ((dp = opendir(name)) == NULL) {
+		return -1;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		/* recipes go along with their metadata files */
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") || resv_name(de->d_name)) {
+			continue;
+		}
+		if (snprintf(path, MAXPATHLEN, "%s/%s", name, de->d_name) >= MAXPATHLEN - 8) {
+			err = ENAMETOOLONG;
+			break;
+		}
+		if (lstat(path, &sbuf) < 0) {
+			continue;
+		}
+		if ((S_ISDIR(sbuf.st_mode) && snap_purge(fs_p, path) < 0)
+				|| (S_ISLNK(sbuf.st_mode) && unlink(path) < 0)
+				|| (S_ISREG(sbuf.st_mode) && snap_drop_file(fs_p, path) < 0)) {
+			err = errno;
+			break;
+		}
+	}
+	closedir(dp);
+	snprintf(path, MAXPATHLEN, "%s/.capfsdir", name);
+	if (err == 0 && ((unlink(path) < 0 && errno != ENOENT) || rmdir(name) < 0)) {
+		err = errno;
+	}
+	if (err) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "snap_purge: could not remove %s: %s\n", name, strerror(err));
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Takes a snapshot of the directory dir_name as dir_name/.snapshot/snap_name.
+ * The snapshot is put together under a name that no file can have, and only
+ * shows up once it is complete. Returns 0 on success, -1 on error with errno set.
+ */
+int snap_create(fsinfo_p fs_p, char *dir_name, char *snap_name)
+{
+	char snap_dir[MAXPATHLEN], target[MAXPATHLEN], staging[MAXPATHLEN];
+	struct stat sbuf;
+	int err = 0;
+
+	if (snprintf(snap_dir, MAXPATHLEN, "%s/%s", dir_name, SNAP_DIR) >= MAXPATHLEN
+			|| snprintf(target, MAXPATHLEN, "%s/%s", snap_dir, snap_name) >= MAXPATHLEN
+			|| snprintf(staging, MAXPATHLEN, "%s.hashes", target) >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	pthread_mutex_lock(&snap_mutex);
+	if (lstat(target, &sbuf) == 0) {
+		err = EEXIST;
+	}
+	else if (lstat(snap_dir, &sbuf) < 0 && (errno != ENOENT || snap_mkdir(dir_name, snap_dir) < 0)) {
+		err = errno;
+	}
+	/* left behind by a snapshot that did not complete */
+	else if (lstat(staging, &sbuf) == 0 && snap_purge(fs_p, staging) < 0) {
+		err = errno;
+	}
+	else if (snap_copy(fs_p, dir_name, staging) < 0) {
+		err = errno;
+		snap_purge(fs_p, staging);
+	}
+	else if (rename(staging, target) < 0) {
+		err = errno;
+		snap_purge(fs_p, staging);
+	}
+	pthread_mutex_unlock(&snap_mutex);
+	if (err) {
+		LOG(stderr, CRITICAL_MSG, SUBSYS_META, "snap_create: could not take snapshot %s of %s: %s\n",
+				snap_name, dir_name, strerror(err));
+		errno = err;
+		return -1;
+	}
+	LOG(stderr, INFO_MSG, SUBSYS_META, "took snapshot %s of %s\n", snap_name, dir_name);
+	return 0;
+}
+
+/* Drops the snapshot snap_name of the directory dir_name. Returns 0 on success, -1 on error with errno set */
+int snap_remove(fsinfo_p fs_p, char *dir_name, char *snap_name)
+{
+	char target[MAXPATHLEN];
+	struct stat sbuf;
+	int ret;
+
+	if (snprintf(target, MAXPATHLEN, "%s/%s/%s", dir_name, SNAP_DIR, snap_name) >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	pthread_mutex_lock(&snap_mutex);
+	if (lstat(target, &sbuf) < 0 || !S_ISDIR(sbuf.st_mode)) {
+		pthread_mutex_unlock(&snap_mutex);
+		errno = ENOENT;
+		return -1;
+	}
+	ret = snap_purge(fs_p, target);
+	pthread_mutex_unlock(&snap_mutex);
+	if (ret == 0) {
+		LOG(stderr, INFO_MSG, SUBSYS_META, "dropped snapshot %s of %s\n", snap_name, dir_name);
+	}
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Hash trees over recipes.
+ *
+ * Level 0 of the tree of a file is its recipe. Node i of level l + 1 is the
+ * SHA-1 of nodes [i * F, (i + 1) * F) of level l, or of as many of them as
+ * there are, where F is CAPFS_TREE_FANOUT. Levels are added until one has a
+ * single node, the root; the root of an empty file is the SHA-1 of nothing.
+ * Node i of level l covers chunks [i * F^l, (i + 1) * F^l), so two files (or
+ * two versions of one) have the same chunks in that range if their nodes
+ * match, and a diff only has to descend into the nodes that do not. A client
+ * can check the nodes it is sent by hashing them and comparing the result
+ * with their parent.
+ *
+ * The trees of the MGR_TREE_FILES most recently used files are kept in memory.
+ * A tree is built the first time one of its nodes is asked for. From then on,
+ * recipe_write() and recipe_truncate() mark the nodes above the chunks they
+ * change as stale, and stale nodes are hashed again when the tree is next
+ * asked for. Nothing is kept on disk; a tree that is dropped is built again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "mgr.h"
+#include "capfs_config.h"
+#include "quicklist.h"
+#include "sha.h"
+#include "log.h"
+
+/* F^8 chunks is more than a file can have */
+#define TREE_MAXLEVELS 8
+/* refreshes of a tree that is written to all along before giving up */
+#define TREE_REFRESH_TRIES 8
+
+struct tree {
+	struct qlist_head t_link; /* on tree_lru, least recently used first */
+	char  *t_name;
+	int    t_refs;  /* users of the entry; protected by tree_mutex */
+	int    t_gone;  /* forgotten; freed by the last user */
+	pthread_mutex_t t_refresh; /* one refresh at a time */
+	pthread_mutex_t t_mutex;   /* protects everything below */
+	int    t_built;
+	int64_t t_nchunks;
+	int    t_levels; /* level of the root */
+	int64_t t_count[TREE_MAXLEVELS + 1];
+	unsigned char *t_nodes[TREE_MAXLEVELS + 1]; /* levels 1 to t_levels */
+	unsigned char *t_stale[TREE_MAXLEVELS + 1]; /* one byte per node */
+};
+
+static QLIST_HEAD(tree_lru);
+static pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int tree_count = 0;
+
+/*
+ * Throws away the levels of the tree; it is built again when it is next used.
+ * must be called with t->t_mutex held
+ */
+static void tree_clear(struct tree *t)
+{
+	int l;
+
+	for (l = 1; l <= TREE_MAXLEVELS; l++) {
+		free(t->t_nodes[l]);
+		free(t->t_stale[l]);
+		t->t_nodes[l] = t->t_stale[l] = NULL;
+		t->t_count[l] = 0;
+	}
+	t->t_levels = 0;
+	t->t_nchunks = 0;
+	t->t_built = 0;
+	return;
+}
+
+/* must be called with tree_mutex held, and only on entries nobody is using */
+static void tree_free(struct tree *t)
+{
+	if (!t->t_gone) {
+		qlist_del(&t->t_link);
+		tree_count--;
+	}
+	tree_clear(t);
+	pthread_mutex_destroy(&t->t_refresh);
+	pthread_mutex_destroy(&t->t_mutex);
+	free(t->t_name);
+	free(t);
+	return;
+}
+
+/* Returns the entry for name, creating it if need be. Must be released with tree_put() */
+static struct tree *tree_get(char *name)
+{
+	struct qlist_head *tmp, *scratch;
+	struct tree *t;
+
+	pthread_mutex_lock(&tree_mutex);
+	qlist_for_each(tmp, &tree_lru) {
+		t = qlist_entry(tmp, struct tree, t_link);
+		if (strcmp(t->t_name, name) == 0) {
+			t->t_refs++;
+			qlist_del(&t->t_link);
+			qlist_add_tail(&t->t_link, &tree_lru);
+			pthread_mutex_unlock(&tree_mutex);
+			return t;
+		}
+	}
+	if ((t = (struct tree *) calloc(1, sizeof(struct tree))) == NULL
+			|| (t->t_name = strdup(name)) == NULL) {
+		pthread_mutex_unlock(&tree_mutex);
+		free(t);
+		errno = ENOMEM;
+		return NULL;
+	}
+	t->t_refs = 1;
+	pthread_mutex_init(&t->t_refresh, NULL);
+	pthread_mutex_init(&t->t_mutex, NULL);
+	qlist_add_tail(&t->t_link, &tree_lru);
+	tree_count++;
+	qlist_for_each_safe(tmp, scratch, &tree_lru) {
+		struct tree *e = qlist_entry(tmp, struct tree, t_link);
+
+		if (tree_count <= MGR_TREE_FILES) {
+			break;
+		}
+		if (e->t_refs == 0) {
+			tree_free(e);
+		}
+	}
+	pthread_mutex_unlock(&tree_mutex);
+	return t;
+}
+
+/* Returns the entry for name if there is one, without making it more recently used */
+static struct tree *tree_find(char *name)
+{
+	struct qlist_head *tmp;
+	struct tree *t;
+
+	pthread_mutex_lock(&tree_mutex);
+	qlist_for_each(tmp, &tree_lru) {
+		t = qlist_entry(tmp, struct tree, t_link);
+		if (strcmp(t->t_name, name) == 0) {
+			t->t_refs++;
+			pthread_mutex_unlock(&tree_mutex);
+			return t;
+		}
+	}
+	pthread_mutex_unlock(&tree_mutex);
+	return NULL;
+}
+
+static void tree_put(struct tree *t)
+{
+	pthread_mutex_lock(&tree_mutex);
+	if (--t->t_refs == 0 && t->t_gone) {
+		tree_free(t);
+	}
+	pthread_mutex_unlock(&tree_mutex);
+	return;
+}
+
+static void tree_hash(unsigned char *children, int64_t nchildren, unsigned char *node)
+{
+	size_t len;
+
+	sha1((char *) children, nchildren * CAPFS_MAXHASHLENGTH, &node, &len);
+	return;
+}
+
+/*
+ * Marks the nodes above chunks [begin_chunk, end_chunk) as stale.
+ * must be called with t->t_mutex held
+ */
+static void tree_mark(struct tree *t, int64_t begin_chunk, int64_t end_chunk)
+{
+	int64_t span = 1, first, last;
+	int l;
+
+	if (end_chunk <= begin_chunk) {
+		return;
+	}
+	for (l = 1; l <= t->t_levels; l++) {
+		span *= CAPFS_TREE_FANOUT;
+		first = begin_chunk / span;
+		last = MIN((end_chunk - 1) / span, t->t_count[l] - 1);
+		if (first <= last) {
+			memset(t->t_stale[l] + first, 1, last - first + 1);
+		}
+	}
+	return;
+}
+
+/*
+ * Reshapes the tree for a recipe of nchunks hashes. New nodes, and the
+ * ones over the chunks that were added or cut off, are marked stale.
+ * On failure the tree is cleared.
+ * must be called with t->t_mutex held
+ */
+static int tree_resize(struct tree *t, int64_t nchunks)
+{
+	int64_t count[TREE_MAXLEVELS + 1], old = t->t_nchunks;
+	unsigned char *nodes, *stale;
+	int l, levels = 0;
+
+	count[0] = nchunks;
+	do {
+		if (++levels > TREE_MAXLEVELS) {
+			tree_clear(t);
+			errno = EFBIG;
+			return -1;
+		}
+		count[levels] = MAX((count[levels - 1] + CAPFS_TREE_FANOUT - 1) / CAPFS_TREE_FANOUT, 1);
+	} while (count[levels] > 1);
+
+	for (l = 1; l <= levels; l++) {
+		if (count[l] == t->t_count[l]) {
+			continue;
+		}
+		nodes = (unsigned char *) realloc(t->t_nodes[l], count[l] * CAPFS_MAXHASHLENGTH);
+		if (nodes != NULL) {
+			t->t_nodes[l] = nodes;
+		}
+		stale = (unsigned char *) realloc(t->t_stale[l], count[l]);
+		if (stale != NULL) {
+			t->t_stale[l] = stale;
+		}
+		if (nodes == NULL || stale == NULL) {
+			tree_clear(t);
+			errno = ENOMEM;
+			return -1;
+		}
+		if (count[l] > t->t_count[l]) {
+			memset(t->t_nodes[l] + t->t_count[l] * CAPFS_MAXHASHLENGTH, 0,
+					(count[l] - t->t_count[l]) * CAPFS_MAXHASHLENGTH);
+			memset(t->t_stale[l] + t->t_count[l], 1, count[l] - t->t_count[l]);
+		}
+		t->t_count[l] = count[l];
+	}
+	for (l = levels + 1; l <= t->t_levels; l++) {
+		free(t->t_nodes[l]);
+		free(t->t_stale[l]);
+		t->t_nodes[l] = t->t_stale[l] = NULL;
+		t->t_count[l] = 0;
+	}
+	t->t_levels = levels;
+	t->t_nchunks = nchunks;
+	if (old != nchunks) {
+		tree_mark(t, MAX(MIN(old, nchunks) - 1, 0), MAX(old, nchunks));
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the tree is not built or has stale nodes at levels 1 to level.
+ * must be called with t->t_mutex held
+ */
+static int tree_stale(struct tree *t, int level)
+{
+	int l;
+
+	if (!t->t_built) {
+		return 1;
+	}
+	for (l = 1; l <= MIN(level, t->t_levels); l++) {
+		if (memchr(t->t_stale[l], 1, t->t_count[l]) != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Builds the tree if need be and hashes its stale nodes again, bottom-up.
+ * Level 1 is hashed from the recipe a run of nodes at a time, without holding
+ * t->t_mutex while the recipe is read. A write in the meantime marks its nodes
+ * stale again, and a node whose children are still stale is left alone, so
+ * the whole pass is repeated until no node at levels 1 to level is stale.
+ * Returns 0 with t->t_mutex held, or -1 (with errno EAGAIN if the tree kept
+ * being written to) without it.
+ * must be called with t->t_refresh held
+ */
+static int tree_refresh(struct tree *t, char *name, int level)
+{
+	unsigned char node[CAPFS_TREE_FANOUT][CAPFS_MAXHASHLENGTH];
+	unsigned char *leaves, *p;
+	int64_t first, last, i, n, b, c;
+	int l, tries = 0;
+
+	pthread_mutex_lock(&t->t_mutex);
+	while (tree_stale(t, level)) {
+		if (tries++ == TREE_REFRESH_TRIES) {
+			pthread_mutex_unlock(&t->t_mutex);
+			errno = EAGAIN;
+			return -1;
+		}
+		if (!t->t_built) {
+			if ((n = recipe_length(name)) < 0 || tree_resize(t, n) < 0) {
+				pthread_mutex_unlock(&t->t_mutex);
+				return -1;
+			}
+			t->t_built = 1;
+		}
+		first = 0;
+		while (first < t->t_count[1]
+				&& (p = memchr(t->t_stale[1] + first, 1, t->t_count[1] - first)) != NULL) {
+			first = p - t->t_stale[1];
+			for (last = first; last < t->t_count[1] && last - first < CAPFS_TREE_FANOUT && t->t_stale[1][last]; last++) {
+				t->t_stale[1][last] = 0;
+			}
+			pthread_mutex_unlock(&t->t_mutex);
+
+			n = (last - first) * CAPFS_TREE_FANOUT;
+			leaves = NULL;
+			if (recipe_read(name, first * CAPFS_TREE_FANOUT, &n, &leaves) < 0) {
+				errno = -n;
+				pthread_mutex_lock(&t->t_mutex);
+				tree_clear(t);
+				pthread_mutex_unlock(&t->t_mutex);
+				return -1;
+			}
+			for (i = first; i < last; i++) {
+				b = (i - first) * CAPFS_TREE_FANOUT;
+				c = MIN(MAX(n - b, 0), CAPFS_TREE_FANOUT);
+				tree_hash(leaves + b * CAPFS_MAXHASHLENGTH, c, node[i - first]);
+			}
+			free(leaves);
+
+			pthread_mutex_lock(&t->t_mutex);
+			for (i = first; i < last && i < t->t_count[1]; i++) {
+				memcpy(t->t_nodes[1] + i * CAPFS_MAXHASHLENGTH, node[i - first], CAPFS_MAXHASHLENGTH);
+			}
+			first = last;
+		}
+		for (l = 2; l <= t->t_levels; l++) {
+			for (i = 0; i < t->t_count[l]; i++) {
+				if (!t->t_stale[l][i]) {
+					continue;
+				}
+				b = i * CAPFS_TREE_FANOUT;
+				c = MIN(t->t_count[l - 1] - b, CAPFS_TREE_FANOUT);
+				if (memchr(t->t_stale[l - 1] + b, 1, c) != NULL) {
+					continue;
+				}
+				tree_hash(t->t_nodes[l - 1] + b * CAPFS_MAXHASHLENGTH, c, t->t_nodes[l] + i * CAPFS_MAXHASHLENGTH);
+				t->t_stale[l][i] = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns up to *nnodes nodes of the given level of the tree of name, starting
+ * at begin_node, in a buffer allocated in *nodes, and the number of nodes found
+ * in *nnodes. Level 0 is the recipe itself. Also returns the length of the
+ * recipe in *nchunks and the level of the root in *levels.
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int tree_read(char *name, int level, int64_t begin_node, int64_t *nnodes, unsigned char **nodes,
+		int64_t *nchunks, int *levels)
+{
+	struct tree *t;
+	int64_t count;
+
+	*nodes = NULL;
+	if (level < 0 || begin_node < 0 || *nnodes < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((t = tree_get(name)) == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&t->t_refresh);
+	if (tree_refresh(t, name, level) < 0) {
+		int err = errno;
+
+		pthread_mutex_unlock(&t->t_refresh);
+		tree_put(t);
+		errno = err;
+		return -1;
+	}
+	pthread_mutex_unlock(&t->t_refresh);
+
+	*nchunks = t->t_nchunks;
+	*levels = t->t_levels;
+	if (level == 0) {
+		pthread_mutex_unlock(&t->t_mutex);
+		tree_put(t);
+		if (*nnodes == 0 || begin_node >= *nchunks) {
+			*nnodes = 0;
+			return 0;
+		}
+		if (recipe_read(name, begin_node, nnodes, nodes) < 0) {
+			errno = -(*nnodes);
+			return -1;
+		}
+		return 0;
+	}
+	count = (level > t->t_levels) ? 0 : MIN(*nnodes, MAX(t->t_count[level] - begin_node, 0));
+	if (count > 0) {
+		if ((*nodes = (unsigned char *) malloc(count * CAPFS_MAXHASHLENGTH)) == NULL) {
+			pthread_mutex_unlock(&t->t_mutex);
+			tree_put(t);
+			errno = ENOMEM;
+			return -1;
+		}
+		memcpy(*nodes, t->t_nodes[level] + begin_node * CAPFS_MAXHASHLENGTH, count * CAPFS_MAXHASHLENGTH);
+	}
+	*nnodes = count;
+	pthread_mutex_unlock(&t->t_mutex);
+	tree_put(t);
+	return 0;
+}
+
+/* Chunks [begin_chunk, begin_chunk + nchunks) of the recipe of name have been written */
+void tree_update(char *name, int64_t begin_chunk, int64_t nchunks)
+{
+	struct tree *t;
+
+	if ((t = tree_find(name)) == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&t->t_mutex);
+	if (t->t_built) {
+		if (begin_chunk + nchunks <= t->t_nchunks || tree_resize(t, begin_chunk + nchunks) == 0) {
+			tree_mark(t, begin_chunk, begin_chunk + nchunks);
+		}
+	}
+	pthread_mutex_unlock(&t->t_mutex);
+	tree_put(t);
+	return;
+}
+
+/* The recipe of name has been cut (or extended) to nchunks hashes */
+void tree_truncate(char *name, int64_t nchunks)
+{
+	struct tree *t;
+
+	if ((t = tree_find(name)) == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&t->t_mutex);
+	if (t->t_built) {
+		tree_resize(t, nchunks);
+	}
+	pthread_mutex_unlock(&t->t_mutex);
+	tree_put(t);
+	return;
+}
+
+/* Drops the trees of name and of everything underneath it (if it is a directory) */
+void tree_forget(char *name)
+{
+	struct qlist_head *tmp, *scratch;
+	size_t len = strlen(name);
+	struct tree *t;
+
+	pthread_mutex_lock(&tree_mutex);
+	qlist_for_each_safe(tmp, scratch, &tree_lru) {
+		t = qlist_entry(tmp, struct tree, t_link);
+		if (strncmp(t->t_name, name, len) != 0 || (t->t_name[len] != '\0' && t->t_name[len] != '/')) {
+			continue;
+		}
+		qlist_del(&t->t_link);
+		tree_count--;
+		t->t_gone = 1;
+		if (t->t_refs == 0) {
+			tree_free(t);
+		}
+	}
+	pthread_mutex_unlock(&tree_mutex);
+	return;
+}
+
+void tree_finalize(void)
+{
+	pthread_mutex_lock(&tree_mutex);
+	while (!qlist_empty(&tree_lru)) {
+		tree_free(qlist_entry(tree_lru.next, struct tree, t_link));
+	}
+	pthread_mutex_unlock(&tree_mutex);
+	return;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
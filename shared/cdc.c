@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Content-defined chunking.
+ *
+ * Cuts a buffer into pieces at positions that depend only on the bytes
+ * just before them, so that inserting or deleting data shifts the pieces
+ * that follow instead of changing them. A gear hash is rolled over the
+ * data (every byte shifts the hash left and adds a random value for the
+ * byte, so the top bits depend on the last 64 bytes), and a piece ends
+ * where the top bits of the hash are all zero. Cuts are never made before
+ * min bytes and always at max bytes. To keep piece sizes close to avg, the
+ * condition is made harder before avg bytes and easier after (normalized
+ * chunking, as in FastCDC).
+ *
+ * The gear table is generated from a fixed seed, since every host has to
+ * cut the same data at the same places.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include "cdc.h"
+
+static uint64_t cdc_gear[256];
+static pthread_once_t cdc_once = PTHREAD_ONCE_INIT;
+
+static void cdc_gear_init(void)
+{
+	uint64_t x = 0x4341504653434443ULL; /* "CAPFSCDC" */
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		uint64_t z;
+
+		/* splitmix64 */
+		x += 0x9e3779b97f4a7c15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cdc_gear[i] = z ^ (z >> 31);
+	}
+	return;
+}
+
+/* a mask of the top bits of the hash */
+static inline uint64_t cdc_mask(int bits)
+{
+	if (bits <= 0) {
+		return 0;
+	}
+	if (bits >= 64) {
+		return ~0ULL;
+	}
+	return ~0ULL << (64 - bits);
+}
+
+/*
+ * Sets up params for pieces of min to max bytes, avg on average
+ * (rounded down to a power of 2).
+ * Returns 0 on success, -EINVAL if the sizes make no sense.
+ */
+int cdc_init(struct cdc_params *params, int min, int avg, int max)
+{
+	int bits = 0;
+
+	if (min <= 0 || avg < min || max < avg) {
+		return -EINVAL;
+	}
+	while ((2 << bits) <= avg) {
+		bits++;
+	}
+	params->cp_min = min;
+	params->cp_avg = 1 << bits;
+	params->cp_max = max;
+	params->cp_mask_s = cdc_mask(bits + 2);
+	params->cp_mask_l = cdc_mask(bits - 2);
+	pthread_once(&cdc_once, cdc_gear_init);
+	return 0;
+}
+
+/* Returns the length of the first piece of the len bytes in buf */
+int cdc_cut(struct cdc_params *params, unsigned char *buf, int len)
+{
+	uint64_t hash = 0;
+	int i, avg, max;
+
+	if (len <= params->cp_min) {
+		return len;
+	}
+	max = (len < params->cp_max) ? len : params->cp_max;
+	avg = (max < params->cp_avg) ? max : params->cp_avg;
+	/* the hash only covers the last 64 bytes, so there is no need to start any earlier */
+	i = (params->cp_min > 64) ? params->cp_min - 64 : 0;
+	for (; i < params->cp_min; i++) {
+		hash = (hash << 1) + cdc_gear[buf[i]];
+	}
+	for (; i < avg; i++) {
+		hash = (hash << 1) + cdc_gear[buf[i]];
+		if (!(hash & params->cp_mask_s)) {
+			return i + 1;
+		}
+	}
+	for (; i < max; i++) {
+		hash = (hash << 1) + cdc_gear[buf[i]];
+		if (!(hash & params->cp_mask_l)) {
+			return i + 1;
+		}
+	}
+	return max;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
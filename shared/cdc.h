@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Content-defined chunking.
+ */
+#ifndef _CDC_H
+#define _CDC_H
+
+#include <stdint.h>
+
+struct cdc_params {
+	int      cp_min;    /* no cut before this many bytes */
+	int      cp_avg;    /* expected piece size, a power of 2 */
+	int      cp_max;    /* always cut here */
+	uint64_t cp_mask_s; /* harder cut condition used below cp_avg */
+	uint64_t cp_mask_l; /* easier cut condition used above cp_avg */
+};
+
+extern int cdc_init(struct cdc_params *params, int min, int avg, int max);
+extern int cdc_cut(struct cdc_params *params, unsigned char *buf, int len);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
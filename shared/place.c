@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Content-hash based placement of chunks on iods (CAPFS_PLACE_HASH).
+ *
+ * A chunk is stored on the iod that scores highest for its hash among
+ * the iods of the file (rendezvous hashing). The score depends only on the
+ * hash and on the address of the iod, not on the position of the iod in
+ * the .iodtab or of the chunk in the file, so identical chunks of any
+ * files end up on the same iod and are stored only once. When an iod
+ * is added, only the chunks that now score highest on it move there.
+ * Both the clients (map_chunk()) and the meta-server (the reference
+ * counts) must place chunks through here.
+ */
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "capfs_config.h"
+#include "place.h"
+
+/* finalizer of splitmix64 */
+static inline uint64_t place_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/*
+ * Returns which of the count iods starting at iod[base] (wrapping
+ * around at nr_iods) the chunk with the given hash belongs to.
+ */
+int place_chunk(unsigned char *hash, iod_info *iod, int base, int count, int nr_iods)
+{
+	uint64_t key = 0, id, weight, best = 0;
+	struct sockaddr_in *addr;
+	int i, j, pick = 0;
+
+	/* hashes are uniformly distributed already, so a prefix is as good as any */
+	for (i = 0; i < 8 && i < CAPFS_MAXHASHLENGTH; i++) {
+		key = (key << 8) | hash[i];
+	}
+	for (j = 0; j < count; j++) {
+		addr = &iod[(base + j) % nr_iods].addr;
+		id = ((uint64_t) ntohl(addr->sin_addr.s_addr) << 16) | ntohs(addr->sin_port);
+		weight = place_mix(key ^ place_mix(id));
+		if (j == 0 || weight > best) {
+			best = weight;
+			pick = j;
+		}
+	}
+	return pick;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Content-hash based placement of chunks on iods.
+ */
+#ifndef _PLACE_H
+#define _PLACE_H
+
+#include <desc.h>
+
+extern int place_chunk(unsigned char *hash, iod_info *iod, int base, int count, int nr_iods);
+
+#endif
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -708,9 +708,14 @@ int blockingSend(int sockfd, void* buffer, int size)
 }
 
 int blockingSendFile(int in_fd, int sockfd, int size)
+{
+	return blockingSendFileOffset(in_fd, sockfd, 0, size);
+}
+
+/* same as above, except that the data is sent starting at "offset" in the file */
+int blockingSendFileOffset(int in_fd, int sockfd, off_t offset, int size)
 {
 	int oldFlags, remaining, retVal,error;
-	off_t offset=0;
 
 	remaining=size;
 	oldFlags = fcntl(sockfd,F_GETFL,0);
@@ -731,9 +736,12 @@ int blockingSendFile(int in_fd, int sockfd, int size)
 		}
 		else
 			if ((retVal==-1)&& (error==EINTR))
-				retVal=0;
+				continue;
+		/* the file is shorter than size */
+		if (retVal==0)
+			break;
+		/* sendfile() has already moved offset past what it sent */
 		remaining -= retVal;
-		offset = offset + retVal;
 	}
 	//fprintf(stderr, "Finished sendfiling %d bytes on socket %d\n", size, sockfd);
 	return size-remaining;
@@ -36,6 +36,7 @@ int nbsendfile(int s, int f, off_t off, int len);
 int connect_timeout(int s, struct sockaddr *saddrp, int len, int time_secs);
 int nbpeek(int s, void* buf, int len);
 int blockingSendFile(int in_fd, int sockfd, int size);
+int blockingSendFileOffset(int in_fd, int sockfd, off_t offset, int size);
 int blockingSend(int sockfd, void* buffer, int size);
 int blockingRecv(int sockfd, void* buffer, int size);
 int nb_connect(int sockNum, struct sockaddr *s);
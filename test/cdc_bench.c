@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Compares how much of an edited copy of a file is found in the store
+ * with fixed size chunks, with fixed size chunks cut into content-defined
+ * pieces (what the iod does when cdc_avg_size is set), and with purely
+ * content-defined chunks.
+ *
+ * usage: cdc_bench [-s <MB>] [-e <edits>] [-m <min>] [-a <avg>] [-x <max>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "capfs_config.h"
+#include "sha.h"
+#include "cdc.h"
+
+struct piece {
+	unsigned char hash[CAPFS_MAXHASHLENGTH];
+	int length;
+};
+
+static struct piece *pieces = NULL;
+static int npieces = 0, maxpieces = 0;
+
+static void add_piece(char *buf, int length)
+{
+	unsigned char *hash;
+	size_t hlen;
+
+	if (npieces == maxpieces) {
+		maxpieces = maxpieces ? 2 * maxpieces : 1024;
+		if ((pieces = (struct piece *) realloc(pieces, maxpieces * sizeof(struct piece))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	hash = pieces[npieces].hash;
+	sha1(buf, length, &hash, &hlen);
+	pieces[npieces].length = length;
+	npieces++;
+	return;
+}
+
+static int piece_cmp(const void *a, const void *b)
+{
+	return memcmp(((struct piece *) a)->hash, ((struct piece *) b)->hash, CAPFS_MAXHASHLENGTH);
+}
+
+/* Returns the number of bytes in distinct pieces and resets the list */
+static int64_t unique_bytes(void)
+{
+	int64_t total = 0;
+	int i;
+
+	qsort(pieces, npieces, sizeof(struct piece), piece_cmp);
+	for (i = 0; i < npieces; i++) {
+		if (i == 0 || piece_cmp(&pieces[i - 1], &pieces[i]) != 0) {
+			total += pieces[i].length;
+		}
+	}
+	npieces = 0;
+	return total;
+}
+
+static void fixed(char *buf, int size)
+{
+	int off;
+
+	for (off = 0; off < size; off += CAPFS_CHUNK_SIZE) {
+		add_piece(buf + off, (size - off < CAPFS_CHUNK_SIZE) ? size - off : CAPFS_CHUNK_SIZE);
+	}
+	return;
+}
+
+static void fixed_cdc(struct cdc_params *params, char *buf, int size)
+{
+	int off, len, cut;
+
+	for (off = 0; off < size; off += CAPFS_CHUNK_SIZE) {
+		char *chunk = buf + off;
+
+		len = (size - off < CAPFS_CHUNK_SIZE) ? size - off : CAPFS_CHUNK_SIZE;
+		while (len > 0) {
+			cut = cdc_cut(params, (unsigned char *) chunk, len);
+			add_piece(chunk, cut);
+			chunk += cut;
+			len -= cut;
+		}
+	}
+	return;
+}
+
+static void pure_cdc(struct cdc_params *params, char *buf, int size)
+{
+	int off, cut;
+
+	for (off = 0; off < size; off += cut) {
+		cut = cdc_cut(params, (unsigned char *) buf + off, size - off);
+		add_piece(buf + off, cut);
+	}
+	return;
+}
+
+/* Fills buf with log-like records, so that there is some structure to find boundaries in */
+static void generate(char *buf, int size)
+{
+	int off = 0;
+
+	while (off < size) {
+		char rec[128];
+		int len;
+
+		len = snprintf(rec, sizeof(rec), "%ld host%02ld op=%s obj=%08lx len=%ld\n",
+				random(), random() % 64, (random() & 1) ? "read" : "write", random(), random() % 65536);
+		if (len > size - off) {
+			len = size - off;
+		}
+		memcpy(buf + off, rec, len);
+		off += len;
+	}
+	return;
+}
+
+/* Copies buf to a new buffer with nedits random insertions and deletions of up to 64 bytes */
+static char *edit(char *buf, int size, int nedits, int *new_size)
+{
+	char *out = (char *) malloc(size + nedits * 64);
+	int i, *at, in = 0, o = 0;
+
+	at = (int *) malloc(nedits * sizeof(int));
+	for (i = 0; i < nedits; i++) {
+		at[i] = random() % size;
+	}
+	for (i = 0; i < nedits; i++) {
+		int j, len = 1 + random() % 64;
+
+		/* visit the edit positions in order */
+		for (j = i + 1; j < nedits; j++) {
+			if (at[j] < at[i]) {
+				int t = at[i]; at[i] = at[j]; at[j] = t;
+			}
+		}
+		if (at[i] < in) {
+			continue;
+		}
+		memcpy(out + o, buf + in, at[i] - in);
+		o += at[i] - in;
+		in = at[i];
+		if (random() & 1) {
+			memset(out + o, 'A' + i % 26, len);
+			o += len;
+		}
+		else {
+			in += (len < size - in) ? len : size - in;
+		}
+	}
+	memcpy(out + o, buf + in, size - in);
+	o += size - in;
+	free(at);
+	*new_size = o;
+	return out;
+}
+
+static void report(char *name, int64_t base, int64_t both, int new_size)
+{
+	int64_t stored = both - base;
+
+	printf("%-18s %10Ld new bytes stored for the %d byte copy (%.2f%% of it)\n",
+			name, (long long) stored, new_size, 100.0 * stored / new_size);
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	struct cdc_params params;
+	int c, size = 8, nedits = 64, min = 512, avg = 2048, max = 8192, new_size;
+	int64_t base, both;
+	char *buf, *copy;
+
+	while ((c = getopt(argc, argv, "s:e:m:a:x:")) != EOF) {
+		switch (c) {
+			case 's': size = atoi(optarg); break;
+			case 'e': nedits = atoi(optarg); break;
+			case 'm': min = atoi(optarg); break;
+			case 'a': avg = atoi(optarg); break;
+			case 'x': max = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-s <MB>] [-e <edits>] [-m <min>] [-a <avg>] [-x <max>]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (cdc_init(&params, min, avg, max) < 0) {
+		fprintf(stderr, "invalid piece sizes %d/%d/%d\n", min, avg, max);
+		exit(1);
+	}
+	size *= 1024 * 1024;
+	if ((buf = (char *) malloc(size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	srandom(1);
+	generate(buf, size);
+	copy = edit(buf, size, nedits, &new_size);
+	printf("%d MB file, %d edits, pieces of %d/%d/%d bytes\n", size >> 20, nedits, min, params.cp_avg, max);
+
+	fixed(buf, size);
+	base = unique_bytes();
+	fixed(buf, size);
+	fixed(copy, new_size);
+	both = unique_bytes();
+	report("fixed chunks", base, both, new_size);
+
+	fixed_cdc(&params, buf, size);
+	base = unique_bytes();
+	fixed_cdc(&params, buf, size);
+	fixed_cdc(&params, copy, new_size);
+	both = unique_bytes();
+	report("chunks as pieces", base, both, new_size);
+
+	pure_cdc(&params, buf, size);
+	base = unique_bytes();
+	pure_cdc(&params, buf, size);
+	pure_cdc(&params, copy, new_size);
+	both = unique_bytes();
+	report("pure cdc", base, both, new_size);
+
+	free(copy);
+	free(buf);
+	free(pieces);
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Times the meta-server's open-file table: opens (f_add) a number of
+ * files, looks them up (f_search) from several threads at once, the way
+ * concurrent requests do, and closes (f_rem) them again.
+ *
+ * usage: flist_bench [-n <files>] [-t <threads>] [-l <lookups per thread>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "flist.h"
+
+static flist_p fl = NULL;
+static int nfiles = 100000, nlookups = 1000000;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *lookup_thread(void *arg)
+{
+	unsigned int seed = (unsigned int) (unsigned long) arg;
+	int i;
+
+	for (i = 0; i < nlookups; i++) {
+		ino_t ino = 1 + rand_r(&seed) % nfiles;
+
+		if (f_search(fl, ino) == NULL) {
+			fprintf(stderr, "file %lu not found\n", (unsigned long) ino);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, nthreads = 4;
+	pthread_t *threads;
+	double start, elapsed;
+
+	while ((c = getopt(argc, argv, "n:t:l:")) != EOF) {
+		switch (c) {
+			case 'n':
+				nfiles = atoi(optarg);
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'l':
+				nlookups = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n <files>] [-t <threads>] [-l <lookups per thread>]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (nfiles <= 0 || nthreads <= 0 || nlookups < 0) {
+		fprintf(stderr, "invalid arguments\n");
+		exit(1);
+	}
+	if ((fl = flist_new()) == NULL
+			|| (threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	start = now();
+	for (i = 1; i <= nfiles; i++) {
+		finfo_p f_p;
+
+		if ((f_p = f_new()) == NULL) {
+			perror("f_new");
+			exit(1);
+		}
+		f_p->f_ino = i;
+		f_add(fl, f_p);
+	}
+	elapsed = now() - start;
+	printf("open   %d files: %.3f sec (%.0f/sec)\n", nfiles, elapsed, nfiles / elapsed);
+
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, lookup_thread, (void *) (unsigned long) (i + 1))) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	elapsed = now() - start;
+	printf("lookup %d x %d files: %.3f sec (%.0f/sec)\n", nthreads, nlookups, elapsed,
+			(double) nthreads * nlookups / elapsed);
+
+	start = now();
+	for (i = 1; i <= nfiles; i++) {
+		if (f_rem(fl, i) < 0) {
+			fprintf(stderr, "file %d not removed\n", i);
+			exit(1);
+		}
+	}
+	elapsed = now() - start;
+	printf("close  %d files: %.3f sec (%.0f/sec)\n", nfiles, elapsed, nfiles / elapsed);
+	if (!flist_empty(fl)) {
+		fprintf(stderr, "table not empty\n");
+		exit(1);
+	}
+	flist_cleanup(fl);
+	free(threads);
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
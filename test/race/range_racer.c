@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Commit contention benchmark, a timed version of racer.c.
+ * Every rank writes its own disjoint region of one shared file over and
+ * over (or, with -o, all ranks write the same region), so that the
+ * meta-server sees a stream of concurrent wcommits on a single file.
+ * Reports the aggregate commit rate and bandwidth seen by the slowest rank.
+ *
+ * usage: mpirun -np <n> range_racer [-f <file>] [-c <chunks per write>] [-n <writes>] [-o]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <string.h>
+#include <errno.h>
+#include "mpi.h"
+
+#define CAPFS_FILE "/mnt/capfs/tst1"
+#define CHUNK_SIZE (16 * 1024)
+
+int main(int argc, char *argv[])
+{
+	int rank, size, c, i, fd, nchunks = 4, nwrites = 64, overlap = 0;
+	char *fname = CAPFS_FILE, *buf;
+	double start, elapsed, slowest;
+	size_t len;
+	off_t base;
+
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	while ((c = getopt(argc, argv, "f:c:n:o")) != EOF) {
+		switch (c) {
+			case 'f': fname = optarg; break;
+			case 'c': nchunks = atoi(optarg); break;
+			case 'n': nwrites = atoi(optarg); break;
+			case 'o': overlap = 1; break;
+			default:
+				if (rank == 0) {
+					fprintf(stderr, "usage: %s [-f <file>] [-c <chunks per write>] [-n <writes>] [-o]\n", argv[0]);
+				}
+				MPI_Finalize();
+				exit(1);
+		}
+	}
+	len = (size_t) nchunks * CHUNK_SIZE;
+	if ((buf = (char *) malloc(len)) == NULL) {
+		perror("malloc");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	fd = open(fname, O_RDWR | O_CREAT, 0700);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	/* chunk aligned, so disjoint regions never share a chunk */
+	base = overlap ? 0 : (off_t) rank * len;
+	MPI_Barrier(MPI_COMM_WORLD);
+	start = MPI_Wtime();
+	for (i = 0; i < nwrites; i++) {
+		/* fresh contents every time, so that every write commits new hashes */
+		memset(buf, 'a' + (rank + i) % 26, len);
+		sprintf(buf, "rank %d write %d\n", rank, i);
+		if (pwrite(fd, buf, len, base) != (ssize_t) len) {
+			fprintf(stderr, "rank %d: write %d failed: %s\n", rank, i, strerror(errno));
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+	}
+	elapsed = MPI_Wtime() - start;
+	MPI_Reduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	if (rank == 0) {
+		printf("%d ranks, %s regions of %d chunks, %d writes each: %.3f s, %.1f commits/s, %.2f MB/s\n",
+				size, overlap ? "overlapping" : "disjoint", nchunks, nwrites, slowest,
+				(double) size * nwrites / slowest, (double) size * nwrites * len / slowest / (1024 * 1024));
+	}
+	close(fd);
+	free(buf);
+	MPI_Finalize();
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
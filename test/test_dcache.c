@@ -94,40 +94,84 @@ struct recipe* get_recipe_list(char *filename, int chunk_size, char **ptr)
 
 int main(int argc, char *argv[])
 {
-	int i, block_size = BSIZE;
+	int i, block_size = BSIZE, ret, mismatches = 0;
 	struct recipe *recipe = NULL;
-	char *ptr= NULL;
-	char str[256];
+	char *ptr= NULL, *buf = NULL;
 	struct stat sbuf;
-	size_t count = 0;
+	size_t count = 0, length;
+	int64_t hits, misses, evicts, cache_size;
+	char *dir = NULL;
 
-	if (argc != 2 && argc != 3) {
-		fprintf(stderr, "usage: %s <filename> {block size}\n", argv[0]);
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "usage: %s <filename> {block size} {on-disk cache directory}\n", argv[0]);
 		return 1;
 	}
-	if (argc == 3) {
+	if (argc >= 3) {
 		block_size = atoi(argv[2]);
 	}
-	stat(argv[1], &sbuf);
-	sprintf(str,"%ld", sbuf.st_size / 10);
-	setenv("CMGR_BCOUNT", str, 1);
-	dcache_init();
+	if (argc == 4) {
+		dir = argv[3];
+	}
+	if (stat(argv[1], &sbuf) < 0) {
+		perror("stat");
+		return 1;
+	}
+	/* leave enough room in every partition (and on disk) for the whole file */
+	cache_size = (int64_t) (sbuf.st_size + block_size) * DCACHE_SHARDS;
+	if ((ret = dcache_init(cache_size)) < 0) {
+		fprintf(stderr, "dcache_init: %s\n", strerror(-ret));
+		return 1;
+	}
+	if (dir && (ret = dcache_disk_init(dir, cache_size, block_size)) < 0) {
+		fprintf(stderr, "dcache_disk_init: %s\n", strerror(-ret));
+		return 1;
+	}
 	recipe = get_recipe_list(argv[1], block_size, &ptr);
+	if (recipe == NULL) {
+		fprintf(stderr, "could not compute the recipe of %s\n", argv[1]);
+		return 1;
+	}
 	for (i = 0; i < recipe->count; i++) {
-		if (count + block_size < sbuf.st_size) {
-			dcache_put(recipe->hashes[i], ptr + i * block_size, block_size);
-		}
-		else {
-			dcache_put(recipe->hashes[i], ptr + i * block_size, sbuf.st_size - count);
+		length = (count + block_size < sbuf.st_size) ? block_size : sbuf.st_size - count;
+		if (length > 0) {
+			dcache_put(recipe->hashes[i], ptr + i * block_size, length);
 		}
 		count += block_size;
 	}
-	ptr = (void *) calloc(1, block_size);
+	if (dir) {
+		/* start over with an empty memory cache, so that everything has to come off the disk */
+		dcache_finalize();
+		dcache_disk_finalize();
+		dcache_init(cache_size);
+		if ((ret = dcache_disk_init(dir, cache_size, block_size)) < 0) {
+			fprintf(stderr, "dcache_disk_init: %s\n", strerror(-ret));
+			return 1;
+		}
+		printf("%d blocks found on disk\n", ret);
+	}
+	buf = (void *) calloc(1, block_size);
+	count = 0;
 	for (i = 0; i < recipe->count; i++) {
-		dcache_get(recipe->hashes[i], ptr, block_size);
-		printf("%s", ptr);
+		length = (count + block_size < sbuf.st_size) ? block_size : sbuf.st_size - count;
+		count += block_size;
+		if (length == 0) {
+			continue;
+		}
+		if ((ret = dcache_get(recipe->hashes[i], buf, block_size)) != length
+				|| memcmp(buf, ptr + i * block_size, length)) {
+			fprintf(stderr, "block %d: got %d bytes, expected %ld\n", i, ret, (long) length);
+			mismatches++;
+		}
+	}
+	dcache_get_stats(&hits, &misses, &evicts, 0);
+	printf("%lld hits %lld misses %lld evicts, %d mismatches\n",
+			(long long) hits, (long long) misses, (long long) evicts, mismatches);
+	if (dir) {
+		dcache_disk_get_stats(&hits, &misses, &evicts, 0);
+		printf("disk: %lld hits %lld misses %lld evicts\n", (long long) hits, (long long) misses, (long long) evicts);
 	}
-	printf("\n");
+	free(buf);
 	dcache_finalize();
-	return 0;
+	dcache_disk_finalize();
+	return mismatches ? 1 : 0;
 }
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Makes copies of a CAPFS file that share its chunks, so that no data
+ * is read or written. Each copy only costs the meta-data server a new
+ * recipe, which makes it cheap to stage the same input for many runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <capfs.h>
+#include <capfs_proto.h>
+
+int capfs_mode = 1;
+
+int usage(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	int i, failed = 0;
+
+	if (argc < 3 || !strcmp(argv[1], "-h")) {
+		usage(argc, argv);
+		return -1;
+	}
+	for (i = 2; i < argc; i++) {
+		if (capfs_clone(argv[1], argv[i]) < 0) {
+			fprintf(stderr, "%s: could not clone %s to %s: %s\n", argv[0], argv[1], argv[i], strerror(errno));
+			failed++;
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+int usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s <source file> <copy> [<copy> ...]\n", argv[0]);
+	fprintf(stderr, " the copies share the chunks of the source; none of them may exist yet\n");
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
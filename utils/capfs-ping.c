@@ -40,6 +40,7 @@ static int ping_tcp(char *hostname, int prog_num, int version, int timeout);
 int mgr_ping(char *host);
 int capfs_iod_ping(char *host, int port_nr);
 int capfs_iod_freespace(char *host, int port_nr, int index);
+int capfs_iod_stats(char *host, int port_nr, int index);
 
 /* capfs_mgr_init()
  *
@@ -165,6 +166,8 @@ use_sockets:0,
 					printf("iod %d (%s:%d) failed to report free space.\n", i, iod_host, iod_port);
 					iod_err++;
 				}
+				/* not fatal, older iods do not keep a chunk cache */
+				capfs_iod_stats(iod_host, iod_port, i);
 			}
 		}
 	}
@@ -241,6 +244,54 @@ oops:
 	return -1;
 }
 
+/* capfs_iod_stats(host, port_nr)
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int capfs_iod_stats(char *host, int port_nr, int index)
+{
+	struct sockaddr iodAddr;
+	struct cas_iod_stat stat;
+
+	if (init_sock(&iodAddr, host, port_nr) < 0) {
+		fprintf(stderr, "No such host : %s? %s\n", host, strerror(errno));
+		goto oops;
+	}
+	if (clnt_iod_stat(TRY_TCP, &iodAddr, &stat) < 0) {
+			goto oops;
+	}
+	if (stat.is_cache_capacity == 0) {
+		printf("iod %d (%s:%d): chunk cache disabled\n", index, host, port_nr);
+	}
+	else {
+		printf("iod %d (%s:%d): chunk cache = %Ld/%Ld Mbytes (%Ld chunks), hits = %Ld, misses = %Ld, evictions = %Ld\n",
+				index, host, port_nr,
+				(int64_t) stat.is_cache_bytes / 1048576, (int64_t) stat.is_cache_capacity / 1048576,
+				(int64_t) stat.is_cache_entries, (int64_t) stat.is_cache_hits,
+				(int64_t) stat.is_cache_misses, (int64_t) stat.is_cache_evictions);
+	}
+	if (stat.is_codec_raw_bytes > 0) {
+		printf("iod %d (%s:%d): compression ratio = %.2f (%Ld of %Ld chunks compressed), "
+				"cpu time = %Ld usecs compressing, %Ld usecs decompressing\n",
+				index, host, port_nr,
+				(double) stat.is_codec_raw_bytes / (double) stat.is_codec_stored_bytes,
+				(int64_t) stat.is_codec_packed, (int64_t) (stat.is_codec_packed + stat.is_codec_skipped),
+				(int64_t) stat.is_codec_pack_usecs, (int64_t) stat.is_codec_unpack_usecs);
+	}
+	printf("iod %d (%s:%d): referenced chunks = %Ld, awaiting reclamation = %Ld, reclaimed = %Ld\n",
+			index, host, port_nr, (int64_t) stat.is_ref_chunks, 
+			(int64_t) stat.is_ref_pending, (int64_t) stat.is_ref_reclaimed);
+	if (stat.is_cdc_bytes > 0) {
+		printf("iod %d (%s:%d): %Ld chunks stored as pieces, %Ld of %Ld bytes new (dedup ratio = %.2f)\n",
+				index, host, port_nr, (int64_t) stat.is_cdc_chunks,
+				(int64_t) stat.is_cdc_new_bytes, (int64_t) stat.is_cdc_bytes,
+				(stat.is_cdc_new_bytes > 0) ? (double) stat.is_cdc_bytes / (double) stat.is_cdc_new_bytes : 0.0);
+	}
+	return 0;
+oops:
+	return -1;
+}
+
 /* capfs_iod_ping(host, port) - does a blocking ping to an capfs I/O server
  *
  * Returns 0 on success, -1 on failure.
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Takes and drops read-only snapshots of CAPFS directory trees. A snapshot
+ * only costs the meta-data server a copy of the metadata of the tree, and
+ * files can be brought back from it with capfs-clone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <capfs.h>
+#include <capfs_proto.h>
+
+int capfs_mode = 1;
+
+int usage(int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+	int c, remove = 0;
+
+	while ((c = getopt(argc, argv, "dh")) != EOF) {
+		switch (c) {
+			case 'd':
+				remove = 1;
+				break;
+			case 'h':
+			default:
+				usage(argc, argv);
+				return -1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argc, argv);
+		return -1;
+	}
+	if ((remove ? capfs_snapshot_remove(argv[optind], argv[optind + 1])
+				: capfs_snapshot(argv[optind], argv[optind + 1])) < 0) {
+		fprintf(stderr, "%s: could not %s snapshot %s of %s: %s\n", argv[0], remove ? "drop" : "take",
+				argv[optind + 1], argv[optind], strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s [-d] <directory> <snapshot name>\n", argv[0]);
+	fprintf(stderr, " takes a read-only snapshot of the tree under <directory> as <directory>/.snapshot/<snapshot name>\n");
+	fprintf(stderr, " -d drops the snapshot instead\n");
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
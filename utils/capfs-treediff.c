@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2005 Murali Vilayannur (vilayann@cse.psu.edu)
+ *
+ * Lists the chunks in which two CAPFS files (say, a file and a snapshot
+ * of it) differ. Rather than fetch both recipes, it compares the hash
+ * trees of the two files from the root down and only descends into the
+ * subtrees whose hashes differ, so files that share most of their chunks
+ * are compared with a handful of requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <capfs.h>
+#include <capfs_proto.h>
+#include "capfs_config.h"
+
+int capfs_mode = 1;
+
+static char *fname[2];
+static int64_t nchunks[2];
+static int levels[2];
+static int64_t nrequests = 0, ndiffer = 0;
+/* the run of differing chunks that has not been printed yet */
+static int64_t run_begin = 0, run_end = 0;
+
+int usage(int argc, char **argv);
+
+/* number of nodes in the given level of the tree of file f */
+static int64_t count(int f, int level)
+{
+	int64_t c = nchunks[f];
+	int l;
+
+	for (l = 0; l < level; l++) {
+		c = (c + CAPFS_TREE_FANOUT - 1) / CAPFS_TREE_FANOUT;
+		if (c < 1) {
+			c = 1;
+		}
+	}
+	return c;
+}
+
+static void flush_run(void)
+{
+	if (run_end > run_begin) {
+		printf("chunks %lld-%lld (bytes %lld-%lld) differ\n", (long long) run_begin, (long long) run_end - 1,
+				(long long) run_begin * CAPFS_CHUNK_SIZE, (long long) run_end * CAPFS_CHUNK_SIZE - 1);
+	}
+	run_begin = run_end = 0;
+	return;
+}
+
+static void report(int64_t chunk)
+{
+	if (run_end != chunk || run_end == run_begin) {
+		flush_run();
+		run_begin = chunk;
+	}
+	run_end = chunk + 1;
+	ndiffer++;
+	return;
+}
+
+/* compares nodes [begin, end) of the given level of both trees */
+static int diff(int level, int64_t begin, int64_t end)
+{
+	unsigned char *nodes[2];
+	int64_t got[2], i, n, below;
+	int f, ret = 0;
+
+	if ((nodes[0] = (unsigned char *) malloc(2 * CAPFS_MAXHASHES * CAPFS_MAXHASHLENGTH)) == NULL) {
+		return -1;
+	}
+	nodes[1] = nodes[0] + CAPFS_MAXHASHES * CAPFS_MAXHASHLENGTH;
+	below = (level > 0) ? (count(0, level - 1) > count(1, level - 1) ? count(0, level - 1) : count(1, level - 1)) : 0;
+	while (ret == 0 && begin < end) {
+		n = (end - begin < CAPFS_MAXHASHES) ? end - begin : CAPFS_MAXHASHES;
+		for (f = 0; f < 2; f++) {
+			got[f] = 0;
+			if (begin >= count(f, level)) {
+				continue;
+			}
+			nrequests++;
+			if ((got[f] = capfs_gettree(fname[f], level, begin, n, nodes[f], NULL, NULL)) < 0) {
+				fprintf(stderr, "could not get the hash tree of %s: %s\n", fname[f], strerror(errno));
+				free(nodes[0]);
+				return -1;
+			}
+		}
+		for (i = 0; ret == 0 && i < n; i++) {
+			if (i < got[0] && i < got[1]
+					&& !memcmp(nodes[0] + i * CAPFS_MAXHASHLENGTH, nodes[1] + i * CAPFS_MAXHASHLENGTH, CAPFS_MAXHASHLENGTH)) {
+				continue;
+			}
+			if (level == 0) {
+				report(begin + i);
+			}
+			else {
+				int64_t child = (begin + i) * CAPFS_TREE_FANOUT;
+
+				ret = diff(level - 1, child, (child + CAPFS_TREE_FANOUT < below) ? child + CAPFS_TREE_FANOUT : below);
+			}
+		}
+		begin += n;
+	}
+	free(nodes[0]);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char root[CAPFS_MAXHASHLENGTH];
+	int f, top;
+	int64_t width;
+
+	if (argc != 3 || !strcmp(argv[1], "-h")) {
+		usage(argc, argv);
+		return -1;
+	}
+	for (f = 0; f < 2; f++) {
+		fname[f] = argv[f + 1];
+		nrequests++;
+		if (capfs_gettree(fname[f], 0, 0, 0, root, &nchunks[f], &levels[f]) < 0) {
+			fprintf(stderr, "%s: could not get the hash tree of %s: %s\n", argv[0], fname[f], strerror(errno));
+			return -1;
+		}
+	}
+	/* the trees have the same shape up to the root of the smaller one */
+	top = (levels[0] < levels[1]) ? levels[0] : levels[1];
+	width = (count(0, top) > count(1, top)) ? count(0, top) : count(1, top);
+	if (diff(top, 0, width) < 0) {
+		return -1;
+	}
+	flush_run();
+	printf("%lld of %lld chunks differ (%lld requests)\n", (long long) ndiffer,
+			(long long) (nchunks[0] > nchunks[1] ? nchunks[0] : nchunks[1]), (long long) nrequests);
+	return ndiffer ? 1 : 0;
+}
+
+int usage(int argc, char **argv)
+{
+	fprintf(stderr, "usage: %s <file> <file>\n", argv[0]);
+	fprintf(stderr, " lists the chunks in which the files differ; exits with 1 if there are any\n");
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 3
+ *  c-basic-offset: 3
+ *  tab-width: 3
+ *
+ * vim: ts=3
+ * End:
+ */
@@ -65,6 +65,7 @@ extern struct address_space_operations capfs_file_aops;
 int capfs_fsync(struct file *file, struct dentry *dentry, int datasync);
 
 int capfs_release(struct inode *i, struct file *f);
+int capfs_flush(struct file *f);
 int capfs_permission(struct inode *inode, int mask);
 int capfs_revalidate_inode(struct dentry *);
 int capfs_meta_to_inode(struct capfs_meta *mbuf, struct inode *ibuf);
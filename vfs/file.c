@@ -76,6 +76,7 @@ struct file_operations capfs_file_operations = {
 	write:   capfs_file_write, /* write */
 	mmap:    capfs_file_mmap,  /* mmap - we'll try the default */
 	open:    capfs_open,       /* open called on first open instance of file */
+	flush:   capfs_flush,      /* flush called on every close() */
 	release: capfs_release,    /* release called when last open instance closed */
 	fsync:   capfs_fsync       /* fsync */
 };
@@ -424,6 +425,28 @@ size_t count, loff_t *ppos)
 	return retsz;
 }
 
+/* capfs_flush()
+ *
+ * Called on every close() of the file.  Depending on the consistency
+ * semantics of the mount, the daemon may be holding back writes until the
+ * file is closed; these are committed before close() returns, so that
+ * a process opening the file afterwards (on any node) sees them, and so
+ * that a failure to commit them is reported to the application.
+ */
+int capfs_flush(struct file *f)
+{
+	int error = 0;
+	struct inode *inode = f->f_dentry->d_inode;
+	PENTRY;
+
+	/* only writers can have anything held back */
+	if (!S_ISDIR(inode->i_mode) && (f->f_mode & FMODE_WRITE)) {
+		error = ll_capfs_fsync(capfs_inop(inode));
+	}
+	PEXIT;
+	return error;
+}
+
 /* capfs_release()
  *
  * Called when the last open file reference for a given file is
@@ -118,6 +118,7 @@ enum {
 	HINT_OPEN = 1,
 	HINT_CLOSE = 2,
 	HINT_STATS = 3,
+	HINT_FLUSH = 4, /* only queued by capfsd itself, to commit writes it held back too long */
 };
 
 /* getdents xfer granularity */
@@ -319,6 +320,14 @@ struct capfs_stats {
 	/* Time spent on IO servers. currently we limit this to 16! */
 	int64_t    server_get_time[CAPFS_STATS_MAX];
 	int64_t    server_put_time[CAPFS_STATS_MAX];
+	/* Bytes not shipped to the IO servers since they already had the chunks */
+	int64_t    put_bytes_saved;
+	/* Upcalls waiting in capfsd for a worker, the most that ever waited, and the total queued */
+	int64_t    queue_depth, queue_max, queue_total;
+	/* Chunks read out of the capfsd data cache, chunks that had to be fetched, and chunks evicted */
+	int64_t    dcache_hits, dcache_misses, dcache_evicts;
+	/* Same, for the on-disk tier of the data cache */
+	int64_t    dcache_disk_hits, dcache_disk_misses, dcache_disk_evicts;
 };
 
 struct capfs_upcall {
@@ -61,6 +61,7 @@ extern struct backing_dev_info capfs_backing_dev_info;
 int capfs_fsync(struct file *file, struct dentry *dentry, int datasync);
 
 int capfs_release(struct inode *i, struct file *f);
+int capfs_flush(struct file *f);
 int capfs_permission(struct inode *inode, int mask);
 int capfs_inode_getattr(struct dentry *);
 int capfs_meta_to_inode(struct capfs_meta *mbuf, struct inode *ibuf);
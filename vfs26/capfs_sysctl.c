@@ -360,6 +360,26 @@ int capfs_capfsd_stats_get_info(char __user * buffer, char ** start, off_t offse
 		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "RPC put time:", cstats.rpc_put);
 		if(len >=  LIMIT) break;
 		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "RPC commit time:", cstats.rpc_commit);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Put bytes saved:", cstats.put_bytes_saved);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Upcall queue depth:", cstats.queue_depth);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Upcall queue max:", cstats.queue_max);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Upcalls queued:", cstats.queue_total);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Dcache hits:", cstats.dcache_hits);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Dcache misses:", cstats.dcache_misses);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Dcache evicts:", cstats.dcache_evicts);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Dcache disk hits:", cstats.dcache_disk_hits);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Dcache disk misses:", cstats.dcache_disk_misses);
+		if(len >=  LIMIT) break;
+		len += sprintf(tmpbuf + len, "%-20s %9lld\n", "Dcache disk evicts:", cstats.dcache_disk_evicts);
 		for (i = 0; i < CAPFS_STATS_MAX; i++)
 		{
 			if (cstats.server_get_time[i] != 0)
@@ -452,6 +472,26 @@ int capfs_capfsd_stats_get_info_kern(char * buffer, char ** start, off_t offset,
 		len += sprintf(buffer + len, "%-20s %9lld\n", "RPC put time:", cstats.rpc_put);
 		if(len >=  LIMIT) break;
 		len += sprintf(buffer + len, "%-20s %9lld\n", "RPC commit time:", cstats.rpc_commit);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Put bytes saved:", cstats.put_bytes_saved);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Upcall queue depth:", cstats.queue_depth);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Upcall queue max:", cstats.queue_max);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Upcalls queued:", cstats.queue_total);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Dcache hits:", cstats.dcache_hits);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Dcache misses:", cstats.dcache_misses);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Dcache evicts:", cstats.dcache_evicts);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Dcache disk hits:", cstats.dcache_disk_hits);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Dcache disk misses:", cstats.dcache_disk_misses);
+		if(len >=  LIMIT) break;
+		len += sprintf(buffer + len, "%-20s %9lld\n", "Dcache disk evicts:", cstats.dcache_disk_evicts);
 		for (i = 0; i < CAPFS_STATS_MAX; i++)
 		{
 			if (cstats.server_get_time[i] != 0)